@@ -21,16 +21,20 @@
 # include <config.h>
 #endif
 
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 
 #include <unistr.h>
 #include <unictype.h>
 #include <unicase.h>
+#include <uninorm.h>
 
 #include <sqlite3ext.h>
 SQLITE_EXTENSION_INIT1
 
+#include "sort_bucket.h"
+
 
 /*
  * MurmurHash2, 64-bit versions, by Austin Appleby
@@ -208,6 +212,78 @@ sqlext_daap_songalbumid_xfunc(sqlite3_context *pv, int n, sqlite3_value **ppv)
   sqlite3_result_int64(pv, result);
 }
 
+/* Binary-comparable equivalent of the DAAP collation, so the sort order can be
+ * computed once when a row is written and then served by a plain index:
+ * a one byte class prefix (alpha first, then everything else) followed by the
+ * case folded, NFD normalized utf-8 string.
+ */
+static void
+sqlext_daap_sortkey_xfunc(sqlite3_context *pv, int n, sqlite3_value **ppv)
+{
+  const uint8_t *str;
+  uint8_t *folded;
+  uint8_t *key;
+  size_t flen;
+  ucs4_t ch;
+  int len;
+  int ret;
+
+  if (n != 1)
+    {
+      sqlite3_result_error(pv, "daap_sortkey() requires 1 parameter", -1);
+      return;
+    }
+
+  /* NULL gets the key of the empty string, so keys are never NULL and
+   * row value comparisons against them follow the index order
+   */
+  str = sqlite3_value_text(ppv[0]);
+  len = sqlite3_value_bytes(ppv[0]);
+
+  folded = NULL;
+  flen = 0;
+  if (str && (len > 0))
+    folded = u8_casefold(str, len, NULL, UNINORM_NFD, NULL, &flen);
+
+  key = sqlite3_malloc(flen + 1);
+  if (!key)
+    {
+      free(folded);
+      sqlite3_result_error_nomem(pv);
+      return;
+    }
+
+  /* Empty and invalid strings sort first, then alpha, then the rest */
+  key[0] = 0;
+  if (str && (len > 0))
+    {
+      ret = u8_mbtoucr(&ch, str, len);
+      if (ret >= 0)
+	key[0] = (uc_is_alpha(ch)) ? 1 : 2;
+    }
+
+  if (folded)
+    {
+      memcpy(key + 1, folded, flen);
+      free(folded);
+    }
+
+  sqlite3_result_blob(pv, key, flen + 1, sqlite3_free);
+}
+
+/* See daap_sort_bucket() */
+static void
+sqlext_daap_sortbucket_xfunc(sqlite3_context *pv, int n, sqlite3_value **ppv)
+{
+  if (n != 1)
+    {
+      sqlite3_result_error(pv, "daap_sortbucket() requires 1 parameter", -1);
+      return;
+    }
+
+  sqlite3_result_int(pv, daap_sort_bucket((const char *)sqlite3_value_text(ppv[0])));
+}
+
 static int
 sqlext_daap_unicode_xcollation(void *notused, int llen, const void *left, int rlen, const void *right)
 {
@@ -260,6 +336,24 @@ sqlite3_extension_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines
       return -1;
     }
 
+  ret = sqlite3_create_function(db, "daap_sortkey", 1, SQLITE_UTF8, NULL, sqlext_daap_sortkey_xfunc, NULL, NULL);
+  if (ret != SQLITE_OK)
+    {
+      if (pzErrMsg)
+	*pzErrMsg = sqlite3_mprintf("Could not create daap_sortkey function: %s\n", sqlite3_errmsg(db));
+
+      return -1;
+    }
+
+  ret = sqlite3_create_function(db, "daap_sortbucket", 1, SQLITE_UTF8, NULL, sqlext_daap_sortbucket_xfunc, NULL, NULL);
+  if (ret != SQLITE_OK)
+    {
+      if (pzErrMsg)
+	*pzErrMsg = sqlite3_mprintf("Could not create daap_sortbucket function: %s\n", sqlite3_errmsg(db));
+
+      return -1;
+    }
+
   ret = sqlite3_create_collation(db, "DAAP", SQLITE_UTF8, NULL, sqlext_daap_unicode_xcollation);
   if (ret != SQLITE_OK)
     {
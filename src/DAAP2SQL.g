@@ -105,13 +105,18 @@ expr	returns [ pANTLR3_STRING result, int valid ]
 			pANTLR3_UINT8 field;
 			pANTLR3_UINT8 val;
 			pANTLR3_UINT8 escaped;
+			char *fts;
 			ANTLR3_UINT8 op;
 			int neg_op;
+			int vlen;
+			int wild_start;
+			int wild_end;
 			const struct dmap_query_field_map *dqfm;
 			char *end;
 			long long llval;
 
 			escaped = NULL;
+			fts = NULL;
 
 			$result = $STR.text->factory->newRaw($STR.text->factory);
 
@@ -235,6 +240,23 @@ expr	returns [ pANTLR3_STRING result, int valid ]
 					goto STR_result_valid_0; /* ABORT */
 				}
 
+				/* Wildcard matches on indexed columns are narrowed down with
+				the trigram index, then checked against the column */
+				vlen = strlen((char *)val);
+				wild_start = (val[0] == '*');
+				wild_end = (vlen > 1) && (val[vlen - 1] == '*');
+
+				if (wild_start || wild_end)
+					fts = db_fts_clause(dqfm->db_col, (char *)val + wild_start, vlen - wild_start - wild_end, wild_start, wild_end);
+
+				if (fts)
+				{
+					$result->set8($result, "(");
+					$result->append8($result, fts);
+					$result->append8($result, " AND ");
+					$result->append8($result, dqfm->db_col);
+				}
+
 				escaped = (pANTLR3_UINT8)db_escape_string((char *)val);
 				if (!escaped)
 				{
@@ -321,12 +343,18 @@ expr	returns [ pANTLR3_STRING result, int valid ]
 				$result->append8($result, ")");
 			}
 
+			if (fts)
+				$result->append8($result, ")");
+
 			STR_result_valid_0: /* bail out label */
 				;
 
 			if (escaped)
 				free(escaped);
 
+			if (fts)
+				free(fts);
+
 			STR_out: /* get out of here */
 				;
 		}
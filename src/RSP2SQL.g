@@ -158,9 +158,11 @@ strcrit	returns [ pANTLR3_STRING result, int valid ]
 			const struct rsp_query_field_map *rqfp;
 			pANTLR3_STRING field;
 			char *escaped;
+			char *fts;
 			ANTLR3_UINT32 optok;
 
 			escaped = NULL;
+			fts = NULL;
 
 			op = NULL;
 			optok = $o.op->getType($o.op);
@@ -196,6 +198,21 @@ strcrit	returns [ pANTLR3_STRING result, int valid ]
 				goto strcrit_valid_0; /* ABORT */
 			}
 
+			$result = field->factory->newRaw(field->factory);
+
+			/* Wildcard matches on indexed columns are narrowed down with
+			the trigram index, then checked against the column */
+			if ((optok == INCLUDES) || (optok == STARTSW) || (optok == ENDSW))
+				fts = db_fts_clause((char *)field->chars, (char *)$s->getText($s)->chars, strlen((char *)$s->getText($s)->chars),
+						    (optok != ENDSW), (optok != STARTSW));
+
+			if (fts)
+			{
+				$result->append8($result, "(");
+				$result->append8($result, fts);
+				$result->append8($result, " AND ");
+			}
+
 			escaped = db_escape_string((char *)$s->getText($s)->chars);
 			if (!escaped)
 			{
@@ -204,7 +221,6 @@ strcrit	returns [ pANTLR3_STRING result, int valid ]
 				goto strcrit_valid_0; /* ABORT */
 			}
 
-			$result = field->factory->newRaw(field->factory);
 			$result->append8($result, "f.");
 			$result->appendS($result, field);
 			$result->append8($result, op);
@@ -218,11 +234,17 @@ strcrit	returns [ pANTLR3_STRING result, int valid ]
 				$result->append8($result, "\%");
 			$result->append8($result, "'");
 
+			if (fts)
+				$result->append8($result, ")");
+
 			strcrit_valid_0:
 				;
 
 			if (escaped)
 				free(escaped);
+
+			if (fts)
+				free(fts);
 		}
 	;
 
@@ -770,6 +770,8 @@ artwork_get_group(int id, int max_w, int max_h, int format, struct evbuffer *evb
   struct query_params qp;
   struct db_media_file_info dbmfi;
   char *dir;
+  char *path;
+  int itemid;
   int got_art;
   int ret;
 
@@ -804,8 +806,22 @@ artwork_get_group(int id, int max_w, int max_h, int format, struct evbuffer *evb
     return got_art;
 
 
-  /* Then try individual files */
+  /* Then try individual files, starting with the group's representative item */
  files_art:
+  itemid = db_group_itemid_byid(id);
+  if (itemid > 0)
+    {
+      path = db_file_path_byid(itemid);
+      if (path)
+	{
+	  got_art = artwork_get_own_image(path, max_w, max_h, format, evbuf);
+	  free(path);
+
+	  if (got_art > 0)
+	    return got_art;
+	}
+    }
+
   memset(&qp, 0, sizeof(struct query_params));
 
   qp.type = Q_GROUPITEMS;
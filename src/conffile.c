@@ -65,6 +65,9 @@ static cfg_opt_t sec_library[] =
     CFG_BOOL("itunes_overrides", cfg_false, CFGF_NONE),
     CFG_STR_LIST("no_transcode", NULL, CFGF_NONE),
     CFG_STR_LIST("force_transcode", NULL, CFGF_NONE),
+    CFG_BOOL("memory_snapshot", cfg_false, CFGF_NONE),
+    CFG_INT("daap_cache_size", 16, CFGF_NONE),
+    CFG_INT("song_cache_size", 32, CFGF_NONE),
     CFG_END()
   };
 
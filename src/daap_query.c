@@ -28,6 +28,7 @@
 #include "logger.h"
 #include "misc.h"
 #include "daap_query.h"
+#include "query_cache.h"
 
 #include "DAAPLexer.h"
 #include "DAAPParser.h"
@@ -55,6 +56,13 @@ daap_query_parse_sql(const char *daap_query)
 
   char *ret = NULL;
 
+  ret = query_cache_get(QUERY_CACHE_DAAP, daap_query);
+  if (ret)
+    {
+      DPRINTF(E_DBG, L_DAAP, "DAAP SQL query (cached): -%s-\n", ret);
+      return ret;
+    }
+
   DPRINTF(E_DBG, L_DAAP, "Trying DAAP query -%s-\n", daap_query);
 
 #if ANTLR3C_NEW_INPUT
@@ -127,6 +135,8 @@ daap_query_parse_sql(const char *daap_query)
     {
       DPRINTF(E_DBG, L_DAAP, "DAAP SQL query: -%s-\n", sql->chars);
       ret = strdup((char *)sql->chars);
+      if (ret)
+	query_cache_add(QUERY_CACHE_DAAP, daap_query, ret);
     }
   else
     {
@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <time.h>
 #include <stdint.h>
 #include <inttypes.h>
@@ -48,6 +49,11 @@
 
 #define STR(x) ((x) ? (x) : "")
 
+/* Items queries select all the columns unless qp->cols says otherwise; the
+ * files table has columns that are not part of media_file_info, so "all" is
+ * the explicit list built from dbmfi_cols_map */
+#define SELECT_COLS(qp) ((qp)->select_cols ? (qp)->select_cols : files_cols)
+
 /* Inotify cookies are uint32_t */
 #define INOTIFY_FAKE_COOKIE ((int64_t)1 << 32)
 
@@ -60,10 +66,184 @@ enum group_type {
 #define DB_POOL_MAX_AGE  (5 * 60)
 #define DB_POOL_MAX_AGE_NSEC (DB_POOL_MAX_AGE * NSEC_PER_SEC)
 
+#define DB_STMT_CACHE_SIZE 32
+
+#define DB_BUSY_TIMEOUT_MSEC 5000
+
+#define DB_COUNT_CACHE_SIZE 32
+
+#define DB_BATCH_MAX_OPS  500
+#define DB_BATCH_MAX_MSEC 1000
+
+#define DB_SMARTPL_REFRESH_MSEC 2000
+
+#define DB_CURSOR_CACHE_SIZE 32
+
+#define DB_PURGE_CHUNK 256
+
+#define DB_SNAPSHOT_REFRESH_MSEC 5000
+#define DB_SNAPSHOT_NORDERS (S_ARTIST + 1)
+#define DB_SNAPSHOT_INTLEN 24
+
+#define DB_PROFILE_NENTRIES 256
+#define DB_PROFILE_NBUCKETS 32
+#define DB_PROFILE_NSLOTS   8
+#define DB_PROFILE_QUERYLEN 512
+
+#define DB_WB_FLUSH_MSEC  1000
+#define DB_WB_MAX_PENDING 512
+#define DB_WB_NBUCKETS    64
+
+/* Prepared statements are cached per connection and keyed by the address
+ * of their query template, which must be a string constant
+ */
+struct db_stmt_cache_entry {
+  const char *tmpl;
+  sqlite3_stmt *stmt;
+
+  unsigned int tick;
+  int busy;
+};
+
+/* Result counts are cached by count query and library revision */
+struct db_count_cache_entry {
+  char *query;
+  int revision;
+  int count;
+
+  unsigned int tick;
+};
+
+/* Paging cursors: where the next page of a query starts, as the id of the
+ * last row delivered; only valid for the library revision they were
+ * taken in
+ */
+struct db_cursor {
+  int session;
+  char *key;
+  int revision;
+  int offset;
+  int lastid;
+
+  unsigned int tick;
+};
+
+/* Smart playlist item counts, as of smartpl_revision */
+struct db_smartpl_count {
+  int id;
+  int items;
+};
+
+/* Path -> (id, db_timestamp) map of the files table, loaded for a bulk
+ * scan; entries chain through next, paths live in one string pool
+ */
+struct db_stamp_entry {
+  uint32_t hash;
+  int id;
+  int64_t stamp;
+  size_t path;
+  int disabled;
+  int next;
+};
+
+struct db_stamp_map {
+  struct db_stamp_entry *entries;
+  int nentries;
+  int *buckets;
+  uint32_t nbuckets;
+  char *pool;
+  size_t pool_len;
+  size_t pool_size;
+
+  /* Bit per file id: enabled at load time, seen during the scan */
+  uint8_t *live;
+  uint8_t *pinged;
+  int max_id;
+};
+
+/* Columnar copy of the enabled files as of revision, rows in id order.
+ * Columns are indexed like dbmfi_cols_map; integer columns live in either
+ * int32 or int64, with a bitmap of the NULL rows if there are any; string
+ * columns are arena offsets with 0 for NULL.
+ */
+struct db_snapshot {
+  int revision;
+  int refcount;
+
+  uint32_t nitems;
+
+  int32_t *int32[DBMFI_NFIELDS];
+  int64_t *int64[DBMFI_NFIELDS];
+  uint32_t *str[DBMFI_NFIELDS];
+  uint8_t *null[DBMFI_NFIELDS];
+
+  char *arena;
+  size_t arena_len;
+  size_t arena_size;
+
+  /* Rows in the order of each sort type, NULL for id order */
+  uint32_t *order[DB_SNAPSHOT_NORDERS];
+};
+
+struct db_snapshot_strtab {
+  uint32_t *slots;
+  uint32_t nslots;
+  uint32_t used;
+};
+
+/* Profile of a query template; bucket b of the latency histogram counts
+ * executions taking less than 2^b microseconds
+ */
+struct db_profile_entry {
+  char *query;
+  uint32_t hash;
+
+  uint64_t calls;
+  uint64_t rows;
+  uint64_t usec;
+  uint64_t wait_usec;
+
+  uint32_t hist[DB_PROFILE_NBUCKETS];
+};
+
+/* Statement execution in progress on a thread */
+struct db_profile_slot {
+  sqlite3_stmt *stmt;
+  struct db_profile_entry *entry;
+
+  uint64_t rows;
+  uint64_t usec;
+  uint64_t wait_usec;
+};
+
+/* Pending small write, merged with later ones on the same (type, id) */
+enum db_wb_type {
+  DB_WB_PLAYCOUNT,
+  DB_WB_FILE_PING,
+  DB_WB_PL_PING,
+  DB_WB_SPEAKER,
+};
+
+struct db_wb_entry {
+  enum db_wb_type type;
+  uint64_t id;
+
+  int count;
+  int64_t stamp;
+  int selected;
+  int volume;
+
+  struct db_wb_entry *next;
+};
+
 struct db_pool_hdl {
   sqlite3 *hdl;
 
   time_t last;
+  uint64_t wait;
+
+  struct db_stmt_cache_entry stmts[DB_STMT_CACHE_SIZE];
+  unsigned int stmts_tick;
 
   struct db_pool_hdl *next;
   struct db_pool_hdl *saved;
@@ -75,6 +255,12 @@ struct db_unlock {
   pthread_mutex_t lck;
 };
 
+/* Value types in the browse table, the triggers use them literally */
+#define BROWSE_ARTIST   1
+#define BROWSE_ALBUM    2
+#define BROWSE_GENRE    3
+#define BROWSE_COMPOSER 4
+
 #define DB_TYPE_CHAR    1
 #define DB_TYPE_INT     2
 #define DB_TYPE_INT64   3
@@ -85,6 +271,11 @@ struct col_type_map {
   short type;
 };
 
+struct col_name_map {
+  ssize_t offset;
+  const char *name;
+};
+
 /* This list must be kept in sync with
  * - the order of the columns in the files table
  * - the type and name of the fields in struct media_file_info
@@ -145,6 +336,7 @@ static const struct col_type_map mfi_cols_map[] =
     { mfi_offsetof(album_sort),         DB_TYPE_STRING },
     { mfi_offsetof(composer_sort),      DB_TYPE_STRING },
     { mfi_offsetof(album_artist_sort),  DB_TYPE_STRING },
+    { mfi_offsetof(title_sort_bucket),  DB_TYPE_INT },
   };
 
 /* This list must be kept in sync with
@@ -170,62 +362,63 @@ static const struct col_type_map pli_cols_map[] =
  * - the order of the columns in the files table
  * - the name of the fields in struct db_media_file_info
  */
-static const ssize_t dbmfi_cols_map[] =
+static const struct col_name_map dbmfi_cols_map[] =
   {
-    dbmfi_offsetof(id),
-    dbmfi_offsetof(path),
-    dbmfi_offsetof(fname),
-    dbmfi_offsetof(title),
-    dbmfi_offsetof(artist),
-    dbmfi_offsetof(album),
-    dbmfi_offsetof(genre),
-    dbmfi_offsetof(comment),
-    dbmfi_offsetof(type),
-    dbmfi_offsetof(composer),
-    dbmfi_offsetof(orchestra),
-    dbmfi_offsetof(conductor),
-    dbmfi_offsetof(grouping),
-    dbmfi_offsetof(url),
-    dbmfi_offsetof(bitrate),
-    dbmfi_offsetof(samplerate),
-    dbmfi_offsetof(song_length),
-    dbmfi_offsetof(file_size),
-    dbmfi_offsetof(year),
-    dbmfi_offsetof(track),
-    dbmfi_offsetof(total_tracks),
-    dbmfi_offsetof(disc),
-    dbmfi_offsetof(total_discs),
-    dbmfi_offsetof(bpm),
-    dbmfi_offsetof(compilation),
-    dbmfi_offsetof(rating),
-    dbmfi_offsetof(play_count),
-    dbmfi_offsetof(data_kind),
-    dbmfi_offsetof(item_kind),
-    dbmfi_offsetof(description),
-    dbmfi_offsetof(time_added),
-    dbmfi_offsetof(time_modified),
-    dbmfi_offsetof(time_played),
-    dbmfi_offsetof(db_timestamp),
-    dbmfi_offsetof(disabled),
-    dbmfi_offsetof(sample_count),
-    dbmfi_offsetof(codectype),
-    dbmfi_offsetof(idx),
-    dbmfi_offsetof(has_video),
-    dbmfi_offsetof(contentrating),
-    dbmfi_offsetof(bits_per_sample),
-    dbmfi_offsetof(album_artist),
-    dbmfi_offsetof(media_kind),
-    dbmfi_offsetof(tv_series_name),
-    dbmfi_offsetof(tv_episode_num_str),
-    dbmfi_offsetof(tv_network_name),
-    dbmfi_offsetof(tv_episode_sort),
-    dbmfi_offsetof(tv_season_num),
-    dbmfi_offsetof(songalbumid),
-    dbmfi_offsetof(title_sort),
-    dbmfi_offsetof(artist_sort),
-    dbmfi_offsetof(album_sort),
-    dbmfi_offsetof(composer_sort),
-    dbmfi_offsetof(album_artist_sort),
+    { dbmfi_offsetof(id),                  "id" },
+    { dbmfi_offsetof(path),                "path" },
+    { dbmfi_offsetof(fname),               "fname" },
+    { dbmfi_offsetof(title),               "title" },
+    { dbmfi_offsetof(artist),              "artist" },
+    { dbmfi_offsetof(album),               "album" },
+    { dbmfi_offsetof(genre),               "genre" },
+    { dbmfi_offsetof(comment),             "comment" },
+    { dbmfi_offsetof(type),                "type" },
+    { dbmfi_offsetof(composer),            "composer" },
+    { dbmfi_offsetof(orchestra),           "orchestra" },
+    { dbmfi_offsetof(conductor),           "conductor" },
+    { dbmfi_offsetof(grouping),            "grouping" },
+    { dbmfi_offsetof(url),                 "url" },
+    { dbmfi_offsetof(bitrate),             "bitrate" },
+    { dbmfi_offsetof(samplerate),          "samplerate" },
+    { dbmfi_offsetof(song_length),         "song_length" },
+    { dbmfi_offsetof(file_size),           "file_size" },
+    { dbmfi_offsetof(year),                "year" },
+    { dbmfi_offsetof(track),               "track" },
+    { dbmfi_offsetof(total_tracks),        "total_tracks" },
+    { dbmfi_offsetof(disc),                "disc" },
+    { dbmfi_offsetof(total_discs),         "total_discs" },
+    { dbmfi_offsetof(bpm),                 "bpm" },
+    { dbmfi_offsetof(compilation),         "compilation" },
+    { dbmfi_offsetof(rating),              "rating" },
+    { dbmfi_offsetof(play_count),          "play_count" },
+    { dbmfi_offsetof(data_kind),           "data_kind" },
+    { dbmfi_offsetof(item_kind),           "item_kind" },
+    { dbmfi_offsetof(description),         "description" },
+    { dbmfi_offsetof(time_added),          "time_added" },
+    { dbmfi_offsetof(time_modified),       "time_modified" },
+    { dbmfi_offsetof(time_played),         "time_played" },
+    { dbmfi_offsetof(db_timestamp),        "db_timestamp" },
+    { dbmfi_offsetof(disabled),            "disabled" },
+    { dbmfi_offsetof(sample_count),        "sample_count" },
+    { dbmfi_offsetof(codectype),           "codectype" },
+    { dbmfi_offsetof(idx),                 "idx" },
+    { dbmfi_offsetof(has_video),           "has_video" },
+    { dbmfi_offsetof(contentrating),       "contentrating" },
+    { dbmfi_offsetof(bits_per_sample),     "bits_per_sample" },
+    { dbmfi_offsetof(album_artist),        "album_artist" },
+    { dbmfi_offsetof(media_kind),          "media_kind" },
+    { dbmfi_offsetof(tv_series_name),      "tv_series_name" },
+    { dbmfi_offsetof(tv_episode_num_str),  "tv_episode_num_str" },
+    { dbmfi_offsetof(tv_network_name),     "tv_network_name" },
+    { dbmfi_offsetof(tv_episode_sort),     "tv_episode_sort" },
+    { dbmfi_offsetof(tv_season_num),       "tv_season_num" },
+    { dbmfi_offsetof(songalbumid),         "songalbumid" },
+    { dbmfi_offsetof(title_sort),          "title_sort" },
+    { dbmfi_offsetof(artist_sort),         "artist_sort" },
+    { dbmfi_offsetof(album_sort),          "album_sort" },
+    { dbmfi_offsetof(composer_sort),       "composer_sort" },
+    { dbmfi_offsetof(album_artist_sort),   "album_artist_sort" },
+    { dbmfi_offsetof(title_sort_bucket),   "title_sort_bucket" },
   };
 
 /* This list must be kept in sync with
@@ -258,6 +451,7 @@ static const ssize_t dbgri_cols_map[] =
     dbgri_offsetof(persistentid),
     dbgri_offsetof(songalbumartist),
     dbgri_offsetof(itemname),
+    dbgri_offsetof(itemid),
   };
 
 /* This list must be kept in sync with
@@ -276,9 +470,29 @@ static const struct col_type_map wi_cols_map[] =
 static const char *sort_clause[] =
   {
     "",
-    "ORDER BY f.title_sort ASC",
-    "ORDER BY f.album_sort ASC, f.disc ASC, f.track ASC",
-    "ORDER BY f.artist_sort ASC",
+    "ORDER BY f.title_sortkey ASC",
+    "ORDER BY f.album_sortkey ASC, f.disc ASC, f.track ASC",
+    "ORDER BY f.artist_sortkey ASC",
+  };
+
+/* Total orders for paging sessions, and the matching predicates selecting
+ * the rows after row l in that order; written as row values so SQLite can
+ * start a range scan of the sort key indexes right after row l
+ */
+static const char *seek_sort_clause[] =
+  {
+    "ORDER BY f.id ASC",
+    "ORDER BY f.title_sortkey ASC, f.id ASC",
+    "ORDER BY f.album_sortkey ASC, f.disc ASC, f.track ASC, f.id ASC",
+    "ORDER BY f.artist_sortkey ASC, f.id ASC",
+  };
+
+static const char *seek_clause[] =
+  {
+    "f.id > l.id",
+    "(f.title_sortkey, f.id) > (l.title_sortkey, l.id)",
+    "(f.album_sortkey, f.disc, f.track, f.id) > (l.album_sortkey, l.disc, l.track, l.id)",
+    "(f.artist_sortkey, f.id) > (l.artist_sortkey, l.id)",
   };
 
 static char *db_path;
@@ -287,17 +501,118 @@ static __thread struct db_pool_hdl *pool_hdl;
 static dispatch_queue_t dbpool_sq;
 static dispatch_source_t pool_reclaim_timer;
 static int pool_size;
+static int pool_size_max;
 static int pool_free_size;
 static struct db_pool_hdl *pool_free;
 static struct db_pool_hdl *pool_used;
+static uint64_t pool_gets;
+static uint64_t pool_wait_usec;
+static uint64_t pool_wait_max_usec;
+
+static pthread_mutex_t writer_lck = PTHREAD_MUTEX_INITIALIZER;
+static struct db_pool_hdl *writer_hdl;
+static __thread int writer_held;
+/* Writer wait statistics, protected by writer_stats_lck */
+static pthread_mutex_t writer_stats_lck = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t writer_gets;
+static uint64_t writer_wait_usec;
+static uint64_t writer_wait_max_usec;
+/* Set when the library tables changed since the last revision bump */
+static int lib_changed;
+/* Set when files or playlists changed since the last smart playlist
+ * refresh; protected by writer_lck like lib_changed */
+static int smartpl_dirty = 1;
+
+/* Batched writes, protected by writer_lck; batch_active is only changed
+ * with count_cache_lck held too, so it can be read under either */
+static dispatch_source_t batch_timer;
+static int batch_active;
+static int batch_txn;
+static int batch_ops;
+
+static pthread_mutex_t count_cache_lck = PTHREAD_MUTEX_INITIALIZER;
+static struct db_count_cache_entry count_cache[DB_COUNT_CACHE_SIZE];
+static unsigned int count_cache_tick;
+static int lib_revision;
+
+/* Paging cursors, protected by count_cache_lck */
+static struct db_cursor cursors[DB_CURSOR_CACHE_SIZE];
+static unsigned int cursors_tick;
+
+/* Smart playlist membership, protected by count_cache_lck;
+ * smartpl_refresh_lck serializes refreshes with db_smartpl_deinit() */
+static pthread_mutex_t smartpl_refresh_lck = PTHREAD_MUTEX_INITIALIZER;
+static struct db_smartpl_count *smartpl_counts;
+static int smartpl_ncounts;
+static int smartpl_revision = -1;
+static int smartpl_refresh_pending;
+static int smartpl_shutdown;
+
+/* Library snapshot, protected by count_cache_lck; snapshot_build_lck
+ * serializes builds */
+static pthread_mutex_t snapshot_build_lck = PTHREAD_MUTEX_INITIALIZER;
+static struct db_snapshot *snapshot;
+static int snapshot_enabled;
+static int snapshot_refresh_pending;
+static int snapshot_shutdown;
+
+/* Statement profiling, protected by profile_lck */
+static pthread_mutex_t profile_lck = PTHREAD_MUTEX_INITIALIZER;
+static int profile_enabled;
+static struct db_profile_entry *profile_entries[DB_PROFILE_NENTRIES];
+static int profile_nentries;
+static __thread struct db_profile_slot profile_slots[DB_PROFILE_NSLOTS];
+static __thread int profile_slots_next;
+
+static pthread_mutex_t stamps_lck = PTHREAD_MUTEX_INITIALIZER;
+static struct db_stamp_map *stamps;
+
+/* "f.id, f.path, ..." in dbmfi_cols_map order */
+static char *files_cols;
+
+/* Write-behind queue, protected by wb_lck; taken after the writer.
+ * wb_flush_lck serializes background flushes with db_wb_deinit() */
+static pthread_mutex_t wb_lck = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t wb_flush_lck = PTHREAD_MUTEX_INITIALIZER;
+static struct db_wb_entry *wb_buckets[DB_WB_NBUCKETS];
+static int wb_pending;
+static int wb_flush_pending;
+static int wb_shutdown;
 
 
 /* Forward */
+static uint64_t
+db_time_usec(void);
+
+static void
+db_stamp_map_free(struct db_stamp_map *map);
+
+static void
+db_batch_commit(void);
+
+static void
+db_lib_changed(int smartpl);
+
+static struct db_wb_entry *
+db_wb_lookup(enum db_wb_type type, uint64_t id, int create);
+
+static void
+db_wb_schedule(void);
+
+static void
+db_wb_flush(void);
+
+static void
+db_smartpl_refresh_schedule(void);
+
+static void
+db_snapshot_refresh_schedule(void);
+
 static int
 db_pl_count_items(int id);
 
 static int
-db_smartpl_count_items(const char *smartpl_query);
+db_smartpl_count_items(int id, const char *smartpl_query);
 
 struct playlist_info *
 db_pl_fetch_byid(int id);
@@ -324,6 +639,90 @@ db_escape_string(const char *str)
   return ret;
 }
 
+/* Trigram index lookup narrowing down a LIKE match of the len bytes of term
+ * in col, anywhere or anchored at either end. The index can return more
+ * rows than the LIKE matches, so the LIKE is still needed. Returns NULL if
+ * col is not indexed or term is too short for the index to help.
+ */
+char *
+db_fts_clause(const char *col, const char *term, int len, int wild_start, int wild_end)
+{
+  static const char *fts_cols[] = { "title", "artist", "album", "album_artist", "composer", "genre" };
+  char *pattern;
+  char *query;
+  char *ret;
+  int run;
+  int longest;
+  int c;
+  int i;
+
+  if (strncmp(col, "f.", 2) == 0)
+    col += 2;
+
+  for (c = 0; c < (sizeof(fts_cols) / sizeof(fts_cols[0])); c++)
+    {
+      if (strcmp(col, fts_cols[c]) == 0)
+	break;
+    }
+
+  if (c == (sizeof(fts_cols) / sizeof(fts_cols[0])))
+    return NULL;
+
+  /* The index is only used for runs of 3 characters without LIKE wildcards */
+  run = 0;
+  longest = 0;
+  for (i = 0; i < len; i++)
+    {
+      if ((term[i] == '%') || (term[i] == '_'))
+	run = 0;
+      else if ((term[i] & 0xc0) != 0x80)
+	run++;
+
+      if (run > longest)
+	longest = run;
+    }
+
+  if (longest < 3)
+    return NULL;
+
+  pattern = (char *)malloc(len + 3);
+  if (!pattern)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for search pattern\n");
+
+      return NULL;
+    }
+
+  i = 0;
+  if (wild_start)
+    pattern[i++] = '%';
+
+  memcpy(pattern + i, term, len);
+  i += len;
+
+  if (wild_end)
+    pattern[i++] = '%';
+
+  pattern[i] = '\0';
+
+  query = sqlite3_mprintf("f.id IN (SELECT rowid FROM files_fts WHERE files_fts.%s LIKE '%q')", fts_cols[c], pattern);
+
+  free(pattern);
+
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      return NULL;
+    }
+
+  ret = strdup(query);
+
+  sqlite3_free(query);
+
+  return ret;
+}
+
 void
 free_pi(struct pairing_info *pi, int content_only)
 {
@@ -514,3628 +913,7091 @@ db_wait_unlock(void)
   return ret;
 }
 
-static int
-db_blocking_step(sqlite3_stmt *stmt)
+/* Runtime statement profiling
+ * Can be switched on and off at any time. Statement executions are timed
+ * step by step in db_blocking_step() and aggregated per query template,
+ * with literals replaced by '?' so queries built with sqlite3_mprintf()
+ * group together. An execution ends when its statement is done, errors
+ * out or is started anew.
+ */
+static void
+db_profile_normalize(const char *sql, char *buf, size_t size)
 {
-  int ret;
+  char *ptr;
+  char *end;
+  char prev;
 
-  while ((ret = sqlite3_step(stmt)) == SQLITE_LOCKED)
+  ptr = buf;
+  end = buf + size - 1;
+  prev = ' ';
+
+  while (*sql && (ptr < end))
     {
-      ret = db_wait_unlock();
-      if (ret != SQLITE_OK)
+      if (*sql == '\'')
 	{
-	  DPRINTF(E_LOG, L_DB, "Database deadlocked!\n");
-	  break;
-	}
+	  /* String literal, '' is an escaped quote */
+	  for (sql++; *sql; sql++)
+	    {
+	      if (*sql != '\'')
+		continue;
 
-      sqlite3_reset(stmt);
-    }
+	      if (*(sql + 1) != '\'')
+		break;
 
-  return ret;
-}
+	      sql++;
+	    }
 
-static int
-db_blocking_prepare_v2(const char *query, int len, sqlite3_stmt **stmt, const char **end)
-{
-  int ret;
+	  if (*sql)
+	    sql++;
 
-  while ((ret = sqlite3_prepare_v2(pool_hdl->hdl, query, len, stmt, end)) == SQLITE_LOCKED)
-    {
-      ret = db_wait_unlock();
-      if (ret != SQLITE_OK)
+	  *ptr++ = prev = '?';
+	}
+      else if (isdigit(*sql) && !isalnum(prev) && (prev != '_') && (prev != '.'))
 	{
-	  DPRINTF(E_LOG, L_DB, "Database deadlocked!\n");
-	  break;
+	  while (isalnum(*sql) || (*sql == '.'))
+	    sql++;
+
+	  *ptr++ = prev = '?';
+	}
+      else if (isspace(*sql))
+	{
+	  while (isspace(*sql))
+	    sql++;
+
+	  if (prev != ' ')
+	    *ptr++ = prev = ' ';
 	}
+      else
+	*ptr++ = prev = *sql++;
     }
 
-  return ret;
+  *ptr = '\0';
 }
 
-
-/* Modelled after sqlite3_exec() */
-static int
-db_exec(const char *query, char **errmsg)
+static struct db_profile_entry *
+db_profile_entry_get(sqlite3_stmt *stmt)
 {
-  sqlite3_stmt *stmt;
-  int try;
-  int ret;
+  struct db_profile_entry *e;
+  char query[DB_PROFILE_QUERYLEN];
+  uint32_t hash;
+  int i;
 
-  *errmsg = NULL;
+  db_profile_normalize(sqlite3_sql(stmt), query, sizeof(query));
 
-  for (try = 0; try < 5; try++)
-    {
-      ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-      if (ret != SQLITE_OK)
-	{
-	  *errmsg = sqlite3_mprintf("prepare failed: %s", sqlite3_errmsg(pool_hdl->hdl));
-	  return ret;
-	}
+  hash = djb_hash(query, strlen(query));
 
-      while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
-	; /* EMPTY */
+  pthread_mutex_lock(&profile_lck);
 
-      sqlite3_finalize(stmt);
+  for (i = 0; i < profile_nentries; i++)
+    {
+      e = profile_entries[i];
 
-      if (ret != SQLITE_SCHEMA)
-	break;
+      if ((e->hash == hash) && (strcmp(e->query, query) == 0))
+	goto out;
     }
 
-  if (ret != SQLITE_DONE)
+  /* The last entry collects everything that doesn't fit */
+  if (profile_nentries == DB_PROFILE_NENTRIES - 1)
     {
-      *errmsg = sqlite3_mprintf("step failed: %s", sqlite3_errmsg(pool_hdl->hdl));
-      return ret;
+      strcpy(query, "(other)");
+      hash = 0;
+    }
+  else if (profile_nentries == DB_PROFILE_NENTRIES)
+    {
+      e = profile_entries[DB_PROFILE_NENTRIES - 1];
+      goto out;
     }
 
-  return SQLITE_OK;
-}
+  e = (struct db_profile_entry *)malloc(sizeof(struct db_profile_entry));
+  if (e)
+    {
+      memset(e, 0, sizeof(struct db_profile_entry));
+
+      e->hash = hash;
+      e->query = strdup(query);
+      if (e->query)
+	profile_entries[profile_nentries++] = e;
+      else
+	{
+	  free(e);
+	  e = NULL;
+	}
+    }
+
+ out:
+  pthread_mutex_unlock(&profile_lck);
 
+  return e;
+}
 
-/* Maintenance and DB hygiene */
 static void
-db_analyze(void)
+db_profile_slot_flush(struct db_profile_slot *slot)
 {
-  char *query = "ANALYZE;";
-  char *errmsg;
-  int ret;
-
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  struct db_profile_entry *e;
+  int b;
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
+  e = slot->entry;
+  if (e)
     {
-      DPRINTF(E_LOG, L_DB, "ANALYZE failed: %s\n", errmsg);
+      for (b = 0; (b < DB_PROFILE_NBUCKETS - 1) && (slot->usec >= (1ULL << b)); b++)
+	; /* EMPTY */
 
-      sqlite3_free(errmsg);
-    }
-}
+      pthread_mutex_lock(&profile_lck);
 
-void
-db_hook_post_scan(void)
-{
-  DPRINTF(E_DBG, L_DB, "Running post-scan DB maintenance tasks...\n");
+      e->calls++;
+      e->rows += slot->rows;
+      e->usec += slot->usec;
+      e->wait_usec += slot->wait_usec;
+      e->hist[b]++;
 
-  db_analyze();
+      pthread_mutex_unlock(&profile_lck);
+    }
 
-  DPRINTF(E_DBG, L_DB, "Done with post-scan DB maintenance\n");
+  memset(slot, 0, sizeof(struct db_profile_slot));
 }
 
-void
-db_purge_cruft(time_t ref)
+/* Returns the slot tracking the execution of stmt, NULL if not profiled */
+static struct db_profile_slot *
+db_profile_slot_get(sqlite3_stmt *stmt)
 {
-  char *errmsg;
+  struct db_profile_slot *slot;
   int i;
-  int ret;
-  char *queries[3] = { NULL, NULL, NULL };
-  char *queries_tmpl[3] =
-    {
-      "DELETE FROM playlistitems WHERE playlistid IN (SELECT id FROM playlists p WHERE p.type <> 1 AND p.db_timestamp < %" PRIi64 ");",
-      "DELETE FROM playlists WHERE type <> 1 AND db_timestamp < %" PRIi64 ";",
-      "DELETE FROM files WHERE db_timestamp < %" PRIi64 ";"
-    };
-
-  if (sizeof(queries) != sizeof(queries_tmpl))
-    {
-      DPRINTF(E_LOG, L_DB, "db_purge_cruft(): queries out of sync with queries_tmpl\n");
-      return;
-    }
 
-  for (i = 0; i < (sizeof(queries_tmpl) / sizeof(queries_tmpl[0])); i++)
+  slot = NULL;
+  for (i = 0; i < DB_PROFILE_NSLOTS; i++)
     {
-      queries[i] = sqlite3_mprintf(queries_tmpl[i], (int64_t)ref);
-      if (!queries[i])
+      if (profile_slots[i].stmt == stmt)
 	{
-	  DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-	  goto purge_fail;
+	  slot = &profile_slots[i];
+	  break;
 	}
+      else if (!slot && !profile_slots[i].stmt)
+	slot = &profile_slots[i];
     }
 
-  for (i = 0; i < (sizeof(queries) / sizeof(queries[0])); i++)
+  /* Still stepping through the same execution */
+  if (slot && (slot->stmt == stmt) && sqlite3_stmt_busy(stmt))
+    return slot;
+
+  if (!slot)
     {
-      DPRINTF(E_DBG, L_DB, "Running purge query '%s'\n", queries[i]);
+      slot = &profile_slots[profile_slots_next];
+      profile_slots_next = (profile_slots_next + 1) % DB_PROFILE_NSLOTS;
+    }
 
-      ret = db_exec(queries[i], &errmsg);
-      if (ret != SQLITE_OK)
-	{
-	  DPRINTF(E_LOG, L_DB, "Purge query %d error: %s\n", i, errmsg);
+  if (slot->stmt)
+    db_profile_slot_flush(slot);
 
-	  sqlite3_free(errmsg);
-	}
-      else
-	DPRINTF(E_DBG, L_DB, "Purged %d rows\n", sqlite3_changes(pool_hdl->hdl));
-    }
+  slot->entry = db_profile_entry_get(stmt);
+  if (!slot->entry)
+    return NULL;
 
- purge_fail:
-  for (i = 0; i < (sizeof(queries) / sizeof(queries[0])); i++)
-    {
-      sqlite3_free(queries[i]);
-    }
+  slot->stmt = stmt;
 
+  return slot;
 }
 
-static int
-db_get_count(char *query)
+void
+db_profile_set(int enable)
 {
-  sqlite3_stmt *stmt;
-  int ret;
+  pthread_mutex_lock(&profile_lck);
+  profile_enabled = enable;
+  pthread_mutex_unlock(&profile_lck);
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  DPRINTF(E_INFO, L_DB, "Statement profiling %s\n", (enable) ? "enabled" : "disabled");
+}
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-  if (ret != SQLITE_OK)
+int
+db_profile_get(struct db_profile_stats **stats, int *nstats)
+{
+  struct db_profile_entry *e;
+  struct db_profile_stats *s;
+  uint64_t n;
+  int enabled;
+  int b;
+  int i;
+
+  pthread_mutex_lock(&profile_lck);
+
+  enabled = profile_enabled;
+
+  *nstats = profile_nentries;
+  *stats = NULL;
+
+  if (profile_nentries > 0)
     {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(pool_hdl->hdl));
-      return -1;
+      *stats = (struct db_profile_stats *)calloc(profile_nentries, sizeof(struct db_profile_stats));
+      if (!*stats)
+	{
+	  DPRINTF(E_LOG, L_DB, "Out of memory for profile stats\n");
+
+	  pthread_mutex_unlock(&profile_lck);
+	  return -1;
+	}
     }
 
-  ret = db_blocking_step(stmt);
-  if (ret != SQLITE_ROW)
+  for (i = 0; i < profile_nentries; i++)
     {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+      e = profile_entries[i];
+      s = &(*stats)[i];
 
-      sqlite3_finalize(stmt);
-      return -1;
+      s->query = strdup(e->query);
+      s->calls = e->calls;
+      s->rows = e->rows;
+      s->usec = e->usec;
+      s->wait_usec = e->wait_usec;
+
+      /* Upper bounds of the buckets holding the percentiles */
+      n = 0;
+      for (b = 0; (b < DB_PROFILE_NBUCKETS) && (e->calls > 0); b++)
+	{
+	  n += e->hist[b];
+
+	  if (!s->p50_usec && (n * 100 >= e->calls * 50))
+	    s->p50_usec = 1ULL << b;
+	  if (n * 100 >= e->calls * 99)
+	    {
+	      s->p99_usec = 1ULL << b;
+	      break;
+	    }
+	}
     }
 
-  ret = sqlite3_column_int(stmt, 0);
+  pthread_mutex_unlock(&profile_lck);
 
-#ifdef DB_PROFILE
-  while (db_blocking_step(stmt) == SQLITE_ROW)
-    ; /* EMPTY */
-#endif
+  return enabled;
+}
 
-  sqlite3_finalize(stmt);
+void
+db_profile_stats_free(struct db_profile_stats *stats, int nstats)
+{
+  int i;
 
-  return ret;
-}
+  for (i = 0; i < nstats; i++)
+    free(stats[i].query);
 
+  free(stats);
+}
 
-/* Queries */
-static int
-db_build_query_index_clause(struct query_params *qp, char **i)
+void
+db_profile_reset(void)
 {
-  char *idx;
+  struct db_profile_entry *e;
+  int i;
 
-  switch (qp->idx_type)
+  pthread_mutex_lock(&profile_lck);
+
+  /* Threads may still point at the entries, only clear them */
+  for (i = 0; i < profile_nentries; i++)
     {
-      case I_FIRST:
-	idx = sqlite3_mprintf("LIMIT %d", qp->limit);
-	break;
+      e = profile_entries[i];
 
-      case I_LAST:
-	idx = sqlite3_mprintf("LIMIT -1 OFFSET %d", qp->results - qp->limit);
-	break;
+      e->calls = 0;
+      e->rows = 0;
+      e->usec = 0;
+      e->wait_usec = 0;
+      memset(e->hist, 0, sizeof(e->hist));
+    }
 
-      case I_SUB:
-	idx = sqlite3_mprintf("LIMIT %d OFFSET %d", qp->limit, qp->offset);
-	break;
+  pthread_mutex_unlock(&profile_lck);
+}
 
-      case I_NONE:
-	*i = NULL;
-	return 0;
+static void
+db_profile_deinit(void)
+{
+  int i;
 
-      default:
-	DPRINTF(E_LOG, L_DB, "Unknown index type\n");
-	return -1;
-    }
+  pthread_mutex_lock(&profile_lck);
 
-  if (!idx)
+  profile_enabled = 0;
+
+  for (i = 0; i < profile_nentries; i++)
     {
-      DPRINTF(E_LOG, L_DB, "Could not build index string; out of memory");
-      return -1;
+      free(profile_entries[i]->query);
+      free(profile_entries[i]);
     }
 
-  *i = idx;
+  profile_nentries = 0;
 
-  return 0;
+  pthread_mutex_unlock(&profile_lck);
 }
 
 static int
-db_build_query_items(struct query_params *qp, char **q)
+db_blocking_step(sqlite3_stmt *stmt)
 {
-  char *query;
-  char *count;
-  char *idx;
-  const char *sort;
+  struct db_profile_slot *slot;
+  uint64_t start;
+  uint64_t wait;
   int ret;
 
-  if (qp->filter)
-    count = sqlite3_mprintf("SELECT COUNT(*) FROM files f WHERE f.disabled = 0 AND %s;", qp->filter);
-  else
-    count = sqlite3_mprintf("SELECT COUNT(*) FROM files f WHERE f.disabled = 0;");
-
-  if (!count)
+  /* Racy, but the worst case is one step more or less in the profile */
+  slot = NULL;
+  if (profile_enabled)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for count query string\n");
-
-      return -1;
+      slot = db_profile_slot_get(stmt);
+      start = db_time_usec();
     }
 
-  qp->results = db_get_count(count);
-  sqlite3_free(count);
+  while ((ret = sqlite3_step(stmt)) == SQLITE_LOCKED)
+    {
+      if (slot)
+	wait = db_time_usec();
 
-  if (qp->results < 0)
-    return -1;
+      ret = db_wait_unlock();
 
-  /* Get index clause */
-  ret = db_build_query_index_clause(qp, &idx);
-  if (ret < 0)
-    return -1;
+      if (slot)
+	slot->wait_usec += db_time_usec() - wait;
 
-  sort = sort_clause[qp->sort];
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_DB, "Database deadlocked!\n");
+	  break;
+	}
 
-  if (idx && qp->filter)
-    query = sqlite3_mprintf("SELECT f.* FROM files f WHERE f.disabled = 0 AND %s %s %s;", qp->filter, sort, idx);
-  else if (idx)
-    query = sqlite3_mprintf("SELECT f.* FROM files f WHERE f.disabled = 0 %s %s;", sort, idx);
-  else if (qp->filter)
-    query = sqlite3_mprintf("SELECT f.* FROM files f WHERE f.disabled = 0 AND %s %s;", qp->filter, sort);
-  else
-    query = sqlite3_mprintf("SELECT f.* FROM files f WHERE f.disabled = 0 %s;", sort);
+      sqlite3_reset(stmt);
+    }
 
-  if (!query)
+  if (slot)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return -1;
-    }
+      slot->usec += db_time_usec() - start;
 
-  *q = query;
+      if (ret == SQLITE_ROW)
+	slot->rows++;
+      else
+	db_profile_slot_flush(slot);
+    }
 
-  return 0;
+  return ret;
 }
 
 static int
-db_build_query_pls(struct query_params *qp, char **q)
+db_blocking_prepare_v2(const char *query, int len, sqlite3_stmt **stmt, const char **end)
 {
-  char *query;
-  char *idx;
   int ret;
 
-  qp->results = db_get_count("SELECT COUNT(*) FROM playlists p WHERE p.disabled = 0;");
-  if (qp->results < 0)
-    return -1;
-
-  /* Get index clause */
-  ret = db_build_query_index_clause(qp, &idx);
-  if (ret < 0)
-    return -1;
-
-  if (idx && qp->filter)
-    query = sqlite3_mprintf("SELECT f.* FROM playlists f WHERE f.disabled = 0 AND %s %s;", qp->filter, idx);
-  else if (idx)
-    query = sqlite3_mprintf("SELECT f.* FROM playlists f WHERE f.disabled = 0 %s;", idx);
-  else if (qp->filter)
-    query = sqlite3_mprintf("SELECT f.* FROM playlists f WHERE f.disabled = 0 AND %s;", qp->filter);
-  else
-    query = sqlite3_mprintf("SELECT f.* FROM playlists f WHERE f.disabled = 0;");
-
-  if (!query)
+  while ((ret = sqlite3_prepare_v2(pool_hdl->hdl, query, len, stmt, end)) == SQLITE_LOCKED)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return -1;
+      ret = db_wait_unlock();
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_DB, "Database deadlocked!\n");
+	  break;
+	}
     }
 
-  *q = query;
-
-  return 0;
+  return ret;
 }
 
+
+/* Modelled after sqlite3_exec() */
 static int
-db_build_query_plitems_plain(struct query_params *qp, char **q)
+db_exec(const char *query, char **errmsg)
 {
-  char *query;
-  char *count;
-  char *idx;
+  sqlite3_stmt *stmt;
+  int try;
   int ret;
 
-  if (qp->filter)
-    count = sqlite3_mprintf("SELECT COUNT(*) FROM files f JOIN playlistitems pi ON f.path = pi.filepath"
-			    " WHERE pi.playlistid = %d AND f.disabled = 0 AND %s;", qp->id, qp->filter);
-  else
-    count = sqlite3_mprintf("SELECT COUNT(*) FROM files f JOIN playlistitems pi ON f.path = pi.filepath"
-			    " WHERE pi.playlistid = %d AND f.disabled = 0;", qp->id);
+  *errmsg = NULL;
 
-  if (!count)
+  for (try = 0; try < 5; try++)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for count query string\n");
-
-      return -1;
-    }
-
-  qp->results = db_get_count(count);
-  sqlite3_free(count);
+      ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+      if (ret != SQLITE_OK)
+	{
+	  *errmsg = sqlite3_mprintf("prepare failed: %s", sqlite3_errmsg(pool_hdl->hdl));
+	  return ret;
+	}
 
-  if (qp->results < 0)
-    return -1;
+      while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
+	; /* EMPTY */
 
-  /* Get index clause */
-  ret = db_build_query_index_clause(qp, &idx);
-  if (ret < 0)
-    return -1;
+      sqlite3_finalize(stmt);
 
-  if (idx && qp->filter)
-    query = sqlite3_mprintf("SELECT f.* FROM files f JOIN playlistitems pi ON f.path = pi.filepath"
-			    " WHERE pi.playlistid = %d AND f.disabled = 0 AND %s ORDER BY pi.id ASC %s;",
-			    qp->id, qp->filter, idx);
-  else if (idx)
-    query = sqlite3_mprintf("SELECT f.* FROM files f JOIN playlistitems pi ON f.path = pi.filepath"
-			    " WHERE pi.playlistid = %d AND f.disabled = 0 ORDER BY pi.id ASC %s;",
-			    qp->id, idx);
-  else if (qp->filter)
-    query = sqlite3_mprintf("SELECT f.* FROM files f JOIN playlistitems pi ON f.path = pi.filepath"
-			    " WHERE pi.playlistid = %d AND f.disabled = 0 AND %s ORDER BY pi.id ASC;",
-			    qp->id, qp->filter);
-  else
-    query = sqlite3_mprintf("SELECT f.* FROM files f JOIN playlistitems pi ON f.path = pi.filepath"
-			    " WHERE pi.playlistid = %d AND f.disabled = 0 ORDER BY pi.id ASC;",
-			    qp->id);
+      if (ret != SQLITE_SCHEMA)
+	break;
+    }
 
-  if (!query)
+  if (ret != SQLITE_DONE)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return -1;
+      *errmsg = sqlite3_mprintf("step failed: %s", sqlite3_errmsg(pool_hdl->hdl));
+      return ret;
     }
 
-  *q = query;
-
-  return 0;
+  return SQLITE_OK;
 }
 
-static int
-db_build_query_plitems_smart(struct query_params *qp, char *smartpl_query, char **q)
+
+/* Prepared statement cache */
+static sqlite3_stmt *
+db_stmt_get(const char *tmpl)
 {
-  char *query;
-  char *count;
-  char *filter;
-  char *idx;
-  const char *sort;
+  struct db_stmt_cache_entry *e;
+  struct db_stmt_cache_entry *lru;
+  sqlite3_stmt *stmt;
+  int i;
   int ret;
 
-  if (qp->filter)
-    filter = qp->filter;
-  else
-    filter = "1 = 1";
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", tmpl);
 
-  count = sqlite3_mprintf("SELECT COUNT(*) FROM files f WHERE f.disabled = 0 AND %s AND %s;", filter, smartpl_query);
-  if (!count)
+  lru = NULL;
+  for (i = 0; i < DB_STMT_CACHE_SIZE; i++)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for count query string\n");
-      return -1;
-    }
+      e = &pool_hdl->stmts[i];
 
-  qp->results = db_get_count(count);
+      if (e->tmpl == tmpl)
+	{
+	  /* Statement is already in use further up the stack */
+	  if (e->busy)
+	    {
+	      lru = NULL;
+	      break;
+	    }
 
-  sqlite3_free(count);
+	  e->busy = 1;
+	  e->tick = ++pool_hdl->stmts_tick;
 
-  if (qp->results < 0)
-    return -1;
+	  return e->stmt;
+	}
 
-  /* Get index clause */
-  ret = db_build_query_index_clause(qp, &idx);
-  if (ret < 0)
-    return -1;
+      if (e->busy)
+	continue;
 
-  if (!idx)
-    idx = "";
-
-  sort = sort_clause[qp->sort];
+      if (!lru || !e->tmpl || (lru->tmpl && (e->tick < lru->tick)))
+	lru = e;
+    }
 
-  query = sqlite3_mprintf("SELECT f.* FROM files f WHERE f.disabled = 0 AND %s AND %s %s %s;", smartpl_query, filter, sort, idx);
-  if (!query)
+  ret = db_blocking_prepare_v2(tmpl, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return -1;
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+
+      return NULL;
     }
 
-  *q = query;
+  /* No slot available, the statement will be finalized on release */
+  if (!lru)
+    return stmt;
 
-  return 0;
+  if (lru->stmt)
+    sqlite3_finalize(lru->stmt);
+
+  lru->tmpl = tmpl;
+  lru->stmt = stmt;
+  lru->busy = 1;
+  lru->tick = ++pool_hdl->stmts_tick;
+
+  return stmt;
 }
 
-static int
-db_build_query_plitems(struct query_params *qp, char **q)
+static void
+db_stmt_release(sqlite3_stmt *stmt)
 {
-  struct playlist_info *pli;
-  int ret;
+  struct db_stmt_cache_entry *e;
+  int i;
 
-  if (qp->id <= 0)
+  for (i = 0; i < DB_STMT_CACHE_SIZE; i++)
     {
-      DPRINTF(E_LOG, L_DB, "No playlist id specified in playlist items query\n");
-      return -1;
-    }
+      e = &pool_hdl->stmts[i];
 
-  pli = db_pl_fetch_byid(qp->id);
-  if (!pli)
-    return -1;
+      if (e->stmt == stmt)
+	{
+	  sqlite3_reset(stmt);
+	  sqlite3_clear_bindings(stmt);
 
-  switch (pli->type)
-    {
-      case PL_SMART:
-	ret = db_build_query_plitems_smart(qp, pli->query, q);
-	break;
+	  e->busy = 0;
+	  return;
+	}
+    }
 
-      case PL_PLAIN:
-	ret = db_build_query_plitems_plain(qp, q);
-	break;
+  sqlite3_finalize(stmt);
+}
 
-      default:
-	DPRINTF(E_LOG, L_DB, "Unknown playlist type %d in playlist items query\n", pli->type);
-	ret = -1;
-	break;
-    }
+static void
+db_stmt_cache_clear(struct db_pool_hdl *ph)
+{
+  int i;
 
-  free_pli(pli, 0);
+  for (i = 0; i < DB_STMT_CACHE_SIZE; i++)
+    {
+      if (ph->stmts[i].stmt)
+	sqlite3_finalize(ph->stmts[i].stmt);
+    }
 
-  return ret;
+  memset(ph->stmts, 0, sizeof(ph->stmts));
 }
 
+/* Run a cached statement to completion and release it */
 static int
-db_build_query_groups(struct query_params *qp, char **q)
+db_stmt_exec(sqlite3_stmt *stmt, char **errmsg)
 {
-  char *query;
-  char *idx;
   int ret;
 
-  qp->results = db_get_count("SELECT COUNT(DISTINCT f.songalbumid) FROM files f WHERE f.disabled = 0;");
-  if (qp->results < 0)
-    return -1;
-
-  /* Get index clause */
-  ret = db_build_query_index_clause(qp, &idx);
-  if (ret < 0)
-    return -1;
+  *errmsg = NULL;
 
-  if (idx && qp->filter)
-    query = sqlite3_mprintf("SELECT COUNT(*), g.id, g.persistentid, f.album_artist, g.name FROM files f, groups g WHERE f.songalbumid = g.persistentid AND g.type = %d AND f.disabled = 0 AND %s GROUP BY f.album, g.name %s;", G_ALBUMS, qp->filter, idx);
-  else if (idx)
-    query = sqlite3_mprintf("SELECT COUNT(*), g.id, g.persistentid, f.album_artist, g.name FROM files f, groups g WHERE f.songalbumid = g.persistentid AND g.type = %d AND f.disabled = 0 GROUP BY f.album, g.name %s;", G_ALBUMS, idx);
-  else if (qp->filter)
-    query = sqlite3_mprintf("SELECT COUNT(*), g.id, g.persistentid, f.album_artist, g.name FROM files f, groups g WHERE f.songalbumid = g.persistentid AND g.type = %d AND f.disabled = 0 AND %s GROUP BY f.album, g.name;", G_ALBUMS, qp->filter);
-  else
-    query = sqlite3_mprintf("SELECT COUNT(*), g.id, g.persistentid, f.album_artist, g.name FROM files f, groups g WHERE f.songalbumid = g.persistentid AND g.type = %d AND f.disabled = 0 GROUP BY f.album, g.name;", G_ALBUMS);
+  while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
+    ; /* EMPTY */
 
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return -1;
-    }
+  if (ret != SQLITE_DONE)
+    *errmsg = sqlite3_mprintf("step failed: %s", sqlite3_errmsg(pool_hdl->hdl));
 
-  *q = query;
+  db_stmt_release(stmt);
 
-  return 0;
+  return (ret == SQLITE_DONE) ? SQLITE_OK : ret;
 }
 
-static int
-db_build_query_groupitems(struct query_params *qp, char **q)
+
+/* Maintenance and DB hygiene */
+static void
+db_analyze(void)
 {
-  char *query;
-  char *count;
-  enum group_type gt;
+  char *query = "ANALYZE;";
+  char *errmsg;
+  int ret;
 
-  gt = db_group_type_byid(qp->id);
+  db_writer_get();
 
-  switch (gt)
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_exec(query, &errmsg);
+  if (ret != SQLITE_OK)
     {
-      case G_ALBUMS:
-	count = sqlite3_mprintf("SELECT COUNT(*) FROM files f JOIN groups g ON f.songalbumid = g.persistentid"
-				" WHERE g.id = %d AND f.disabled = 0;", qp->id);
-	break;
+      DPRINTF(E_LOG, L_DB, "ANALYZE failed: %s\n", errmsg);
 
-      default:
-	DPRINTF(E_LOG, L_DB, "Unsupported group type %d for group id %d\n", gt, qp->id);
-	return -1;
+      sqlite3_free(errmsg);
     }
 
-  if (!count)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for count query string\n");
+  db_writer_release();
+}
 
-      return -1;
-    }
+void
+db_hook_post_scan(void)
+{
+  DPRINTF(E_DBG, L_DB, "Running post-scan DB maintenance tasks...\n");
 
-  qp->results = db_get_count(count);
-  sqlite3_free(count);
+  db_analyze();
 
-  if (qp->results < 0)
-    return -1;
+  DPRINTF(E_DBG, L_DB, "Done with post-scan DB maintenance\n");
+}
 
-  switch (gt)
+/* Deletes in chunks so the writer is handed back between them */
+static int
+db_purge_files_chunk(const char *query)
+{
+  char *errmsg;
+  int ret;
+
+  db_writer_get();
+
+  ret = db_exec(query, &errmsg);
+  if (ret != SQLITE_OK)
     {
-      case G_ALBUMS:
-	query = sqlite3_mprintf("SELECT f.* FROM files f JOIN groups g ON f.songalbumid = g.persistentid"
-				" WHERE g.id = %d AND f.disabled = 0;", qp->id);
-	break;
-    }
+      DPRINTF(E_LOG, L_DB, "Purge query error: %s\n", errmsg);
 
-  if (!query)
+      sqlite3_free(errmsg);
+      ret = -1;
+    }
+  else
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return -1;
+      ret = sqlite3_changes(pool_hdl->hdl);
+
+      db_lib_changed(1);
     }
 
-  *q = query;
+  db_writer_release();
 
-  return 0;
+  return ret;
 }
 
-static int
-db_build_query_group_dirs(struct query_params *qp, char **q)
+/* Files known at the start of the bulk scan that it didn't see; files
+ * written since then are spared by their timestamp
+ */
+static void
+db_purge_files_unseen(struct db_stamp_map *map, time_t ref)
 {
+  struct db_stamp_entry *e;
+  char ids[DB_PURGE_CHUNK * 12];
   char *query;
-  char *count;
-  enum group_type gt;
+  int purged;
+  int len;
+  int n;
+  int i;
+  int ret;
 
-  gt = db_group_type_byid(qp->id);
+  purged = 0;
+  len = 0;
+  n = 0;
 
-  switch (gt)
+  for (i = 0; i <= map->nentries; i++)
     {
-      case G_ALBUMS:
-	count = sqlite3_mprintf("SELECT COUNT(DISTINCT(SUBSTR(f.path, 1, LENGTH(f.path) - LENGTH(f.fname) - 1)))"
-				" FROM files f JOIN groups g ON f.songalbumid = g.persistentid"
-				" WHERE g.id = %d AND f.disabled = 0;", qp->id);
-	break;
+      if (i < map->nentries)
+	{
+	  e = &map->entries[i];
 
-      default:
-	DPRINTF(E_LOG, L_DB, "Unsupported group type %d for group id %d\n", gt, qp->id);
-	return -1;
-    }
+	  if (map->pinged[e->id / 8] & (1 << (e->id % 8)))
+	    continue;
 
-  if (!count)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for count query string\n");
+	  len += snprintf(ids + len, sizeof(ids) - len, (n == 0) ? "%d" : ",%d", e->id);
+	  n++;
 
-      return -1;
-    }
+	  if (n < DB_PURGE_CHUNK)
+	    continue;
+	}
 
-  qp->results = db_get_count(count);
-  sqlite3_free(count);
+      if (n == 0)
+	break;
 
-  if (qp->results < 0)
-    return -1;
+      query = sqlite3_mprintf("DELETE FROM files WHERE db_timestamp < %" PRIi64 " AND id IN (%s);", (int64_t)ref, ids);
+      if (!query)
+	{
+	  DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+	  return;
+	}
 
-  switch (gt)
-    {
-      case G_ALBUMS:
-	query = sqlite3_mprintf("SELECT DISTINCT(SUBSTR(f.path, 1, LENGTH(f.path) - LENGTH(f.fname) - 1))"
-				" FROM files f JOIN groups g ON f.songalbumid = g.persistentid"
-				" WHERE g.id = %d AND f.disabled = 0;", qp->id);
-	break;
-    }
+      ret = db_purge_files_chunk(query);
+      sqlite3_free(query);
+      if (ret < 0)
+	return;
 
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return -1;
+      purged += ret;
+      len = 0;
+      n = 0;
     }
 
-  *q = query;
-
-  return 0;
+  DPRINTF(E_DBG, L_DB, "Purged %d unseen files\n", purged);
 }
 
-static int
-db_build_query_browse(struct query_params *qp, char *field, char **q)
+static void
+db_purge_files_stale(time_t ref)
 {
   char *query;
-  char *count;
-  char *idx;
+  int purged;
   int ret;
 
-  if (qp->filter)
-    count = sqlite3_mprintf("SELECT COUNT(DISTINCT f.%s) FROM files f WHERE f.data_kind = 0 AND f.disabled = 0 AND f.%s != '' AND %s;",
-			    field, field, qp->filter);
-  else
-    count = sqlite3_mprintf("SELECT COUNT(DISTINCT f.%s) FROM files f WHERE f.data_kind = 0 AND f.disabled = 0 AND f.%s != '';",
-			    field, field);
-
-  if (!count)
+  query = sqlite3_mprintf("DELETE FROM files WHERE id IN (SELECT id FROM files WHERE db_timestamp < %" PRIi64 " LIMIT %d);", (int64_t)ref, DB_PURGE_CHUNK);
+  if (!query)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for count query string\n");
-
-      return -1;
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return;
     }
 
-  qp->results = db_get_count(count);
-  sqlite3_free(count);
-
-  if (qp->results < 0)
-    return -1;
-
-  /* Get index clause */
-  ret = db_build_query_index_clause(qp, &idx);
-  if (ret < 0)
-    return -1;
-
-  if (idx && qp->filter)
-    query = sqlite3_mprintf("SELECT DISTINCT f.%s, f.%s FROM files f WHERE f.data_kind = 0 AND f.disabled = 0 AND f.%s != ''"
-			    " AND %s %s;", field, field, field, qp->filter, idx);
-  else if (idx)
-    query = sqlite3_mprintf("SELECT DISTINCT f.%s, f.%s FROM files f WHERE f.data_kind = 0 AND f.disabled = 0 AND f.%s != ''"
-			    " %s;", field, field, field, idx);
-  else if (qp->filter)
-    query = sqlite3_mprintf("SELECT DISTINCT f.%s, f.%s FROM files f WHERE f.data_kind = 0 AND f.disabled = 0 AND f.%s != ''"
-			    " AND %s;", field, field, field, qp->filter);
-  else
-    query = sqlite3_mprintf("SELECT DISTINCT f.%s, f.%s FROM files f WHERE f.data_kind = 0 AND f.disabled = 0 AND f.%s != ''",
-			    field, field, field);
-
-  if (!query)
+  purged = 0;
+  do
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return -1;
+      ret = db_purge_files_chunk(query);
+      if (ret > 0)
+	purged += ret;
     }
+  while (ret == DB_PURGE_CHUNK);
 
-  *q = query;
+  sqlite3_free(query);
 
-  return 0;
+  DPRINTF(E_DBG, L_DB, "Purged %d stale files\n", purged);
 }
 
-int
-db_query_start(struct query_params *qp)
+void
+db_purge_cruft(time_t ref)
 {
-  char *query;
+  struct db_stamp_map *map;
+  char *errmsg;
+  int i;
   int ret;
+  char *queries[2] = { NULL, NULL };
+  char *queries_tmpl[2] =
+    {
+      "DELETE FROM playlistitems WHERE playlistid IN (SELECT id FROM playlists p WHERE p.type <> 1 AND p.db_timestamp < %" PRIi64 ");",
+      "DELETE FROM playlists WHERE type <> 1 AND db_timestamp < %" PRIi64 ";"
+    };
 
-  qp->stmt = NULL;
+  db_writer_get();
 
-  switch (qp->type)
-    {
-      case Q_ITEMS:
-	ret = db_build_query_items(qp, &query);
-	break;
+  /* Make sure pending scanner writes and pings are visible to the purge */
+  db_wb_flush();
+  db_batch_flush();
 
-      case Q_PL:
-	ret = db_build_query_pls(qp, &query);
-	break;
+  if (sizeof(queries) != sizeof(queries_tmpl))
+    {
+      DPRINTF(E_LOG, L_DB, "db_purge_cruft(): queries out of sync with queries_tmpl\n");
+      db_writer_release();
+      return;
+    }
 
-      case Q_PLITEMS:
-	ret = db_build_query_plitems(qp, &query);
-	break;
+  for (i = 0; i < (sizeof(queries_tmpl) / sizeof(queries_tmpl[0])); i++)
+    {
+      queries[i] = sqlite3_mprintf(queries_tmpl[i], (int64_t)ref);
+      if (!queries[i])
+	{
+	  DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+	  goto purge_fail;
+	}
+    }
 
-      case Q_GROUPS:
-	ret = db_build_query_groups(qp, &query);
-	break;
+  for (i = 0; i < (sizeof(queries) / sizeof(queries[0])); i++)
+    {
+      DPRINTF(E_DBG, L_DB, "Running purge query '%s'\n", queries[i]);
 
-      case Q_GROUPITEMS:
-	ret = db_build_query_groupitems(qp, &query);
-	break;
+      ret = db_exec(queries[i], &errmsg);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_DB, "Purge query %d error: %s\n", i, errmsg);
 
-      case Q_GROUP_DIRS:
-	ret = db_build_query_group_dirs(qp, &query);
-	break;
+	  sqlite3_free(errmsg);
+	}
+      else
+	{
+	  DPRINTF(E_DBG, L_DB, "Purged %d rows\n", sqlite3_changes(pool_hdl->hdl));
 
-      case Q_BROWSE_ALBUMS:
-	ret = db_build_query_browse(qp, "album", &query);
-	break;
+	  db_lib_changed(1);
+	}
+    }
 
-      case Q_BROWSE_ARTISTS:
-	ret = db_build_query_browse(qp, "artist", &query);
-	break;
+ purge_fail:
+  for (i = 0; i < (sizeof(queries) / sizeof(queries[0])); i++)
+    {
+      sqlite3_free(queries[i]);
+    }
 
-      case Q_BROWSE_GENRES:
-	ret = db_build_query_browse(qp, "genre", &query);
-	break;
+  db_writer_release();
 
-      case Q_BROWSE_COMPOSERS:
-	ret = db_build_query_browse(qp, "composer", &query);
-	break;
+  /* Unchanged files were only marked as seen by the bulk scan */
+  pthread_mutex_lock(&stamps_lck);
+  map = stamps;
+  stamps = NULL;
+  pthread_mutex_unlock(&stamps_lck);
 
-      default:
-	DPRINTF(E_LOG, L_DB, "Unknown query type\n");
-	return -1;
+  if (map)
+    {
+      db_purge_files_unseen(map, ref);
+      db_stamp_map_free(map);
     }
+  else
+    db_purge_files_stale(ref);
+}
 
-  if (ret < 0)
-    return -1;
+static int
+db_get_count(char *query)
+{
+  sqlite3_stmt *stmt;
+  int ret;
 
-  DPRINTF(E_DBG, L_DB, "Starting query '%s'\n", query);
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
 
-  ret = db_blocking_prepare_v2(query, -1, &qp->stmt, NULL);
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+      return -1;
+    }
 
-      sqlite3_free(query);
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+
+      sqlite3_finalize(stmt);
       return -1;
     }
 
-  sqlite3_free(query);
+  ret = sqlite3_column_int(stmt, 0);
 
-  return 0;
+#ifdef DB_PROFILE
+  while (db_blocking_step(stmt) == SQLITE_ROW)
+    ; /* EMPTY */
+#endif
+
+  sqlite3_finalize(stmt);
+
+  return ret;
 }
 
-void
-db_query_end(struct query_params *qp)
+/* Call with the writer held, right after a successful write to the
+ * library tables (files, playlists, playlistitems, groups); play counts,
+ * pings, speakers and the like don't change what the caches hold.
+ * smartpl is set when the write touched files or playlists, which is
+ * what smart playlist membership depends on
+ */
+static void
+db_lib_changed(int smartpl)
 {
-  if (!qp->stmt)
+  if (sqlite3_changes(writer_hdl->hdl) == 0)
     return;
 
-  qp->results = -1;
+  lib_changed = 1;
+  if (smartpl)
+    smartpl_dirty = 1;
+}
 
-  sqlite3_finalize(qp->stmt);
-  qp->stmt = NULL;
+/* Library revision, bumped when library changes become visible to readers */
+static void
+db_revision_bump(void)
+{
+  lib_changed = 0;
+
+  pthread_mutex_lock(&count_cache_lck);
+  lib_revision++;
+  pthread_mutex_unlock(&count_cache_lck);
+
+  db_smartpl_refresh_schedule();
+  db_snapshot_refresh_schedule();
 }
 
 int
-db_query_fetch_file(struct query_params *qp, struct db_media_file_info *dbmfi)
+db_revision_get(void)
 {
-  int ncols;
-  char **strcol;
+  int revision;
+
+  pthread_mutex_lock(&count_cache_lck);
+  revision = lib_revision;
+  pthread_mutex_unlock(&count_cache_lck);
+
+  return revision;
+}
+
+static int
+db_get_count_cached(char *query)
+{
+  struct db_count_cache_entry *e;
+  struct db_count_cache_entry *lru;
+  int revision;
+  int count;
   int i;
-  int ret;
 
-  memset(dbmfi, 0, sizeof(struct db_media_file_info));
+  /* The writer may see uncommitted data that doesn't match any revision */
+  if (writer_held)
+    return db_get_count(query);
 
-  if (!qp->stmt)
-    {
-      DPRINTF(E_LOG, L_DB, "Query not started!\n");
-      return -1;
-    }
+  lru = NULL;
 
-  if ((qp->type != Q_ITEMS) && (qp->type != Q_PLITEMS) && (qp->type != Q_GROUPITEMS))
-    {
-      DPRINTF(E_LOG, L_DB, "Not an items, playlist or group items query!\n");
-      return -1;
-    }
+  pthread_mutex_lock(&count_cache_lck);
 
-  ret = db_blocking_step(qp->stmt);
-  if (ret == SQLITE_DONE)
-    {
-      DPRINTF(E_INFO, L_DB, "End of query results\n");
-      dbmfi->id = NULL;
-      return 0;
-    }
-  else if (ret != SQLITE_ROW)
+  revision = lib_revision;
+
+  for (i = 0; i < DB_COUNT_CACHE_SIZE; i++)
     {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
-      return -1;
-    }
+      e = &count_cache[i];
 
-  ncols = sqlite3_column_count(qp->stmt);
+      if (e->query && (e->revision == revision) && (strcmp(e->query, query) == 0))
+	{
+	  e->tick = ++count_cache_tick;
+	  count = e->count;
 
-  if (sizeof(dbmfi_cols_map) / sizeof(dbmfi_cols_map[0]) != ncols)
-    {
-      DPRINTF(E_LOG, L_DB, "BUG: dbmfi column map out of sync with schema\n");
-      return -1;
+	  pthread_mutex_unlock(&count_cache_lck);
+
+	  DPRINTF(E_DBG, L_DB, "Cached count %d for query '%s'\n", count, query);
+
+	  return count;
+	}
     }
 
-  for (i = 0; i < ncols; i++)
+  pthread_mutex_unlock(&count_cache_lck);
+
+  count = db_get_count(query);
+  if (count < 0)
+    return -1;
+
+  pthread_mutex_lock(&count_cache_lck);
+
+  /* Prefer entries from an older revision, they're dead anyway */
+  for (i = 0; i < DB_COUNT_CACHE_SIZE; i++)
     {
-      strcol = (char **) ((char *)dbmfi + dbmfi_cols_map[i]);
+      e = &count_cache[i];
 
-      *strcol = (char *)sqlite3_column_text(qp->stmt, i);
+      if (!e->query || (e->revision != lib_revision))
+	{
+	  lru = e;
+	  break;
+	}
+
+      if (!lru || (e->tick < lru->tick))
+	lru = e;
     }
 
-  return 0;
+  if (lru->query)
+    free(lru->query);
+
+  /* The count was computed against revision, so store it as such */
+  lru->query = strdup(query);
+  lru->revision = revision;
+  lru->count = count;
+  lru->tick = ++count_cache_tick;
+
+  pthread_mutex_unlock(&count_cache_lck);
+
+  return count;
 }
 
-int
-db_query_fetch_pl(struct query_params *qp, struct db_playlist_info *dbpli)
+static void
+db_count_cache_clear(void)
 {
-  int ncols;
-  char **strcol;
-  int id;
-  int type;
-  int nitems;
   int i;
-  int ret;
 
-  memset(dbpli, 0, sizeof(struct db_playlist_info));
-
-  if (!qp->stmt)
-    {
-      DPRINTF(E_LOG, L_DB, "Query not started!\n");
-      return -1;
-    }
+  pthread_mutex_lock(&count_cache_lck);
 
-  if (qp->type != Q_PL)
+  for (i = 0; i < DB_COUNT_CACHE_SIZE; i++)
     {
-      DPRINTF(E_LOG, L_DB, "Not a playlist query!\n");
-      return -1;
+      if (count_cache[i].query)
+	free(count_cache[i].query);
     }
 
-  ret = db_blocking_step(qp->stmt);
-  if (ret == SQLITE_DONE)
-    {
-      DPRINTF(E_INFO, L_DB, "End of query results\n");
-      dbpli->id = NULL;
-      return 0;
-    }
-  else if (ret != SQLITE_ROW)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
-      return -1;
-    }
+  memset(count_cache, 0, sizeof(count_cache));
 
-  ncols = sqlite3_column_count(qp->stmt);
+  pthread_mutex_unlock(&count_cache_lck);
+}
 
-  if (sizeof(dbpli_cols_map) / sizeof(dbpli_cols_map[0]) != ncols)
-    {
-      DPRINTF(E_LOG, L_DB, "BUG: dbpli column map out of sync with schema\n");
-      return -1;
-    }
 
-  for (i = 0; i < ncols; i++)
-    {
-      strcol = (char **) ((char *)dbpli + dbpli_cols_map[i]);
+/* Paging cursors
+ * A client paging through a big list with index ranges makes SQLite step
+ * over every skipped row with OFFSET. Queries from a paging session are
+ * sorted in a total order instead, and the id of the last row delivered
+ * is kept so the next page can seek past it.
+ */
+static char *
+db_cursor_key(struct query_params *qp)
+{
+  return sqlite3_mprintf("%d:%d:%d:%s", qp->type, qp->id, qp->sort, STR(qp->filter));
+}
 
-      *strcol = (char *)sqlite3_column_text(qp->stmt, i);
-    }
+/* Returns the id of the row before qp->offset, 0 if not known */
+static int
+db_cursor_get(struct query_params *qp)
+{
+  struct db_cursor *c;
+  char *key;
+  int lastid;
+  int i;
 
-  type = sqlite3_column_int(qp->stmt, 2);
+  if (!qp->session || (qp->idx_type != I_SUB) || (qp->offset <= 0))
+    return 0;
 
-  switch (type)
-    {
-      case PL_PLAIN:
-	id = sqlite3_column_int(qp->stmt, 0);
-	nitems = db_pl_count_items(id);
-	break;
+  key = db_cursor_key(qp);
+  if (!key)
+    return 0;
 
-      case PL_SMART:
-	nitems = db_smartpl_count_items(dbpli->query);
-	break;
+  lastid = 0;
 
-      default:
-	DPRINTF(E_LOG, L_DB, "Unknown playlist type %d while fetching playlist\n", type);
-	return -1;
-    }
+  pthread_mutex_lock(&count_cache_lck);
 
-  dbpli->items = qp->buf;
-  ret = snprintf(qp->buf, sizeof(qp->buf), "%d", nitems);
-  if ((ret < 0) || (ret >= sizeof(qp->buf)))
+  /* Any session's cursor will do, they are all taken in the same order */
+  for (i = 0; i < DB_CURSOR_CACHE_SIZE; i++)
     {
-      DPRINTF(E_LOG, L_DB, "Could not convert items, buffer too small\n");
+      c = &cursors[i];
 
-      strcpy(qp->buf, "0");
+      if (c->key && (c->revision == qp->revision) && (c->offset == qp->offset) && (strcmp(c->key, key) == 0))
+	{
+	  c->tick = ++cursors_tick;
+	  lastid = c->lastid;
+	  break;
+	}
     }
 
-  return 0;
+  pthread_mutex_unlock(&count_cache_lck);
+
+  sqlite3_free(key);
+
+  return lastid;
 }
 
-int
-db_query_fetch_group(struct query_params *qp, struct db_group_info *dbgri)
+static void
+db_cursor_save(struct query_params *qp)
 {
-  int ncols;
-  char **strcol;
+  struct db_cursor *c;
+  struct db_cursor *lru;
+  char *key;
   int i;
-  int ret;
 
-  memset(dbgri, 0, sizeof(struct db_group_info));
+  /* Only full pages can have a next page */
+  if (!qp->session || (qp->idx_type != I_SUB) || (qp->limit <= 0) || (qp->fetched != qp->limit))
+    return;
 
-  if (!qp->stmt)
-    {
-      DPRINTF(E_LOG, L_DB, "Query not started!\n");
-      return -1;
-    }
+  key = db_cursor_key(qp);
+  if (!key)
+    return;
 
-  if (qp->type != Q_GROUPS)
-    {
-      DPRINTF(E_LOG, L_DB, "Not a groups query!\n");
-      return -1;
-    }
+  lru = NULL;
 
-  ret = db_blocking_step(qp->stmt);
-  if (ret == SQLITE_DONE)
+  pthread_mutex_lock(&count_cache_lck);
+
+  /* One cursor per session and query; otherwise prefer dead entries */
+  for (i = 0; i < DB_CURSOR_CACHE_SIZE; i++)
     {
-      DPRINTF(E_INFO, L_DB, "End of query results\n");
-      return 1;
-    }
-  else if (ret != SQLITE_ROW)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
-      return -1;
-    }
+      c = &cursors[i];
 
-  ncols = sqlite3_column_count(qp->stmt);
+      if (c->key && (c->session == qp->session) && (strcmp(c->key, key) == 0))
+	{
+	  lru = c;
+	  break;
+	}
 
-  if (sizeof(dbgri_cols_map) / sizeof(dbgri_cols_map[0]) != ncols)
-    {
-      DPRINTF(E_LOG, L_DB, "BUG: dbgri column map out of sync with schema\n");
-      return -1;
+      if (!c->key || (c->revision != lib_revision))
+	{
+	  if (!lru || (lru->key && (lru->revision == lib_revision)))
+	    lru = c;
+	}
+      else if (!lru || ((lru->revision == lib_revision) && (c->tick < lru->tick)))
+	lru = c;
     }
 
-  for (i = 0; i < ncols; i++)
-    {
-      strcol = (char **) ((char *)dbgri + dbgri_cols_map[i]);
+  if (lru->key)
+    free(lru->key);
 
-      *strcol = (char *)sqlite3_column_text(qp->stmt, i);
-    }
+  lru->key = strdup(key);
+  lru->session = qp->session;
+  lru->revision = qp->revision;
+  lru->offset = qp->offset + qp->fetched;
+  lru->lastid = qp->lastid;
+  lru->tick = ++cursors_tick;
 
-  return 0;
+  pthread_mutex_unlock(&count_cache_lck);
+
+  sqlite3_free(key);
 }
 
-int
-db_query_fetch_string(struct query_params *qp, char **string)
+static void
+db_cursor_clear(void)
 {
-  int ret;
-
-  *string = NULL;
-
-  if (!qp->stmt)
-    {
-      DPRINTF(E_LOG, L_DB, "Query not started!\n");
-      return -1;
-    }
+  int i;
 
-  if (!(qp->type & Q_F_BROWSE))
-    {
-      DPRINTF(E_LOG, L_DB, "Not a browse query!\n");
-      return -1;
-    }
+  pthread_mutex_lock(&count_cache_lck);
 
-  ret = db_blocking_step(qp->stmt);
-  if (ret == SQLITE_DONE)
-    {
-      DPRINTF(E_INFO, L_DB, "End of query results\n");
-      *string = NULL;
-      return 0;
-    }
-  else if (ret != SQLITE_ROW)
+  for (i = 0; i < DB_CURSOR_CACHE_SIZE; i++)
     {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
-      return -1;
+      if (cursors[i].key)
+	free(cursors[i].key);
     }
 
-  *string = (char *)sqlite3_column_text(qp->stmt, 0);
+  memset(cursors, 0, sizeof(cursors));
 
-  return 0;
+  pthread_mutex_unlock(&count_cache_lck);
 }
 
-int
-db_query_fetch_string_sort(struct query_params *qp, char **string, char **sortstring)
+/* Smart playlist membership
+ * The items of all smart playlists are materialized into the smartplitems
+ * table in the background, once the library settles after a change. The
+ * table is only used while it matches the current library revision;
+ * until then queries evaluate the playlist predicate against files.
+ */
+static int
+db_smartpl_items_get(int id, int *items)
 {
   int ret;
+  int i;
 
-  *string = NULL;
+  /* The writer may see uncommitted data that doesn't match any revision */
+  if (writer_held)
+    return -1;
 
-  if (!qp->stmt)
-    {
-      DPRINTF(E_LOG, L_DB, "Query not started!\n");
-      return -1;
-    }
+  ret = -1;
 
-  if (!(qp->type & Q_F_BROWSE))
-    {
-      DPRINTF(E_LOG, L_DB, "Not a browse query!\n");
-      return -1;
-    }
+  pthread_mutex_lock(&count_cache_lck);
 
-  ret = db_blocking_step(qp->stmt);
-  if (ret == SQLITE_DONE)
-    {
-      DPRINTF(E_INFO, L_DB, "End of query results\n");
-      *string = NULL;
-      return 0;
-    }
-  else if (ret != SQLITE_ROW)
+  if (smartpl_revision == lib_revision)
     {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
-      return -1;
+      for (i = 0; i < smartpl_ncounts; i++)
+	{
+	  if (smartpl_counts[i].id == id)
+	    {
+	      *items = smartpl_counts[i].items;
+	      ret = 0;
+	      break;
+	    }
+	}
     }
 
-  *string = (char *)sqlite3_column_text(qp->stmt, 0);
-  *sortstring = (char *)sqlite3_column_text(qp->stmt, 1);
-
-  return 0;
-}
+  pthread_mutex_unlock(&count_cache_lck);
 
+  if (ret < 0)
+    db_smartpl_refresh_schedule();
 
-/* Files */
-int
-db_files_get_count(void)
-{
-  return db_get_count("SELECT COUNT(*) FROM files f WHERE f.disabled = 0;");
+  return ret;
 }
 
-void
-db_files_update_songalbumid(void)
+static void
+db_smartpl_refresh(void)
 {
-#define Q_SONGALBUMID "UPDATE files SET songalbumid = daap_songalbumid(album_artist, album);"
+#define Q_SMARTPL "SELECT p.id, p.query FROM playlists p WHERE p.type = %d;"
+#define Q_FILL "INSERT INTO smartplitems (playlistid, fileid) SELECT %d, f.id FROM files f WHERE f.disabled = 0 AND %s;"
+  struct db_smartpl_count *counts;
+  struct db_smartpl_count *tmp;
+  sqlite3_stmt *stmt;
+  char *query;
   char *errmsg;
+  int ncounts;
+  int revision;
   int ret;
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", Q_SONGALBUMID);
-
-  ret = db_exec(Q_SONGALBUMID, &errmsg);
-  if (ret != SQLITE_OK)
-    DPRINTF(E_LOG, L_DB, "Error updating songalbumid: %s\n", errmsg);
-
-  sqlite3_free(errmsg);
+  db_writer_get();
 
-#undef Q_SONGALBUMID
-}
+  /* A batch will bump the revision when it commits, refresh then */
+  if (batch_active)
+    {
+      db_writer_release();
+      return;
+    }
 
-void
-db_file_inc_playcount(int id)
-{
-#define Q_TMPL "UPDATE files SET play_count = play_count + 1, time_played = %" PRIi64 " WHERE id = %d;"
-  char *query;
-  char *errmsg;
-  int ret;
+  pthread_mutex_lock(&count_cache_lck);
+  revision = lib_revision;
+  ret = smartpl_shutdown || (smartpl_revision == revision);
+  pthread_mutex_unlock(&count_cache_lck);
 
-  query = sqlite3_mprintf(Q_TMPL, (int64_t)time(NULL), id);
-  if (!query)
+  if (ret)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
+      db_writer_release();
       return;
     }
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
-    DPRINTF(E_LOG, L_DB, "Error incrementing play count on %d: %s\n", id, errmsg);
+  /* Only groups or plain playlist items changed, the items still hold */
+  if (!smartpl_dirty)
+    {
+      pthread_mutex_lock(&count_cache_lck);
+      smartpl_revision = revision;
+      pthread_mutex_unlock(&count_cache_lck);
 
-  sqlite3_free(errmsg);
-  sqlite3_free(query);
+      db_writer_release();
+      return;
+    }
 
-#undef Q_TMPL
-}
+  DPRINTF(E_DBG, L_DB, "Refreshing smart playlists for library revision %d\n", revision);
 
-void
-db_file_ping(int id)
-{
-#define Q_TMPL "UPDATE files SET db_timestamp = %" PRIi64 ", disabled = 0 WHERE id = %d;"
-  char *query;
-  char *errmsg;
-  int ret;
+  counts = NULL;
+  ncounts = 0;
 
-  query = sqlite3_mprintf(Q_TMPL, (int64_t)time(NULL), id);
-  if (!query)
+  ret = db_exec("BEGIN TRANSACTION;", &errmsg);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      DPRINTF(E_LOG, L_DB, "Could not begin smart playlist refresh: %s\n", errmsg);
 
+      sqlite3_free(errmsg);
+      db_writer_release();
       return;
     }
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  ret = db_exec(query, &errmsg);
+  ret = db_exec("DELETE FROM smartplitems;", &errmsg);
   if (ret != SQLITE_OK)
-    DPRINTF(E_LOG, L_DB, "Error pinging file ID %d: %s\n", id, errmsg);
-
-  sqlite3_free(errmsg);
-  sqlite3_free(query);
-
-#undef Q_TMPL
-}
+    {
+      DPRINTF(E_LOG, L_DB, "Could not clear smart playlist items: %s\n", errmsg);
 
-char *
-db_file_path_byid(int id)
-{
-#define Q_TMPL "SELECT f.path FROM files f WHERE f.id = %d;"
-  char *query;
-  sqlite3_stmt *stmt;
-  char *res;
-  int ret;
+      sqlite3_free(errmsg);
+      goto out_rollback;
+    }
 
-  query = sqlite3_mprintf(Q_TMPL, id);
+  query = sqlite3_mprintf(Q_SMARTPL, PL_SMART);
   if (!query)
     {
       DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
 
-      return NULL;
+      goto out_rollback;
     }
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  ret = db_blocking_prepare_v2(query, strlen(query) + 1, &stmt, NULL);
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  sqlite3_free(query);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(pool_hdl->hdl));
 
-      sqlite3_free(query);
-      return NULL;
+      goto out_rollback;
     }
 
-  ret = db_blocking_step(stmt);
-  if (ret != SQLITE_ROW)
+  while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
     {
-      if (ret == SQLITE_DONE)
-	DPRINTF(E_INFO, L_DB, "No results\n");
-      else
-	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+      tmp = (struct db_smartpl_count *)realloc(counts, (ncounts + 1) * sizeof(struct db_smartpl_count));
+      if (!tmp)
+	{
+	  DPRINTF(E_LOG, L_DB, "Out of memory for smart playlist counts\n");
 
-      sqlite3_finalize(stmt);
-      sqlite3_free(query);
-      return NULL;
-    }
+	  ret = -1;
+	  break;
+	}
 
-  res = (char *)sqlite3_column_text(stmt, 0);
-  if (res)
-    res = strdup(res);
+      counts = tmp;
 
-#ifdef DB_PROFILE
-  while (db_blocking_step(stmt) == SQLITE_ROW)
-    ; /* EMPTY */
-#endif
+      counts[ncounts].id = sqlite3_column_int(stmt, 0);
 
-  sqlite3_finalize(stmt);
-  sqlite3_free(query);
+      query = sqlite3_mprintf(Q_FILL, counts[ncounts].id, (const char *)sqlite3_column_text(stmt, 1));
+      if (!query)
+	{
+	  DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
 
-  return res;
+	  ret = -1;
+	  break;
+	}
 
-#undef Q_TMPL
-}
+      ret = db_exec(query, &errmsg);
+      sqlite3_free(query);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_DB, "Could not fill smart playlist %d: %s\n", counts[ncounts].id, errmsg);
 
-static int
-db_file_id_byquery(char *query)
-{
-  sqlite3_stmt *stmt;
-  int ret;
+	  sqlite3_free(errmsg);
 
-  if (!query)
-    return 0;
+	  ret = -1;
+	  break;
+	}
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+      counts[ncounts].items = sqlite3_changes(pool_hdl->hdl);
+      ncounts++;
+    }
 
-  ret = db_blocking_prepare_v2(query, strlen(query) + 1, &stmt, NULL);
-  if (ret != SQLITE_OK)
+  sqlite3_finalize(stmt);
+
+  if (ret < 0)
+    goto out_rollback;
+  else if (ret != SQLITE_DONE)
     {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
 
-      return 0;
+      goto out_rollback;
     }
 
-  ret = db_blocking_step(stmt);
-  if (ret != SQLITE_ROW)
+  ret = db_exec("COMMIT TRANSACTION;", &errmsg);
+  if (ret != SQLITE_OK)
     {
-      if (ret == SQLITE_DONE)
-	DPRINTF(E_INFO, L_DB, "No results\n");
-      else
-	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+      DPRINTF(E_LOG, L_DB, "Could not commit smart playlist refresh: %s\n", errmsg);
 
-      sqlite3_finalize(stmt);
-      return 0;
+      sqlite3_free(errmsg);
+      goto out_rollback;
     }
 
-  ret = sqlite3_column_int(stmt, 0);
-
-#ifdef DB_PROFILE
-  while (db_blocking_step(stmt) == SQLITE_ROW)
-    ; /* EMPTY */
-#endif
+  pthread_mutex_lock(&count_cache_lck);
 
-  sqlite3_finalize(stmt);
+  tmp = smartpl_counts;
+  smartpl_counts = counts;
+  smartpl_ncounts = ncounts;
+  smartpl_revision = revision;
 
-  return ret;
-}
+  pthread_mutex_unlock(&count_cache_lck);
 
-int
-db_file_id_bypath(char *path)
-{
-#define Q_TMPL "SELECT f.id FROM files f WHERE f.path = '%q';"
-  char *query;
-  int ret;
+  smartpl_dirty = 0;
 
-  query = sqlite3_mprintf(Q_TMPL, path);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  if (tmp)
+    free(tmp);
 
-      return 0;
-    }
+  db_writer_release();
 
-  ret = db_file_id_byquery(query);
+  DPRINTF(E_DBG, L_DB, "Refreshed %d smart playlists\n", ncounts);
 
-  sqlite3_free(query);
+  return;
 
-  return ret;
+ out_rollback:
+  ret = db_exec("ROLLBACK TRANSACTION;", &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not roll back smart playlist refresh: %s\n", errmsg);
 
-#undef Q_TMPL
+      sqlite3_free(errmsg);
+    }
+
+  if (counts)
+    free(counts);
+
+  db_writer_release();
+
+#undef Q_SMARTPL
+#undef Q_FILL
 }
 
-int
-db_file_id_byfilebase(char *filename, char *base)
+static void
+db_smartpl_refresh_task(void *arg)
 {
-#define Q_TMPL "SELECT f.id FROM files f WHERE f.path LIKE '%q/%%/%q';"
-  char *query;
-  int ret;
+  int shutdown;
 
-  query = sqlite3_mprintf(Q_TMPL, base, filename);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  pthread_mutex_lock(&smartpl_refresh_lck);
 
-      return 0;
+  pthread_mutex_lock(&count_cache_lck);
+  smartpl_refresh_pending = 0;
+  shutdown = smartpl_shutdown;
+  pthread_mutex_unlock(&count_cache_lck);
+
+  /* The writer connection may be gone already */
+  if (!shutdown)
+    db_smartpl_refresh();
+
+  pthread_mutex_unlock(&smartpl_refresh_lck);
+}
+
+/* Refreshes are delayed a bit so a burst of changes only costs one */
+static void
+db_smartpl_refresh_schedule(void)
+{
+  pthread_mutex_lock(&count_cache_lck);
+
+  if (smartpl_refresh_pending || smartpl_shutdown)
+    {
+      pthread_mutex_unlock(&count_cache_lck);
+      return;
     }
 
-  ret = db_file_id_byquery(query);
+  smartpl_refresh_pending = 1;
 
-  sqlite3_free(query);
+  pthread_mutex_unlock(&count_cache_lck);
 
-  return ret;
+  dispatch_after_f(dispatch_time(DISPATCH_TIME_NOW, DB_SMARTPL_REFRESH_MSEC * NSEC_PER_MSEC),
+		   dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0), NULL, db_smartpl_refresh_task);
+}
 
-#undef Q_TMPL
+/* db_bench starts over with db_deinit() and db_init() */
+static void
+db_smartpl_init(void)
+{
+  pthread_mutex_lock(&count_cache_lck);
+  smartpl_shutdown = 0;
+  pthread_mutex_unlock(&count_cache_lck);
 }
 
-int
-db_file_id_byfile(char *filename)
+static void
+db_smartpl_deinit(void)
 {
-#define Q_TMPL "SELECT f.id FROM files f WHERE f.fname = '%q';"
-  char *query;
-  int ret;
+  pthread_mutex_lock(&count_cache_lck);
+  smartpl_shutdown = 1;
+  pthread_mutex_unlock(&count_cache_lck);
 
-  query = sqlite3_mprintf(Q_TMPL, filename);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  /* Wait for a refresh in progress; refreshes still pending won't run */
+  pthread_mutex_lock(&smartpl_refresh_lck);
+  pthread_mutex_unlock(&smartpl_refresh_lck);
 
-      return 0;
+  pthread_mutex_lock(&count_cache_lck);
+
+  if (smartpl_counts)
+    free(smartpl_counts);
+
+  smartpl_counts = NULL;
+  smartpl_ncounts = 0;
+  smartpl_revision = -1;
+  smartpl_dirty = 1;
+
+  pthread_mutex_unlock(&count_cache_lck);
+}
+
+/* Library snapshot
+ * Optionally, an in-memory columnar copy of the enabled files serves the
+ * unfiltered items lists, which are what iTunes and Remote fetch on
+ * connect, without going through SQLite at all. Integer columns are kept
+ * as arrays, 32 bits wide when the values allow; strings are interned in
+ * one arena. The row orders for the sort types come from SQLite, so they
+ * match the DAAP collation exactly.
+ *
+ * The snapshot is rebuilt in the background once the library settles
+ * after a change, and only used while it matches the library revision.
+ */
+static void
+db_snapshot_free(struct db_snapshot *snap)
+{
+  int i;
+
+  for (i = 0; i < DBMFI_NFIELDS; i++)
+    {
+      free(snap->int32[i]);
+      free(snap->int64[i]);
+      free(snap->str[i]);
+      free(snap->null[i]);
     }
 
-  ret = db_file_id_byquery(query);
+  for (i = 0; i < DB_SNAPSHOT_NORDERS; i++)
+    free(snap->order[i]);
 
-  sqlite3_free(query);
+  free(snap->arena);
+  free(snap);
+}
 
-  return ret;
+static void
+db_snapshot_unref(struct db_snapshot *snap)
+{
+  int refcount;
 
-#undef Q_TMPL
+  pthread_mutex_lock(&count_cache_lck);
+  refcount = --snap->refcount;
+  pthread_mutex_unlock(&count_cache_lck);
+
+  if (refcount == 0)
+    db_snapshot_free(snap);
 }
 
-int
-db_file_id_byurl(char *url)
+static inline int64_t
+db_snapshot_int(struct db_snapshot *snap, int col, uint32_t row)
 {
-#define Q_TMPL "SELECT f.id FROM files f WHERE f.url = '%q';"
-  char *query;
-  int ret;
+  if (snap->int32[col])
+    return snap->int32[col][row];
 
-  query = sqlite3_mprintf(Q_TMPL, url);
-  if (!query)
+  return snap->int64[col][row];
+}
+
+static inline int
+db_snapshot_isnull(struct db_snapshot *snap, int col, uint32_t row)
+{
+  if (!snap->null[col])
+    return 0;
+
+  return (snap->null[col][row / 8] & (1 << (row % 8))) != 0;
+}
+
+static inline const char *
+db_snapshot_str(struct db_snapshot *snap, int col, uint32_t row)
+{
+  uint32_t off;
+
+  off = snap->str[col][row];
+
+  return (off) ? snap->arena + off : NULL;
+}
+
+/* Interns str into the arena, returns its offset or 0 on error */
+static uint32_t
+db_snapshot_intern(struct db_snapshot *snap, struct db_snapshot_strtab *tab, const char *str, size_t len)
+{
+  uint32_t *slots;
+  uint32_t nslots;
+  uint32_t hash;
+  uint32_t off;
+  uint32_t s;
+  size_t size;
+  void *tmp;
+  int i;
+
+  if (tab->used * 2 >= tab->nslots)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      nslots = (tab->nslots) ? tab->nslots * 2 : 65536;
 
-      return 0;
+      slots = (uint32_t *)calloc(nslots, sizeof(uint32_t));
+      if (!slots)
+	return 0;
+
+      for (i = 0; i < tab->nslots; i++)
+	{
+	  off = tab->slots[i];
+	  if (!off)
+	    continue;
+
+	  hash = djb_hash(snap->arena + off, strlen(snap->arena + off));
+	  for (s = hash & (nslots - 1); slots[s]; s = (s + 1) & (nslots - 1))
+	    ; /* EMPTY */
+
+	  slots[s] = off;
+	}
+
+      free(tab->slots);
+      tab->slots = slots;
+      tab->nslots = nslots;
     }
 
-  ret = db_file_id_byquery(query);
+  hash = djb_hash((void *)str, len);
+  for (s = hash & (tab->nslots - 1); tab->slots[s]; s = (s + 1) & (tab->nslots - 1))
+    {
+      off = tab->slots[s];
 
-  sqlite3_free(query);
+      if ((strncmp(snap->arena + off, str, len) == 0) && (snap->arena[off + len] == '\0'))
+	return off;
+    }
 
-  return ret;
+  if (snap->arena_len + len + 1 > UINT32_MAX)
+    return 0;
 
-#undef Q_TMPL
+  if (snap->arena_len + len + 1 > snap->arena_size)
+    {
+      for (size = snap->arena_size; size < snap->arena_len + len + 1; size <<= 1)
+	; /* EMPTY */
+
+      tmp = realloc(snap->arena, size);
+      if (!tmp)
+	return 0;
+
+      snap->arena = tmp;
+      snap->arena_size = size;
+    }
+
+  off = snap->arena_len;
+
+  memcpy(snap->arena + off, str, len);
+  snap->arena[off + len] = '\0';
+  snap->arena_len += len + 1;
+
+  tab->slots[s] = off;
+  tab->used++;
+
+  return off;
 }
 
-void
-db_file_stamp_bypath(char *path, time_t *stamp, int *id)
+/* The value ranges of the integer columns decide how wide their arrays
+ * are, so they are sized right away instead of narrowed after the fill
+ */
+static int
+db_snapshot_load_ranges(int64_t *min, int64_t *max)
 {
-#define Q_TMPL "SELECT f.id, f.db_timestamp FROM files f WHERE f.path = '%q';"
-  char *query;
+#define Q_TMPL "SELECT %s FROM files f WHERE f.disabled = 0;"
   sqlite3_stmt *stmt;
+  char *cols;
+  char *query;
+  char *ptr;
+  int ncols;
+  int len;
+  int i;
+  int n;
   int ret;
 
-  *stamp = 0;
+  ncols = sizeof(dbmfi_cols_map) / sizeof(dbmfi_cols_map[0]);
 
-  query = sqlite3_mprintf(Q_TMPL, path);
+  len = 1;
+  for (i = 0; i < ncols; i++)
+    len += 2 * strlen(dbmfi_cols_map[i].name) + 22;
+
+  cols = (char *)malloc(len);
+  if (!cols)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for select list\n");
+      return -1;
+    }
+
+  ptr = cols;
+  n = 0;
+  for (i = 0; i < ncols; i++)
+    {
+      min[i] = 0;
+      max[i] = 0;
+
+      if (mfi_cols_map[i].type == DB_TYPE_STRING)
+	continue;
+
+      ptr += sprintf(ptr, "%sMIN(f.%s), MAX(f.%s)", (n > 0) ? ", " : "", dbmfi_cols_map[i].name, dbmfi_cols_map[i].name);
+      n++;
+    }
+
+  query = sqlite3_mprintf(Q_TMPL, cols);
+  free(cols);
   if (!query)
     {
       DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return;
+      return -1;
     }
 
   DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
 
-  ret = db_blocking_prepare_v2(query, strlen(query) + 1, &stmt, NULL);
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  sqlite3_free(query);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(pool_hdl->hdl));
-
-      sqlite3_free(query);
-      return;
+      return -1;
     }
 
   ret = db_blocking_step(stmt);
   if (ret != SQLITE_ROW)
     {
-      if (ret == SQLITE_DONE)
-	DPRINTF(E_INFO, L_DB, "No results\n");
-      else
-	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
 
       sqlite3_finalize(stmt);
-      sqlite3_free(query);
-      return;
+      return -1;
     }
 
-  *id = sqlite3_column_int(stmt, 0);
-  *stamp = (time_t)sqlite3_column_int64(stmt, 1);
+  /* Keep 0 in range, it fills the NULL slots */
+  n = 0;
+  for (i = 0; i < ncols; i++)
+    {
+      if (mfi_cols_map[i].type == DB_TYPE_STRING)
+	continue;
 
-#ifdef DB_PROFILE
-  while (db_blocking_step(stmt) == SQLITE_ROW)
-    ; /* EMPTY */
-#endif
+      if (sqlite3_column_int64(stmt, n) < 0)
+	min[i] = sqlite3_column_int64(stmt, n);
+      if (sqlite3_column_int64(stmt, n + 1) > 0)
+	max[i] = sqlite3_column_int64(stmt, n + 1);
+
+      n += 2;
+    }
 
   sqlite3_finalize(stmt);
-  sqlite3_free(query);
+
+  return 0;
 
 #undef Q_TMPL
 }
 
-static struct media_file_info *
-db_file_fetch_byquery(char *query)
+static int
+db_snapshot_load_files(struct db_snapshot *snap)
 {
-  struct media_file_info *mfi;
+#define Q_TMPL "SELECT %s FROM files f WHERE f.disabled = 0 ORDER BY f.id;"
+  struct db_snapshot_strtab tab;
   sqlite3_stmt *stmt;
+  char *query;
+  const char *str;
+  int64_t val;
+  int64_t min[DBMFI_NFIELDS];
+  int64_t max[DBMFI_NFIELDS];
+  uint32_t row;
   int ncols;
-  char *cval;
-  uint32_t *ival;
-  uint64_t *i64val;
-  char **strval;
-  uint64_t disabled;
   int i;
   int ret;
 
-  if (!query)
-    return NULL;
+  ncols = sizeof(dbmfi_cols_map) / sizeof(dbmfi_cols_map[0]);
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  ret = db_snapshot_load_ranges(min, max);
+  if (ret < 0)
+    return -1;
 
-  mfi = (struct media_file_info *)malloc(sizeof(struct media_file_info));
-  if (!mfi)
+  /* Integer columns are 32 bits wide when the values allow */
+  for (i = 0; i < ncols; i++)
     {
-      DPRINTF(E_LOG, L_DB, "Could not allocate struct media_file_info, out of memory\n");
-      return NULL;
+      if (mfi_cols_map[i].type == DB_TYPE_STRING)
+	snap->str[i] = (uint32_t *)calloc(snap->nitems + 1, sizeof(uint32_t));
+      else if ((min[i] >= INT32_MIN) && (max[i] <= INT32_MAX))
+	snap->int32[i] = (int32_t *)calloc(snap->nitems + 1, sizeof(int32_t));
+      else
+	snap->int64[i] = (int64_t *)calloc(snap->nitems + 1, sizeof(int64_t));
+
+      if (!snap->str[i] && !snap->int32[i] && !snap->int64[i])
+	{
+	  DPRINTF(E_LOG, L_DB, "Out of memory for library snapshot\n");
+	  return -1;
+	}
     }
-  memset(mfi, 0, sizeof(struct media_file_info));
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-  if (ret != SQLITE_OK)
+  /* Offset 0 stands for NULL */
+  snap->arena_size = 1 << 20;
+  snap->arena = (char *)malloc(snap->arena_size);
+  if (!snap->arena)
     {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(pool_hdl->hdl));
-
-      free(mfi);
-      return NULL;
+      DPRINTF(E_LOG, L_DB, "Out of memory for library snapshot\n");
+      return -1;
     }
 
-  ret = db_blocking_step(stmt);
+  snap->arena[0] = '\0';
+  snap->arena_len = 1;
 
-  if (ret != SQLITE_ROW)
-    {
-      if (ret == SQLITE_DONE)
-	DPRINTF(E_INFO, L_DB, "No results\n");
-      else
-	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+  memset(&tab, 0, sizeof(struct db_snapshot_strtab));
 
-      sqlite3_finalize(stmt);
-      free(mfi);
-      return NULL;
+  query = sqlite3_mprintf(Q_TMPL, files_cols);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
     }
 
-  ncols = sqlite3_column_count(stmt);
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
 
-  if (sizeof(mfi_cols_map) / sizeof(mfi_cols_map[0]) != ncols)
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "BUG: mfi column map out of sync with schema\n");
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+      return -1;
+    }
+
+  if (sqlite3_column_count(stmt) != ncols)
+    {
+      DPRINTF(E_LOG, L_DB, "BUG: dbmfi column map out of sync with files table\n");
 
       sqlite3_finalize(stmt);
-      free(mfi);
-      return NULL;
+      return -1;
     }
 
-  for (i = 0; i < ncols; i++)
+  row = 0;
+  ret = SQLITE_DONE;
+  while ((row < snap->nitems) && ((ret = db_blocking_step(stmt)) == SQLITE_ROW))
     {
-      switch (mfi_cols_map[i].type)
+      for (i = 0; i < ncols; i++)
 	{
-	  case DB_TYPE_CHAR:
-	    cval = (char *)mfi + mfi_cols_map[i].offset;
+	  if (snap->str[i])
+	    {
+	      str = (const char *)sqlite3_column_text(stmt, i);
+	      if (!str)
+		continue;
+
+	      snap->str[i][row] = db_snapshot_intern(snap, &tab, str, sqlite3_column_bytes(stmt, i));
+	      if (!snap->str[i][row])
+		{
+		  DPRINTF(E_LOG, L_DB, "Out of memory for library snapshot strings\n");
+
+		  ret = -1;
+		  break;
+		}
+	    }
+	  else if (sqlite3_column_type(stmt, i) == SQLITE_NULL)
+	    {
+	      if (!snap->null[i])
+		snap->null[i] = (uint8_t *)calloc(snap->nitems / 8 + 1, 1);
+
+	      if (!snap->null[i])
+		{
+		  DPRINTF(E_LOG, L_DB, "Out of memory for library snapshot\n");
+
+		  ret = -1;
+		  break;
+		}
+
+	      snap->null[i][row / 8] |= 1 << (row % 8);
+	    }
+	  else
+	    {
+	      val = sqlite3_column_int64(stmt, i);
+
+	      /* Both queries run in the same transaction, the range holds */
+	      if (snap->int32[i])
+		snap->int32[i][row] = val;
+	      else
+		snap->int64[i][row] = val;
+	    }
+	}
 
-	    *cval = sqlite3_column_int(stmt, i);
-	    break;
+      if (ret < 0)
+	break;
 
-	  case DB_TYPE_INT:
-	    ival = (uint32_t *) ((char *)mfi + mfi_cols_map[i].offset);
+      row++;
+    }
 
-	    if (mfi_cols_map[i].offset == mfi_offsetof(disabled))
-	      {
-		disabled = sqlite3_column_int64(stmt, i);
-		*ival = (disabled != 0);
-	      }
-	    else
-	      *ival = sqlite3_column_int(stmt, i);
-	    break;
+  sqlite3_finalize(stmt);
+  free(tab.slots);
 
-	  case DB_TYPE_INT64:
-	    i64val = (uint64_t *) ((char *)mfi + mfi_cols_map[i].offset);
+  if (ret < 0)
+    return -1;
+  else if ((ret != SQLITE_ROW) && (ret != SQLITE_DONE))
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+      return -1;
+    }
 
-	    *i64val = sqlite3_column_int64(stmt, i);
-	    break;
+  snap->nitems = row;
 
-	  case DB_TYPE_STRING:
-	    strval = (char **) ((char *)mfi + mfi_cols_map[i].offset);
-
-	    cval = (char *)sqlite3_column_text(stmt, i);
-	    if (cval)
-	      *strval = strdup(cval);
-	    break;
-
-	  default:
-	    DPRINTF(E_LOG, L_DB, "BUG: Unknown type %d in mfi column map\n", mfi_cols_map[i].type);
-
-	    free_mfi(mfi, 0);
-	    sqlite3_finalize(stmt);
-	    return NULL;
-	}
-    }
-
-#ifdef DB_PROFILE
-  while (db_blocking_step(stmt) == SQLITE_ROW)
-    ; /* EMPTY */
-#endif
-
-  sqlite3_finalize(stmt);
+  return 0;
 
-  return mfi;
+#undef Q_TMPL
 }
 
-struct media_file_info *
-db_file_fetch_byid(int id)
+static int
+db_snapshot_load_order(struct db_snapshot *snap, enum sort_type sort)
 {
-#define Q_TMPL "SELECT f.* FROM files f WHERE f.id = %d;"
-  struct media_file_info *mfi;
+  sqlite3_stmt *stmt;
+  uint32_t *order;
   char *query;
+  int64_t id;
+  uint32_t lo;
+  uint32_t hi;
+  uint32_t mid;
+  uint32_t n;
+  int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, id);
+  order = (uint32_t *)malloc((snap->nitems + 1) * sizeof(uint32_t));
+  if (!order)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for library snapshot\n");
+      return -1;
+    }
+
+  /* Ties broken by id, like the paging sessions */
+  query = sqlite3_mprintf("SELECT f.id FROM files f WHERE f.disabled = 0 %s;", seek_sort_clause[sort]);
   if (!query)
     {
       DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
 
-      return NULL;
+      free(order);
+      return -1;
     }
 
-  mfi = db_file_fetch_byquery(query);
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
 
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
   sqlite3_free(query);
-
-  return mfi;
-
-#undef Q_TMPL
-}
-
-int
-db_file_add(struct media_file_info *mfi)
-{
-#define Q_TMPL "INSERT INTO files (id, path, fname, title, artist, album, genre, comment, type, composer," \
-               " orchestra, conductor, grouping, url, bitrate, samplerate, song_length, file_size, year, track," \
-               " total_tracks, disc, total_discs, bpm, compilation, rating, play_count, data_kind, item_kind," \
-               " description, time_added, time_modified, time_played, db_timestamp, disabled, sample_count," \
-               " codectype, idx, has_video, contentrating, bits_per_sample, album_artist," \
-               " media_kind, tv_series_name, tv_episode_num_str, tv_network_name, tv_episode_sort, tv_season_num, " \
-               " songalbumid, title_sort, artist_sort, album_sort, composer_sort, album_artist_sort" \
-               " ) " \
-               " VALUES (NULL, '%q', '%q', TRIM(%Q), TRIM(%Q), TRIM(%Q), TRIM(%Q), TRIM(%Q), %Q, TRIM(%Q)," \
-               " TRIM(%Q), TRIM(%Q), TRIM(%Q), %Q, %d, %d, %d, %" PRIi64 ", %d, %d," \
-               " %d, %d, %d, %d, %d, %d, %d, %d, %d," \
-               " %Q, %" PRIi64 ", %" PRIi64 ", %" PRIi64 ", %" PRIi64 ", %d, %" PRIi64 "," \
-               " %Q, %d, %d, %d, %d, TRIM(%Q), %d, TRIM(%Q), TRIM(%Q), TRIM(%Q), %d, %d, daap_songalbumid(TRIM(%Q), TRIM(%Q))," \
-               " TRIM(%Q), TRIM(%Q), TRIM(%Q), TRIM(%Q), TRIM(%Q));"
-
-  char *query;
-  char *errmsg;
-  int ret;
-
-
-  if (mfi->id != 0)
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_WARN, L_DB, "Trying to add file with non-zero id; use db_file_update()?\n");
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+
+      free(order);
       return -1;
     }
 
-  mfi->db_timestamp = (uint64_t)time(NULL);
-  mfi->time_added = mfi->db_timestamp;
+  /* Rows are in id order, find them by binary search */
+  n = 0;
+  while ((n < snap->nitems) && ((ret = db_blocking_step(stmt)) == SQLITE_ROW))
+    {
+      id = sqlite3_column_int64(stmt, 0);
 
-  if (mfi->time_modified == 0)
-    mfi->time_modified = mfi->db_timestamp;
+      lo = 0;
+      hi = snap->nitems;
+      while (lo < hi)
+	{
+	  mid = lo + (hi - lo) / 2;
 
-  query = sqlite3_mprintf(Q_TMPL,
-			  STR(mfi->path), STR(mfi->fname), mfi->title, mfi->artist, mfi->album,
-			  mfi->genre, mfi->comment, mfi->type, mfi->composer,
-			  mfi->orchestra, mfi->conductor, mfi->grouping, mfi->url, mfi->bitrate,
-			  mfi->samplerate, mfi->song_length, mfi->file_size, mfi->year, mfi->track,
-			  mfi->total_tracks, mfi->disc, mfi->total_discs, mfi->bpm, mfi->compilation,
-			  mfi->rating, mfi->play_count, mfi->data_kind, mfi->item_kind,
-			  mfi->description, (int64_t)mfi->time_added, (int64_t)mfi->time_modified,
-			  (int64_t)mfi->time_played, (int64_t)mfi->db_timestamp, mfi->disabled, mfi->sample_count,
-			  mfi->codectype, mfi->index, mfi->has_video,
-			  mfi->contentrating, mfi->bits_per_sample, mfi->album_artist,
-                          mfi->media_kind, mfi->tv_series_name, mfi->tv_episode_num_str, 
-                          mfi->tv_network_name, mfi->tv_episode_sort, mfi->tv_season_num,
-			  mfi->album_artist, mfi->album, mfi->title_sort, mfi->artist_sort, mfi->album_sort,
-			  mfi->composer_sort, mfi->album_artist_sort);
+	  if (db_snapshot_int(snap, 0, mid) < id)
+	    lo = mid + 1;
+	  else
+	    hi = mid;
+	}
 
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return -1;
+      if ((lo == snap->nitems) || (db_snapshot_int(snap, 0, lo) != id))
+	{
+	  DPRINTF(E_LOG, L_DB, "Library snapshot out of sync with files table\n");
+
+	  ret = -1;
+	  break;
+	}
+
+      order[n] = lo;
+      n++;
     }
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  sqlite3_finalize(stmt);
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
+  if ((ret < 0) || (n != snap->nitems))
     {
-      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
-
-      sqlite3_free(errmsg);
-      sqlite3_free(query);
+      free(order);
       return -1;
     }
 
-  sqlite3_free(query);
+  snap->order[sort] = order;
 
   return 0;
-
-#undef Q_TMPL
 }
 
-int
-db_file_update(struct media_file_info *mfi)
+static void
+db_snapshot_refresh(void)
 {
-#define Q_TMPL "UPDATE files SET path = '%q', fname = '%q', title = TRIM(%Q), artist = TRIM(%Q), album = TRIM(%Q), genre = TRIM(%Q)," \
-               " comment = TRIM(%Q), type = %Q, composer = TRIM(%Q), orchestra = TRIM(%Q), conductor = TRIM(%Q), grouping = TRIM(%Q)," \
-               " url = %Q, bitrate = %d, samplerate = %d, song_length = %d, file_size = %" PRIi64 "," \
-               " year = %d, track = %d, total_tracks = %d, disc = %d, total_discs = %d, bpm = %d," \
-               " compilation = %d, rating = %d, data_kind = %d, item_kind = %d," \
-               " description = %Q, time_modified = %" PRIi64 "," \
-               " db_timestamp = %" PRIi64 ", sample_count = %" PRIi64 "," \
-               " codectype = %Q, idx = %d, has_video = %d," \
-               " bits_per_sample = %d, album_artist = TRIM(%Q)," \
-               " media_kind = %d, tv_series_name = TRIM(%Q), tv_episode_num_str = TRIM(%Q)," \
-               " tv_network_name = TRIM(%Q), tv_episode_sort = %d, tv_season_num = %d," \
-               " songalbumid = daap_songalbumid(TRIM(%Q), TRIM(%Q))," \
-               " title_sort = TRIM(%Q), artist_sort = TRIM(%Q), album_sort = TRIM(%Q), composer_sort = TRIM(%Q), album_artist_sort = TRIM(%Q)" \
-               " WHERE id = %d;"
-  char *query;
+  struct db_snapshot *snap;
+  struct db_snapshot *old;
   char *errmsg;
+  int revision;
   int ret;
+  int i;
 
-  if (mfi->id == 0)
+  pthread_mutex_lock(&snapshot_build_lck);
+
+  /* A batch will bump the revision when it commits, refresh then */
+  pthread_mutex_lock(&count_cache_lck);
+  revision = lib_revision;
+  ret = snapshot_shutdown || batch_active || (snapshot && (snapshot->revision == revision));
+  pthread_mutex_unlock(&count_cache_lck);
+
+  if (ret)
     {
-      DPRINTF(E_WARN, L_DB, "Trying to update file with id 0; use db_file_add()?\n");
-      return -1;
+      pthread_mutex_unlock(&snapshot_build_lck);
+      return;
     }
 
-  mfi->db_timestamp = (uint64_t)time(NULL);
+  ret = db_pool_get();
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not acquire database connection for library snapshot\n");
 
-  if (mfi->time_modified == 0)
-    mfi->time_modified = mfi->db_timestamp;
+      pthread_mutex_unlock(&snapshot_build_lck);
+      return;
+    }
 
-  query = sqlite3_mprintf(Q_TMPL,
-			  STR(mfi->path), STR(mfi->fname), mfi->title, mfi->artist, mfi->album, mfi->genre,
-			  mfi->comment, mfi->type, mfi->composer, mfi->orchestra, mfi->conductor, mfi->grouping, 
-			  mfi->url, mfi->bitrate, mfi->samplerate, mfi->song_length, mfi->file_size,
-			  mfi->year, mfi->track, mfi->total_tracks, mfi->disc, mfi->total_discs, mfi->bpm,
-			  mfi->compilation, mfi->rating, mfi->data_kind, mfi->item_kind,
-			  mfi->description, (int64_t)mfi->time_modified,
-			  (int64_t)mfi->db_timestamp, mfi->sample_count,
-			  mfi->codectype, mfi->index, mfi->has_video,
-			  mfi->bits_per_sample, mfi->album_artist,
-			  mfi->media_kind, mfi->tv_series_name, mfi->tv_episode_num_str, 
-			  mfi->tv_network_name, mfi->tv_episode_sort, mfi->tv_season_num,
-			  mfi->album_artist, mfi->album,
-			  mfi->title_sort, mfi->artist_sort, mfi->album_sort,
-			  mfi->composer_sort, mfi->album_artist_sort,
-			  mfi->id);
+  DPRINTF(E_DBG, L_DB, "Building library snapshot for library revision %d\n", revision);
 
-  if (!query)
+  snap = (struct db_snapshot *)malloc(sizeof(struct db_snapshot));
+  if (!snap)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return -1;
+      DPRINTF(E_LOG, L_DB, "Out of memory for library snapshot\n");
+
+      db_pool_release();
+      pthread_mutex_unlock(&snapshot_build_lck);
+      return;
     }
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  memset(snap, 0, sizeof(struct db_snapshot));
 
-  ret = db_exec(query, &errmsg);
+  snap->revision = revision;
+  snap->refcount = 1;
+
+  /* All the queries must see the same data */
+  ret = db_exec("BEGIN TRANSACTION;", &errmsg);
   if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
+      DPRINTF(E_LOG, L_DB, "Could not begin library snapshot: %s\n", errmsg);
 
       sqlite3_free(errmsg);
-      sqlite3_free(query);
-      return -1;
+      goto out_free;
     }
 
-  sqlite3_free(query);
+  ret = db_get_count("SELECT COUNT(*) FROM files f WHERE f.disabled = 0;");
+  if (ret < 0)
+    goto out_end;
 
-  return 0;
+  snap->nitems = ret;
 
-#undef Q_TMPL
-}
+  ret = db_snapshot_load_files(snap);
+  if (ret < 0)
+    goto out_end;
 
-void
-db_file_delete_bypath(char *path)
-{
-#define Q_TMPL "DELETE FROM files WHERE path = '%q';"
-  char *query;
-  char *errmsg;
-  int ret;
+  for (i = S_NAME; i < DB_SNAPSHOT_NORDERS; i++)
+    {
+      ret = db_snapshot_load_order(snap, i);
+      if (ret < 0)
+	goto out_end;
+    }
 
-  query = sqlite3_mprintf(Q_TMPL, path);
-  if (!query)
+  ret = db_exec("COMMIT TRANSACTION;", &errmsg);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      DPRINTF(E_LOG, L_DB, "Could not end library snapshot: %s\n", errmsg);
 
-      return;
+      sqlite3_free(errmsg);
+      goto out_free;
     }
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  db_pool_release();
 
-  ret = db_exec(query, &errmsg);
+  pthread_mutex_lock(&count_cache_lck);
+  old = snapshot;
+  snapshot = snap;
+  pthread_mutex_unlock(&count_cache_lck);
+
+  DPRINTF(E_DBG, L_DB, "Built library snapshot of %d items (%zu bytes of strings)\n", snap->nitems, snap->arena_len);
+
+  pthread_mutex_unlock(&snapshot_build_lck);
+
+  if (old)
+    db_snapshot_unref(old);
+
+  return;
+
+ out_end:
+  ret = db_exec("COMMIT TRANSACTION;", &errmsg);
   if (ret != SQLITE_OK)
-    DPRINTF(E_LOG, L_DB, "Error deleting file: %s\n", errmsg);
+    {
+      DPRINTF(E_LOG, L_DB, "Could not end library snapshot: %s\n", errmsg);
 
-  sqlite3_free(errmsg);
-  sqlite3_free(query);
+      sqlite3_free(errmsg);
+    }
 
-#undef Q_TMPL
+ out_free:
+  db_snapshot_free(snap);
+
+  db_pool_release();
+
+  pthread_mutex_unlock(&snapshot_build_lck);
 }
 
 static void
-db_file_disable_byquery(char *query)
+db_snapshot_refresh_task(void *arg)
 {
-  char *errmsg;
-  int ret;
-
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  pthread_mutex_lock(&count_cache_lck);
+  snapshot_refresh_pending = 0;
+  pthread_mutex_unlock(&count_cache_lck);
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
-    DPRINTF(E_LOG, L_DB, "Error disabling file: %s\n", errmsg);
-
-  sqlite3_free(errmsg);
+  db_snapshot_refresh();
 }
 
-void
-db_file_disable_bypath(char *path, char *strip, uint32_t cookie)
+static void
+db_snapshot_refresh_schedule(void)
 {
-#define Q_TMPL "UPDATE files SET path = substr(path, %d), disabled = %" PRIi64 " WHERE path = '%q';"
-  char *query;
-  int64_t disabled;
-  int striplen;
+  if (!snapshot_enabled)
+    return;
 
-  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
-  striplen = strlen(strip) + 1;
+  pthread_mutex_lock(&count_cache_lck);
 
-  query = sqlite3_mprintf(Q_TMPL, striplen, disabled, path);
-  if (!query)
+  if (snapshot_refresh_pending || snapshot_shutdown)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
+      pthread_mutex_unlock(&count_cache_lck);
       return;
     }
 
-  db_file_disable_byquery(query);
+  snapshot_refresh_pending = 1;
 
-  sqlite3_free(query);
+  pthread_mutex_unlock(&count_cache_lck);
 
-#undef Q_TMPL
+  dispatch_after_f(dispatch_time(DISPATCH_TIME_NOW, DB_SNAPSHOT_REFRESH_MSEC * NSEC_PER_MSEC),
+		   dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0), NULL, db_snapshot_refresh_task);
 }
 
-void
-db_file_disable_bymatch(char *path, char *strip, uint32_t cookie)
+/* Serves an unfiltered items query from the snapshot if it is current */
+static int
+db_snapshot_query_start(struct query_params *qp)
 {
-#define Q_TMPL "UPDATE files SET path = substr(path, %d), disabled = %" PRIi64 " WHERE path LIKE '%q/%%';"
-  char *query;
-  int64_t disabled;
-  int striplen;
-
-  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
-  striplen = strlen(strip) + 1;
+  struct db_snapshot *snap;
+  int nitems;
 
-  query = sqlite3_mprintf(Q_TMPL, striplen, disabled, path);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  if (!snapshot_enabled || (qp->type != Q_ITEMS) || qp->filter || (qp->sort >= DB_SNAPSHOT_NORDERS))
+    return -1;
 
-      return;
-    }
+  /* The writer may see uncommitted data that doesn't match any revision */
+  if (writer_held)
+    return -1;
 
-  db_file_disable_byquery(query);
+  pthread_mutex_lock(&count_cache_lck);
 
-  sqlite3_free(query);
+  snap = snapshot;
+  if (snap && (snap->revision == lib_revision))
+    snap->refcount++;
+  else
+    snap = NULL;
 
-#undef Q_TMPL
-}
+  pthread_mutex_unlock(&count_cache_lck);
 
-int
-db_file_enable_bycookie(uint32_t cookie, char *path)
-{
-#define Q_TMPL "UPDATE files SET path = '%q' || path, disabled = 0 WHERE disabled = %" PRIi64 ";"
-  char *query;
-  char *errmsg;
-  int ret;
+  if (!snap)
+    {
+      db_snapshot_refresh_schedule();
+      return -1;
+    }
 
-  query = sqlite3_mprintf(Q_TMPL, path, (int64_t)cookie);
-  if (!query)
+  /* Text for integer columns, for db_query_fetch_file() */
+  qp->snap_buf = (char *)malloc(DBMFI_NFIELDS * DB_SNAPSHOT_INTLEN);
+  if (!qp->snap_buf)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      DPRINTF(E_LOG, L_DB, "Out of memory for snapshot query buffer\n");
 
+      db_snapshot_unref(snap);
       return -1;
     }
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  nitems = snap->nitems;
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
+  switch (qp->idx_type)
     {
-      DPRINTF(E_LOG, L_DB, "Error enabling files: %s\n", errmsg);
+      case I_FIRST:
+	qp->snap_pos = 0;
+	qp->snap_end = (qp->limit < nitems) ? qp->limit : nitems;
+	break;
 
-      sqlite3_free(errmsg);
-      sqlite3_free(query);
-      return -1;
-    }
+      case I_LAST:
+	qp->snap_pos = (qp->limit < nitems) ? nitems - qp->limit : 0;
+	qp->snap_end = nitems;
+	break;
 
-  sqlite3_free(query);
+      case I_SUB:
+	qp->snap_pos = (qp->offset < nitems) ? qp->offset : nitems;
+	if ((qp->limit < 0) || (qp->limit > nitems - qp->snap_pos))
+	  qp->snap_end = nitems;
+	else
+	  qp->snap_end = qp->snap_pos + qp->limit;
+	break;
 
-  return sqlite3_changes(pool_hdl->hdl);
+      default:
+	qp->snap_pos = 0;
+	qp->snap_end = nitems;
+	break;
+    }
 
-#undef Q_TMPL
-}
+  if (qp->snap_pos < 0)
+    qp->snap_pos = 0;
+  if (qp->snap_end < qp->snap_pos)
+    qp->snap_end = qp->snap_pos;
 
+  qp->results = nitems;
+  qp->snap = snap;
 
-/* Playlists */
-int
-db_pl_get_count(void)
-{
-  return db_get_count("SELECT COUNT(*) FROM playlists p WHERE p.disabled = 0;");
+  DPRINTF(E_DBG, L_DB, "Serving items query from library snapshot, rows %d-%d of %d\n", qp->snap_pos, qp->snap_end, nitems);
+
+  return 0;
 }
 
+/* Returns the snapshot row of the next result, -1 at the end */
 static int
-db_pl_count_items(int id)
+db_snapshot_query_next(struct query_params *qp)
 {
-#define Q_TMPL "SELECT COUNT(*) FROM playlistitems pi JOIN files f" \
-               " ON pi.filepath = f.path WHERE f.disabled = 0 AND pi.playlistid = %d;"
-  char *query;
-  int ret;
+  struct db_snapshot *snap;
+  int pos;
 
-  query = sqlite3_mprintf(Q_TMPL, id);
+  snap = qp->snap;
 
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return 0;
-    }
+  if (qp->snap_pos >= qp->snap_end)
+    return -1;
 
-  ret = db_get_count(query);
+  pos = qp->snap_pos++;
 
-  sqlite3_free(query);
+  qp->fetched++;
 
-  return ret;
+  if (snap->order[qp->sort])
+    return snap->order[qp->sort][pos];
 
-#undef Q_TMPL
+  return pos;
 }
 
-static int
-db_smartpl_count_items(const char *smartpl_query)
+static void
+db_snapshot_init(void)
 {
-#define Q_TMPL "SELECT COUNT(*) FROM files f WHERE f.disabled = 0 AND %s;"
-  char *query;
-  int ret;
-
-  query = sqlite3_mprintf(Q_TMPL, smartpl_query);
-
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return 0;
-    }
-
-  ret = db_get_count(query);
+  pthread_mutex_lock(&count_cache_lck);
+  snapshot_shutdown = 0;
+  pthread_mutex_unlock(&count_cache_lck);
 
-  sqlite3_free(query);
+  snapshot_enabled = cfg_getbool(cfg_getsec(cfg, "library"), "memory_snapshot");
+  if (!snapshot_enabled)
+    return;
 
-  return ret;
+  DPRINTF(E_INFO, L_DB, "Serving items lists from an in-memory library snapshot\n");
 
-#undef Q_TMPL
+  db_snapshot_refresh_schedule();
 }
 
-void
-db_pl_ping(int id)
+/* Builds the snapshot right away if it doesn't match the library revision,
+ * for callers that must not race the background build; call without a
+ * pooled connection held
+ */
+int
+db_snapshot_wait(void)
 {
-#define Q_TMPL "UPDATE playlists SET db_timestamp = %" PRIi64 ", disabled = 0 WHERE id = %d;"
-  char *query;
-  char *errmsg;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, (int64_t)time(NULL), id);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return;
-    }
-
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  if (!snapshot_enabled)
+    return -1;
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
-    DPRINTF(E_LOG, L_DB, "Error pinging playlist %d: %s\n", id, errmsg);
+  db_snapshot_refresh();
 
-  sqlite3_free(errmsg);
-  sqlite3_free(query);
+  pthread_mutex_lock(&count_cache_lck);
+  ret = (snapshot && (snapshot->revision == lib_revision)) ? 0 : -1;
+  pthread_mutex_unlock(&count_cache_lck);
 
-#undef Q_TMPL
+  return ret;
 }
 
-static int
-db_pl_id_bypath(char *path, int *id)
+static void
+db_snapshot_deinit(void)
 {
-#define Q_TMPL "SELECT p.id FROM playlists p WHERE p.path = '%q';"
-  char *query;
-  sqlite3_stmt *stmt;
-  int ret;
-
-  query = sqlite3_mprintf(Q_TMPL, path);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return -1;
-    }
+  struct db_snapshot *snap;
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+  pthread_mutex_lock(&count_cache_lck);
+  snapshot_shutdown = 1;
+  pthread_mutex_unlock(&count_cache_lck);
 
-      sqlite3_free(query);
-      return -1;
-    }
+  /* Wait for a refresh in progress */
+  pthread_mutex_lock(&snapshot_build_lck);
+  pthread_mutex_unlock(&snapshot_build_lck);
 
-  ret = db_blocking_step(stmt);
-  if (ret != SQLITE_ROW)
-    {
-      if (ret == SQLITE_DONE)
-	DPRINTF(E_INFO, L_DB, "No results\n");
-      else
-	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+  pthread_mutex_lock(&count_cache_lck);
+  snap = snapshot;
+  snapshot = NULL;
+  pthread_mutex_unlock(&count_cache_lck);
 
-      sqlite3_finalize(stmt);
-      sqlite3_free(query);
-      return -1;
-    }
+  if (snap)
+    db_snapshot_unref(snap);
+}
 
-  *id = sqlite3_column_int(stmt, 0);
 
-#ifdef DB_PROFILE
-  while (db_blocking_step(stmt) == SQLITE_ROW)
-    ; /* EMPTY */
-#endif
+/* Queries */
+static int
+db_query_get_count(struct query_params *qp, char *count)
+{
+  int unbounded;
 
-  sqlite3_finalize(stmt);
-  sqlite3_free(query);
+  unbounded = (qp->idx_type == I_NONE)
+    || ((qp->idx_type == I_SUB) && (qp->limit < 0) && (qp->offset == 0));
 
-  return 0;
+  /* The results are all going to be fetched anyway, count them then */
+  if (qp->single_pass && unbounded)
+    {
+      qp->counting = 1;
+      return 0;
+    }
 
-#undef Q_TMPL
+  return db_get_count_cached(count);
 }
 
-static struct playlist_info *
-db_pl_fetch_byquery(char *query)
+/* Select list for items queries, limited to the columns in qp->cols */
+static int
+db_build_query_cols(struct query_params *qp)
 {
-  struct playlist_info *pli;
-  sqlite3_stmt *stmt;
-  int ncols;
-  char *cval;
-  uint32_t *ival;
-  char **strval;
-  uint64_t disabled;
+  char *cols;
+  char *ptr;
+  uint64_t wanted;
+  int len;
   int i;
-  int ret;
-
-  if (!query)
-    return NULL;
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  qp->select_cols = NULL;
 
-  pli = (struct playlist_info *)malloc(sizeof(struct playlist_info));
-  if (!pli)
+  if (!qp->cols)
     {
-      DPRINTF(E_LOG, L_DB, "Could not allocate struct playlist_info, out of memory\n");
-      return NULL;
+      qp->ncols = sizeof(dbmfi_cols_map) / sizeof(dbmfi_cols_map[0]);
+      return 0;
     }
-  memset(pli, 0, sizeof(struct playlist_info));
-
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(pool_hdl->hdl));
 
-      free(pli);
-      return NULL;
-    }
+  /* Needed to detect the end of the results */
+  wanted = qp->cols | dbmfi_col(id);
 
-  ret = db_blocking_step(stmt);
-  if (ret != SQLITE_ROW)
+  len = 1;
+  for (i = 0; i < (sizeof(dbmfi_cols_map) / sizeof(dbmfi_cols_map[0])); i++)
     {
-      if (ret == SQLITE_DONE)
-	DPRINTF(E_INFO, L_DB, "No results\n");
-      else
-	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
-
-      sqlite3_finalize(stmt);
-      free(pli);
-      return NULL;
+      if (wanted & dbmfi_col_byoffset(dbmfi_cols_map[i].offset))
+	len += strlen(dbmfi_cols_map[i].name) + 4;
     }
 
-  ncols = sqlite3_column_count(stmt);
-
-  if (sizeof(pli_cols_map) / sizeof(pli_cols_map[0]) != ncols)
+  cols = (char *)malloc(len);
+  if (!cols)
     {
-      DPRINTF(E_LOG, L_DB, "BUG: pli column map out of sync with schema\n");
-
-      sqlite3_finalize(stmt);
-      free(pli);
-      return NULL;
+      DPRINTF(E_LOG, L_DB, "Out of memory for select list\n");
+      return -1;
     }
 
-  for (i = 0; i < ncols; i++)
+  ptr = cols;
+  qp->ncols = 0;
+  for (i = 0; i < (sizeof(dbmfi_cols_map) / sizeof(dbmfi_cols_map[0])); i++)
     {
-      switch (pli_cols_map[i].type)
-	{
-	  case DB_TYPE_INT:
-	    ival = (uint32_t *) ((char *)pli + pli_cols_map[i].offset);
-
-	    if (pli_cols_map[i].offset == pli_offsetof(disabled))
-	      {
-		disabled = sqlite3_column_int64(stmt, i);
-		*ival = (disabled != 0);
-	      }
-	    else
-	      *ival = sqlite3_column_int(stmt, i);
-	    break;
-
-	  case DB_TYPE_STRING:
-	    strval = (char **) ((char *)pli + pli_cols_map[i].offset);
-
-	    cval = (char *)sqlite3_column_text(stmt, i);
-	    if (cval)
-	      *strval = strdup(cval);
-	    break;
-
-	  default:
-	    DPRINTF(E_LOG, L_DB, "BUG: Unknown type %d in pli column map\n", pli_cols_map[i].type);
+      if (!(wanted & dbmfi_col_byoffset(dbmfi_cols_map[i].offset)))
+	continue;
 
-	    sqlite3_finalize(stmt);
-	    free_pli(pli, 0);
-	    return NULL;
-	}
+      ptr += sprintf(ptr, "%sf.%s", (qp->ncols > 0) ? ", " : "", dbmfi_cols_map[i].name);
+      qp->ncols++;
     }
 
-  ret = db_blocking_step(stmt);
-  sqlite3_finalize(stmt);
+  qp->select_cols = cols;
 
-  if (ret != SQLITE_DONE)
-    {
-      DPRINTF(E_WARN, L_DB, "Query had more than a single result!\n");
+  return 0;
+}
 
-      free_pli(pli, 0);
-      return NULL;
-    }
+static int
+db_build_query_index_clause(struct query_params *qp, char **i)
+{
+  char *idx;
 
-  switch (pli->type)
+  switch (qp->idx_type)
     {
-      case PL_PLAIN:
-	pli->items = db_pl_count_items(pli->id);
+      case I_FIRST:
+	idx = sqlite3_mprintf("LIMIT %d", qp->limit);
 	break;
 
-      case PL_SMART:
-	pli->items = db_smartpl_count_items(pli->query);
+      case I_LAST:
+	idx = sqlite3_mprintf("LIMIT -1 OFFSET %d", qp->results - qp->limit);
+	break;
+
+      case I_SUB:
+	idx = sqlite3_mprintf("LIMIT %d OFFSET %d", qp->limit, qp->offset);
 	break;
 
+      case I_NONE:
+	*i = NULL;
+	return 0;
+
       default:
-	DPRINTF(E_LOG, L_DB, "Unknown playlist type %d while fetching playlist\n", pli->type);
+	DPRINTF(E_LOG, L_DB, "Unknown index type\n");
+	return -1;
+    }
 
-	free_pli(pli, 0);
-	return NULL;
+  if (!idx)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not build index string; out of memory");
+      return -1;
     }
 
-  return pli;
+  *i = idx;
+
+  return 0;
 }
 
-struct playlist_info *
-db_pl_fetch_bypath(char *path)
+/* Next page of a paging session: seek past the last row delivered */
+static int
+db_build_query_items_seek(struct query_params *qp, int lastid, const char *sort, char **q)
 {
-#define Q_TMPL "SELECT p.* FROM playlists p WHERE p.path = '%q';"
-  struct playlist_info *pli;
   char *query;
 
-  query = sqlite3_mprintf(Q_TMPL, path);
+  DPRINTF(E_DBG, L_DB, "Resuming paged query at offset %d after id %d\n", qp->offset, lastid);
+
+  if (qp->filter)
+    query = sqlite3_mprintf("SELECT %s FROM files f, files l WHERE l.id = %d AND f.disabled = 0 AND %s AND %s %s LIMIT %d;",
+			    SELECT_COLS(qp), lastid, seek_clause[qp->sort], qp->filter, sort, qp->limit);
+  else
+    query = sqlite3_mprintf("SELECT %s FROM files f, files l WHERE l.id = %d AND f.disabled = 0 AND %s %s LIMIT %d;",
+			    SELECT_COLS(qp), lastid, seek_clause[qp->sort], sort, qp->limit);
+
   if (!query)
     {
       DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return NULL;
+      return -1;
     }
 
-  pli = db_pl_fetch_byquery(query);
-
-  sqlite3_free(query);
-
-  return pli;
+  *q = query;
 
-#undef Q_TMPL
+  return 0;
 }
 
-struct playlist_info *
-db_pl_fetch_byid(int id)
+static int
+db_build_query_items(struct query_params *qp, char **q)
 {
-#define Q_TMPL "SELECT p.* FROM playlists p WHERE p.id = %d;"
-  struct playlist_info *pli;
   char *query;
-
-  query = sqlite3_mprintf(Q_TMPL, id);
-  if (!query)
+  char *count;
+  char *idx;
+  const char *sort;
+  int lastid;
+  int ret;
+
+  if (qp->filter)
+    count = sqlite3_mprintf("SELECT COUNT(*) FROM files f WHERE f.disabled = 0 AND %s;", qp->filter);
+  else
+    count = sqlite3_mprintf("SELECT COUNT(*) FROM files f WHERE f.disabled = 0;");
+
+  if (!count)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      DPRINTF(E_LOG, L_DB, "Out of memory for count query string\n");
 
-      return NULL;
+      return -1;
     }
 
-  pli = db_pl_fetch_byquery(query);
+  qp->results = db_query_get_count(qp, count);
+  sqlite3_free(count);
 
-  sqlite3_free(query);
+  if (qp->results < 0)
+    return -1;
 
-  return pli;
+  if (!qp->session)
+    sort = sort_clause[qp->sort];
+  else
+    {
+      sort = seek_sort_clause[qp->sort];
 
-#undef Q_TMPL
-}
+      lastid = db_cursor_get(qp);
+      if (lastid > 0)
+	return db_build_query_items_seek(qp, lastid, sort, q);
+    }
 
-struct playlist_info *
-db_pl_fetch_bytitlepath(char *title, char *path)
-{
-#define Q_TMPL "SELECT p.* FROM playlists p WHERE p.title = '%q' AND p.path = '%q';"
-  struct playlist_info *pli;
-  char *query;
+  /* Get index clause */
+  ret = db_build_query_index_clause(qp, &idx);
+  if (ret < 0)
+    return -1;
+
+  if (idx && qp->filter)
+    query = sqlite3_mprintf("SELECT %s FROM files f WHERE f.disabled = 0 AND %s %s %s;", SELECT_COLS(qp), qp->filter, sort, idx);
+  else if (idx)
+    query = sqlite3_mprintf("SELECT %s FROM files f WHERE f.disabled = 0 %s %s;", SELECT_COLS(qp), sort, idx);
+  else if (qp->filter)
+    query = sqlite3_mprintf("SELECT %s FROM files f WHERE f.disabled = 0 AND %s %s;", SELECT_COLS(qp), qp->filter, sort);
+  else
+    query = sqlite3_mprintf("SELECT %s FROM files f WHERE f.disabled = 0 %s;", SELECT_COLS(qp), sort);
 
-  query = sqlite3_mprintf(Q_TMPL, title, path);
   if (!query)
     {
       DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return NULL;
+      return -1;
     }
 
-  pli = db_pl_fetch_byquery(query);
-
-  sqlite3_free(query);
-
-  return pli;
+  *q = query;
 
-#undef Q_TMPL
+  return 0;
 }
 
-int
-db_pl_add(char *title, char *path, int *id)
+static int
+db_build_query_pls(struct query_params *qp, char **q)
 {
-#define QDUP_TMPL "SELECT COUNT(*) FROM playlists p WHERE p.title = '%q' AND p.path = '%q';"
-#define QADD_TMPL "INSERT INTO playlists (title, type, query, db_timestamp, disabled, path, idx, special_id)" \
-                  " VALUES ('%q', 0, NULL, %" PRIi64 ", 0, '%q', 0, 0);"
   char *query;
-  char *errmsg;
+  char *idx;
   int ret;
 
-  /* Check duplicates */
-  query = sqlite3_mprintf(QDUP_TMPL, title, path);
+  qp->results = db_query_get_count(qp, "SELECT COUNT(*) FROM playlists p WHERE p.disabled = 0;");
+  if (qp->results < 0)
+    return -1;
+
+  /* Get index clause */
+  ret = db_build_query_index_clause(qp, &idx);
+  if (ret < 0)
+    return -1;
+
+  if (idx && qp->filter)
+    query = sqlite3_mprintf("SELECT f.* FROM playlists f WHERE f.disabled = 0 AND %s %s;", qp->filter, idx);
+  else if (idx)
+    query = sqlite3_mprintf("SELECT f.* FROM playlists f WHERE f.disabled = 0 %s;", idx);
+  else if (qp->filter)
+    query = sqlite3_mprintf("SELECT f.* FROM playlists f WHERE f.disabled = 0 AND %s;", qp->filter);
+  else
+    query = sqlite3_mprintf("SELECT f.* FROM playlists f WHERE f.disabled = 0;");
+
   if (!query)
     {
       DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
       return -1;
     }
 
-  ret = db_get_count(query);
+  *q = query;
 
-  sqlite3_free(query);
+  return 0;
+}
 
-  if (ret > 0)
-    {
-      DPRINTF(E_WARN, L_DB, "Duplicate playlist with title '%s' path '%s'\n", title, path);
-      return -1;
-    }
+static int
+db_build_query_plitems_plain(struct query_params *qp, char **q)
+{
+  char *query;
+  char *count;
+  char *idx;
+  int ret;
 
-  /* Add */
-  query = sqlite3_mprintf(QADD_TMPL, title, (int64_t)time(NULL), path);
-  if (!query)
+  if (qp->filter)
+    count = sqlite3_mprintf("SELECT COUNT(*) FROM files f JOIN playlistitems pi ON f.id = pi.fileid"
+			    " WHERE pi.playlistid = %d AND f.disabled = 0 AND %s;", qp->id, qp->filter);
+  else
+    count = sqlite3_mprintf("SELECT COUNT(*) FROM files f JOIN playlistitems pi ON f.id = pi.fileid"
+			    " WHERE pi.playlistid = %d AND f.disabled = 0;", qp->id);
+
+  if (!count)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      DPRINTF(E_LOG, L_DB, "Out of memory for count query string\n");
+
       return -1;
     }
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  qp->results = db_query_get_count(qp, count);
+  sqlite3_free(count);
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
+  if (qp->results < 0)
+    return -1;
 
-      sqlite3_free(errmsg);
-      sqlite3_free(query);
-      return -1;
-    }
+  /* Get index clause */
+  ret = db_build_query_index_clause(qp, &idx);
+  if (ret < 0)
+    return -1;
 
-  sqlite3_free(query);
+  if (idx && qp->filter)
+    query = sqlite3_mprintf("SELECT %s FROM files f JOIN playlistitems pi ON f.id = pi.fileid"
+			    " WHERE pi.playlistid = %d AND f.disabled = 0 AND %s ORDER BY pi.id ASC %s;",
+			    SELECT_COLS(qp), qp->id, qp->filter, idx);
+  else if (idx)
+    query = sqlite3_mprintf("SELECT %s FROM files f JOIN playlistitems pi ON f.id = pi.fileid"
+			    " WHERE pi.playlistid = %d AND f.disabled = 0 ORDER BY pi.id ASC %s;",
+			    SELECT_COLS(qp), qp->id, idx);
+  else if (qp->filter)
+    query = sqlite3_mprintf("SELECT %s FROM files f JOIN playlistitems pi ON f.id = pi.fileid"
+			    " WHERE pi.playlistid = %d AND f.disabled = 0 AND %s ORDER BY pi.id ASC;",
+			    SELECT_COLS(qp), qp->id, qp->filter);
+  else
+    query = sqlite3_mprintf("SELECT %s FROM files f JOIN playlistitems pi ON f.id = pi.fileid"
+			    " WHERE pi.playlistid = %d AND f.disabled = 0 ORDER BY pi.id ASC;",
+			    SELECT_COLS(qp), qp->id);
 
-  *id = (int)sqlite3_last_insert_rowid(pool_hdl->hdl);
-  if (*id == 0)
+  if (!query)
     {
-      DPRINTF(E_LOG, L_DB, "Successful insert but no last_insert_rowid!\n");
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
       return -1;
     }
 
-  DPRINTF(E_DBG, L_DB, "Added playlist %s (path %s) with id %d\n", title, path, *id);
+  *q = query;
 
   return 0;
-
-#undef QDUP_TMPL
-#undef QADD_TMPL
 }
 
-int
-db_pl_add_item_bypath(int plid, char *path)
+/* Smart playlist membership is read from the smartplitems table when it
+ * is up to date with the library, see db_smartpl_refresh()
+ */
+static int
+db_build_query_plitems_smartpl(struct query_params *qp, int items, char **q)
 {
-#define Q_TMPL "INSERT INTO playlistitems (playlistid, filepath) VALUES (%d, '%q');"
   char *query;
-  char *errmsg;
+  char *count;
+  char *filter;
+  char *idx;
+  const char *sort;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, plid, path);
-  if (!query)
+  if (qp->filter)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return -1;
-    }
+      filter = qp->filter;
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+      count = sqlite3_mprintf("SELECT COUNT(*) FROM smartplitems s JOIN files f ON f.id = s.fileid"
+			      " WHERE s.playlistid = %d AND %s;", qp->id, filter);
+      if (!count)
+	{
+	  DPRINTF(E_LOG, L_DB, "Out of memory for count query string\n");
+	  return -1;
+	}
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
+      qp->results = db_query_get_count(qp, count);
+
+      sqlite3_free(count);
+
+      if (qp->results < 0)
+	return -1;
+    }
+  else
     {
-      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
+      filter = "1 = 1";
 
-      sqlite3_free(errmsg);
-      sqlite3_free(query);
+      qp->results = items;
+    }
+
+  /* Get index clause */
+  ret = db_build_query_index_clause(qp, &idx);
+  if (ret < 0)
+    return -1;
+
+  if (!idx)
+    idx = "";
+
+  sort = sort_clause[qp->sort];
+
+  query = sqlite3_mprintf("SELECT %s FROM smartplitems s JOIN files f ON f.id = s.fileid"
+			  " WHERE s.playlistid = %d AND %s %s %s;", SELECT_COLS(qp), qp->id, filter, sort, idx);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
       return -1;
     }
 
-  sqlite3_free(query);
+  *q = query;
 
   return 0;
-
-#undef Q_TMPL
 }
 
-int
-db_pl_add_item_byid(int plid, int fileid)
+static int
+db_build_query_plitems_smart(struct query_params *qp, char *smartpl_query, char **q)
 {
-#define Q_TMPL "INSERT INTO playlistitems (playlistid, filepath) VALUES (%d, (SELECT f.path FROM files f WHERE f.id = %d));"
   char *query;
-  char *errmsg;
+  char *count;
+  char *filter;
+  char *idx;
+  const char *sort;
+  int items;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, plid, fileid);
-  if (!query)
+  ret = db_smartpl_items_get(qp->id, &items);
+  if (ret == 0)
+    return db_build_query_plitems_smartpl(qp, items, q);
+
+  if (qp->filter)
+    filter = qp->filter;
+  else
+    filter = "1 = 1";
+
+  count = sqlite3_mprintf("SELECT COUNT(*) FROM files f WHERE f.disabled = 0 AND %s AND %s;", filter, smartpl_query);
+  if (!count)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      DPRINTF(E_LOG, L_DB, "Out of memory for count query string\n");
       return -1;
     }
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  qp->results = db_query_get_count(qp, count);
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
+  sqlite3_free(count);
 
-      sqlite3_free(errmsg);
-      sqlite3_free(query);
+  if (qp->results < 0)
+    return -1;
+
+  /* Get index clause */
+  ret = db_build_query_index_clause(qp, &idx);
+  if (ret < 0)
+    return -1;
+
+  if (!idx)
+    idx = "";
+
+  sort = sort_clause[qp->sort];
+
+  query = sqlite3_mprintf("SELECT %s FROM files f WHERE f.disabled = 0 AND %s AND %s %s %s;", SELECT_COLS(qp), smartpl_query, filter, sort, idx);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
       return -1;
     }
 
-  sqlite3_free(query);
+  *q = query;
 
   return 0;
-
-#undef Q_TMPL
 }
 
-void
-db_pl_clear_items(int id)
+static int
+db_build_query_plitems(struct query_params *qp, char **q)
 {
-#define Q_TMPL "DELETE FROM playlistitems WHERE playlistid = %d;"
-  char *query;
-  char *errmsg;
+  struct playlist_info *pli;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, id);
-  if (!query)
+  if (qp->id <= 0)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return;
+      DPRINTF(E_LOG, L_DB, "No playlist id specified in playlist items query\n");
+      return -1;
     }
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  pli = db_pl_fetch_byid(qp->id);
+  if (!pli)
+    return -1;
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
-    DPRINTF(E_LOG, L_DB, "Error clearing playlist %d items: %s\n", id, errmsg);
+  switch (pli->type)
+    {
+      case PL_SMART:
+	ret = db_build_query_plitems_smart(qp, pli->query, q);
+	break;
 
-  sqlite3_free(errmsg);
-  sqlite3_free(query);
+      case PL_PLAIN:
+	ret = db_build_query_plitems_plain(qp, q);
+	break;
 
-#undef Q_TMPL
+      default:
+	DPRINTF(E_LOG, L_DB, "Unknown playlist type %d in playlist items query\n", pli->type);
+	ret = -1;
+	break;
+    }
+
+  free_pli(pli, 0);
+
+  return ret;
 }
 
-void
-db_pl_delete(int id)
+static int
+db_build_query_groups(struct query_params *qp, char **q)
 {
-#define Q_TMPL "DELETE FROM playlists WHERE id = %d;"
   char *query;
-  char *errmsg;
+  char *count;
+  char *idx;
   int ret;
 
-  if (id == 1)
-    return;
-
-  query = sqlite3_mprintf(Q_TMPL, id);
-  if (!query)
+  /* The groups table carries per-album item counts maintained by the
+   * files triggers; filters apply to files, so those still need the join.
+   * Both paths list the groups in the same order, so index ranges match.
+   */
+  if (qp->filter)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      count = sqlite3_mprintf("SELECT COUNT(DISTINCT g.id) FROM files f, groups g WHERE f.songalbumid = g.persistentid AND g.type = %d AND f.disabled = 0 AND %s;", G_ALBUMS, qp->filter);
+      if (!count)
+	{
+	  DPRINTF(E_LOG, L_DB, "Out of memory for count query string\n");
+	  return -1;
+	}
 
-      return;
+      qp->results = db_query_get_count(qp, count);
+      sqlite3_free(count);
     }
+  else
+    qp->results = db_query_get_count(qp, "SELECT COUNT(*) FROM groups g WHERE g.type = 1 AND g.items > 0;");
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  if (qp->results < 0)
+    return -1;
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
-    DPRINTF(E_LOG, L_DB, "Error deleting playlist %d: %s\n", id, errmsg);
+  /* Get index clause */
+  ret = db_build_query_index_clause(qp, &idx);
+  if (ret < 0)
+    return -1;
 
-  sqlite3_free(errmsg);
-  sqlite3_free(query);
+  if (idx && qp->filter)
+    query = sqlite3_mprintf("SELECT COUNT(*), g.id, g.persistentid, f.album_artist, g.name, MIN(f.id) FROM files f, groups g WHERE f.songalbumid = g.persistentid AND g.type = %d AND f.disabled = 0 AND %s GROUP BY g.id ORDER BY g.name, g.id %s;", G_ALBUMS, qp->filter, idx);
+  else if (idx)
+    query = sqlite3_mprintf("SELECT g.items, g.id, g.persistentid, g.album_artist, g.name, g.itemid FROM groups g WHERE g.type = %d AND g.items > 0 ORDER BY g.name, g.id %s;", G_ALBUMS, idx);
+  else if (qp->filter)
+    query = sqlite3_mprintf("SELECT COUNT(*), g.id, g.persistentid, f.album_artist, g.name, MIN(f.id) FROM files f, groups g WHERE f.songalbumid = g.persistentid AND g.type = %d AND f.disabled = 0 AND %s GROUP BY g.id ORDER BY g.name, g.id;", G_ALBUMS, qp->filter);
+  else
+    query = sqlite3_mprintf("SELECT g.items, g.id, g.persistentid, g.album_artist, g.name, g.itemid FROM groups g WHERE g.type = %d AND g.items > 0 ORDER BY g.name, g.id;", G_ALBUMS);
 
-  db_pl_clear_items(id);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
+    }
 
-#undef Q_TMPL
+  *q = query;
+
+  return 0;
 }
 
-void
-db_pl_delete_bypath(char *path)
+static int
+db_build_query_groupitems(struct query_params *qp, char **q)
 {
-  int id;
-  int ret;
+  char *query;
+  char *count;
+  enum group_type gt;
 
-  ret = db_pl_id_bypath(path, &id);
-  if (ret < 0)
-    return;
+  gt = db_group_type_byid(qp->id);
 
-  db_pl_delete(id);
-}
+  switch (gt)
+    {
+      case G_ALBUMS:
+	count = sqlite3_mprintf("SELECT COUNT(*) FROM files f JOIN groups g ON f.songalbumid = g.persistentid"
+				" WHERE g.id = %d AND f.disabled = 0;", qp->id);
+	break;
 
-static void
-db_pl_disable_byquery(char *query)
-{
-  char *errmsg;
-  int ret;
+      default:
+	DPRINTF(E_LOG, L_DB, "Unsupported group type %d for group id %d\n", gt, qp->id);
+	return -1;
+    }
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  if (!count)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for count query string\n");
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
-    DPRINTF(E_LOG, L_DB, "Error disabling playlist: %s\n", errmsg);
+      return -1;
+    }
 
-  sqlite3_free(errmsg);
-}
+  qp->results = db_query_get_count(qp, count);
+  sqlite3_free(count);
 
-void
-db_pl_disable_bypath(char *path, char *strip, uint32_t cookie)
-{
-#define Q_TMPL "UPDATE playlists SET path = substr(path, %d), disabled = %" PRIi64 " WHERE path = '%q';"
-  char *query;
-  int64_t disabled;
-  int striplen;
+  if (qp->results < 0)
+    return -1;
 
-  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
-  striplen = strlen(strip) + 1;
+  switch (gt)
+    {
+      case G_ALBUMS:
+	query = sqlite3_mprintf("SELECT %s FROM files f JOIN groups g ON f.songalbumid = g.persistentid"
+				" WHERE g.id = %d AND f.disabled = 0;", SELECT_COLS(qp), qp->id);
+	break;
+    }
 
-  query = sqlite3_mprintf(Q_TMPL, striplen, disabled, path);
   if (!query)
     {
       DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return;
+      return -1;
     }
 
-  db_pl_disable_byquery(query);
-
-  sqlite3_free(query);
+  *q = query;
 
-#undef Q_TMPL
+  return 0;
 }
 
-void
-db_pl_disable_bymatch(char *path, char *strip, uint32_t cookie)
+static int
+db_build_query_group_dirs(struct query_params *qp, char **q)
 {
-#define Q_TMPL "UPDATE playlists SET path = substr(path, %d), disabled = %" PRIi64 " WHERE path LIKE '%q/%%';"
   char *query;
-  int64_t disabled;
-  int striplen;
+  char *count;
+  enum group_type gt;
 
-  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
-  striplen = strlen(strip) + 1;
+  gt = db_group_type_byid(qp->id);
 
-  query = sqlite3_mprintf(Q_TMPL, striplen, disabled, path);
-  if (!query)
+  switch (gt)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      case G_ALBUMS:
+	count = sqlite3_mprintf("SELECT COUNT(DISTINCT(SUBSTR(f.path, 1, LENGTH(f.path) - LENGTH(f.fname) - 1)))"
+				" FROM files f JOIN groups g ON f.songalbumid = g.persistentid"
+				" WHERE g.id = %d AND f.disabled = 0;", qp->id);
+	break;
 
-      return;
+      default:
+	DPRINTF(E_LOG, L_DB, "Unsupported group type %d for group id %d\n", gt, qp->id);
+	return -1;
     }
 
-  db_pl_disable_byquery(query);
+  if (!count)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for count query string\n");
 
-  sqlite3_free(query);
+      return -1;
+    }
 
-#undef Q_TMPL
-}
+  qp->results = db_query_get_count(qp, count);
+  sqlite3_free(count);
 
-int
-db_pl_enable_bycookie(uint32_t cookie, char *path)
-{
-#define Q_TMPL "UPDATE playlists SET path = '%q' || path, disabled = 0 WHERE disabled = %" PRIi64 ";"
-  char *query;
-  char *errmsg;
-  int ret;
+  if (qp->results < 0)
+    return -1;
+
+  switch (gt)
+    {
+      case G_ALBUMS:
+	query = sqlite3_mprintf("SELECT DISTINCT(SUBSTR(f.path, 1, LENGTH(f.path) - LENGTH(f.fname) - 1))"
+				" FROM files f JOIN groups g ON f.songalbumid = g.persistentid"
+				" WHERE g.id = %d AND f.disabled = 0;", qp->id);
+	break;
+    }
 
-  query = sqlite3_mprintf(Q_TMPL, path, (int64_t)cookie);
   if (!query)
     {
       DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
       return -1;
     }
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  *q = query;
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
+  return 0;
+}
+
+/* Unfiltered browse queries are served from the browse table, which the
+ * files triggers keep up to date; filters apply to the files table, so
+ * those still need the full scan below.
+ */
+static int
+db_build_query_browse_table(struct query_params *qp, int type, char **q)
+{
+  char *query;
+  char *count;
+  char *idx;
+  int ret;
+
+  count = sqlite3_mprintf("SELECT COUNT(*) FROM browse b WHERE b.type = %d;", type);
+  if (!count)
     {
-      DPRINTF(E_LOG, L_DB, "Error enabling playlists: %s\n", errmsg);
+      DPRINTF(E_LOG, L_DB, "Out of memory for count query string\n");
 
-      sqlite3_free(errmsg);
-      sqlite3_free(query);
       return -1;
     }
 
-  sqlite3_free(query);
-
-  return sqlite3_changes(pool_hdl->hdl);
-
-#undef Q_TMPL
-}
+  qp->results = db_query_get_count(qp, count);
+  sqlite3_free(count);
 
+  if (qp->results < 0)
+    return -1;
 
-/* Groups */
-int
-db_groups_clear(void)
-{
-  char *query = "DELETE FROM groups;";
-  char *errmsg;
-  int ret;
+  /* Get index clause */
+  ret = db_build_query_index_clause(qp, &idx);
+  if (ret < 0)
+    return -1;
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  if (idx)
+    query = sqlite3_mprintf("SELECT b.value, b.sort_value FROM browse b WHERE b.type = %d ORDER BY b.sort_value %s;", type, idx);
+  else
+    query = sqlite3_mprintf("SELECT b.value, b.sort_value FROM browse b WHERE b.type = %d ORDER BY b.sort_value;", type);
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
+  if (!query)
     {
-      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
-
-      sqlite3_free(errmsg);
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
       return -1;
     }
 
+  *q = query;
+
   return 0;
 }
 
-enum group_type
-db_group_type_byid(int id)
+static int
+db_build_query_browse(struct query_params *qp, char *field, int type, char **q)
 {
-#define Q_TMPL "SELECT g.type FROM groups g WHERE g.id = '%d';"
   char *query;
-  sqlite3_stmt *stmt;
+  char *count;
+  char *idx;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, id);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  if (!qp->filter)
+    return db_build_query_browse_table(qp, type, q);
 
-      return 0;
-    }
-
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  ret = db_blocking_prepare_v2(query, strlen(query) + 1, &stmt, NULL);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+  count = sqlite3_mprintf("SELECT COUNT(DISTINCT f.%s) FROM files f WHERE f.data_kind = 0 AND f.disabled = 0 AND f.%s != '' AND %s;",
+			  field, field, qp->filter);
 
-      sqlite3_free(query);
-      return 0;
-    }
-
-  ret = db_blocking_step(stmt);
-  if (ret != SQLITE_ROW)
+  if (!count)
     {
-      if (ret == SQLITE_DONE)
-	DPRINTF(E_INFO, L_DB, "No results\n");
-      else
-	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+      DPRINTF(E_LOG, L_DB, "Out of memory for count query string\n");
 
-      sqlite3_finalize(stmt);
-      sqlite3_free(query);
-      return 0;
+      return -1;
     }
 
-  ret = sqlite3_column_int(stmt, 0);
-
-#ifdef DB_PROFILE
-  while (db_blocking_step(stmt) == SQLITE_ROW)
-    ; /* EMPTY */
-#endif
-
-  sqlite3_finalize(stmt);
-  sqlite3_free(query);
+  qp->results = db_query_get_count(qp, count);
+  sqlite3_free(count);
 
-  return ret;
+  if (qp->results < 0)
+    return -1;
 
-#undef Q_TMPL
-}
+  /* Get index clause */
+  ret = db_build_query_index_clause(qp, &idx);
+  if (ret < 0)
+    return -1;
 
-/* Remotes */
-static int
-db_pairing_delete_byremote(char *remote_id)
-{
-#define Q_TMPL "DELETE FROM pairings WHERE remote = '%q';"
-  char *query;
-  char *errmsg;
-  int ret;
+  if (idx)
+    query = sqlite3_mprintf("SELECT DISTINCT f.%s, f.%s FROM files f WHERE f.data_kind = 0 AND f.disabled = 0 AND f.%s != ''"
+			    " AND %s %s;", field, field, field, qp->filter, idx);
+  else
+    query = sqlite3_mprintf("SELECT DISTINCT f.%s, f.%s FROM files f WHERE f.data_kind = 0 AND f.disabled = 0 AND f.%s != ''"
+			    " AND %s;", field, field, field, qp->filter);
 
-  query = sqlite3_mprintf(Q_TMPL, remote_id);
   if (!query)
     {
       DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
-      return -1;
-    }
-
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Error deleting pairing: %s\n", errmsg);
-
-      sqlite3_free(errmsg);
-      sqlite3_free(query);
       return -1;
     }
 
-  sqlite3_free(query);
+  *q = query;
 
   return 0;
-
-#undef Q_TMPL
 }
 
 int
-db_pairing_add(struct pairing_info *pi)
+db_query_start(struct query_params *qp)
 {
-#define Q_TMPL "INSERT INTO pairings (remote, name, guid) VALUES ('%q', '%q', '%q');"
   char *query;
-  char *errmsg;
   int ret;
 
-  ret = db_pairing_delete_byremote(pi->remote_id);
+  qp->stmt = NULL;
+  qp->counting = 0;
+  qp->fetched = 0;
+  qp->lastid = 0;
+
+  /* The writer may see uncommitted data that doesn't match any revision */
+  if (writer_held)
+    qp->session = 0;
+
+  if (qp->session)
+    qp->revision = db_revision_get();
+
+  qp->snap = NULL;
+  qp->snap_buf = NULL;
+
+  ret = db_snapshot_query_start(qp);
+  if (ret == 0)
+    return 0;
+
+  ret = db_build_query_cols(qp);
   if (ret < 0)
-    return ret;
+    return -1;
 
-  query = sqlite3_mprintf(Q_TMPL, pi->remote_id, pi->name, pi->guid);
-  if (!query)
+  switch (qp->type)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      case Q_ITEMS:
+	ret = db_build_query_items(qp, &query);
+	break;
 
-      return -1;
-    }
+      case Q_PL:
+	ret = db_build_query_pls(qp, &query);
+	break;
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+      case Q_PLITEMS:
+	ret = db_build_query_plitems(qp, &query);
+	break;
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Error adding pairing: %s\n", errmsg);
+      case Q_GROUPS:
+	ret = db_build_query_groups(qp, &query);
+	break;
 
-      sqlite3_free(errmsg);
-      sqlite3_free(query);
-      return -1;
-    }
+      case Q_GROUPITEMS:
+	ret = db_build_query_groupitems(qp, &query);
+	break;
 
-  sqlite3_free(query);
+      case Q_GROUP_DIRS:
+	ret = db_build_query_group_dirs(qp, &query);
+	break;
 
-  return 0;
+      case Q_BROWSE_ALBUMS:
+	ret = db_build_query_browse(qp, "album", BROWSE_ALBUM, &query);
+	break;
 
-#undef Q_TMPL
-}
+      case Q_BROWSE_ARTISTS:
+	ret = db_build_query_browse(qp, "artist", BROWSE_ARTIST, &query);
+	break;
 
-int
-db_pairing_fetch_byguid(struct pairing_info *pi)
-{
-#define Q_TMPL "SELECT p.* FROM pairings p WHERE p.guid = '%q';"
-  char *query;
-  sqlite3_stmt *stmt;
-  int ret;
+      case Q_BROWSE_GENRES:
+	ret = db_build_query_browse(qp, "genre", BROWSE_GENRE, &query);
+	break;
 
-  query = sqlite3_mprintf(Q_TMPL, pi->guid);
-  if (!query)
+      case Q_BROWSE_COMPOSERS:
+	ret = db_build_query_browse(qp, "composer", BROWSE_COMPOSER, &query);
+	break;
+
+      default:
+	DPRINTF(E_LOG, L_DB, "Unknown query type\n");
+	ret = -1;
+	break;
+    }
+
+  if (qp->select_cols)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      return -1;
+      free(qp->select_cols);
+      qp->select_cols = NULL;
     }
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  if (ret < 0)
+    return -1;
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  DPRINTF(E_DBG, L_DB, "Starting query '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, -1, &qp->stmt, NULL);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(pool_hdl->hdl));
-      return -1;
-    }
-
-  ret = db_blocking_step(stmt);
-  if (ret != SQLITE_ROW)
-    {
-      if (ret == SQLITE_DONE)
-	DPRINTF(E_INFO, L_DB, "Pairing GUID %s not found\n", pi->guid);
-      else
-	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
 
-      sqlite3_finalize(stmt);
       sqlite3_free(query);
       return -1;
     }
 
-  pi->remote_id = strdup((char *)sqlite3_column_text(stmt, 0));
-  pi->name = strdup((char *)sqlite3_column_text(stmt, 1));
-
-#ifdef DB_PROFILE
-  while (db_blocking_step(stmt) == SQLITE_ROW)
-    ; /* EMPTY */
-#endif
-
-  sqlite3_finalize(stmt);
   sqlite3_free(query);
 
   return 0;
-
-#undef Q_TMPL
 }
 
-
-/* Speakers */
-int
-db_speaker_save(uint64_t id, int selected, int volume)
+void
+db_query_end(struct query_params *qp)
 {
-#define Q_TMPL "INSERT OR REPLACE INTO speakers (id, selected, volume) VALUES (%" PRIi64 ", %d, %d);"
-  char *query;
-  char *errmsg;
-  int ret;
-
-  query = sqlite3_mprintf(Q_TMPL, id, selected, volume);
-  if (!query)
+  if (qp->snap)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      db_snapshot_unref(qp->snap);
+      free(qp->snap_buf);
 
-      return -1;
+      qp->snap = NULL;
+      qp->snap_buf = NULL;
+      qp->results = -1;
+      return;
     }
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  errmsg = NULL;
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Error saving speaker state: %s\n", errmsg);
-
-      sqlite3_free(errmsg);
-      sqlite3_free(query);
-      return -1;
-    }
+  if (!qp->stmt)
+    return;
 
-  sqlite3_free(query);
+  if (qp->type == Q_ITEMS)
+    db_cursor_save(qp);
 
-  return 0;
+  qp->results = -1;
 
-#undef Q_TMPL
+  sqlite3_finalize(qp->stmt);
+  qp->stmt = NULL;
 }
 
-int
-db_speaker_get(uint64_t id, int *selected, int *volume)
+/* Whether files table column i is part of the query's select list */
+static inline int
+db_query_col_wanted(struct query_params *qp, int i)
 {
-#define Q_TMPL "SELECT s.selected, s.volume FROM speakers s WHERE s.id = %" PRIi64 ";"
-  sqlite3_stmt *stmt;
-  char *query;
-  int ret;
+  if (!qp->cols)
+    return 1;
 
-  query = sqlite3_mprintf(Q_TMPL, id);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  return ((qp->cols | dbmfi_col(id)) & dbmfi_col_byoffset(dbmfi_cols_map[i].offset)) != 0;
+}
 
-      return -1;
-    }
+static int
+db_snapshot_fetch_file(struct query_params *qp, struct db_media_file_info *dbmfi)
+{
+  struct db_snapshot *snap;
+  char **strcol;
+  char *buf;
+  int row;
+  int i;
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  snap = qp->snap;
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-  if (ret != SQLITE_OK)
+  row = db_snapshot_query_next(qp);
+  if (row < 0)
     {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(pool_hdl->hdl));
-
-      ret = -1;
-      goto out;
+      dbmfi->id = NULL;
+      return 0;
     }
 
-  ret = db_blocking_step(stmt);
-  if (ret != SQLITE_ROW)
+  for (i = 0; i < (sizeof(dbmfi_cols_map) / sizeof(dbmfi_cols_map[0])); i++)
     {
-      if (ret != SQLITE_DONE)
-	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+      if (!db_query_col_wanted(qp, i))
+	continue;
 
-      sqlite3_finalize(stmt);
+      strcol = (char **) ((char *)dbmfi + dbmfi_cols_map[i].offset);
 
-      ret = -1;
-      goto out;
+      if (snap->str[i])
+	*strcol = (char *)db_snapshot_str(snap, i, row);
+      else if (db_snapshot_isnull(snap, i, row))
+	*strcol = NULL;
+      else
+	{
+	  buf = qp->snap_buf + i * DB_SNAPSHOT_INTLEN;
+	  snprintf(buf, DB_SNAPSHOT_INTLEN, "%" PRIi64, db_snapshot_int(snap, i, row));
+
+	  *strcol = buf;
+	}
     }
 
-  *selected = sqlite3_column_int(stmt, 0);
-  *volume = sqlite3_column_int(stmt, 1);
+  return 0;
+}
 
-#ifdef DB_PROFILE
-  while (db_blocking_step(stmt) == SQLITE_ROW)
-    ; /* EMPTY */
-#endif
-
-  sqlite3_finalize(stmt);
-
-  ret = 0;
-
- out:
-  sqlite3_free(query);
-  return ret;
-
-#undef Q_TMPL
-}
-
-void
-db_speaker_clear_all(void)
+static int
+db_snapshot_fetch_file_values(struct query_params *qp, struct db_media_file_values *dbmfv)
 {
-  char *query = "UPDATE speakers SET selected = 0;";
-  char *errmsg;
-  int ret;
+  struct db_snapshot *snap;
+  struct db_value *v;
+  int row;
+  int i;
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  snap = qp->snap;
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
+  row = db_snapshot_query_next(qp);
+  if (row < 0)
+    return 0;
+
+  for (i = 0; i < (sizeof(dbmfi_cols_map) / sizeof(dbmfi_cols_map[0])); i++)
     {
-      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
+      if (!db_query_col_wanted(qp, i))
+	continue;
 
-      sqlite3_free(errmsg);
+      v = dbmfv_field(dbmfv, dbmfi_cols_map[i].offset);
+
+      if (snap->str[i])
+	{
+	  v->strval = db_snapshot_str(snap, i, row);
+	  v->len = (v->strval) ? strlen(v->strval) : 0;
+	}
+      else
+	{
+	  v->intval = db_snapshot_int(snap, i, row);
+	  v->isnull = db_snapshot_isnull(snap, i, row);
+	}
     }
-}
 
+  return 0;
+}
 
-/* Inotify */
 int
-db_watch_clear(void)
+db_query_fetch_file(struct query_params *qp, struct db_media_file_info *dbmfi)
 {
-  char *query = "DELETE FROM inotify;";
-  char *errmsg;
+  int ncols;
+  char **strcol;
+  int col;
+  int i;
   int ret;
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  memset(dbmfi, 0, sizeof(struct db_media_file_info));
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
+  if (qp->snap)
+    return db_snapshot_fetch_file(qp, dbmfi);
 
-      sqlite3_free(errmsg);
+  if (!qp->stmt)
+    {
+      DPRINTF(E_LOG, L_DB, "Query not started!\n");
       return -1;
     }
 
-  return 0;
-}
-
-int
-db_watch_add(struct watch_info *wi)
-{
-#define Q_TMPL "INSERT INTO inotify (wd, cookie, path) VALUES (%d, 0, '%q');"
-  char *query;
-  char *errmsg;
-  int ret;
-
-  query = sqlite3_mprintf(Q_TMPL, wi->wd, wi->path);
-  if (!query)
+  if ((qp->type != Q_ITEMS) && (qp->type != Q_PLITEMS) && (qp->type != Q_GROUPITEMS))
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
+      DPRINTF(E_LOG, L_DB, "Not an items, playlist or group items query!\n");
       return -1;
     }
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
+  ret = db_blocking_step(qp->stmt);
+  if (ret == SQLITE_DONE)
     {
-      DPRINTF(E_LOG, L_DB, "Error adding watch: %s\n", errmsg);
-
-      sqlite3_free(errmsg);
-      sqlite3_free(query);
+      DPRINTF(E_INFO, L_DB, "End of query results\n");
+      dbmfi->id = NULL;
+      return 0;
+    }
+  else if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
       return -1;
     }
 
-  sqlite3_free(query);
-
-  return 0;
+  if (qp->counting)
+    qp->results++;
 
-#undef Q_TMPL
-}
+  /* id is always the first column */
+  qp->lastid = sqlite3_column_int(qp->stmt, 0);
+  qp->fetched++;
 
-static int
-db_watch_delete_byquery(char *query)
-{
-  char *errmsg;
-  int ret;
+  ncols = sqlite3_column_count(qp->stmt);
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  if (ncols != qp->ncols)
+    {
+      DPRINTF(E_LOG, L_DB, "BUG: dbmfi column map out of sync with query (%d columns, expected %d)\n", ncols, qp->ncols);
+      return -1;
+    }
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
+  for (i = 0, col = 0; col < ncols; i++)
     {
-      DPRINTF(E_LOG, L_DB, "Error deleting watch: %s\n", errmsg);
+      if (!db_query_col_wanted(qp, i))
+	continue;
 
-      sqlite3_free(errmsg);
-      sqlite3_free(query);
-      return -1;
+      strcol = (char **) ((char *)dbmfi + dbmfi_cols_map[i].offset);
+
+      *strcol = (char *)sqlite3_column_text(qp->stmt, col);
+      col++;
     }
 
   return 0;
 }
 
 int
-db_watch_delete_bywd(uint32_t wd)
+db_query_fetch_file_values(struct query_params *qp, struct db_media_file_values *dbmfv)
 {
-#define Q_TMPL "DELETE FROM inotify WHERE wd = %d;"
-  char *query;
+  struct db_value *v;
+  int ncols;
+  int col;
+  int i;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, wd);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  memset(dbmfv, 0, sizeof(struct db_media_file_values));
 
+  if (qp->snap)
+    return db_snapshot_fetch_file_values(qp, dbmfv);
+
+  if (!qp->stmt)
+    {
+      DPRINTF(E_LOG, L_DB, "Query not started!\n");
       return -1;
     }
 
-  ret = db_watch_delete_byquery(query);
-
-  sqlite3_free(query);
-
-  return ret;
-
-#undef Q_TMPL
-}
-
-int
-db_watch_delete_bypath(char *path)
-{
-#define Q_TMPL "DELETE FROM inotify WHERE path = '%q';"
-  char *query;
-  int ret;
-
-  query = sqlite3_mprintf(Q_TMPL, path);
-  if (!query)
+  if ((qp->type != Q_ITEMS) && (qp->type != Q_PLITEMS) && (qp->type != Q_GROUPITEMS))
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
+      DPRINTF(E_LOG, L_DB, "Not an items, playlist or group items query!\n");
       return -1;
     }
 
-  ret = db_watch_delete_byquery(query);
-
-  sqlite3_free(query);
-
-  return ret;
-
-#undef Q_TMPL
-}
-
-int
-db_watch_delete_bymatch(char *path)
-{
-#define Q_TMPL "DELETE FROM inotify WHERE path LIKE '%q/%%';"
-  char *query;
-  int ret;
-
-  query = sqlite3_mprintf(Q_TMPL, path);
-  if (!query)
+  ret = db_blocking_step(qp->stmt);
+  if (ret == SQLITE_DONE)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
+      DPRINTF(E_INFO, L_DB, "End of query results\n");
+      return 0;
+    }
+  else if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
       return -1;
     }
 
-  ret = db_watch_delete_byquery(query);
-
-  sqlite3_free(query);
-
-  return ret;
-
-#undef Q_TMPL
-}
+  if (qp->counting)
+    qp->results++;
 
-int
-db_watch_delete_bycookie(uint32_t cookie)
-{
-#define Q_TMPL "DELETE FROM inotify WHERE cookie = %" PRIi64 ";"
-  char *query;
-  int ret;
+  /* id is always the first column */
+  qp->lastid = sqlite3_column_int(qp->stmt, 0);
+  qp->fetched++;
 
-  if (cookie == 0)
-    return -1;
+  ncols = sqlite3_column_count(qp->stmt);
 
-  query = sqlite3_mprintf(Q_TMPL, (int64_t)cookie);
-  if (!query)
+  if (ncols != qp->ncols)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-
+      DPRINTF(E_LOG, L_DB, "BUG: dbmfi column map out of sync with query (%d columns, expected %d)\n", ncols, qp->ncols);
       return -1;
     }
 
-  ret = db_watch_delete_byquery(query);
+  /* mfi_cols_map has the same column order and knows the types */
+  for (i = 0, col = 0; col < ncols; i++)
+    {
+      if (!db_query_col_wanted(qp, i))
+	continue;
 
-  sqlite3_free(query);
+      v = dbmfv_field(dbmfv, dbmfi_cols_map[i].offset);
 
-  return ret;
+      if (mfi_cols_map[i].type == DB_TYPE_STRING)
+	{
+	  v->strval = (const char *)sqlite3_column_text(qp->stmt, col);
+	  v->len = sqlite3_column_bytes(qp->stmt, col);
+	}
+      else
+	{
+	  v->intval = sqlite3_column_int64(qp->stmt, col);
+	  v->isnull = (sqlite3_column_type(qp->stmt, col) == SQLITE_NULL);
+	}
 
-#undef Q_TMPL
+      col++;
+    }
+
+  return 0;
 }
 
 int
-db_watch_get_bywd(struct watch_info *wi)
+db_query_fetch_pl(struct query_params *qp, struct db_playlist_info *dbpli)
 {
-#define Q_TMPL "SELECT * FROM inotify WHERE wd = %d;"
-  char *query;
-  sqlite3_stmt *stmt;
-  char **strval;
-  char *cval;
-  uint32_t *ival;
-  int64_t cookie;
   int ncols;
+  char **strcol;
+  int id;
+  int type;
+  int nitems;
   int i;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, wi->wd);
-  if (!query)
+  memset(dbpli, 0, sizeof(struct db_playlist_info));
+
+  if (!qp->stmt)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      DPRINTF(E_LOG, L_DB, "Query not started!\n");
       return -1;
     }
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-  if (ret != SQLITE_OK)
+  if (qp->type != Q_PL)
     {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+      DPRINTF(E_LOG, L_DB, "Not a playlist query!\n");
       return -1;
     }
 
-  ret = db_blocking_step(stmt);
-  if (ret != SQLITE_ROW)
+  ret = db_blocking_step(qp->stmt);
+  if (ret == SQLITE_DONE)
     {
-      DPRINTF(E_LOG, L_DB, "Watch wd %d not found\n", wi->wd);
-
-      sqlite3_finalize(stmt);
-      sqlite3_free(query);
+      DPRINTF(E_INFO, L_DB, "End of query results\n");
+      dbpli->id = NULL;
+      return 0;
+    }
+  else if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
       return -1;
     }
 
-  ncols = sqlite3_column_count(stmt);
+  if (qp->counting)
+    qp->results++;
 
-  if (sizeof(wi_cols_map) / sizeof(wi_cols_map[0]) != ncols)
-    {
-      DPRINTF(E_LOG, L_DB, "BUG: wi column map out of sync with schema\n");
+  ncols = sqlite3_column_count(qp->stmt);
 
-      sqlite3_finalize(stmt);
-      sqlite3_free(query);
+  if (sizeof(dbpli_cols_map) / sizeof(dbpli_cols_map[0]) != ncols)
+    {
+      DPRINTF(E_LOG, L_DB, "BUG: dbpli column map out of sync with schema\n");
       return -1;
     }
 
   for (i = 0; i < ncols; i++)
     {
-      switch (wi_cols_map[i].type)
-	{
-	  case DB_TYPE_INT:
-	    ival = (uint32_t *) ((char *)wi + wi_cols_map[i].offset);
+      strcol = (char **) ((char *)dbpli + dbpli_cols_map[i]);
 
-	    if (wi_cols_map[i].offset == wi_offsetof(cookie))
-	      {
-		cookie = sqlite3_column_int64(stmt, i);
-		*ival = (cookie == INOTIFY_FAKE_COOKIE) ? 0 : cookie;
+      *strcol = (char *)sqlite3_column_text(qp->stmt, i);
+    }
+
+  type = sqlite3_column_int(qp->stmt, 2);
+
+  switch (type)
+    {
+      case PL_PLAIN:
+	id = sqlite3_column_int(qp->stmt, 0);
+	nitems = db_pl_count_items(id);
+	break;
+
+      case PL_SMART:
+	id = sqlite3_column_int(qp->stmt, 0);
+	nitems = db_smartpl_count_items(id, dbpli->query);
+	break;
+
+      default:
+	DPRINTF(E_LOG, L_DB, "Unknown playlist type %d while fetching playlist\n", type);
+	return -1;
+    }
+
+  dbpli->items = qp->buf;
+  ret = snprintf(qp->buf, sizeof(qp->buf), "%d", nitems);
+  if ((ret < 0) || (ret >= sizeof(qp->buf)))
+    {
+      DPRINTF(E_LOG, L_DB, "Could not convert items, buffer too small\n");
+
+      strcpy(qp->buf, "0");
+    }
+
+  return 0;
+}
+
+int
+db_query_fetch_group(struct query_params *qp, struct db_group_info *dbgri)
+{
+  int ncols;
+  char **strcol;
+  int i;
+  int ret;
+
+  memset(dbgri, 0, sizeof(struct db_group_info));
+
+  if (!qp->stmt)
+    {
+      DPRINTF(E_LOG, L_DB, "Query not started!\n");
+      return -1;
+    }
+
+  if (qp->type != Q_GROUPS)
+    {
+      DPRINTF(E_LOG, L_DB, "Not a groups query!\n");
+      return -1;
+    }
+
+  ret = db_blocking_step(qp->stmt);
+  if (ret == SQLITE_DONE)
+    {
+      DPRINTF(E_INFO, L_DB, "End of query results\n");
+      return 1;
+    }
+  else if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+      return -1;
+    }
+
+  if (qp->counting)
+    qp->results++;
+
+  ncols = sqlite3_column_count(qp->stmt);
+
+  if (sizeof(dbgri_cols_map) / sizeof(dbgri_cols_map[0]) != ncols)
+    {
+      DPRINTF(E_LOG, L_DB, "BUG: dbgri column map out of sync with schema\n");
+      return -1;
+    }
+
+  for (i = 0; i < ncols; i++)
+    {
+      strcol = (char **) ((char *)dbgri + dbgri_cols_map[i]);
+
+      *strcol = (char *)sqlite3_column_text(qp->stmt, i);
+    }
+
+  return 0;
+}
+
+int
+db_query_fetch_string(struct query_params *qp, char **string)
+{
+  int ret;
+
+  *string = NULL;
+
+  if (!qp->stmt)
+    {
+      DPRINTF(E_LOG, L_DB, "Query not started!\n");
+      return -1;
+    }
+
+  if (!(qp->type & Q_F_BROWSE))
+    {
+      DPRINTF(E_LOG, L_DB, "Not a browse query!\n");
+      return -1;
+    }
+
+  ret = db_blocking_step(qp->stmt);
+  if (ret == SQLITE_DONE)
+    {
+      DPRINTF(E_INFO, L_DB, "End of query results\n");
+      *string = NULL;
+      return 0;
+    }
+  else if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+      return -1;
+    }
+
+  if (qp->counting)
+    qp->results++;
+
+  *string = (char *)sqlite3_column_text(qp->stmt, 0);
+
+  return 0;
+}
+
+int
+db_query_fetch_string_sort(struct query_params *qp, char **string, char **sortstring)
+{
+  int ret;
+
+  *string = NULL;
+
+  if (!qp->stmt)
+    {
+      DPRINTF(E_LOG, L_DB, "Query not started!\n");
+      return -1;
+    }
+
+  if (!(qp->type & Q_F_BROWSE))
+    {
+      DPRINTF(E_LOG, L_DB, "Not a browse query!\n");
+      return -1;
+    }
+
+  ret = db_blocking_step(qp->stmt);
+  if (ret == SQLITE_DONE)
+    {
+      DPRINTF(E_INFO, L_DB, "End of query results\n");
+      *string = NULL;
+      return 0;
+    }
+  else if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+      return -1;
+    }
+
+  if (qp->counting)
+    qp->results++;
+
+  *string = (char *)sqlite3_column_text(qp->stmt, 0);
+  *sortstring = (char *)sqlite3_column_text(qp->stmt, 1);
+
+  return 0;
+}
+
+
+/* Files */
+int
+db_files_get_count(void)
+{
+  return db_get_count_cached("SELECT COUNT(*) FROM files f WHERE f.disabled = 0;");
+}
+
+void
+db_files_update_songalbumid(void)
+{
+#define Q_SONGALBUMID "UPDATE files SET songalbumid = daap_songalbumid(album_artist, album);"
+#define Q_GROUPCOUNT "UPDATE groups SET"					\
+  " items = (SELECT COUNT(*) FROM files f WHERE f.songalbumid = groups.persistentid AND f.disabled = 0)," \
+  " album_artist = (SELECT f.album_artist FROM files f WHERE f.songalbumid = groups.persistentid LIMIT 1)," \
+  " itemid = IFNULL((SELECT MIN(f.id) FROM files f WHERE f.songalbumid = groups.persistentid AND f.disabled = 0), 0)" \
+  " WHERE type = 1;"
+  char *errmsg;
+  int ret;
+
+  db_writer_get();
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", Q_SONGALBUMID);
+
+  ret = db_exec(Q_SONGALBUMID, &errmsg);
+  if (ret != SQLITE_OK)
+    DPRINTF(E_LOG, L_DB, "Error updating songalbumid: %s\n", errmsg);
+  else
+    db_lib_changed(1);
+
+  sqlite3_free(errmsg);
+
+  /* The count triggers skip rows whose songalbumid did not change, so
+   * groups recreated by the update above need their summary rebuilt */
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", Q_GROUPCOUNT);
+
+  ret = db_exec(Q_GROUPCOUNT, &errmsg);
+  if (ret != SQLITE_OK)
+    DPRINTF(E_LOG, L_DB, "Error updating group counts: %s\n", errmsg);
+  else
+    db_lib_changed(1);
+
+  sqlite3_free(errmsg);
+
+  db_writer_release();
+
+#undef Q_SONGALBUMID
+#undef Q_GROUPCOUNT
+}
+
+void
+db_file_inc_playcount(int id)
+{
+  struct db_wb_entry *e;
+
+  pthread_mutex_lock(&wb_lck);
+
+  e = db_wb_lookup(DB_WB_PLAYCOUNT, id, 1);
+  if (e)
+    {
+      e->count++;
+      e->stamp = (int64_t)time(NULL);
+
+      db_wb_schedule();
+    }
+
+  pthread_mutex_unlock(&wb_lck);
+}
+
+void
+db_file_ping(int id)
+{
+  struct db_wb_entry *e;
+
+  /* During a bulk scan, seeing a file is only recorded; the purge spares it */
+  pthread_mutex_lock(&stamps_lck);
+  if (stamps && (id > 0) && (id <= stamps->max_id) && (stamps->live[id / 8] & (1 << (id % 8))))
+    {
+      stamps->pinged[id / 8] |= 1 << (id % 8);
+
+      pthread_mutex_unlock(&stamps_lck);
+      return;
+    }
+  pthread_mutex_unlock(&stamps_lck);
+
+  pthread_mutex_lock(&wb_lck);
+
+  e = db_wb_lookup(DB_WB_FILE_PING, id, 1);
+  if (e)
+    {
+      e->stamp = (int64_t)time(NULL);
+
+      db_wb_schedule();
+    }
+
+  pthread_mutex_unlock(&wb_lck);
+}
+
+char *
+db_file_path_byid(int id)
+{
+#define Q_TMPL "SELECT f.path FROM files f WHERE f.id = ?;"
+  sqlite3_stmt *stmt;
+  char *res;
+  int ret;
+
+  stmt = db_stmt_get(Q_TMPL);
+  if (!stmt)
+    return NULL;
+
+  sqlite3_bind_int(stmt, 1, id);
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      if (ret == SQLITE_DONE)
+	DPRINTF(E_INFO, L_DB, "No results\n");
+      else
+	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+
+      db_stmt_release(stmt);
+      return NULL;
+    }
+
+  res = (char *)sqlite3_column_text(stmt, 0);
+  if (res)
+    res = strdup(res);
+
+#ifdef DB_PROFILE
+  while (db_blocking_step(stmt) == SQLITE_ROW)
+    ; /* EMPTY */
+#endif
+
+  db_stmt_release(stmt);
+
+  return res;
+
+#undef Q_TMPL
+}
+
+/* Looks up a file id with a cached statement taking one or two string parameters */
+static int
+db_file_id_bystmt(const char *tmpl, const char *arg1, const char *arg2)
+{
+  sqlite3_stmt *stmt;
+  int ret;
+
+  stmt = db_stmt_get(tmpl);
+  if (!stmt)
+    return 0;
+
+  sqlite3_bind_text(stmt, 1, arg1, -1, SQLITE_STATIC);
+  if (arg2)
+    sqlite3_bind_text(stmt, 2, arg2, -1, SQLITE_STATIC);
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      if (ret == SQLITE_DONE)
+	DPRINTF(E_INFO, L_DB, "No results\n");
+      else
+	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+
+      db_stmt_release(stmt);
+      return 0;
+    }
+
+  ret = sqlite3_column_int(stmt, 0);
+
+#ifdef DB_PROFILE
+  while (db_blocking_step(stmt) == SQLITE_ROW)
+    ; /* EMPTY */
+#endif
+
+  db_stmt_release(stmt);
+
+  return ret;
+}
+
+int
+db_file_id_bypath(char *path)
+{
+#define Q_TMPL "SELECT f.id FROM files f WHERE f.path = ?;"
+
+  return db_file_id_bystmt(Q_TMPL, path, NULL);
+
+#undef Q_TMPL
+}
+
+int
+db_file_id_byfilebase(char *filename, char *base)
+{
+#define Q_TMPL "SELECT f.id FROM files f WHERE f.path LIKE ? || '/%/' || ?;"
+
+  return db_file_id_bystmt(Q_TMPL, base, filename);
+
+#undef Q_TMPL
+}
+
+int
+db_file_id_byfile(char *filename)
+{
+#define Q_TMPL "SELECT f.id FROM files f WHERE f.fname = ?;"
+
+  return db_file_id_bystmt(Q_TMPL, filename, NULL);
+
+#undef Q_TMPL
+}
+
+int
+db_file_id_byurl(char *url)
+{
+#define Q_TMPL "SELECT f.id FROM files f WHERE f.url = ?;"
+
+  return db_file_id_bystmt(Q_TMPL, url, NULL);
+
+#undef Q_TMPL
+}
+
+/* Bulk scan stamp map
+ * A rescan visits every file in the library and needs its id and
+ * timestamp; one pass over the files table up front answers those
+ * lookups from memory. Unchanged files are only marked as seen, which
+ * costs no writes; db_purge_cruft() then removes the files that weren't.
+ */
+static void
+db_stamp_map_free(struct db_stamp_map *map)
+{
+  free(map->entries);
+  free(map->buckets);
+  free(map->pool);
+  free(map->live);
+  free(map->pinged);
+  free(map);
+}
+
+static int
+db_stamp_map_add(struct db_stamp_map *map, const char *path, size_t len, int id, int64_t stamp, int disabled)
+{
+  struct db_stamp_entry *e;
+  void *tmp;
+  size_t size;
+
+  if ((map->nentries % 4096) == 0)
+    {
+      tmp = realloc(map->entries, (map->nentries + 4096) * sizeof(struct db_stamp_entry));
+      if (!tmp)
+	return -1;
+
+      map->entries = tmp;
+    }
+
+  if (map->pool_len + len + 1 > map->pool_size)
+    {
+      for (size = (map->pool_size) ? map->pool_size : 65536; size < map->pool_len + len + 1; size <<= 1)
+	; /* EMPTY */
+
+      tmp = realloc(map->pool, size);
+      if (!tmp)
+	return -1;
+
+      map->pool = tmp;
+      map->pool_size = size;
+    }
+
+  memcpy(map->pool + map->pool_len, path, len + 1);
+
+  e = &map->entries[map->nentries];
+  e->hash = djb_hash((void *)path, len);
+  e->id = id;
+  e->stamp = stamp;
+  e->path = map->pool_len;
+  e->disabled = (disabled != 0);
+  e->next = -1;
+
+  map->pool_len += len + 1;
+  map->nentries++;
+
+  if (id > map->max_id)
+    map->max_id = id;
+
+  return 0;
+}
+
+int
+db_file_stamps_load(void)
+{
+#define Q_TMPL "SELECT f.id, f.db_timestamp, f.path, f.disabled FROM files f;"
+  struct db_stamp_map *map;
+  struct db_stamp_entry *e;
+  sqlite3_stmt *stmt;
+  const char *path;
+  uint32_t b;
+  int i;
+  int ret;
+
+  map = (struct db_stamp_map *)malloc(sizeof(struct db_stamp_map));
+  if (!map)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for file stamp map\n");
+      return -1;
+    }
+
+  memset(map, 0, sizeof(struct db_stamp_map));
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", Q_TMPL);
+
+  ret = db_blocking_prepare_v2(Q_TMPL, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+
+      db_stamp_map_free(map);
+      return -1;
+    }
+
+  while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
+    {
+      path = (const char *)sqlite3_column_text(stmt, 2);
+      if (!path)
+	continue;
+
+      ret = db_stamp_map_add(map, path, sqlite3_column_bytes(stmt, 2), sqlite3_column_int(stmt, 0), sqlite3_column_int64(stmt, 1), sqlite3_column_int64(stmt, 3));
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_DB, "Out of memory for file stamp map\n");
+
+	  sqlite3_finalize(stmt);
+	  db_stamp_map_free(map);
+	  return -1;
+	}
+    }
+
+  if (ret != SQLITE_DONE)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+
+      sqlite3_finalize(stmt);
+      db_stamp_map_free(map);
+      return -1;
+    }
+
+  sqlite3_finalize(stmt);
+
+  for (map->nbuckets = 1024; map->nbuckets < map->nentries; map->nbuckets <<= 1)
+    ; /* EMPTY */
+
+  map->buckets = (int *)malloc(map->nbuckets * sizeof(int));
+  map->live = (uint8_t *)calloc(map->max_id / 8 + 1, 1);
+  map->pinged = (uint8_t *)calloc(map->max_id / 8 + 1, 1);
+  if (!map->buckets || !map->live || !map->pinged)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for file stamp map\n");
+
+      db_stamp_map_free(map);
+      return -1;
+    }
+
+  memset(map->buckets, 0xff, map->nbuckets * sizeof(int));
+
+  for (i = 0; i < map->nentries; i++)
+    {
+      e = &map->entries[i];
+      b = e->hash & (map->nbuckets - 1);
+
+      e->next = map->buckets[b];
+      map->buckets[b] = i;
+
+      if (!e->disabled)
+	map->live[e->id / 8] |= 1 << (e->id % 8);
+    }
+
+  DPRINTF(E_DBG, L_DB, "Loaded stamps for %d files (%zu bytes of paths)\n", map->nentries, map->pool_len);
+
+  pthread_mutex_lock(&stamps_lck);
+  if (stamps)
+    db_stamp_map_free(stamps);
+  stamps = map;
+  pthread_mutex_unlock(&stamps_lck);
+
+  return 0;
+
+#undef Q_TMPL
+}
+
+/* Returns 1 and fills in stamp and id if path is in the stamp map */
+static int
+db_file_stamp_bymap(char *path, time_t *stamp, int *id)
+{
+  struct db_stamp_entry *e;
+  uint32_t hash;
+  size_t len;
+  int i;
+  int ret;
+
+  len = strlen(path);
+  hash = djb_hash(path, len);
+
+  ret = 0;
+
+  pthread_mutex_lock(&stamps_lck);
+
+  if (stamps)
+    {
+      for (i = stamps->buckets[hash & (stamps->nbuckets - 1)]; i >= 0; i = e->next)
+	{
+	  e = &stamps->entries[i];
+
+	  if ((e->hash == hash) && (strcmp(stamps->pool + e->path, path) == 0))
+	    {
+	      *stamp = (time_t)e->stamp;
+	      *id = e->id;
+
+	      ret = 1;
+	      break;
+	    }
+	}
+    }
+
+  pthread_mutex_unlock(&stamps_lck);
+
+  return ret;
+}
+
+void
+db_file_stamp_bypath(char *path, time_t *stamp, int *id)
+{
+#define Q_TMPL "SELECT f.id, f.db_timestamp FROM files f WHERE f.path = ?;"
+  sqlite3_stmt *stmt;
+  int ret;
+
+  *stamp = 0;
+
+  /* Files not in the map are new, or were added since it was loaded */
+  if (db_file_stamp_bymap(path, stamp, id))
+    return;
+
+  stmt = db_stmt_get(Q_TMPL);
+  if (!stmt)
+    return;
+
+  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      if (ret == SQLITE_DONE)
+	DPRINTF(E_INFO, L_DB, "No results\n");
+      else
+	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+
+      db_stmt_release(stmt);
+      return;
+    }
+
+  *id = sqlite3_column_int(stmt, 0);
+  *stamp = (time_t)sqlite3_column_int64(stmt, 1);
+
+#ifdef DB_PROFILE
+  while (db_blocking_step(stmt) == SQLITE_ROW)
+    ; /* EMPTY */
+#endif
+
+  db_stmt_release(stmt);
+
+#undef Q_TMPL
+}
+
+static struct media_file_info *
+db_file_fetch_byquery(char *query)
+{
+  struct media_file_info *mfi;
+  sqlite3_stmt *stmt;
+  int ncols;
+  char *cval;
+  uint32_t *ival;
+  uint64_t *i64val;
+  char **strval;
+  uint64_t disabled;
+  int i;
+  int ret;
+
+  if (!query)
+    return NULL;
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  mfi = (struct media_file_info *)malloc(sizeof(struct media_file_info));
+  if (!mfi)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not allocate struct media_file_info, out of memory\n");
+      return NULL;
+    }
+  memset(mfi, 0, sizeof(struct media_file_info));
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+
+      free(mfi);
+      return NULL;
+    }
+
+  ret = db_blocking_step(stmt);
+
+  if (ret != SQLITE_ROW)
+    {
+      if (ret == SQLITE_DONE)
+	DPRINTF(E_INFO, L_DB, "No results\n");
+      else
+	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+
+      sqlite3_finalize(stmt);
+      free(mfi);
+      return NULL;
+    }
+
+  ncols = sqlite3_column_count(stmt);
+
+  if (sizeof(mfi_cols_map) / sizeof(mfi_cols_map[0]) != ncols)
+    {
+      DPRINTF(E_LOG, L_DB, "BUG: mfi column map out of sync with schema\n");
+
+      sqlite3_finalize(stmt);
+      free(mfi);
+      return NULL;
+    }
+
+  for (i = 0; i < ncols; i++)
+    {
+      switch (mfi_cols_map[i].type)
+	{
+	  case DB_TYPE_CHAR:
+	    cval = (char *)mfi + mfi_cols_map[i].offset;
+
+	    *cval = sqlite3_column_int(stmt, i);
+	    break;
+
+	  case DB_TYPE_INT:
+	    ival = (uint32_t *) ((char *)mfi + mfi_cols_map[i].offset);
+
+	    if (mfi_cols_map[i].offset == mfi_offsetof(disabled))
+	      {
+		disabled = sqlite3_column_int64(stmt, i);
+		*ival = (disabled != 0);
+	      }
+	    else
+	      *ival = sqlite3_column_int(stmt, i);
+	    break;
+
+	  case DB_TYPE_INT64:
+	    i64val = (uint64_t *) ((char *)mfi + mfi_cols_map[i].offset);
+
+	    *i64val = sqlite3_column_int64(stmt, i);
+	    break;
+
+	  case DB_TYPE_STRING:
+	    strval = (char **) ((char *)mfi + mfi_cols_map[i].offset);
+
+	    cval = (char *)sqlite3_column_text(stmt, i);
+	    if (cval)
+	      *strval = strdup(cval);
+	    break;
+
+	  default:
+	    DPRINTF(E_LOG, L_DB, "BUG: Unknown type %d in mfi column map\n", mfi_cols_map[i].type);
+
+	    free_mfi(mfi, 0);
+	    sqlite3_finalize(stmt);
+	    return NULL;
+	}
+    }
+
+#ifdef DB_PROFILE
+  while (db_blocking_step(stmt) == SQLITE_ROW)
+    ; /* EMPTY */
+#endif
+
+  sqlite3_finalize(stmt);
+
+  return mfi;
+}
+
+struct media_file_info *
+db_file_fetch_byid(int id)
+{
+#define Q_TMPL "SELECT %s FROM files f WHERE f.id = %d;"
+  struct media_file_info *mfi;
+  char *query;
+
+  query = sqlite3_mprintf(Q_TMPL, files_cols, id);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      return NULL;
+    }
+
+  mfi = db_file_fetch_byquery(query);
+
+  sqlite3_free(query);
+
+  return mfi;
+
+#undef Q_TMPL
+}
+
+int
+db_file_add(struct media_file_info *mfi)
+{
+#define Q_TMPL "INSERT INTO files (id, path, fname, title, artist, album, genre, comment, type, composer," \
+               " orchestra, conductor, grouping, url, bitrate, samplerate, song_length, file_size, year, track," \
+               " total_tracks, disc, total_discs, bpm, compilation, rating, play_count, data_kind, item_kind," \
+               " description, time_added, time_modified, time_played, db_timestamp, disabled, sample_count," \
+               " codectype, idx, has_video, contentrating, bits_per_sample, album_artist," \
+               " media_kind, tv_series_name, tv_episode_num_str, tv_network_name, tv_episode_sort, tv_season_num, " \
+               " songalbumid, title_sort, artist_sort, album_sort, composer_sort, album_artist_sort," \
+               " title_sortkey, artist_sortkey, album_sortkey, title_sort_bucket" \
+               " ) " \
+               " VALUES (NULL, ?, ?, TRIM(?), TRIM(?), TRIM(?), TRIM(?), TRIM(?), ?, TRIM(?)," \
+               " TRIM(?), TRIM(?), TRIM(?), ?, ?, ?, ?, ?, ?, ?," \
+               " ?, ?, ?, ?, ?, ?, ?, ?, ?," \
+               " ?, ?, ?, ?, ?, ?, ?," \
+               " ?, ?, ?, ?, ?, TRIM(?), ?, TRIM(?), TRIM(?), TRIM(?), ?, ?, daap_songalbumid(TRIM(?), TRIM(?))," \
+               " TRIM(?), TRIM(?), TRIM(?), TRIM(?), TRIM(?)," \
+               " daap_sortkey(TRIM(?)), daap_sortkey(TRIM(?)), daap_sortkey(TRIM(?)), daap_sortbucket(TRIM(?)));"
+
+  sqlite3_stmt *stmt;
+  char *errmsg;
+  int i;
+  int ret;
+
+  db_writer_get();
+
+  if (mfi->id != 0)
+    {
+      DPRINTF(E_WARN, L_DB, "Trying to add file with non-zero id; use db_file_update()?\n");
+      db_writer_release();
+      return -1;
+    }
+
+  mfi->db_timestamp = (uint64_t)time(NULL);
+  mfi->time_added = mfi->db_timestamp;
+
+  if (mfi->time_modified == 0)
+    mfi->time_modified = mfi->db_timestamp;
+
+  stmt = db_stmt_get(Q_TMPL);
+  if (!stmt)
+    {
+      db_writer_release();
+      return -1;
+    }
+
+  i = 1;
+  sqlite3_bind_text(stmt, i++, STR(mfi->path), -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, STR(mfi->fname), -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->title, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->artist, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->album, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->genre, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->comment, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->type, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->composer, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->orchestra, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->conductor, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->grouping, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->url, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, i++, mfi->bitrate);
+  sqlite3_bind_int(stmt, i++, mfi->samplerate);
+  sqlite3_bind_int(stmt, i++, mfi->song_length);
+  sqlite3_bind_int64(stmt, i++, mfi->file_size);
+  sqlite3_bind_int(stmt, i++, mfi->year);
+  sqlite3_bind_int(stmt, i++, mfi->track);
+  sqlite3_bind_int(stmt, i++, mfi->total_tracks);
+  sqlite3_bind_int(stmt, i++, mfi->disc);
+  sqlite3_bind_int(stmt, i++, mfi->total_discs);
+  sqlite3_bind_int(stmt, i++, mfi->bpm);
+  sqlite3_bind_int(stmt, i++, mfi->compilation);
+  sqlite3_bind_int(stmt, i++, mfi->rating);
+  sqlite3_bind_int(stmt, i++, mfi->play_count);
+  sqlite3_bind_int(stmt, i++, mfi->data_kind);
+  sqlite3_bind_int(stmt, i++, mfi->item_kind);
+  sqlite3_bind_text(stmt, i++, mfi->description, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, i++, (int64_t)mfi->time_added);
+  sqlite3_bind_int64(stmt, i++, (int64_t)mfi->time_modified);
+  sqlite3_bind_int64(stmt, i++, (int64_t)mfi->time_played);
+  sqlite3_bind_int64(stmt, i++, (int64_t)mfi->db_timestamp);
+  sqlite3_bind_int(stmt, i++, mfi->disabled);
+  sqlite3_bind_int64(stmt, i++, mfi->sample_count);
+  sqlite3_bind_text(stmt, i++, mfi->codectype, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, i++, mfi->index);
+  sqlite3_bind_int(stmt, i++, mfi->has_video);
+  sqlite3_bind_int(stmt, i++, mfi->contentrating);
+  sqlite3_bind_int(stmt, i++, mfi->bits_per_sample);
+  sqlite3_bind_text(stmt, i++, mfi->album_artist, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, i++, mfi->media_kind);
+  sqlite3_bind_text(stmt, i++, mfi->tv_series_name, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->tv_episode_num_str, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->tv_network_name, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, i++, mfi->tv_episode_sort);
+  sqlite3_bind_int(stmt, i++, mfi->tv_season_num);
+  sqlite3_bind_text(stmt, i++, mfi->album_artist, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->album, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->title_sort, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->artist_sort, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->album_sort, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->composer_sort, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->album_artist_sort, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->title_sort, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->artist_sort, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->album_sort, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->title_sort, -1, SQLITE_STATIC);
+
+  ret = db_stmt_exec(stmt, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      db_writer_release();
+      return -1;
+    }
+
+  db_lib_changed(1);
+
+  db_writer_release();
+
+  return 0;
+
+#undef Q_TMPL
+}
+
+int
+db_file_update(struct media_file_info *mfi)
+{
+#define Q_TMPL "UPDATE files SET path = ?, fname = ?, title = TRIM(?), artist = TRIM(?), album = TRIM(?), genre = TRIM(?)," \
+               " comment = TRIM(?), type = ?, composer = TRIM(?), orchestra = TRIM(?), conductor = TRIM(?), grouping = TRIM(?)," \
+               " url = ?, bitrate = ?, samplerate = ?, song_length = ?, file_size = ?," \
+               " year = ?, track = ?, total_tracks = ?, disc = ?, total_discs = ?, bpm = ?," \
+               " compilation = ?, rating = ?, data_kind = ?, item_kind = ?," \
+               " description = ?, time_modified = ?," \
+               " db_timestamp = ?, sample_count = ?," \
+               " codectype = ?, idx = ?, has_video = ?," \
+               " bits_per_sample = ?, album_artist = TRIM(?)," \
+               " media_kind = ?, tv_series_name = TRIM(?), tv_episode_num_str = TRIM(?)," \
+               " tv_network_name = TRIM(?), tv_episode_sort = ?, tv_season_num = ?," \
+               " songalbumid = daap_songalbumid(TRIM(?), TRIM(?))," \
+               " title_sort = TRIM(?), artist_sort = TRIM(?), album_sort = TRIM(?), composer_sort = TRIM(?), album_artist_sort = TRIM(?)," \
+               " title_sortkey = daap_sortkey(TRIM(?)), artist_sortkey = daap_sortkey(TRIM(?)), album_sortkey = daap_sortkey(TRIM(?))," \
+               " title_sort_bucket = daap_sortbucket(TRIM(?))" \
+               " WHERE id = ?;"
+  sqlite3_stmt *stmt;
+  char *errmsg;
+  int i;
+  int ret;
+
+  db_writer_get();
+
+  if (mfi->id == 0)
+    {
+      DPRINTF(E_WARN, L_DB, "Trying to update file with id 0; use db_file_add()?\n");
+      db_writer_release();
+      return -1;
+    }
+
+  mfi->db_timestamp = (uint64_t)time(NULL);
+
+  if (mfi->time_modified == 0)
+    mfi->time_modified = mfi->db_timestamp;
+
+  stmt = db_stmt_get(Q_TMPL);
+  if (!stmt)
+    {
+      db_writer_release();
+      return -1;
+    }
+
+  i = 1;
+  sqlite3_bind_text(stmt, i++, STR(mfi->path), -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, STR(mfi->fname), -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->title, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->artist, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->album, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->genre, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->comment, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->type, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->composer, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->orchestra, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->conductor, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->grouping, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->url, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, i++, mfi->bitrate);
+  sqlite3_bind_int(stmt, i++, mfi->samplerate);
+  sqlite3_bind_int(stmt, i++, mfi->song_length);
+  sqlite3_bind_int64(stmt, i++, mfi->file_size);
+  sqlite3_bind_int(stmt, i++, mfi->year);
+  sqlite3_bind_int(stmt, i++, mfi->track);
+  sqlite3_bind_int(stmt, i++, mfi->total_tracks);
+  sqlite3_bind_int(stmt, i++, mfi->disc);
+  sqlite3_bind_int(stmt, i++, mfi->total_discs);
+  sqlite3_bind_int(stmt, i++, mfi->bpm);
+  sqlite3_bind_int(stmt, i++, mfi->compilation);
+  sqlite3_bind_int(stmt, i++, mfi->rating);
+  sqlite3_bind_int(stmt, i++, mfi->data_kind);
+  sqlite3_bind_int(stmt, i++, mfi->item_kind);
+  sqlite3_bind_text(stmt, i++, mfi->description, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, i++, (int64_t)mfi->time_modified);
+  sqlite3_bind_int64(stmt, i++, (int64_t)mfi->db_timestamp);
+  sqlite3_bind_int64(stmt, i++, mfi->sample_count);
+  sqlite3_bind_text(stmt, i++, mfi->codectype, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, i++, mfi->index);
+  sqlite3_bind_int(stmt, i++, mfi->has_video);
+  sqlite3_bind_int(stmt, i++, mfi->bits_per_sample);
+  sqlite3_bind_text(stmt, i++, mfi->album_artist, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, i++, mfi->media_kind);
+  sqlite3_bind_text(stmt, i++, mfi->tv_series_name, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->tv_episode_num_str, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->tv_network_name, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, i++, mfi->tv_episode_sort);
+  sqlite3_bind_int(stmt, i++, mfi->tv_season_num);
+  sqlite3_bind_text(stmt, i++, mfi->album_artist, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->album, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->title_sort, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->artist_sort, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->album_sort, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->composer_sort, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->album_artist_sort, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->title_sort, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->artist_sort, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->album_sort, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, i++, mfi->title_sort, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, i++, mfi->id);
+
+  ret = db_stmt_exec(stmt, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      db_writer_release();
+      return -1;
+    }
+
+  db_lib_changed(1);
+
+  db_writer_release();
+
+  return 0;
+
+#undef Q_TMPL
+}
+
+void
+db_file_delete_bypath(char *path)
+{
+#define Q_TMPL "DELETE FROM files WHERE path = ?;"
+  sqlite3_stmt *stmt;
+  char *errmsg;
+  int ret;
+
+  db_writer_get();
+
+  stmt = db_stmt_get(Q_TMPL);
+  if (!stmt)
+    {
+      db_writer_release();
+      return;
+    }
+
+  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+
+  ret = db_stmt_exec(stmt, &errmsg);
+  if (ret != SQLITE_OK)
+    DPRINTF(E_LOG, L_DB, "Error deleting file: %s\n", errmsg);
+  else
+    db_lib_changed(1);
+
+  sqlite3_free(errmsg);
+
+  db_writer_release();
+
+#undef Q_TMPL
+}
+
+static void
+db_file_disable_byquery(char *query)
+{
+  char *errmsg;
+  int ret;
+
+  /* A queued ping must not re-enable what gets disabled here */
+  db_wb_flush();
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_exec(query, &errmsg);
+  if (ret != SQLITE_OK)
+    DPRINTF(E_LOG, L_DB, "Error disabling file: %s\n", errmsg);
+  else
+    db_lib_changed(1);
+
+  sqlite3_free(errmsg);
+}
+
+void
+db_file_disable_bypath(char *path, char *strip, uint32_t cookie)
+{
+#define Q_TMPL "UPDATE files SET path = substr(path, %d), disabled = %" PRIi64 " WHERE path = '%q';"
+  char *query;
+  int64_t disabled;
+  int striplen;
+
+  db_writer_get();
+
+  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
+  striplen = strlen(strip) + 1;
+
+  query = sqlite3_mprintf(Q_TMPL, striplen, disabled, path);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      db_writer_release();
+      return;
+    }
+
+  db_file_disable_byquery(query);
+
+  sqlite3_free(query);
+
+  db_writer_release();
+
+#undef Q_TMPL
+}
+
+void
+db_file_disable_bymatch(char *path, char *strip, uint32_t cookie)
+{
+#define Q_TMPL "UPDATE files SET path = substr(path, %d), disabled = %" PRIi64 " WHERE path LIKE '%q/%%';"
+  char *query;
+  int64_t disabled;
+  int striplen;
+
+  db_writer_get();
+
+  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
+  striplen = strlen(strip) + 1;
+
+  query = sqlite3_mprintf(Q_TMPL, striplen, disabled, path);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      db_writer_release();
+      return;
+    }
+
+  db_file_disable_byquery(query);
+
+  sqlite3_free(query);
+
+  db_writer_release();
+
+#undef Q_TMPL
+}
+
+int
+db_file_enable_bycookie(uint32_t cookie, char *path)
+{
+#define Q_TMPL "UPDATE files SET path = '%q' || path, disabled = 0 WHERE disabled = %" PRIi64 ";"
+  char *query;
+  char *errmsg;
+  int ret;
+
+  db_writer_get();
+
+  query = sqlite3_mprintf(Q_TMPL, path, (int64_t)cookie);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      db_writer_release();
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_exec(query, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Error enabling files: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      sqlite3_free(query);
+      db_writer_release();
+      return -1;
+    }
+
+  sqlite3_free(query);
+
+  ret = sqlite3_changes(pool_hdl->hdl);
+
+  db_lib_changed(1);
+
+  db_writer_release();
+
+  return ret;
+
+#undef Q_TMPL
+}
+
+
+/* Playlists */
+int
+db_pl_get_count(void)
+{
+  return db_get_count_cached("SELECT COUNT(*) FROM playlists p WHERE p.disabled = 0;");
+}
+
+static int
+db_pl_count_items(int id)
+{
+#define Q_TMPL "SELECT COUNT(*) FROM playlistitems pi JOIN files f" \
+               " ON pi.fileid = f.id WHERE f.disabled = 0 AND pi.playlistid = ?;"
+  sqlite3_stmt *stmt;
+  int ret;
+
+  stmt = db_stmt_get(Q_TMPL);
+  if (!stmt)
+    return 0;
+
+  sqlite3_bind_int(stmt, 1, id);
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+
+      db_stmt_release(stmt);
+      return 0;
+    }
+
+  ret = sqlite3_column_int(stmt, 0);
+
+  db_stmt_release(stmt);
+
+  return ret;
+
+#undef Q_TMPL
+}
+
+static int
+db_smartpl_count_items(int id, const char *smartpl_query)
+{
+#define Q_TMPL "SELECT COUNT(*) FROM files f WHERE f.disabled = 0 AND %s;"
+  char *query;
+  int items;
+  int ret;
+
+  ret = db_smartpl_items_get(id, &items);
+  if (ret == 0)
+    return items;
+
+  query = sqlite3_mprintf(Q_TMPL, smartpl_query);
+
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return 0;
+    }
+
+  ret = db_get_count_cached(query);
+
+  sqlite3_free(query);
+
+  return ret;
+
+#undef Q_TMPL
+}
+
+void
+db_pl_ping(int id)
+{
+  struct db_wb_entry *e;
+
+  pthread_mutex_lock(&wb_lck);
+
+  e = db_wb_lookup(DB_WB_PL_PING, id, 1);
+  if (e)
+    {
+      e->stamp = (int64_t)time(NULL);
+
+      db_wb_schedule();
+    }
+
+  pthread_mutex_unlock(&wb_lck);
+}
+
+static int
+db_pl_id_bypath(char *path, int *id)
+{
+#define Q_TMPL "SELECT p.id FROM playlists p WHERE p.path = '%q';"
+  char *query;
+  sqlite3_stmt *stmt;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL, path);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+
+      sqlite3_free(query);
+      return -1;
+    }
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      if (ret == SQLITE_DONE)
+	DPRINTF(E_INFO, L_DB, "No results\n");
+      else
+	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+
+      sqlite3_finalize(stmt);
+      sqlite3_free(query);
+      return -1;
+    }
+
+  *id = sqlite3_column_int(stmt, 0);
+
+#ifdef DB_PROFILE
+  while (db_blocking_step(stmt) == SQLITE_ROW)
+    ; /* EMPTY */
+#endif
+
+  sqlite3_finalize(stmt);
+  sqlite3_free(query);
+
+  return 0;
+
+#undef Q_TMPL
+}
+
+static struct playlist_info *
+db_pl_fetch_byquery(char *query)
+{
+  struct playlist_info *pli;
+  sqlite3_stmt *stmt;
+  int ncols;
+  char *cval;
+  uint32_t *ival;
+  char **strval;
+  uint64_t disabled;
+  int i;
+  int ret;
+
+  if (!query)
+    return NULL;
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  pli = (struct playlist_info *)malloc(sizeof(struct playlist_info));
+  if (!pli)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not allocate struct playlist_info, out of memory\n");
+      return NULL;
+    }
+  memset(pli, 0, sizeof(struct playlist_info));
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+
+      free(pli);
+      return NULL;
+    }
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      if (ret == SQLITE_DONE)
+	DPRINTF(E_INFO, L_DB, "No results\n");
+      else
+	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+
+      sqlite3_finalize(stmt);
+      free(pli);
+      return NULL;
+    }
+
+  ncols = sqlite3_column_count(stmt);
+
+  if (sizeof(pli_cols_map) / sizeof(pli_cols_map[0]) != ncols)
+    {
+      DPRINTF(E_LOG, L_DB, "BUG: pli column map out of sync with schema\n");
+
+      sqlite3_finalize(stmt);
+      free(pli);
+      return NULL;
+    }
+
+  for (i = 0; i < ncols; i++)
+    {
+      switch (pli_cols_map[i].type)
+	{
+	  case DB_TYPE_INT:
+	    ival = (uint32_t *) ((char *)pli + pli_cols_map[i].offset);
+
+	    if (pli_cols_map[i].offset == pli_offsetof(disabled))
+	      {
+		disabled = sqlite3_column_int64(stmt, i);
+		*ival = (disabled != 0);
+	      }
+	    else
+	      *ival = sqlite3_column_int(stmt, i);
+	    break;
+
+	  case DB_TYPE_STRING:
+	    strval = (char **) ((char *)pli + pli_cols_map[i].offset);
+
+	    cval = (char *)sqlite3_column_text(stmt, i);
+	    if (cval)
+	      *strval = strdup(cval);
+	    break;
+
+	  default:
+	    DPRINTF(E_LOG, L_DB, "BUG: Unknown type %d in pli column map\n", pli_cols_map[i].type);
+
+	    sqlite3_finalize(stmt);
+	    free_pli(pli, 0);
+	    return NULL;
+	}
+    }
+
+  ret = db_blocking_step(stmt);
+  sqlite3_finalize(stmt);
+
+  if (ret != SQLITE_DONE)
+    {
+      DPRINTF(E_WARN, L_DB, "Query had more than a single result!\n");
+
+      free_pli(pli, 0);
+      return NULL;
+    }
+
+  switch (pli->type)
+    {
+      case PL_PLAIN:
+	pli->items = db_pl_count_items(pli->id);
+	break;
+
+      case PL_SMART:
+	pli->items = db_smartpl_count_items(pli->id, pli->query);
+	break;
+
+      default:
+	DPRINTF(E_LOG, L_DB, "Unknown playlist type %d while fetching playlist\n", pli->type);
+
+	free_pli(pli, 0);
+	return NULL;
+    }
+
+  return pli;
+}
+
+struct playlist_info *
+db_pl_fetch_bypath(char *path)
+{
+#define Q_TMPL "SELECT p.* FROM playlists p WHERE p.path = '%q';"
+  struct playlist_info *pli;
+  char *query;
+
+  query = sqlite3_mprintf(Q_TMPL, path);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      return NULL;
+    }
+
+  pli = db_pl_fetch_byquery(query);
+
+  sqlite3_free(query);
+
+  return pli;
+
+#undef Q_TMPL
+}
+
+struct playlist_info *
+db_pl_fetch_byid(int id)
+{
+#define Q_TMPL "SELECT p.* FROM playlists p WHERE p.id = %d;"
+  struct playlist_info *pli;
+  char *query;
+
+  query = sqlite3_mprintf(Q_TMPL, id);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      return NULL;
+    }
+
+  pli = db_pl_fetch_byquery(query);
+
+  sqlite3_free(query);
+
+  return pli;
+
+#undef Q_TMPL
+}
+
+struct playlist_info *
+db_pl_fetch_bytitlepath(char *title, char *path)
+{
+#define Q_TMPL "SELECT p.* FROM playlists p WHERE p.title = '%q' AND p.path = '%q';"
+  struct playlist_info *pli;
+  char *query;
+
+  query = sqlite3_mprintf(Q_TMPL, title, path);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      return NULL;
+    }
+
+  pli = db_pl_fetch_byquery(query);
+
+  sqlite3_free(query);
+
+  return pli;
+
+#undef Q_TMPL
+}
+
+int
+db_pl_add(char *title, char *path, int *id)
+{
+#define QDUP_TMPL "SELECT COUNT(*) FROM playlists p WHERE p.title = '%q' AND p.path = '%q';"
+#define QADD_TMPL "INSERT INTO playlists (title, type, query, db_timestamp, disabled, path, idx, special_id)" \
+                  " VALUES ('%q', 0, NULL, %" PRIi64 ", 0, '%q', 0, 0);"
+  char *query;
+  char *errmsg;
+  int ret;
+
+  db_writer_get();
+
+  /* Check duplicates */
+  query = sqlite3_mprintf(QDUP_TMPL, title, path);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      db_writer_release();
+      return -1;
+    }
+
+  ret = db_get_count(query);
+
+  sqlite3_free(query);
+
+  if (ret > 0)
+    {
+      DPRINTF(E_WARN, L_DB, "Duplicate playlist with title '%s' path '%s'\n", title, path);
+      db_writer_release();
+      return -1;
+    }
+
+  /* Add */
+  query = sqlite3_mprintf(QADD_TMPL, title, (int64_t)time(NULL), path);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      db_writer_release();
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_exec(query, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      sqlite3_free(query);
+      db_writer_release();
+      return -1;
+    }
+
+  sqlite3_free(query);
+
+  *id = (int)sqlite3_last_insert_rowid(pool_hdl->hdl);
+  if (*id == 0)
+    {
+      DPRINTF(E_LOG, L_DB, "Successful insert but no last_insert_rowid!\n");
+      db_writer_release();
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Added playlist %s (path %s) with id %d\n", title, path, *id);
+
+  db_lib_changed(1);
+
+  db_writer_release();
+
+  return 0;
+
+#undef QDUP_TMPL
+#undef QADD_TMPL
+}
+
+/* Items for files not in the library yet keep their path until the file
+ * shows up, see TRG_PLITEMS_INSERT_FILES
+ */
+int
+db_pl_add_item_bypath(int plid, char *path)
+{
+#define Q_TMPL "INSERT INTO playlistitems (playlistid, fileid, filepath)" \
+               " SELECT ?1, IFNULL(f.id, 0), CASE WHEN f.id IS NULL THEN ?2 END" \
+               " FROM (SELECT 1) LEFT JOIN files f ON f.path = ?2 LIMIT 1;"
+  sqlite3_stmt *stmt;
+  char *errmsg;
+  int ret;
+
+  db_writer_get();
+
+  stmt = db_stmt_get(Q_TMPL);
+  if (!stmt)
+    {
+      db_writer_release();
+      return -1;
+    }
+
+  sqlite3_bind_int(stmt, 1, plid);
+  sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC);
+
+  ret = db_stmt_exec(stmt, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      db_writer_release();
+      return -1;
+    }
+
+  db_lib_changed(0);
+
+  db_writer_release();
+
+  return 0;
+
+#undef Q_TMPL
+}
+
+int
+db_pl_add_item_byid(int plid, int fileid)
+{
+#define Q_TMPL "INSERT INTO playlistitems (playlistid, fileid)" \
+               " SELECT ?1, ?2 WHERE EXISTS (SELECT 1 FROM files WHERE id = ?2);"
+  sqlite3_stmt *stmt;
+  char *errmsg;
+  int ret;
+
+  db_writer_get();
+
+  stmt = db_stmt_get(Q_TMPL);
+  if (!stmt)
+    {
+      db_writer_release();
+      return -1;
+    }
+
+  sqlite3_bind_int(stmt, 1, plid);
+  sqlite3_bind_int(stmt, 2, fileid);
+
+  ret = db_stmt_exec(stmt, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      db_writer_release();
+      return -1;
+    }
+
+  if (sqlite3_changes(pool_hdl->hdl) == 0)
+    {
+      DPRINTF(E_LOG, L_DB, "Not adding file id %d to playlist %d, no such file\n", fileid, plid);
+
+      db_writer_release();
+      return -1;
+    }
+
+  db_lib_changed(0);
+
+  db_writer_release();
+
+  return 0;
+
+#undef Q_TMPL
+}
+
+void
+db_pl_clear_items(int id)
+{
+#define Q_TMPL "DELETE FROM playlistitems WHERE playlistid = ?;"
+  sqlite3_stmt *stmt;
+  char *errmsg;
+  int ret;
+
+  db_writer_get();
+
+  stmt = db_stmt_get(Q_TMPL);
+  if (!stmt)
+    {
+      db_writer_release();
+      return;
+    }
+
+  sqlite3_bind_int(stmt, 1, id);
+
+  ret = db_stmt_exec(stmt, &errmsg);
+  if (ret != SQLITE_OK)
+    DPRINTF(E_LOG, L_DB, "Error clearing playlist %d items: %s\n", id, errmsg);
+  else
+    db_lib_changed(0);
+
+  sqlite3_free(errmsg);
+
+  db_writer_release();
+
+#undef Q_TMPL
+}
+
+void
+db_pl_delete(int id)
+{
+#define Q_TMPL "DELETE FROM playlists WHERE id = %d;"
+  char *query;
+  char *errmsg;
+  int ret;
+
+  db_writer_get();
+
+  if (id == 1)
+    {
+      db_writer_release();
+      return;
+    }
+
+  query = sqlite3_mprintf(Q_TMPL, id);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      db_writer_release();
+      return;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_exec(query, &errmsg);
+  if (ret != SQLITE_OK)
+    DPRINTF(E_LOG, L_DB, "Error deleting playlist %d: %s\n", id, errmsg);
+  else
+    db_lib_changed(1);
+
+  sqlite3_free(errmsg);
+  sqlite3_free(query);
+
+  db_pl_clear_items(id);
+
+  db_writer_release();
+
+#undef Q_TMPL
+}
+
+void
+db_pl_delete_bypath(char *path)
+{
+  int id;
+  int ret;
+
+  db_writer_get();
+
+  ret = db_pl_id_bypath(path, &id);
+  if (ret < 0)
+    {
+      db_writer_release();
+      return;
+    }
+
+  db_pl_delete(id);
+
+  db_writer_release();
+}
+
+static void
+db_pl_disable_byquery(char *query)
+{
+  char *errmsg;
+  int ret;
+
+  /* A queued ping must not re-enable what gets disabled here */
+  db_wb_flush();
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_exec(query, &errmsg);
+  if (ret != SQLITE_OK)
+    DPRINTF(E_LOG, L_DB, "Error disabling playlist: %s\n", errmsg);
+  else
+    db_lib_changed(1);
+
+  sqlite3_free(errmsg);
+}
+
+void
+db_pl_disable_bypath(char *path, char *strip, uint32_t cookie)
+{
+#define Q_TMPL "UPDATE playlists SET path = substr(path, %d), disabled = %" PRIi64 " WHERE path = '%q';"
+  char *query;
+  int64_t disabled;
+  int striplen;
+
+  db_writer_get();
+
+  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
+  striplen = strlen(strip) + 1;
+
+  query = sqlite3_mprintf(Q_TMPL, striplen, disabled, path);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      db_writer_release();
+      return;
+    }
+
+  db_pl_disable_byquery(query);
+
+  sqlite3_free(query);
+
+  db_writer_release();
+
+#undef Q_TMPL
+}
+
+void
+db_pl_disable_bymatch(char *path, char *strip, uint32_t cookie)
+{
+#define Q_TMPL "UPDATE playlists SET path = substr(path, %d), disabled = %" PRIi64 " WHERE path LIKE '%q/%%';"
+  char *query;
+  int64_t disabled;
+  int striplen;
+
+  db_writer_get();
+
+  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
+  striplen = strlen(strip) + 1;
+
+  query = sqlite3_mprintf(Q_TMPL, striplen, disabled, path);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      db_writer_release();
+      return;
+    }
+
+  db_pl_disable_byquery(query);
+
+  sqlite3_free(query);
+
+  db_writer_release();
+
+#undef Q_TMPL
+}
+
+int
+db_pl_enable_bycookie(uint32_t cookie, char *path)
+{
+#define Q_TMPL "UPDATE playlists SET path = '%q' || path, disabled = 0 WHERE disabled = %" PRIi64 ";"
+  char *query;
+  char *errmsg;
+  int ret;
+
+  db_writer_get();
+
+  query = sqlite3_mprintf(Q_TMPL, path, (int64_t)cookie);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      db_writer_release();
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_exec(query, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Error enabling playlists: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      sqlite3_free(query);
+      db_writer_release();
+      return -1;
+    }
+
+  sqlite3_free(query);
+
+  ret = sqlite3_changes(pool_hdl->hdl);
+
+  db_lib_changed(1);
+
+  db_writer_release();
+
+  return ret;
+
+#undef Q_TMPL
+}
+
+
+/* Groups */
+int
+db_groups_clear(void)
+{
+  char *query = "DELETE FROM groups;";
+  char *errmsg;
+  int ret;
+
+  db_writer_get();
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_exec(query, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      db_writer_release();
+      return -1;
+    }
+
+  db_lib_changed(0);
+
+  db_writer_release();
+
+  return 0;
+}
+
+enum group_type
+db_group_type_byid(int id)
+{
+#define Q_TMPL "SELECT g.type FROM groups g WHERE g.id = ?;"
+  sqlite3_stmt *stmt;
+  int ret;
+
+  stmt = db_stmt_get(Q_TMPL);
+  if (!stmt)
+    return 0;
+
+  sqlite3_bind_int(stmt, 1, id);
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      if (ret == SQLITE_DONE)
+	DPRINTF(E_INFO, L_DB, "No results\n");
+      else
+	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+
+      db_stmt_release(stmt);
+      return 0;
+    }
+
+  ret = sqlite3_column_int(stmt, 0);
+
+#ifdef DB_PROFILE
+  while (db_blocking_step(stmt) == SQLITE_ROW)
+    ; /* EMPTY */
+#endif
+
+  db_stmt_release(stmt);
+
+  return ret;
+
+#undef Q_TMPL
+}
+
+int
+db_group_itemid_byid(int id)
+{
+#define Q_TMPL "SELECT g.itemid FROM groups g WHERE g.id = ?;"
+  sqlite3_stmt *stmt;
+  int ret;
+
+  stmt = db_stmt_get(Q_TMPL);
+  if (!stmt)
+    return 0;
+
+  sqlite3_bind_int(stmt, 1, id);
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      if (ret == SQLITE_DONE)
+	DPRINTF(E_INFO, L_DB, "No results\n");
+      else
+	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+
+      db_stmt_release(stmt);
+      return 0;
+    }
+
+  ret = sqlite3_column_int(stmt, 0);
+
+#ifdef DB_PROFILE
+  while (db_blocking_step(stmt) == SQLITE_ROW)
+    ; /* EMPTY */
+#endif
+
+  db_stmt_release(stmt);
+
+  return ret;
+
+#undef Q_TMPL
+}
+
+/* Remotes */
+static int
+db_pairing_delete_byremote(char *remote_id)
+{
+#define Q_TMPL "DELETE FROM pairings WHERE remote = '%q';"
+  char *query;
+  char *errmsg;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL, remote_id);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_exec(query, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Error deleting pairing: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      sqlite3_free(query);
+      return -1;
+    }
+
+  sqlite3_free(query);
+
+  return 0;
+
+#undef Q_TMPL
+}
+
+int
+db_pairing_add(struct pairing_info *pi)
+{
+#define Q_TMPL "INSERT INTO pairings (remote, name, guid) VALUES ('%q', '%q', '%q');"
+  char *query;
+  char *errmsg;
+  int ret;
+
+  db_writer_get();
+
+  ret = db_pairing_delete_byremote(pi->remote_id);
+  if (ret < 0)
+    {
+      db_writer_release();
+      return ret;
+    }
+
+  query = sqlite3_mprintf(Q_TMPL, pi->remote_id, pi->name, pi->guid);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      db_writer_release();
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_exec(query, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Error adding pairing: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      sqlite3_free(query);
+      db_writer_release();
+      return -1;
+    }
+
+  sqlite3_free(query);
+
+  db_writer_release();
+
+  return 0;
+
+#undef Q_TMPL
+}
+
+int
+db_pairing_fetch_byguid(struct pairing_info *pi)
+{
+#define Q_TMPL "SELECT p.* FROM pairings p WHERE p.guid = '%q';"
+  char *query;
+  sqlite3_stmt *stmt;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL, pi->guid);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+      return -1;
+    }
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      if (ret == SQLITE_DONE)
+	DPRINTF(E_INFO, L_DB, "Pairing GUID %s not found\n", pi->guid);
+      else
+	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+
+      sqlite3_finalize(stmt);
+      sqlite3_free(query);
+      return -1;
+    }
+
+  pi->remote_id = strdup((char *)sqlite3_column_text(stmt, 0));
+  pi->name = strdup((char *)sqlite3_column_text(stmt, 1));
+
+#ifdef DB_PROFILE
+  while (db_blocking_step(stmt) == SQLITE_ROW)
+    ; /* EMPTY */
+#endif
+
+  sqlite3_finalize(stmt);
+  sqlite3_free(query);
+
+  return 0;
+
+#undef Q_TMPL
+}
+
+
+/* Speakers */
+int
+db_speaker_save(uint64_t id, int selected, int volume)
+{
+  struct db_wb_entry *e;
+
+  pthread_mutex_lock(&wb_lck);
+
+  e = db_wb_lookup(DB_WB_SPEAKER, id, 1);
+  if (!e)
+    {
+      pthread_mutex_unlock(&wb_lck);
+      return -1;
+    }
+
+  e->selected = selected;
+  e->volume = volume;
+
+  db_wb_schedule();
+
+  pthread_mutex_unlock(&wb_lck);
+
+  return 0;
+}
+
+int
+db_speaker_get(uint64_t id, int *selected, int *volume)
+{
+#define Q_TMPL "SELECT s.selected, s.volume FROM speakers s WHERE s.id = ?;"
+  struct db_wb_entry *e;
+  sqlite3_stmt *stmt;
+  int ret;
+
+  /* A queued state is more recent than the table */
+  pthread_mutex_lock(&wb_lck);
+
+  e = db_wb_lookup(DB_WB_SPEAKER, id, 0);
+  if (e)
+    {
+      *selected = e->selected;
+      *volume = e->volume;
+
+      pthread_mutex_unlock(&wb_lck);
+      return 0;
+    }
+
+  pthread_mutex_unlock(&wb_lck);
+
+  stmt = db_stmt_get(Q_TMPL);
+  if (!stmt)
+    return -1;
+
+  sqlite3_bind_int64(stmt, 1, id);
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      if (ret != SQLITE_DONE)
+	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+
+      db_stmt_release(stmt);
+      return -1;
+    }
+
+  *selected = sqlite3_column_int(stmt, 0);
+  *volume = sqlite3_column_int(stmt, 1);
+
+#ifdef DB_PROFILE
+  while (db_blocking_step(stmt) == SQLITE_ROW)
+    ; /* EMPTY */
+#endif
+
+  db_stmt_release(stmt);
+
+  return 0;
+
+#undef Q_TMPL
+}
+
+void
+db_speaker_clear_all(void)
+{
+  char *query = "UPDATE speakers SET selected = 0;";
+  char *errmsg;
+  int ret;
+
+  db_writer_get();
+
+  /* Queued speaker states predate this */
+  db_wb_flush();
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_exec(query, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+    }
+
+  db_writer_release();
+}
+
+
+/* Inotify */
+int
+db_watch_clear(void)
+{
+  char *query = "DELETE FROM inotify;";
+  char *errmsg;
+  int ret;
+
+  db_writer_get();
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_exec(query, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Query error: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      db_writer_release();
+      return -1;
+    }
+
+  db_writer_release();
+
+  return 0;
+}
+
+int
+db_watch_add(struct watch_info *wi)
+{
+#define Q_TMPL "INSERT INTO inotify (wd, cookie, path) VALUES (?, 0, ?);"
+  sqlite3_stmt *stmt;
+  char *errmsg;
+  int ret;
+
+  db_writer_get();
+
+  stmt = db_stmt_get(Q_TMPL);
+  if (!stmt)
+    {
+      db_writer_release();
+      return -1;
+    }
+
+  sqlite3_bind_int(stmt, 1, wi->wd);
+  sqlite3_bind_text(stmt, 2, wi->path, -1, SQLITE_STATIC);
+
+  ret = db_stmt_exec(stmt, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Error adding watch: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      db_writer_release();
+      return -1;
+    }
+
+  db_writer_release();
+
+  return 0;
+
+#undef Q_TMPL
+}
+
+static int
+db_watch_delete_bystmt(sqlite3_stmt *stmt)
+{
+  char *errmsg;
+  int ret;
+
+  ret = db_stmt_exec(stmt, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Error deleting watch: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      return -1;
+    }
+
+  return 0;
+}
+
+int
+db_watch_delete_bywd(uint32_t wd)
+{
+#define Q_TMPL "DELETE FROM inotify WHERE wd = ?;"
+  sqlite3_stmt *stmt;
+  int ret;
+
+  db_writer_get();
+
+  stmt = db_stmt_get(Q_TMPL);
+  if (!stmt)
+    {
+      db_writer_release();
+      return -1;
+    }
+
+  sqlite3_bind_int(stmt, 1, wd);
+
+  ret = db_watch_delete_bystmt(stmt);
+
+  db_writer_release();
+
+  return ret;
+
+#undef Q_TMPL
+}
+
+int
+db_watch_delete_bypath(char *path)
+{
+#define Q_TMPL "DELETE FROM inotify WHERE path = ?;"
+  sqlite3_stmt *stmt;
+  int ret;
+
+  db_writer_get();
+
+  stmt = db_stmt_get(Q_TMPL);
+  if (!stmt)
+    {
+      db_writer_release();
+      return -1;
+    }
+
+  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+
+  ret = db_watch_delete_bystmt(stmt);
+
+  db_writer_release();
+
+  return ret;
+
+#undef Q_TMPL
+}
+
+int
+db_watch_delete_bymatch(char *path)
+{
+#define Q_TMPL "DELETE FROM inotify WHERE path LIKE ? || '/%';"
+  sqlite3_stmt *stmt;
+  int ret;
+
+  db_writer_get();
+
+  stmt = db_stmt_get(Q_TMPL);
+  if (!stmt)
+    {
+      db_writer_release();
+      return -1;
+    }
+
+  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+
+  ret = db_watch_delete_bystmt(stmt);
+
+  db_writer_release();
+
+  return ret;
+
+#undef Q_TMPL
+}
+
+int
+db_watch_delete_bycookie(uint32_t cookie)
+{
+#define Q_TMPL "DELETE FROM inotify WHERE cookie = ?;"
+  sqlite3_stmt *stmt;
+  int ret;
+
+  db_writer_get();
+
+  if (cookie == 0)
+    {
+      db_writer_release();
+      return -1;
+    }
+
+  stmt = db_stmt_get(Q_TMPL);
+  if (!stmt)
+    {
+      db_writer_release();
+      return -1;
+    }
+
+  sqlite3_bind_int64(stmt, 1, (int64_t)cookie);
+
+  ret = db_watch_delete_bystmt(stmt);
+
+  db_writer_release();
+
+  return ret;
+
+#undef Q_TMPL
+}
+
+int
+db_watch_get_bywd(struct watch_info *wi)
+{
+#define Q_TMPL "SELECT * FROM inotify WHERE wd = ?;"
+  sqlite3_stmt *stmt;
+  char **strval;
+  char *cval;
+  uint32_t *ival;
+  int64_t cookie;
+  int ncols;
+  int i;
+  int ret;
+
+  stmt = db_stmt_get(Q_TMPL);
+  if (!stmt)
+    return -1;
+
+  sqlite3_bind_int(stmt, 1, wi->wd);
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Watch wd %d not found\n", wi->wd);
+
+      db_stmt_release(stmt);
+      return -1;
+    }
+
+  ncols = sqlite3_column_count(stmt);
+
+  if (sizeof(wi_cols_map) / sizeof(wi_cols_map[0]) != ncols)
+    {
+      DPRINTF(E_LOG, L_DB, "BUG: wi column map out of sync with schema\n");
+
+      db_stmt_release(stmt);
+      return -1;
+    }
+
+  for (i = 0; i < ncols; i++)
+    {
+      switch (wi_cols_map[i].type)
+	{
+	  case DB_TYPE_INT:
+	    ival = (uint32_t *) ((char *)wi + wi_cols_map[i].offset);
+
+	    if (wi_cols_map[i].offset == wi_offsetof(cookie))
+	      {
+		cookie = sqlite3_column_int64(stmt, i);
+		*ival = (cookie == INOTIFY_FAKE_COOKIE) ? 0 : cookie;
 	      }
 	    else
 	      *ival = sqlite3_column_int(stmt, i);
 	    break;
 
-	  case DB_TYPE_STRING:
-	    strval = (char **) ((char *)wi + wi_cols_map[i].offset);
+	  case DB_TYPE_STRING:
+	    strval = (char **) ((char *)wi + wi_cols_map[i].offset);
+
+	    cval = (char *)sqlite3_column_text(stmt, i);
+	    if (cval)
+	      *strval = strdup(cval);
+	    break;
+
+	  default:
+	    DPRINTF(E_LOG, L_DB, "BUG: Unknown type %d in wi column map\n", wi_cols_map[i].type);
+	    db_stmt_release(stmt);
+	    return -1;
+	}
+    }
+
+#ifdef DB_PROFILE
+  while (db_blocking_step(stmt) == SQLITE_ROW)
+    ; /* EMPTY */
+#endif
+
+  db_stmt_release(stmt);
+
+  return 0;
+
+#undef Q_TMPL
+}
+
+static void
+db_watch_mark_bystmt(const char *tmpl, char *path, char *strip, uint32_t cookie)
+{
+  sqlite3_stmt *stmt;
+  char *errmsg;
+  int64_t disabled;
+  int striplen;
+  int ret;
+
+  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
+  striplen = strlen(strip) + 1;
+
+  db_writer_get();
+
+  stmt = db_stmt_get(tmpl);
+  if (!stmt)
+    {
+      db_writer_release();
+      return;
+    }
+
+  sqlite3_bind_int(stmt, 1, striplen);
+  sqlite3_bind_int64(stmt, 2, disabled);
+  sqlite3_bind_text(stmt, 3, path, -1, SQLITE_STATIC);
+
+  ret = db_stmt_exec(stmt, &errmsg);
+  if (ret != SQLITE_OK)
+    DPRINTF(E_LOG, L_DB, "Error marking watch: %s\n", errmsg);
+
+  sqlite3_free(errmsg);
+
+  db_writer_release();
+}
+
+void
+db_watch_mark_bypath(char *path, char *strip, uint32_t cookie)
+{
+#define Q_TMPL "UPDATE inotify SET path = substr(path, ?), cookie = ? WHERE path = ?;"
+
+  db_watch_mark_bystmt(Q_TMPL, path, strip, cookie);
+
+#undef Q_TMPL
+}
+
+void
+db_watch_mark_bymatch(char *path, char *strip, uint32_t cookie)
+{
+#define Q_TMPL "UPDATE inotify SET path = substr(path, ?), cookie = ? WHERE path LIKE ? || '/%';"
+
+  db_watch_mark_bystmt(Q_TMPL, path, strip, cookie);
+
+#undef Q_TMPL
+}
+
+void
+db_watch_move_bycookie(uint32_t cookie, char *path)
+{
+#define Q_TMPL "UPDATE inotify SET path = ? || path, cookie = 0 WHERE cookie = ?;"
+  sqlite3_stmt *stmt;
+  char *errmsg;
+  int ret;
+
+  db_writer_get();
+
+  if (cookie == 0)
+    {
+      db_writer_release();
+      return;
+    }
+
+  stmt = db_stmt_get(Q_TMPL);
+  if (!stmt)
+    {
+      db_writer_release();
+      return;
+    }
+
+  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 2, (int64_t)cookie);
+
+  ret = db_stmt_exec(stmt, &errmsg);
+  if (ret != SQLITE_OK)
+    DPRINTF(E_LOG, L_DB, "Error moving watch: %s\n", errmsg);
+
+  sqlite3_free(errmsg);
+
+  db_writer_release();
+
+#undef Q_TMPL
+}
+
+int
+db_watch_cookie_known(uint32_t cookie)
+{
+#define Q_TMPL "SELECT COUNT(*) FROM inotify WHERE cookie = ?;"
+  sqlite3_stmt *stmt;
+  int ret;
+
+  if (cookie == 0)
+    return 0;
+
+  stmt = db_stmt_get(Q_TMPL);
+  if (!stmt)
+    return 0;
+
+  sqlite3_bind_int64(stmt, 1, (int64_t)cookie);
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+
+      db_stmt_release(stmt);
+      return 0;
+    }
+
+  ret = sqlite3_column_int(stmt, 0);
+
+  db_stmt_release(stmt);
+
+  return (ret > 0);
+
+#undef Q_TMPL
+}
+
+int
+db_watch_enum_start(struct watch_enum *we)
+{
+#define Q_MATCH_TMPL "SELECT wd FROM inotify WHERE path LIKE '%q/%%';"
+#define Q_COOKIE_TMPL "SELECT wd FROM inotify WHERE cookie = %" PRIi64 ";"
+  char *query;
+  int ret;
+
+  we->stmt = NULL;
+
+  if (we->match)
+    query = sqlite3_mprintf(Q_MATCH_TMPL, we->match);
+  else if (we->cookie != 0)
+    query = sqlite3_mprintf(Q_COOKIE_TMPL, we->cookie);
+  else
+    {
+      DPRINTF(E_LOG, L_DB, "Could not start enum, no parameter given\n");
+      return -1;
+    }
+
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Starting enum '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, -1, &we->stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+
+      sqlite3_free(query);
+      return -1;
+    }
+
+  sqlite3_free(query);
+
+  return 0;
+
+#undef Q_MATCH_TMPL
+#undef Q_COOKIE_TMPL
+}
+
+void
+db_watch_enum_end(struct watch_enum *we)
+{
+  if (!we->stmt)
+    return;
+
+  sqlite3_finalize(we->stmt);
+  we->stmt = NULL;
+}
+
+int
+db_watch_enum_fetchwd(struct watch_enum *we, uint32_t *wd)
+{
+  int ret;
+
+  *wd = 0;
+
+  if (!we->stmt)
+    {
+      DPRINTF(E_LOG, L_DB, "Watch enum not started!\n");
+      return -1;
+    }
+
+  ret = db_blocking_step(we->stmt);
+  if (ret == SQLITE_DONE)
+    {
+      DPRINTF(E_INFO, L_DB, "End of watch enum results\n");
+      return 0;
+    }
+  else if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+      return -1;
+    }
+
+  *wd = (uint32_t)sqlite3_column_int(we->stmt, 0);
+
+  return 0;
+}
+
+
+#ifdef DB_PROFILE
+static void
+db_xprofile(void *notused, const char *pquery, sqlite3_uint64 ptime)
+{
+  sqlite3_stmt *stmt;
+  char *query;
+  int ret;
+
+  DPRINTF(E_DBG, L_DBPERF, "SQL PROFILE query: %s\n", pquery);
+  DPRINTF(E_DBG, L_DBPERF, "SQL PROFILE time: %" PRIu64 " ms\n", ((uint64_t)ptime / 1000000));
+
+  if ((strncmp(pquery, "SELECT", 6) != 0)
+       && (strncmp(pquery, "UPDATE", 6) != 0)
+       && (strncmp(pquery, "DELETE", 6) != 0))
+      return;
+
+  /* Disable profiling callback */
+  sqlite3_profile(pool_hdl->hdl, NULL, NULL);
+
+  query = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", pquery);
+  if (!query)
+    {
+      DPRINTF(E_DBG, L_DBPERF, "Query plan: Out of memory\n");
+
+      goto out;
+    }
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_DBG, L_DBPERF, "Query plan: Could not prepare statement: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+
+      goto out;
+    }
+
+  DPRINTF(E_DBG, L_DBPERF, "Query plan:\n");
+
+  while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
+    {
+      DPRINTF(E_DBG, L_DBPERF, "(%d,%d,%d) %s\n",
+	      sqlite3_column_int(stmt, 0), sqlite3_column_int(stmt, 1), sqlite3_column_int(stmt, 2),
+	      sqlite3_column_text(stmt, 3));
+    }
+
+  if (ret != SQLITE_DONE)
+    DPRINTF(E_DBG, L_DBPERF, "Query plan: Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+
+  DPRINTF(E_DBG, L_DBPERF, "---\n");
+
+  sqlite3_finalize(stmt);
+
+ out:
+  /* Reenable profiling callback */
+  sqlite3_profile(pool_hdl->hdl, db_xprofile, NULL);
+}
+#endif
+
+
+/* Database connections */
+static uint64_t
+db_time_usec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static sqlite3 *
+db_conn_open(int readonly)
+{
+  sqlite3 *conn;
+  char *errmsg;
+  int flags;
+  int ret;
+
+  if (readonly)
+    flags = SQLITE_OPEN_READONLY;
+  else
+    flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+
+  ret = sqlite3_open_v2(db_path, &conn, flags, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not open database: %s\n", sqlite3_errmsg(conn));
+
+      goto fail;
+    }
 
-	    cval = (char *)sqlite3_column_text(stmt, i);
-	    if (cval)
-	      *strval = strdup(cval);
-	    break;
+  ret = sqlite3_enable_load_extension(conn, 1);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not enable extension loading\n");
 
-	  default:
-	    DPRINTF(E_LOG, L_DB, "BUG: Unknown type %d in wi column map\n", wi_cols_map[i].type);
-	    sqlite3_finalize(stmt);
-	    sqlite3_free(query);
-	    return -1;
+      goto fail;
+    }
+
+  errmsg = NULL;
+  ret = sqlite3_load_extension(conn, PKGLIBDIR "/forked-daapd-sqlext.so", NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      if (errmsg)
+	{
+	  DPRINTF(E_LOG, L_DB, "Could not load SQLite extension: %s\n", errmsg);
+	  sqlite3_free(errmsg);
 	}
+      else
+	DPRINTF(E_LOG, L_DB, "Could not load SQLite extension: %s\n", sqlite3_errmsg(conn));
+
+      goto fail;
+    }
+
+  ret = sqlite3_enable_load_extension(conn, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not disable extension loading\n");
+
+      goto fail;
+    }
+
+  /* WAL checkpoints and recovery can still briefly lock the database */
+  ret = sqlite3_busy_timeout(conn, DB_BUSY_TIMEOUT_MSEC);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not set busy timeout: %s\n", sqlite3_errmsg(conn));
+
+      goto fail;
     }
 
 #ifdef DB_PROFILE
-  while (db_blocking_step(stmt) == SQLITE_ROW)
-    ; /* EMPTY */
+  sqlite3_profile(conn, db_xprofile, NULL);
 #endif
 
-  sqlite3_finalize(stmt);
-  sqlite3_free(query);
+  return conn;
+
+ fail:
+  sqlite3_close(conn);
+
+  return NULL;
+}
+
+static void
+db_conn_close(sqlite3 *conn)
+{
+  sqlite3_stmt *stmt;
+
+  /* Tear down anything that's in flight */
+  while ((stmt = sqlite3_next_stmt(conn, 0)))
+    sqlite3_finalize(stmt);
+
+  sqlite3_close(conn);
+}
+
+
+/* Database connection pool */
+static int
+db_pool_open(void)
+{
+  struct db_pool_hdl *ph;
+
+  ph = (struct db_pool_hdl *)malloc(sizeof(struct db_pool_hdl));
+  if (!ph)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for database connection pool\n");
+
+      return -1;
+    }
+
+  memset(ph, 0, sizeof(struct db_pool_hdl));
+
+  ph->hdl = db_conn_open(1);
+  if (!ph->hdl)
+    {
+      free(ph);
+      return -1;
+    }
+
+  pool_size++;
+  if (pool_size > pool_size_max)
+    pool_size_max = pool_size;
+
+  ph->next = pool_free;
+  pool_free = ph;
 
   return 0;
+}
 
-#undef Q_TMPL
+static void
+db_pool_close(struct db_pool_hdl *ph)
+{
+  pool_size--;
+
+  db_stmt_cache_clear(ph);
+  db_conn_close(ph->hdl);
+  free(ph);
 }
 
 static void
-db_watch_mark_byquery(char *query)
+db_pool_reclaim(void *arg)
 {
-  char *errmsg;
+  struct db_pool_hdl *ph;
+  struct db_pool_hdl *ph_prev;
+  time_t threshold;
+  int reclaimed;
+
+  DPRINTF(E_DBG, L_DB, "DB pool status: size %d free %d max %d; %" PRIu64 " gets, %" PRIu64 " us max wait\n",
+	  pool_size, pool_free_size, pool_size_max, pool_gets, pool_wait_max_usec);
+
+  if (pool_free_size <= DB_POOL_MIN_FREE)
+    return;
+
+  threshold = time(NULL) - DB_POOL_MAX_AGE;
+  reclaimed = 0;
+
+  ph_prev = NULL;
+  for (ph = pool_free; ph && (pool_free_size > DB_POOL_MIN_FREE); /* EMPTY */)
+    {
+      if (ph->last <= threshold)
+	{
+	  if (ph_prev)
+	    ph_prev->next = ph->next;
+	  else
+	    pool_free = ph->next;
+
+	  db_pool_close(ph);
+
+	  reclaimed++;
+	  pool_free_size--;
+
+	  if (ph_prev)
+	    ph = ph_prev->next;
+	  else
+	    ph = pool_free;
+	}
+      else
+	{
+	  ph_prev = ph;
+	  ph = ph->next;
+	}
+    }
+
+  DPRINTF(E_DBG, L_DB, "DB pool status: reclaimed %d size %d free %d\n", reclaimed, pool_size, pool_free_size);
+}
+
+static void
+db_pool_get_task(void *arg)
+{
+  struct db_pool_hdl *ph;
+  struct db_pool_hdl **my_pool_hdl;
   int ret;
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  my_pool_hdl = (struct db_pool_hdl **)arg;
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
-    DPRINTF(E_LOG, L_DB, "Error marking watch: %s\n", errmsg);
+  if (!pool_free)
+    {
+      ret = db_pool_open();
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_DB, "Could not open a new database connection; no free connections available\n");
 
-  sqlite3_free(errmsg);
+	  return;
+	}
+    }
+  else
+    pool_free_size--;
+
+  /* Remove from free list */
+  ph = pool_free;
+  pool_free = ph->next;
+
+  /* Add to used list */
+  ph->next = pool_used;
+  pool_used = ph;
+
+  ph->saved = *my_pool_hdl;
+  *my_pool_hdl = ph;
+}
+
+int
+db_pool_get(void)
+{
+  struct db_pool_hdl *my_pool_hdl;
+  uint64_t start;
+
+  my_pool_hdl = pool_hdl;
+
+  start = db_time_usec();
+
+  dispatch_sync_f(dbpool_sq, &my_pool_hdl, db_pool_get_task);
+
+  /* Failed to get a new pool_hdl */
+  if (my_pool_hdl == pool_hdl)
+    return -1;
+
+  /* Accounted for on release */
+  my_pool_hdl->wait = db_time_usec() - start;
+
+  /* Set thread-local database handle */
+  pool_hdl = my_pool_hdl;
+
+  return 0;
+}
+
+static void
+db_pool_release_task(void *arg)
+{
+  struct db_pool_hdl *ph;
+  struct db_pool_hdl *ph_prev;
+  struct db_pool_hdl *my_pool_hdl;
+
+  my_pool_hdl = (struct db_pool_hdl *)arg;
+
+  ph_prev = NULL;
+
+  for (ph = pool_used; ph; ph = ph->next)
+    {
+      if (ph == my_pool_hdl)
+	break;
+
+      ph_prev = ph;
+    }
+
+  if (!ph)
+    return;
+
+  /* Remove from used list */
+  if (!ph_prev)
+    pool_used = ph->next;
+  else
+    ph_prev->next = ph->next;
+
+  /* Add to free list */
+  ph->next = pool_free;
+  pool_free = ph;
+
+  ph->last = time(NULL);
+  pool_free_size++;
+
+  pool_gets++;
+  pool_wait_usec += ph->wait;
+  if (ph->wait > pool_wait_max_usec)
+    pool_wait_max_usec = ph->wait;
 }
 
 void
-db_watch_mark_bypath(char *path, char *strip, uint32_t cookie)
+db_pool_release(void)
+{
+  struct db_pool_hdl *my_pool_hdl;
+
+  /* Copy thread-local database handle */
+  my_pool_hdl = pool_hdl;
+
+  /* Restore thread-local database handle to previous value */
+  pool_hdl = my_pool_hdl->saved;
+
+  dispatch_async_f(dbpool_sq, my_pool_hdl, db_pool_release_task);
+}
+
+static int
+db_pool_init(void)
 {
-#define Q_TMPL "UPDATE inotify SET path = substr(path, %d), cookie = %" PRIi64 " WHERE path = '%q';"
-  char *query;
-  int64_t disabled;
-  int striplen;
+  time_t now;
+  int ret;
 
-  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
-  striplen = strlen(strip) + 1;
+  pool_size = 0;
+  pool_size_max = 0;
+  pool_free_size = 0;
+  pool_free = 0;
+  pool_used = 0;
+  pool_gets = 0;
+  pool_wait_usec = 0;
+  pool_wait_max_usec = 0;
 
-  query = sqlite3_mprintf(Q_TMPL, striplen, disabled, path);
-  if (!query)
+  dbpool_sq = dispatch_queue_create("org.forked-daapd.db-pool", NULL);
+  if (!dbpool_sq)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      DPRINTF(E_LOG, L_DB, "Could not create dispatch queue for database pool\n");
 
-      return;
+      return -1;
     }
 
-  db_watch_mark_byquery(query);
-
-  sqlite3_free(query);
-
-#undef Q_TMPL
-}
+  now = time(NULL);
 
-void
-db_watch_mark_bymatch(char *path, char *strip, uint32_t cookie)
-{
-#define Q_TMPL "UPDATE inotify SET path = substr(path, %d), cookie = %" PRIi64 " WHERE path LIKE '%q/%%';"
-  char *query;
-  int64_t disabled;
-  int striplen;
+  for (pool_size = 0; pool_size < DB_POOL_MIN_SIZE; pool_free_size++)
+    {
+      ret = db_pool_open();
+      if (ret < 0)
+	return -1;
 
-  disabled = (cookie != 0) ? cookie : INOTIFY_FAKE_COOKIE;
-  striplen = strlen(strip) + 1;
+      pool_free->last = now;
+    }
 
-  query = sqlite3_mprintf(Q_TMPL, striplen, disabled, path);
-  if (!query)
+  pool_reclaim_timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dbpool_sq);
+  if (!pool_reclaim_timer)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      DPRINTF(E_LOG, L_DB, "Could not create timer for database pool reclaim\n");
 
-      return;
+      return -1;
     }
 
-  db_watch_mark_byquery(query);
-
-  sqlite3_free(query);
+  dispatch_source_set_timer(pool_reclaim_timer,
+			    dispatch_time(DISPATCH_TIME_NOW, DB_POOL_MAX_AGE_NSEC),
+			    DB_POOL_MAX_AGE_NSEC, 30 * NSEC_PER_SEC);
+  dispatch_source_set_event_handler_f(pool_reclaim_timer, db_pool_reclaim);
+  dispatch_resume(pool_reclaim_timer);
 
-#undef Q_TMPL
+  return 0;
 }
 
-void
-db_watch_move_bycookie(uint32_t cookie, char *path)
+static void
+db_pool_deinit(void)
 {
-#define Q_TMPL "UPDATE inotify SET path = '%q' || path, cookie = 0 WHERE cookie = %" PRIi64 ";"
-  char *query;
-  char *errmsg;
-  int ret;
-
-  if (cookie == 0)
-    return;
+  struct db_pool_hdl *ph;
 
-  query = sqlite3_mprintf(Q_TMPL, path, (int64_t)cookie);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  dispatch_source_cancel(pool_reclaim_timer);
+  dispatch_release(pool_reclaim_timer);
 
-      return;
-    }
+  dispatch_sync(dbpool_sq,
+		^{
+		  /* Nothing to do, just resynching with the queue */
+		});
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  dispatch_release(dbpool_sq);
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
-    DPRINTF(E_LOG, L_DB, "Error moving watch: %s\n", errmsg);
+  if (pool_used)
+    DPRINTF(E_LOG, L_DB, "db_pool_deinit: some connections are still in use!\n");
 
-  sqlite3_free(errmsg);
-  sqlite3_free(query);
+  for (ph = pool_free; pool_free; ph = pool_free)
+    {
+      pool_free = ph->next;
 
-#undef Q_TMPL
+      db_stmt_cache_clear(ph);
+      db_conn_close(ph->hdl);
+      free(ph);
+    }
 }
 
-int
-db_watch_cookie_known(uint32_t cookie)
+static void
+db_pool_stats_task(void *arg)
 {
-#define Q_TMPL "SELECT COUNT(*) FROM inotify WHERE cookie = %" PRIi64 ";"
-  char *query;
-  int ret;
+  struct db_pool_stats *stats;
 
-  if (cookie == 0)
-    return 0;
+  stats = (struct db_pool_stats *)arg;
 
-  query = sqlite3_mprintf(Q_TMPL, (int64_t)cookie);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  stats->readers = pool_size;
+  stats->readers_free = pool_free_size;
+  stats->readers_max = pool_size_max;
 
-      return 0;
-    }
+  stats->reader_gets = pool_gets;
+  stats->reader_wait_usec = pool_wait_usec;
+  stats->reader_wait_max_usec = pool_wait_max_usec;
+}
 
-  ret = db_get_count(query);
+void
+db_pool_stats_get(struct db_pool_stats *stats)
+{
+  memset(stats, 0, sizeof(struct db_pool_stats));
 
-  sqlite3_free(query);
+  dispatch_sync_f(dbpool_sq, stats, db_pool_stats_task);
 
-  return (ret > 0);
+  pthread_mutex_lock(&writer_stats_lck);
 
-#undef Q_TMPL
+  stats->writer_gets = writer_gets;
+  stats->writer_wait_usec = writer_wait_usec;
+  stats->writer_wait_max_usec = writer_wait_max_usec;
+
+  pthread_mutex_unlock(&writer_stats_lck);
 }
 
-int
-db_watch_enum_start(struct watch_enum *we)
+
+/* Writer connection
+ * All writes go through a single read-write connection, serialized by
+ * writer_lck; writing functions bracket their work with db_writer_get()/
+ * db_writer_release(), which nest. In WAL mode the read-only connections
+ * of the pool keep reading the last committed snapshot meanwhile.
+ */
+static int
+db_writer_init(void)
 {
-#define Q_MATCH_TMPL "SELECT wd FROM inotify WHERE path LIKE '%q/%%';"
-#define Q_COOKIE_TMPL "SELECT wd FROM inotify WHERE cookie = %" PRIi64 ";"
-  char *query;
+  char *errmsg;
   int ret;
 
-  we->stmt = NULL;
-
-  if (we->match)
-    query = sqlite3_mprintf(Q_MATCH_TMPL, we->match);
-  else if (we->cookie != 0)
-    query = sqlite3_mprintf(Q_COOKIE_TMPL, we->cookie);
-  else
+  writer_hdl = (struct db_pool_hdl *)malloc(sizeof(struct db_pool_hdl));
+  if (!writer_hdl)
     {
-      DPRINTF(E_LOG, L_DB, "Could not start enum, no parameter given\n");
+      DPRINTF(E_LOG, L_DB, "Out of memory for database writer connection\n");
+
       return -1;
     }
 
-  if (!query)
+  memset(writer_hdl, 0, sizeof(struct db_pool_hdl));
+
+  writer_hdl->hdl = db_conn_open(0);
+  if (!writer_hdl->hdl)
+    goto fail;
+
+  /* Persistent, but we want to be sure about existing databases */
+  ret = sqlite3_exec(writer_hdl->hdl, "PRAGMA journal_mode = WAL;", NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      DPRINTF(E_LOG, L_DB, "Could not switch database to WAL mode: %s\n", errmsg);
 
-      return -1;
+      sqlite3_free(errmsg);
+      goto fail_close;
     }
 
-  DPRINTF(E_DBG, L_DB, "Starting enum '%s'\n", query);
-
-  ret = db_blocking_prepare_v2(query, -1, &we->stmt, NULL);
+  /* Durable as of the last checkpoint; a crash can only lose the latest commits */
+  ret = sqlite3_exec(writer_hdl->hdl, "PRAGMA synchronous = NORMAL;", NULL, NULL, &errmsg);
   if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(pool_hdl->hdl));
+      DPRINTF(E_LOG, L_DB, "Could not set synchronous mode: %s\n", errmsg);
 
-      sqlite3_free(query);
-      return -1;
+      sqlite3_free(errmsg);
+      goto fail_close;
     }
 
-  sqlite3_free(query);
+  writer_gets = 0;
+  writer_wait_usec = 0;
+  writer_wait_max_usec = 0;
 
   return 0;
 
-#undef Q_MATCH_TMPL
-#undef Q_COOKIE_TMPL
+ fail_close:
+  db_conn_close(writer_hdl->hdl);
+ fail:
+  free(writer_hdl);
+  writer_hdl = NULL;
+
+  return -1;
 }
 
-void
-db_watch_enum_end(struct watch_enum *we)
+static void
+db_writer_deinit(void)
 {
-  if (!we->stmt)
+  if (!writer_hdl)
     return;
 
-  sqlite3_finalize(we->stmt);
-  we->stmt = NULL;
+  db_stmt_cache_clear(writer_hdl);
+  db_conn_close(writer_hdl->hdl);
+
+  free(writer_hdl);
+  writer_hdl = NULL;
 }
 
-int
-db_watch_enum_fetchwd(struct watch_enum *we, uint32_t *wd)
+/* Takes the writer connection without starting the batch transaction;
+ * returns 1 if it was held already, released by db_writer_release()
+ */
+static int
+db_writer_lock(void)
 {
-  int ret;
+  uint64_t start;
+  uint64_t wait;
 
-  *wd = 0;
-
-  if (!we->stmt)
+  if (writer_held)
     {
-      DPRINTF(E_LOG, L_DB, "Watch enum not started!\n");
-      return -1;
+      writer_held++;
+      return 1;
     }
 
-  ret = db_blocking_step(we->stmt);
-  if (ret == SQLITE_DONE)
-    {
-      DPRINTF(E_INFO, L_DB, "End of watch enum results\n");
-      return 0;
-    }
-  else if (ret != SQLITE_ROW)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
-      return -1;
-    }
+  start = db_time_usec();
 
-  *wd = (uint32_t)sqlite3_column_int(we->stmt, 0);
+  pthread_mutex_lock(&writer_lck);
+
+  wait = db_time_usec() - start;
+
+  pthread_mutex_lock(&writer_stats_lck);
+
+  writer_gets++;
+  writer_wait_usec += wait;
+  if (wait > writer_wait_max_usec)
+    writer_wait_max_usec = wait;
+
+  pthread_mutex_unlock(&writer_stats_lck);
+
+  writer_held = 1;
+
+  writer_hdl->saved = pool_hdl;
+  pool_hdl = writer_hdl;
 
   return 0;
 }
 
-
-#ifdef DB_PROFILE
-static void
-db_xprofile(void *notused, const char *pquery, sqlite3_uint64 ptime)
+void
+db_writer_get(void)
 {
-  sqlite3_stmt *stmt;
-  char *query;
+  char *errmsg;
   int ret;
 
-  DPRINTF(E_DBG, L_DBPERF, "SQL PROFILE query: %s\n", pquery);
-  DPRINTF(E_DBG, L_DBPERF, "SQL PROFILE time: %" PRIu64 " ms\n", ((uint64_t)ptime / 1000000));
-
-  if ((strncmp(pquery, "SELECT", 6) != 0)
-       && (strncmp(pquery, "UPDATE", 6) != 0)
-       && (strncmp(pquery, "DELETE", 6) != 0))
-      return;
-
-  /* Disable profiling callback */
-  sqlite3_profile(pool_hdl->hdl, NULL, NULL);
+  if (db_writer_lock())
+    return;
 
-  query = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", pquery);
-  if (!query)
+  if (batch_active && !batch_txn)
     {
-      DPRINTF(E_DBG, L_DBPERF, "Query plan: Out of memory\n");
+      ret = db_exec("BEGIN TRANSACTION;", &errmsg);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_DB, "Could not begin batched writes: %s\n", errmsg);
 
-      goto out;
+	  sqlite3_free(errmsg);
+	}
+      else
+	batch_txn = 1;
     }
+}
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-  sqlite3_free(query);
-  if (ret != SQLITE_OK)
+void
+db_writer_release(void)
+{
+  if (writer_held > 1)
     {
-      DPRINTF(E_DBG, L_DBPERF, "Query plan: Could not prepare statement: %s\n", sqlite3_errmsg(pool_hdl->hdl));
-
-      goto out;
+      writer_held--;
+      return;
     }
 
-  DPRINTF(E_DBG, L_DBPERF, "Query plan:\n");
-
-  while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
+  if (batch_txn)
     {
-      DPRINTF(E_DBG, L_DBPERF, "(%d,%d,%d) %s\n",
-	      sqlite3_column_int(stmt, 0), sqlite3_column_int(stmt, 1), sqlite3_column_int(stmt, 2),
-	      sqlite3_column_text(stmt, 3));
+      batch_ops++;
+      if (batch_ops >= DB_BATCH_MAX_OPS)
+	db_batch_commit();
     }
+  else if (lib_changed)
+    db_revision_bump();
 
-  if (ret != SQLITE_DONE)
-    DPRINTF(E_DBG, L_DBPERF, "Query plan: Could not step: %s\n", sqlite3_errmsg(pool_hdl->hdl));
-
-  DPRINTF(E_DBG, L_DBPERF, "---\n");
-
-  sqlite3_finalize(stmt);
+  pool_hdl = writer_hdl->saved;
+  writer_held = 0;
 
- out:
-  /* Reenable profiling callback */
-  sqlite3_profile(pool_hdl->hdl, db_xprofile, NULL);
+  pthread_mutex_unlock(&writer_lck);
 }
-#endif
 
 
-/* Database connections */
-static sqlite3 *
-db_conn_open(void)
+/* Batched writes
+ * While a batch is running, the writer connection keeps a transaction
+ * open; it is committed every DB_BATCH_MAX_OPS writes or
+ * DB_BATCH_MAX_MSEC milliseconds, whichever comes first.
+ */
+
+/* Call with the writer connection held */
+static void
+db_batch_commit(void)
 {
-  sqlite3 *conn;
   char *errmsg;
   int ret;
 
-  ret = sqlite3_open(db_path, &conn);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not open database: %s\n", sqlite3_errmsg(conn));
-
-      goto fail;
-    }
+  if (!batch_txn)
+    return;
 
-  ret = sqlite3_enable_load_extension(conn, 1);
+  ret = db_exec("COMMIT TRANSACTION;", &errmsg);
   if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Could not enable extension loading\n");
+      DPRINTF(E_LOG, L_DB, "Could not commit batched writes: %s\n", errmsg);
 
-      goto fail;
-    }
+      sqlite3_free(errmsg);
 
-  errmsg = NULL;
-  ret = sqlite3_load_extension(conn, PKGLIBDIR "/forked-daapd-sqlext.so", NULL, &errmsg);
-  if (ret != SQLITE_OK)
-    {
-      if (errmsg)
+      ret = db_exec("ROLLBACK TRANSACTION;", &errmsg);
+      if (ret != SQLITE_OK)
 	{
-	  DPRINTF(E_LOG, L_DB, "Could not load SQLite extension: %s\n", errmsg);
+	  DPRINTF(E_LOG, L_DB, "Could not roll back batched writes: %s\n", errmsg);
+
 	  sqlite3_free(errmsg);
 	}
-      else
-	DPRINTF(E_LOG, L_DB, "Could not load SQLite extension: %s\n", sqlite3_errmsg(conn));
+    }
+  else
+    DPRINTF(E_DBG, L_DB, "Committed batch of %d writes\n", batch_ops);
 
-      goto fail;
+  batch_txn = 0;
+  batch_ops = 0;
+
+  if (lib_changed)
+    db_revision_bump();
+}
+
+static void
+db_batch_timer_cb(void *arg)
+{
+  db_batch_flush();
+}
+
+int
+db_batch_start(void)
+{
+  db_writer_get();
+
+  if (batch_active)
+    {
+      db_writer_release();
+      return 0;
     }
 
-  ret = sqlite3_enable_load_extension(conn, 0);
-  if (ret != SQLITE_OK)
+  batch_timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0));
+  if (!batch_timer)
     {
-      DPRINTF(E_LOG, L_DB, "Could not disable extension loading\n");
+      DPRINTF(E_LOG, L_DB, "Could not create timer for batched writes\n");
 
-      goto fail;
+      db_writer_release();
+      return -1;
     }
 
-#ifdef DB_PROFILE
-  sqlite3_profile(conn, db_xprofile, NULL);
-#endif
+  dispatch_source_set_timer(batch_timer,
+			    dispatch_time(DISPATCH_TIME_NOW, DB_BATCH_MAX_MSEC * NSEC_PER_MSEC),
+			    DB_BATCH_MAX_MSEC * NSEC_PER_MSEC, 100 * NSEC_PER_MSEC);
+  dispatch_source_set_event_handler_f(batch_timer, db_batch_timer_cb);
+  dispatch_resume(batch_timer);
 
-  return conn;
+  pthread_mutex_lock(&count_cache_lck);
+  batch_active = 1;
+  pthread_mutex_unlock(&count_cache_lck);
 
- fail:
-  sqlite3_close(conn);
+  batch_txn = 0;
+  batch_ops = 0;
 
-  return NULL;
+  db_writer_release();
+
+  DPRINTF(E_DBG, L_DB, "Batched writes started\n");
+
+  return 0;
 }
 
-static void
-db_conn_close(sqlite3 *conn)
+void
+db_batch_flush(void)
 {
-  sqlite3_stmt *stmt;
+  /* Not db_writer_get(), that would open a transaction only to commit it */
+  db_writer_lock();
 
-  /* Tear down anything that's in flight */
-  while ((stmt = sqlite3_next_stmt(conn, 0)))
-    sqlite3_finalize(stmt);
+  db_batch_commit();
 
-  sqlite3_close(conn);
+  db_writer_release();
 }
 
-
-/* Database connection pool */
-static int
-db_pool_open(void)
+void
+db_batch_end(void)
 {
-  struct db_pool_hdl *ph;
+  db_writer_get();
 
-  ph = (struct db_pool_hdl *)malloc(sizeof(struct db_pool_hdl));
-  if (!ph)
+  if (!batch_active)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for database connection pool\n");
-
-      return -1;
+      db_writer_release();
+      return;
     }
 
-  memset(ph, 0, sizeof(struct db_pool_hdl));
+  dispatch_source_cancel(batch_timer);
+  dispatch_release(batch_timer);
+  batch_timer = NULL;
 
-  ph->hdl = db_conn_open();
-  if (!ph->hdl)
-    {
-      free(ph);
-      return -1;
-    }
+  pthread_mutex_lock(&count_cache_lck);
+  batch_active = 0;
+  pthread_mutex_unlock(&count_cache_lck);
 
-  pool_size++;
+  db_batch_commit();
 
-  ph->next = pool_free;
-  pool_free = ph;
+  db_writer_release();
 
-  return 0;
+  DPRINTF(E_DBG, L_DB, "Batched writes ended\n");
 }
 
-static void
-db_pool_close(struct db_pool_hdl *ph)
-{
-  pool_size--;
 
-  db_conn_close(ph->hdl);
-  free(ph);
-}
+/* Write-behind queue
+ * Play counts, pings and speaker states are queued without touching the
+ * database and written together every DB_WB_FLUSH_MSEC milliseconds, so
+ * streaming and playback never wait for the writer. Writes to the same
+ * row are merged while queued.
+ */
 
-static void
-db_pool_reclaim(void *arg)
+/* Call with wb_lck held */
+static struct db_wb_entry *
+db_wb_lookup(enum db_wb_type type, uint64_t id, int create)
 {
-  struct db_pool_hdl *ph;
-  struct db_pool_hdl *ph_prev;
-  time_t threshold;
-  int reclaimed;
+  struct db_wb_entry *e;
+  int b;
 
-  DPRINTF(E_DBG, L_DB, "DB pool status: size %d free %d\n", pool_size, pool_free_size);
+  b = (id * 31 + type) % DB_WB_NBUCKETS;
 
-  if (pool_free_size <= DB_POOL_MIN_FREE)
-    return;
+  for (e = wb_buckets[b]; e; e = e->next)
+    {
+      if ((e->type == type) && (e->id == id))
+	return e;
+    }
 
-  threshold = time(NULL) - DB_POOL_MAX_AGE;
-  reclaimed = 0;
+  if (!create)
+    return NULL;
 
-  ph_prev = NULL;
-  for (ph = pool_free; ph && (pool_free_size > DB_POOL_MIN_FREE); /* EMPTY */)
+  e = (struct db_wb_entry *)malloc(sizeof(struct db_wb_entry));
+  if (!e)
     {
-      if (ph->last <= threshold)
-	{
-	  if (ph_prev)
-	    ph_prev->next = ph->next;
-	  else
-	    pool_free = ph->next;
+      DPRINTF(E_LOG, L_DB, "Out of memory for write-behind entry\n");
+      return NULL;
+    }
 
-	  db_pool_close(ph);
+  memset(e, 0, sizeof(struct db_wb_entry));
+  e->type = type;
+  e->id = id;
 
-	  reclaimed++;
-	  pool_free_size--;
+  e->next = wb_buckets[b];
+  wb_buckets[b] = e;
 
-	  if (ph_prev)
-	    ph = ph_prev->next;
-	  else
-	    ph = pool_free;
-	}
-      else
-	{
-	  ph_prev = ph;
-	  ph = ph->next;
-	}
-    }
+  wb_pending++;
 
-  DPRINTF(E_DBG, L_DB, "DB pool status: reclaimed %d size %d free %d\n", reclaimed, pool_size, pool_free_size);
+  return e;
 }
 
 static void
-db_pool_get_task(void *arg)
+db_wb_flush_task(void *arg)
 {
-  struct db_pool_hdl *ph;
-  struct db_pool_hdl **my_pool_hdl;
-  int ret;
+  int shutdown;
 
-  my_pool_hdl = (struct db_pool_hdl **)arg;
+  pthread_mutex_lock(&wb_flush_lck);
 
-  if (!pool_free)
-    {
-      ret = db_pool_open();
-      if (ret < 0)
-	{
-	  DPRINTF(E_LOG, L_DB, "Could not open a new database connection; no free connections available\n");
+  pthread_mutex_lock(&wb_lck);
+  wb_flush_pending = 0;
+  shutdown = wb_shutdown;
+  pthread_mutex_unlock(&wb_lck);
 
-	  return;
-	}
+  /* The writer connection may be gone already */
+  if (!shutdown)
+    db_wb_flush();
+
+  pthread_mutex_unlock(&wb_flush_lck);
+}
+
+/* Call with wb_lck held */
+static void
+db_wb_schedule(void)
+{
+  if (wb_shutdown)
+    return;
+
+  /* A full queue is written right away, still off the caller's queue */
+  if (wb_pending == DB_WB_MAX_PENDING)
+    {
+      dispatch_async_f(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0), NULL, db_wb_flush_task);
+      return;
     }
-  else
-    pool_free_size--;
 
-  /* Remove from free list */
-  ph = pool_free;
-  pool_free = ph->next;
+  if (wb_flush_pending)
+    return;
 
-  /* Add to used list */
-  ph->next = pool_used;
-  pool_used = ph;
+  wb_flush_pending = 1;
 
-  ph->saved = *my_pool_hdl;
-  *my_pool_hdl = ph;
+  dispatch_after_f(dispatch_time(DISPATCH_TIME_NOW, DB_WB_FLUSH_MSEC * NSEC_PER_MSEC),
+		   dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0), NULL, db_wb_flush_task);
 }
 
-int
-db_pool_get(void)
+/* Call with the writer connection held; a ping that re-enables a file or
+ * playlist changes the library, a plain ping doesn't. Returns 1 if the
+ * ping was written that way.
+ */
+static int
+db_wb_enable(const char *query, struct db_wb_entry *e)
 {
-  struct db_pool_hdl *my_pool_hdl;
+  sqlite3_stmt *stmt;
+  char *errmsg;
+  int ret;
 
-  my_pool_hdl = pool_hdl;
+  stmt = db_stmt_get(query);
+  if (!stmt)
+    return -1;
 
-  dispatch_sync_f(dbpool_sq, &my_pool_hdl, db_pool_get_task);
+  sqlite3_bind_int64(stmt, 1, e->stamp);
+  sqlite3_bind_int(stmt, 2, (int)e->id);
 
-  /* Failed to get a new pool_hdl */
-  if (my_pool_hdl == pool_hdl)
-    return -1;
+  ret = db_stmt_exec(stmt, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Error writing queued update (type %d, id %" PRIu64 "): %s\n", e->type, e->id, errmsg);
 
-  /* Set thread-local database handle */
-  pool_hdl = my_pool_hdl;
+      sqlite3_free(errmsg);
+      return -1;
+    }
 
-  return 0;
+  if (sqlite3_changes(pool_hdl->hdl) == 0)
+    return 0;
+
+  db_lib_changed(1);
+
+  return 1;
 }
 
+/* Call with the writer connection held */
 static void
-db_pool_release_task(void *arg)
+db_wb_exec(struct db_wb_entry *e)
 {
-  struct db_pool_hdl *ph;
-  struct db_pool_hdl *ph_prev;
-  struct db_pool_hdl *my_pool_hdl;
+#define Q_PLAYCOUNT "UPDATE files SET play_count = play_count + ?, time_played = ? WHERE id = ?;"
+#define Q_FILE_ENABLE "UPDATE files SET db_timestamp = ?, disabled = 0 WHERE id = ? AND disabled <> 0;"
+#define Q_FILE_PING "UPDATE files SET db_timestamp = ? WHERE id = ?;"
+#define Q_PL_ENABLE "UPDATE playlists SET db_timestamp = ?, disabled = 0 WHERE id = ? AND disabled <> 0;"
+#define Q_PL_PING "UPDATE playlists SET db_timestamp = ? WHERE id = ?;"
+#define Q_SPEAKER "INSERT OR REPLACE INTO speakers (id, selected, volume) VALUES (?, ?, ?);"
+  sqlite3_stmt *stmt;
+  char *errmsg;
+  int ret;
 
-  my_pool_hdl = (struct db_pool_hdl *)arg;
+  switch (e->type)
+    {
+      case DB_WB_PLAYCOUNT:
+	stmt = db_stmt_get(Q_PLAYCOUNT);
+	if (!stmt)
+	  return;
 
-  ph_prev = NULL;
+	sqlite3_bind_int(stmt, 1, e->count);
+	sqlite3_bind_int64(stmt, 2, e->stamp);
+	sqlite3_bind_int(stmt, 3, (int)e->id);
+	break;
 
-  for (ph = pool_used; ph; ph = ph->next)
-    {
-      if (ph == my_pool_hdl)
+      case DB_WB_FILE_PING:
+	ret = db_wb_enable(Q_FILE_ENABLE, e);
+	if (ret != 0)
+	  return;
+
+	stmt = db_stmt_get(Q_FILE_PING);
+	if (!stmt)
+	  return;
+
+	sqlite3_bind_int64(stmt, 1, e->stamp);
+	sqlite3_bind_int(stmt, 2, (int)e->id);
 	break;
 
-      ph_prev = ph;
-    }
+      case DB_WB_PL_PING:
+	ret = db_wb_enable(Q_PL_ENABLE, e);
+	if (ret != 0)
+	  return;
 
-  if (!ph)
-    return;
+	stmt = db_stmt_get(Q_PL_PING);
+	if (!stmt)
+	  return;
 
-  /* Remove from used list */
-  if (!ph_prev)
-    pool_used = ph->next;
-  else
-    ph_prev->next = ph->next;
+	sqlite3_bind_int64(stmt, 1, e->stamp);
+	sqlite3_bind_int(stmt, 2, (int)e->id);
+	break;
 
-  /* Add to free list */
-  ph->next = pool_free;
-  pool_free = ph;
+      case DB_WB_SPEAKER:
+	stmt = db_stmt_get(Q_SPEAKER);
+	if (!stmt)
+	  return;
 
-  ph->last = time(NULL);
-  pool_free_size++;
-}
+	sqlite3_bind_int64(stmt, 1, e->id);
+	sqlite3_bind_int(stmt, 2, e->selected);
+	sqlite3_bind_int(stmt, 3, e->volume);
+	break;
 
-void
-db_pool_release(void)
-{
-  struct db_pool_hdl *my_pool_hdl;
+      default:
+	return;
+    }
 
-  /* Copy thread-local database handle */
-  my_pool_hdl = pool_hdl;
+  ret = db_stmt_exec(stmt, &errmsg);
+  if (ret != SQLITE_OK)
+    DPRINTF(E_LOG, L_DB, "Error writing queued update (type %d, id %" PRIu64 "): %s\n", e->type, e->id, errmsg);
 
-  /* Restore thread-local database handle to previous value */
-  pool_hdl = my_pool_hdl->saved;
+  sqlite3_free(errmsg);
 
-  dispatch_async_f(dbpool_sq, my_pool_hdl, db_pool_release_task);
+#undef Q_PLAYCOUNT
+#undef Q_FILE_ENABLE
+#undef Q_FILE_PING
+#undef Q_PL_ENABLE
+#undef Q_PL_PING
+#undef Q_SPEAKER
 }
 
-static int
-db_pool_init(void)
+/* Writes out the queue; also called before writes that must not be
+ * overtaken by queued ones, e.g. disabling a file that was just pinged
+ */
+static void
+db_wb_flush(void)
 {
-  time_t now;
+  struct db_wb_entry *list;
+  struct db_wb_entry *e;
+  char *errmsg;
+  int txn;
+  int n;
+  int i;
   int ret;
 
-  pool_size = 0;
-  pool_free_size = 0;
-  pool_free = 0;
-  pool_used = 0;
+  db_writer_get();
 
-  dbpool_sq = dispatch_queue_create("org.forked-daapd.db-pool", NULL);
-  if (!dbpool_sq)
+  pthread_mutex_lock(&wb_lck);
+
+  if (wb_pending == 0)
     {
-      DPRINTF(E_LOG, L_DB, "Could not create dispatch queue for database pool\n");
+      pthread_mutex_unlock(&wb_lck);
+      db_writer_release();
+      return;
+    }
 
-      return -1;
+  list = NULL;
+  for (i = 0; i < DB_WB_NBUCKETS; i++)
+    {
+      while ((e = wb_buckets[i]))
+	{
+	  wb_buckets[i] = e->next;
+	  e->next = list;
+	  list = e;
+	}
     }
 
-  now = time(NULL);
+  n = wb_pending;
+  wb_pending = 0;
+
+  pthread_mutex_unlock(&wb_lck);
 
-  for (pool_size = 0; pool_size < DB_POOL_MIN_SIZE; pool_free_size++)
+  /* During a batch the writes just join the batch transaction */
+  txn = 0;
+  if (!batch_txn)
     {
-      ret = db_pool_open();
-      if (ret < 0)
-	return -1;
+      ret = db_exec("BEGIN TRANSACTION;", &errmsg);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_DB, "Could not begin queued writes: %s\n", errmsg);
 
-      pool_free->last = now;
+	  sqlite3_free(errmsg);
+	}
+      else
+	txn = 1;
     }
 
-  pool_reclaim_timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dbpool_sq);
-  if (!pool_reclaim_timer)
+  while (list)
     {
-      DPRINTF(E_LOG, L_DB, "Could not create timer for database pool reclaim\n");
+      e = list;
+      list = e->next;
 
-      return -1;
-    }
+      db_wb_exec(e);
 
-  dispatch_source_set_timer(pool_reclaim_timer,
-			    dispatch_time(DISPATCH_TIME_NOW, DB_POOL_MAX_AGE_NSEC),
-			    DB_POOL_MAX_AGE_NSEC, 30 * NSEC_PER_SEC);
-  dispatch_source_set_event_handler_f(pool_reclaim_timer, db_pool_reclaim);
-  dispatch_resume(pool_reclaim_timer);
+      free(e);
+    }
 
-  return 0;
-}
+  if (txn)
+    {
+      ret = db_exec("COMMIT TRANSACTION;", &errmsg);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_DB, "Could not commit queued writes: %s\n", errmsg);
 
-static void
-db_pool_deinit(void)
-{
-  struct db_pool_hdl *ph;
+	  sqlite3_free(errmsg);
 
-  dispatch_source_cancel(pool_reclaim_timer);
-  dispatch_release(pool_reclaim_timer);
+	  ret = db_exec("ROLLBACK TRANSACTION;", &errmsg);
+	  if (ret != SQLITE_OK)
+	    {
+	      DPRINTF(E_LOG, L_DB, "Could not roll back queued writes: %s\n", errmsg);
 
-  dispatch_sync(dbpool_sq,
-		^{
-		  /* Nothing to do, just resynching with the queue */
-		});
+	      sqlite3_free(errmsg);
+	    }
+	}
+    }
 
-  dispatch_release(dbpool_sq);
+  db_writer_release();
 
-  if (pool_used)
-    DPRINTF(E_LOG, L_DB, "db_pool_deinit: some connections are still in use!\n");
+  DPRINTF(E_DBG, L_DB, "Wrote %d queued updates\n", n);
+}
 
-  for (ph = pool_free; pool_free; ph = pool_free)
-    {
-      pool_free = ph->next;
+static void
+db_wb_init(void)
+{
+  pthread_mutex_lock(&wb_lck);
+  wb_shutdown = 0;
+  pthread_mutex_unlock(&wb_lck);
+}
 
-      db_conn_close(ph->hdl);
-      free(ph);
-    }
+static void
+db_wb_deinit(void)
+{
+  pthread_mutex_lock(&wb_lck);
+  wb_shutdown = 1;
+  pthread_mutex_unlock(&wb_lck);
+
+  /* Wait for a flush in progress; flushes still pending won't run */
+  pthread_mutex_lock(&wb_flush_lck);
+  db_wb_flush();
+  pthread_mutex_unlock(&wb_flush_lck);
 }
 
 
@@ -4150,7 +8012,7 @@ db_perthread_init(void)
 
   memset(pool_hdl, 0, sizeof(struct db_pool_hdl));
 
-  pool_hdl->hdl = db_conn_open();
+  pool_hdl->hdl = db_conn_open(0);
   if (!pool_hdl->hdl)
     {
       free(pool_hdl);
@@ -4168,6 +8030,7 @@ db_perthread_deinit(void)
   if (!pool_hdl)
     return;
 
+  db_stmt_cache_clear(pool_hdl);
   db_conn_close(pool_hdl->hdl);
 
   free(pool_hdl);
@@ -4236,7 +8099,11 @@ db_perthread_deinit(void)
   "   artist_sort        VARCHAR(1024) DEFAULT NULL COLLATE DAAP,"	\
   "   album_sort         VARCHAR(1024) DEFAULT NULL COLLATE DAAP,"	\
   "   composer_sort      VARCHAR(1024) DEFAULT NULL COLLATE DAAP,"	\
-  "   album_artist_sort  VARCHAR(1024) DEFAULT NULL COLLATE DAAP"	\
+  "   album_artist_sort  VARCHAR(1024) DEFAULT NULL COLLATE DAAP,"	\
+  "   title_sortkey      BLOB NOT NULL DEFAULT x'00',"		\
+  "   artist_sortkey     BLOB NOT NULL DEFAULT x'00',"		\
+  "   album_sortkey      BLOB NOT NULL DEFAULT x'00',"		\
+  "   title_sort_bucket  INTEGER DEFAULT 0"		\
   ");"
 
 #define T_PL					\
@@ -4256,7 +8123,8 @@ db_perthread_deinit(void)
   "CREATE TABLE IF NOT EXISTS playlistitems ("		\
   "   id             INTEGER PRIMARY KEY NOT NULL,"	\
   "   playlistid     INTEGER NOT NULL,"			\
-  "   filepath       VARCHAR(4096) NOT NULL"		\
+  "   fileid         INTEGER NOT NULL DEFAULT 0,"	\
+  "   filepath       VARCHAR(4096) DEFAULT NULL"	\
   ");"
 
 #define T_GROUPS							\
@@ -4265,9 +8133,34 @@ db_perthread_deinit(void)
   "   type           INTEGER NOT NULL,"					\
   "   name           VARCHAR(1024) NOT NULL COLLATE DAAP,"		\
   "   persistentid   INTEGER NOT NULL,"					\
+  "   items          INTEGER DEFAULT 0,"				\
+  "   album_artist   VARCHAR(1024) DEFAULT NULL COLLATE DAAP,"		\
+  "   itemid         INTEGER DEFAULT 0,"				\
   "CONSTRAINT groups_type_unique_persistentid UNIQUE (type, persistentid)" \
   ");"
 
+#define T_SMARTPLITEMS				\
+  "CREATE TABLE IF NOT EXISTS smartplitems ("		\
+  "   playlistid     INTEGER NOT NULL,"			\
+  "   fileid         INTEGER NOT NULL"			\
+  ");"
+
+/* Case folded trigrams, for LIKE matches anywhere in a string */
+#define T_FILES_FTS							\
+  "CREATE VIRTUAL TABLE files_fts USING fts5("				\
+  "   title, artist, album, album_artist, composer, genre,"		\
+  "   tokenize = 'trigram'"						\
+  ");"
+
+#define T_BROWSE							\
+  "CREATE TABLE IF NOT EXISTS browse ("					\
+  "   type           INTEGER NOT NULL,"					\
+  "   value          VARCHAR(1024) NOT NULL COLLATE DAAP,"		\
+  "   sort_value     VARCHAR(1024) NOT NULL COLLATE DAAP,"		\
+  "   items          INTEGER NOT NULL,"					\
+  "CONSTRAINT browse_type_unique_value UNIQUE (type, value)"		\
+  ");"
+
 #define T_PAIRINGS					\
   "CREATE TABLE IF NOT EXISTS pairings("		\
   "   remote         VARCHAR(64) PRIMARY KEY NOT NULL,"	\
@@ -4313,6 +8206,16 @@ db_perthread_deinit(void)
 #define I_ALBUM					\
   "CREATE INDEX IF NOT EXISTS idx_album ON files(album, album_sort);"
 
+/* daap_sortkey() keys compare bytewise like the DAAP collation */
+#define I_TITLESORTKEY				\
+  "CREATE INDEX IF NOT EXISTS idx_title_sortkey ON files(title_sortkey, id);"
+
+#define I_ARTISTSORTKEY				\
+  "CREATE INDEX IF NOT EXISTS idx_artist_sortkey ON files(artist_sortkey, id);"
+
+#define I_ALBUMSORTKEY				\
+  "CREATE INDEX IF NOT EXISTS idx_album_sortkey ON files(album_sortkey, disc, track, id);"
+
 #define I_PL_PATH				\
   "CREATE INDEX IF NOT EXISTS idx_pl_path ON playlists(path);"
 
@@ -4323,11 +8226,20 @@ db_perthread_deinit(void)
   "CREATE INDEX IF NOT EXISTS idx_filepath ON playlistitems(filepath ASC);"
 
 #define I_PLITEMID							\
-  "CREATE INDEX IF NOT EXISTS idx_playlistid ON playlistitems(playlistid, filepath);"
+  "CREATE INDEX IF NOT EXISTS idx_playlistid ON playlistitems(playlistid, fileid);"
+
+#define I_PLITEMFILEID							\
+  "CREATE INDEX IF NOT EXISTS idx_plitem_fileid ON playlistitems(fileid);"
+
+#define I_SMARTPLITEMID							\
+  "CREATE INDEX IF NOT EXISTS idx_smartplid ON smartplitems(playlistid, fileid);"
 
 #define I_GRP_TYPE_PERSIST				\
   "CREATE INDEX IF NOT EXISTS idx_grp_type_persist ON groups(type, persistentid);"
 
+#define I_BROWSE_SORT				\
+  "CREATE INDEX IF NOT EXISTS idx_browse_sort ON browse(type, sort_value);"
+
 #define I_PAIRING				\
   "CREATE INDEX IF NOT EXISTS idx_pairingguid ON pairings(guid);"
 
@@ -4344,6 +8256,143 @@ db_perthread_deinit(void)
   "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (1, NEW.album, NEW.songalbumid);" \
   " END;"
 
+/* Album group summary: item count, album artist and a representative
+ * item for the enabled files of each album group
+ */
+#define GROUPS_NEW							\
+  "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (1, NEW.album, NEW.songalbumid);" \
+  "   UPDATE groups SET items = items + 1, album_artist = NEW.album_artist," \
+  "     itemid = CASE WHEN itemid = 0 THEN NEW.id ELSE itemid END"	\
+  "     WHERE NEW.disabled = 0 AND type = 1 AND persistentid = NEW.songalbumid;"
+
+#define GROUPS_OLD							\
+  "   UPDATE groups SET items = items - 1,"				\
+  "     itemid = CASE WHEN itemid = OLD.id THEN IFNULL((SELECT f.id FROM files f" \
+  "       WHERE f.songalbumid = OLD.songalbumid AND f.disabled = 0 LIMIT 1), 0) ELSE itemid END" \
+  "     WHERE OLD.disabled = 0 AND type = 1 AND persistentid = OLD.songalbumid;"
+
+#define TRG_GROUPS_COUNT_INSERT_FILES					\
+  "CREATE TRIGGER update_groups_count_new_file AFTER INSERT ON files FOR EACH ROW" \
+  " BEGIN"								\
+  GROUPS_NEW								\
+  " END;"
+
+#define TRG_GROUPS_COUNT_UPDATE_FILES					\
+  "CREATE TRIGGER update_groups_count_update_file AFTER UPDATE OF songalbumid, disabled ON files FOR EACH ROW" \
+  " WHEN OLD.songalbumid != NEW.songalbumid OR OLD.disabled != NEW.disabled" \
+  " BEGIN"								\
+  GROUPS_OLD								\
+  GROUPS_NEW								\
+  " END;"
+
+#define TRG_GROUPS_COUNT_DELETE_FILES					\
+  "CREATE TRIGGER update_groups_count_delete_file AFTER DELETE ON files FOR EACH ROW" \
+  " BEGIN"								\
+  GROUPS_OLD								\
+  " END;"
+
+/* Browse table maintenance: a file counts towards the browse values of
+ * its artist, album, genre and composer while it is an enabled local file
+ */
+#define BROWSE_NEW(type, field, sort)					\
+  "   INSERT OR IGNORE INTO browse (type, value, sort_value, items)"	\
+  "     SELECT " type ", NEW." field ", COALESCE(NEW." sort ", NEW." field "), 0" \
+  "     WHERE NEW.data_kind = 0 AND NEW.disabled = 0 AND NEW." field " != '';" \
+  "   UPDATE browse SET items = items + 1, sort_value = COALESCE(NEW." sort ", NEW." field ")" \
+  "     WHERE NEW.data_kind = 0 AND NEW.disabled = 0 AND type = " type " AND value = NEW." field ";"
+
+#define BROWSE_OLD(type, field)						\
+  "   UPDATE browse SET items = items - 1"				\
+  "     WHERE OLD.data_kind = 0 AND OLD.disabled = 0 AND type = " type " AND value = OLD." field ";" \
+  "   DELETE FROM browse WHERE type = " type " AND value = OLD." field " AND items <= 0;"
+
+#define BROWSE_NEW_ALL							\
+  BROWSE_NEW("1", "artist", "artist_sort")				\
+  BROWSE_NEW("2", "album", "album_sort")				\
+  BROWSE_NEW("3", "genre", "genre")					\
+  BROWSE_NEW("4", "composer", "composer_sort")
+
+#define BROWSE_OLD_ALL							\
+  BROWSE_OLD("1", "artist")						\
+  BROWSE_OLD("2", "album")						\
+  BROWSE_OLD("3", "genre")						\
+  BROWSE_OLD("4", "composer")
+
+#define TRG_BROWSE_INSERT_FILES						\
+  "CREATE TRIGGER update_browse_new_file AFTER INSERT ON files FOR EACH ROW" \
+  " BEGIN"								\
+  BROWSE_NEW_ALL							\
+  " END;"
+
+#define TRG_BROWSE_UPDATE_FILES						\
+  "CREATE TRIGGER update_browse_update_file AFTER UPDATE OF"		\
+  "   artist, artist_sort, album, album_sort, genre, composer, composer_sort, data_kind, disabled" \
+  " ON files FOR EACH ROW"						\
+  " WHEN OLD.artist IS NOT NEW.artist OR OLD.artist_sort IS NOT NEW.artist_sort" \
+  "   OR OLD.album IS NOT NEW.album OR OLD.album_sort IS NOT NEW.album_sort" \
+  "   OR OLD.genre IS NOT NEW.genre"					\
+  "   OR OLD.composer IS NOT NEW.composer OR OLD.composer_sort IS NOT NEW.composer_sort" \
+  "   OR OLD.data_kind != NEW.data_kind OR OLD.disabled != NEW.disabled" \
+  " BEGIN"								\
+  BROWSE_OLD_ALL							\
+  BROWSE_NEW_ALL							\
+  " END;"
+
+#define TRG_BROWSE_DELETE_FILES						\
+  "CREATE TRIGGER update_browse_delete_file AFTER DELETE ON files FOR EACH ROW" \
+  " BEGIN"								\
+  BROWSE_OLD_ALL							\
+  " END;"
+
+/* Trigram index over the searchable columns, keyed by file id */
+#define TRG_FTS_INSERT_FILES						\
+  "CREATE TRIGGER update_fts_new_file AFTER INSERT ON files FOR EACH ROW" \
+  " BEGIN"								\
+  "   INSERT INTO files_fts (rowid, title, artist, album, album_artist, composer, genre)" \
+  "     VALUES (NEW.id, NEW.title, NEW.artist, NEW.album, NEW.album_artist, NEW.composer, NEW.genre);" \
+  " END;"
+
+#define TRG_FTS_UPDATE_FILES						\
+  "CREATE TRIGGER update_fts_update_file AFTER UPDATE OF"		\
+  "   title, artist, album, album_artist, composer, genre ON files FOR EACH ROW" \
+  " WHEN OLD.title IS NOT NEW.title OR OLD.artist IS NOT NEW.artist"	\
+  "   OR OLD.album IS NOT NEW.album OR OLD.album_artist IS NOT NEW.album_artist" \
+  "   OR OLD.composer IS NOT NEW.composer OR OLD.genre IS NOT NEW.genre" \
+  " BEGIN"								\
+  "   UPDATE files_fts SET title = NEW.title, artist = NEW.artist, album = NEW.album," \
+  "     album_artist = NEW.album_artist, composer = NEW.composer, genre = NEW.genre" \
+  "     WHERE rowid = NEW.id;"						\
+  " END;"
+
+#define TRG_FTS_DELETE_FILES						\
+  "CREATE TRIGGER update_fts_delete_file AFTER DELETE ON files FOR EACH ROW" \
+  " BEGIN"								\
+  "   DELETE FROM files_fts WHERE rowid = OLD.id;"			\
+  " END;"
+
+/* Playlist items refer to files by id; an item whose file is not in the
+ * library keeps the file path instead, and is linked when a file with
+ * that path is added or renamed into place
+ */
+#define TRG_PLITEMS_INSERT_FILES					\
+  "CREATE TRIGGER update_plitems_new_file AFTER INSERT ON files FOR EACH ROW" \
+  " BEGIN"								\
+  "   UPDATE playlistitems SET fileid = NEW.id, filepath = NULL WHERE filepath = NEW.path;" \
+  " END;"
+
+#define TRG_PLITEMS_UPDATE_FILES					\
+  "CREATE TRIGGER update_plitems_update_file AFTER UPDATE OF path, disabled ON files FOR EACH ROW" \
+  " WHEN NEW.disabled = 0 AND (OLD.path IS NOT NEW.path OR OLD.disabled <> 0)" \
+  " BEGIN"								\
+  "   UPDATE playlistitems SET fileid = NEW.id, filepath = NULL WHERE filepath = NEW.path;" \
+  " END;"
+
+#define TRG_PLITEMS_DELETE_FILES					\
+  "CREATE TRIGGER update_plitems_delete_file AFTER DELETE ON files FOR EACH ROW" \
+  " BEGIN"								\
+  "   UPDATE playlistitems SET fileid = 0, filepath = OLD.path WHERE fileid = OLD.id;" \
+  " END;"
+
 #define Q_PL1								\
   "INSERT INTO playlists (id, title, type, query, db_timestamp, path, idx, special_id)" \
   " VALUES(1, 'Library', 1, '1 = 1', 0, '', 0, 0);"
@@ -4368,9 +8417,9 @@ db_perthread_deinit(void)
   " VALUES(8, 'Purchased', 0, 'media_kind = 1024', 0, '', 0, 8);"
  */
 
-#define SCHEMA_VERSION 13
+#define SCHEMA_VERSION 20
 #define Q_SCVER					\
-  "INSERT INTO admin (key, value) VALUES ('schema_version', '13');"
+  "INSERT INTO admin (key, value) VALUES ('schema_version', '20');"
 
 struct db_init_query {
   char *query;
@@ -4383,7 +8432,10 @@ static const struct db_init_query db_init_queries[] =
     { T_FILES,     "create table files" },
     { T_PL,        "create table playlists" },
     { T_PLITEMS,   "create table playlistitems" },
+    { T_SMARTPLITEMS, "create table smartplitems" },
+    { T_FILES_FTS, "create table files_fts" },
     { T_GROUPS,    "create table groups" },
+    { T_BROWSE,    "create table browse" },
     { T_PAIRINGS,  "create table pairings" },
     { T_SPEAKERS,  "create table speakers" },
     { T_INOTIFY,   "create table inotify" },
@@ -4398,19 +8450,43 @@ static const struct db_init_query db_init_queries[] =
     { I_TITLE,     "create title index" },
     { I_ALBUM,     "create album index" },
 
+    { I_TITLESORTKEY,  "create title sort key index" },
+    { I_ARTISTSORTKEY, "create artist sort key index" },
+    { I_ALBUMSORTKEY,  "create album sort key index" },
+
     { I_PL_PATH,   "create playlist path index" },
     { I_PL_DISABLED, "create playlist state index" },
 
     { I_FILEPATH,  "create file path index" },
     { I_PLITEMID,  "create playlist id index" },
+    { I_PLITEMFILEID, "create playlist item file id index" },
+    { I_SMARTPLITEMID, "create smart playlist id index" },
 
     { I_GRP_TYPE_PERSIST, "create groups type/persistentid index" },
 
+    { I_BROWSE_SORT, "create browse type/sort_value index" },
+
     { I_PAIRING,   "create pairing guid index" },
 
     { TRG_GROUPS_INSERT_FILES,    "create trigger update_groups_new_file" },
     { TRG_GROUPS_UPDATE_FILES,    "create trigger update_groups_update_file" },
 
+    { TRG_GROUPS_COUNT_INSERT_FILES, "create trigger update_groups_count_new_file" },
+    { TRG_GROUPS_COUNT_UPDATE_FILES, "create trigger update_groups_count_update_file" },
+    { TRG_GROUPS_COUNT_DELETE_FILES, "create trigger update_groups_count_delete_file" },
+
+    { TRG_BROWSE_INSERT_FILES,    "create trigger update_browse_new_file" },
+    { TRG_BROWSE_UPDATE_FILES,    "create trigger update_browse_update_file" },
+    { TRG_BROWSE_DELETE_FILES,    "create trigger update_browse_delete_file" },
+
+    { TRG_FTS_INSERT_FILES,       "create trigger update_fts_new_file" },
+    { TRG_FTS_UPDATE_FILES,       "create trigger update_fts_update_file" },
+    { TRG_FTS_DELETE_FILES,       "create trigger update_fts_delete_file" },
+
+    { TRG_PLITEMS_INSERT_FILES,   "create trigger update_plitems_new_file" },
+    { TRG_PLITEMS_UPDATE_FILES,   "create trigger update_plitems_update_file" },
+    { TRG_PLITEMS_DELETE_FILES,   "create trigger update_plitems_delete_file" },
+
     { Q_PL1,       "create default playlist" },
     { Q_PL2,       "create default smart playlist 'Music'" },
     { Q_PL3,       "create default smart playlist 'Movies'" },
@@ -5033,6 +9109,210 @@ static const struct db_init_query db_upgrade_v13_queries[] =
     { U_V13_SCVER,    "set schema_version to 13" },
   };
 
+/* Upgrade from schema v13 to v14 */
+
+#define U_V14_BROWSE							\
+  "CREATE TABLE IF NOT EXISTS browse ("					\
+  "   type           INTEGER NOT NULL,"					\
+  "   value          VARCHAR(1024) NOT NULL COLLATE DAAP,"		\
+  "   sort_value     VARCHAR(1024) NOT NULL COLLATE DAAP,"		\
+  "   items          INTEGER NOT NULL,"					\
+  "CONSTRAINT browse_type_unique_value UNIQUE (type, value)"		\
+  ");"
+
+#define U_V14_IDX_BROWSE_SORT						\
+  "CREATE INDEX IF NOT EXISTS idx_browse_sort ON browse(type, sort_value);"
+
+#define U_V14_BROWSE_FILL(type, field, sort)				\
+  "INSERT INTO browse (type, value, sort_value, items)"			\
+  " SELECT " type ", f." field ", MIN(COALESCE(f." sort ", f." field ")), COUNT(*) FROM files f" \
+  " WHERE f.data_kind = 0 AND f.disabled = 0 AND f." field " != '' GROUP BY f." field ";"
+
+#define U_V14_SCVER				\
+  "UPDATE admin SET value = '14' WHERE key = 'schema_version';"
+
+static const struct db_init_query db_upgrade_v14_queries[] =
+  {
+    { U_V14_BROWSE,          "create table browse" },
+    { U_V14_IDX_BROWSE_SORT, "create browse type/sort_value index" },
+
+    { U_V14_BROWSE_FILL("1", "artist", "artist_sort"),     "fill browse table with artists" },
+    { U_V14_BROWSE_FILL("2", "album", "album_sort"),       "fill browse table with albums" },
+    { U_V14_BROWSE_FILL("3", "genre", "genre"),            "fill browse table with genres" },
+    { U_V14_BROWSE_FILL("4", "composer", "composer_sort"), "fill browse table with composers" },
+
+    { TRG_BROWSE_INSERT_FILES, "create trigger update_browse_new_file" },
+    { TRG_BROWSE_UPDATE_FILES, "create trigger update_browse_update_file" },
+    { TRG_BROWSE_DELETE_FILES, "create trigger update_browse_delete_file" },
+
+    { U_V14_SCVER,    "set schema_version to 14" },
+  };
+
+/* Upgrade from schema v14 to v15 */
+
+#define U_V15_GRP_ITEMS							\
+  "ALTER TABLE groups ADD COLUMN items INTEGER DEFAULT 0;"
+
+#define U_V15_GRP_ALBUMARTIST						\
+  "ALTER TABLE groups ADD COLUMN album_artist VARCHAR(1024) DEFAULT NULL COLLATE DAAP;"
+
+#define U_V15_GRP_ITEMID						\
+  "ALTER TABLE groups ADD COLUMN itemid INTEGER DEFAULT 0;"
+
+#define U_V15_SCVER				\
+  "UPDATE admin SET value = '15' WHERE key = 'schema_version';"
+
+static const struct db_init_query db_upgrade_v15_queries[] =
+  {
+    { U_V15_GRP_ITEMS,       "add column items to table groups" },
+    { U_V15_GRP_ALBUMARTIST, "add column album_artist to table groups" },
+    { U_V15_GRP_ITEMID,      "add column itemid to table groups" },
+
+    { TRG_GROUPS_COUNT_INSERT_FILES, "create trigger update_groups_count_new_file" },
+    { TRG_GROUPS_COUNT_UPDATE_FILES, "create trigger update_groups_count_update_file" },
+    { TRG_GROUPS_COUNT_DELETE_FILES, "create trigger update_groups_count_delete_file" },
+
+    { U_V15_SCVER,    "set schema_version to 15" },
+  };
+
+/* Upgrade from schema v15 to v16 */
+
+#define U_V16_SMARTPLITEMS				\
+  "CREATE TABLE IF NOT EXISTS smartplitems ("		\
+  "   playlistid     INTEGER NOT NULL,"			\
+  "   fileid         INTEGER NOT NULL"			\
+  ");"
+
+#define U_V16_IDX_SMARTPLITEMID						\
+  "CREATE INDEX IF NOT EXISTS idx_smartplid ON smartplitems(playlistid, fileid);"
+
+#define U_V16_SCVER				\
+  "UPDATE admin SET value = '16' WHERE key = 'schema_version';"
+
+static const struct db_init_query db_upgrade_v16_queries[] =
+  {
+    { U_V16_SMARTPLITEMS,      "create table smartplitems" },
+    { U_V16_IDX_SMARTPLITEMID, "create smart playlist id index" },
+
+    { U_V16_SCVER,    "set schema_version to 16" },
+  };
+
+/* Upgrade from schema v16 to v17 */
+
+#define U_V17_FILL_FTS							\
+  "INSERT INTO files_fts (rowid, title, artist, album, album_artist, composer, genre)" \
+  " SELECT id, title, artist, album, album_artist, composer, genre FROM files;"
+
+#define U_V17_SCVER				\
+  "UPDATE admin SET value = '17' WHERE key = 'schema_version';"
+
+static const struct db_init_query db_upgrade_v17_queries[] =
+  {
+    { T_FILES_FTS,     "create table files_fts" },
+    { U_V17_FILL_FTS,  "fill table files_fts" },
+
+    { TRG_FTS_INSERT_FILES, "create trigger update_fts_new_file" },
+    { TRG_FTS_UPDATE_FILES, "create trigger update_fts_update_file" },
+    { TRG_FTS_DELETE_FILES, "create trigger update_fts_delete_file" },
+
+    { U_V17_SCVER,    "set schema_version to 17" },
+  };
+
+/* Upgrade from schema v17 to v18 */
+
+#define U_V18_NEW_PLITEMS				\
+  "CREATE TABLE playlistitems_new ("			\
+  "   id             INTEGER PRIMARY KEY NOT NULL,"	\
+  "   playlistid     INTEGER NOT NULL,"			\
+  "   fileid         INTEGER NOT NULL DEFAULT 0,"	\
+  "   filepath       VARCHAR(4096) DEFAULT NULL"	\
+  ");"
+
+#define U_V18_FILL_PLITEMS						\
+  "INSERT INTO playlistitems_new (id, playlistid, fileid, filepath)"	\
+  " SELECT pi.id, pi.playlistid, IFNULL(pi.fileid, 0), CASE WHEN pi.fileid IS NULL THEN pi.filepath END" \
+  " FROM (SELECT p.id, p.playlistid, p.filepath,"			\
+  "       (SELECT f.id FROM files f WHERE f.path = p.filepath LIMIT 1) AS fileid" \
+  "       FROM playlistitems p) pi;"
+
+#define U_V18_DROP_PLITEMS			\
+  "DROP TABLE playlistitems;"
+
+#define U_V18_RENAME_PLITEMS			\
+  "ALTER TABLE playlistitems_new RENAME TO playlistitems;"
+
+#define U_V18_SCVER				\
+  "UPDATE admin SET value = '18' WHERE key = 'schema_version';"
+
+static const struct db_init_query db_upgrade_v18_queries[] =
+  {
+    { U_V18_NEW_PLITEMS,    "create new table playlistitems" },
+    { U_V18_FILL_PLITEMS,   "link playlist items to files" },
+    { U_V18_DROP_PLITEMS,   "drop old table playlistitems" },
+    { U_V18_RENAME_PLITEMS, "rename new table playlistitems" },
+
+    { I_FILEPATH,     "create file path index" },
+    { I_PLITEMID,     "create playlist id index" },
+    { I_PLITEMFILEID, "create playlist item file id index" },
+
+    { TRG_PLITEMS_INSERT_FILES, "create trigger update_plitems_new_file" },
+    { TRG_PLITEMS_UPDATE_FILES, "create trigger update_plitems_update_file" },
+    { TRG_PLITEMS_DELETE_FILES, "create trigger update_plitems_delete_file" },
+
+    { U_V18_SCVER,    "set schema_version to 18" },
+  };
+
+/* Upgrade from schema v18 to v19 */
+
+#define U_V19_TITLESORTKEY				\
+  "ALTER TABLE files ADD COLUMN title_sortkey BLOB NOT NULL DEFAULT x'00';"
+
+#define U_V19_ARTISTSORTKEY				\
+  "ALTER TABLE files ADD COLUMN artist_sortkey BLOB NOT NULL DEFAULT x'00';"
+
+#define U_V19_ALBUMSORTKEY				\
+  "ALTER TABLE files ADD COLUMN album_sortkey BLOB NOT NULL DEFAULT x'00';"
+
+#define U_V19_FILL_SORTKEYS						\
+  "UPDATE files SET title_sortkey = daap_sortkey(title_sort),"		\
+  " artist_sortkey = daap_sortkey(artist_sort), album_sortkey = daap_sortkey(album_sort);"
+
+#define U_V19_SCVER				\
+  "UPDATE admin SET value = '19' WHERE key = 'schema_version';"
+
+static const struct db_init_query db_upgrade_v19_queries[] =
+  {
+    { U_V19_TITLESORTKEY,  "alter table files add column title_sortkey" },
+    { U_V19_ARTISTSORTKEY, "alter table files add column artist_sortkey" },
+    { U_V19_ALBUMSORTKEY,  "alter table files add column album_sortkey" },
+    { U_V19_FILL_SORTKEYS, "compute sort keys" },
+
+    { I_TITLESORTKEY,  "create title sort key index" },
+    { I_ARTISTSORTKEY, "create artist sort key index" },
+    { I_ALBUMSORTKEY,  "create album sort key index" },
+
+    { U_V19_SCVER,    "set schema_version to 19" },
+  };
+
+/* Upgrade from schema v19 to v20 */
+
+#define U_V20_TITLESORTBUCKET				\
+  "ALTER TABLE files ADD COLUMN title_sort_bucket INTEGER DEFAULT 0;"
+
+#define U_V20_FILL_SORTBUCKETS				\
+  "UPDATE files SET title_sort_bucket = daap_sortbucket(title_sort);"
+
+#define U_V20_SCVER				\
+  "UPDATE admin SET value = '20' WHERE key = 'schema_version';"
+
+static const struct db_init_query db_upgrade_v20_queries[] =
+  {
+    { U_V20_TITLESORTBUCKET,  "alter table files add column title_sort_bucket" },
+    { U_V20_FILL_SORTBUCKETS, "compute title sort buckets" },
+
+    { U_V20_SCVER,    "set schema_version to 20" },
+  };
+
 static int
 db_check_version(void)
 {
@@ -5104,6 +9384,55 @@ db_check_version(void)
 	    if (ret < 0)
 	      return -1;
 
+	    /* FALLTHROUGH */
+
+	  case 13:
+	    ret = db_generic_upgrade(db_upgrade_v14_queries, sizeof(db_upgrade_v14_queries) / sizeof(db_upgrade_v14_queries[0]));
+	    if (ret < 0)
+	      return -1;
+
+	    /* FALLTHROUGH */
+
+	  case 14:
+	    ret = db_generic_upgrade(db_upgrade_v15_queries, sizeof(db_upgrade_v15_queries) / sizeof(db_upgrade_v15_queries[0]));
+	    if (ret < 0)
+	      return -1;
+
+	    /* FALLTHROUGH */
+
+	  case 15:
+	    ret = db_generic_upgrade(db_upgrade_v16_queries, sizeof(db_upgrade_v16_queries) / sizeof(db_upgrade_v16_queries[0]));
+	    if (ret < 0)
+	      return -1;
+
+	    /* FALLTHROUGH */
+
+	  case 16:
+	    ret = db_generic_upgrade(db_upgrade_v17_queries, sizeof(db_upgrade_v17_queries) / sizeof(db_upgrade_v17_queries[0]));
+	    if (ret < 0)
+	      return -1;
+
+	    /* FALLTHROUGH */
+
+	  case 17:
+	    ret = db_generic_upgrade(db_upgrade_v18_queries, sizeof(db_upgrade_v18_queries) / sizeof(db_upgrade_v18_queries[0]));
+	    if (ret < 0)
+	      return -1;
+
+	    /* FALLTHROUGH */
+
+	  case 18:
+	    ret = db_generic_upgrade(db_upgrade_v19_queries, sizeof(db_upgrade_v19_queries) / sizeof(db_upgrade_v19_queries[0]));
+	    if (ret < 0)
+	      return -1;
+
+	    /* FALLTHROUGH */
+
+	  case 19:
+	    ret = db_generic_upgrade(db_upgrade_v20_queries, sizeof(db_upgrade_v20_queries) / sizeof(db_upgrade_v20_queries[0]));
+	    if (ret < 0)
+	      return -1;
+
 	    break;
 
 	  default:
@@ -5135,6 +9464,31 @@ db_check_version(void)
 #undef Q_VACUUM
 }
 
+static int
+db_files_cols_init(void)
+{
+  char *ptr;
+  int len;
+  int i;
+
+  len = 1;
+  for (i = 0; i < (sizeof(dbmfi_cols_map) / sizeof(dbmfi_cols_map[0])); i++)
+    len += strlen(dbmfi_cols_map[i].name) + 4;
+
+  files_cols = (char *)malloc(len);
+  if (!files_cols)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for select list\n");
+      return -1;
+    }
+
+  ptr = files_cols;
+  for (i = 0; i < (sizeof(dbmfi_cols_map) / sizeof(dbmfi_cols_map[0])); i++)
+    ptr += sprintf(ptr, "%sf.%s", (i > 0) ? ", " : "", dbmfi_cols_map[i].name);
+
+  return 0;
+}
+
 
 int
 db_init(void)
@@ -5145,6 +9499,10 @@ db_init(void)
 
   db_path = cfg_getstr(cfg_getsec(cfg, "general"), "db_path");
 
+  ret = db_files_cols_init();
+  if (ret < 0)
+    return -1;
+
   ret = sqlite3_config(SQLITE_CONFIG_MULTITHREAD);
   if (ret != SQLITE_OK)
     {
@@ -5153,23 +9511,26 @@ db_init(void)
       return -1;
     }
 
-  ret = sqlite3_enable_shared_cache(1);
+  ret = sqlite3_initialize();
   if (ret != SQLITE_OK)
     {
-      DPRINTF(E_FATAL, L_DB, "Could not enable SQLite3 shared-cache mode\n");
+      DPRINTF(E_FATAL, L_DB, "SQLite3 failed to initialize\n");
       return -1;
     }
 
-  ret = sqlite3_initialize();
-  if (ret != SQLITE_OK)
+  ret = db_writer_init();
+  if (ret < 0)
     {
-      DPRINTF(E_FATAL, L_DB, "SQLite3 failed to initialize\n");
+      DPRINTF(E_FATAL, L_DB, "Could not open database writer connection\n");
       return -1;
     }
 
   ret = db_perthread_init();
   if (ret < 0)
-    return ret;
+    {
+      db_writer_deinit();
+      return ret;
+    }
 
   ret = db_check_version();
   if (ret < 0)
@@ -5177,6 +9538,7 @@ db_init(void)
       DPRINTF(E_FATAL, L_DB, "Database version check errored out, incompatible database\n");
 
       db_perthread_deinit();
+      db_writer_deinit();
       return -1;
     }
   else if (ret > 0)
@@ -5188,6 +9550,7 @@ db_init(void)
 	{
 	  DPRINTF(E_FATAL, L_DB, "Could not create tables\n");
 	  db_perthread_deinit();
+	  db_writer_deinit();
 	  return -1;
 	}
     }
@@ -5207,16 +9570,38 @@ db_init(void)
       DPRINTF(E_FATAL, L_DB, "Could not initialize database connection pool\n");
 
       db_pool_deinit();
+      db_writer_deinit();
       return -1;
     }
 
+  db_wb_init();
+  db_smartpl_init();
+  db_snapshot_init();
+
   return 0;
 }
 
 void
 db_deinit(void)
 {
+  db_wb_deinit();
+  db_snapshot_deinit();
+  db_smartpl_deinit();
+
   db_pool_deinit();
+  db_writer_deinit();
+
+  db_count_cache_clear();
+  db_cursor_clear();
+  db_profile_deinit();
+
+  free(files_cols);
+  files_cols = NULL;
+
+  /* A bulk scan that was stopped never applies its pings */
+  if (stamps)
+    db_stamp_map_free(stamps);
+  stamps = NULL;
 
   sqlite3_shutdown();
 }
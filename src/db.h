@@ -49,11 +49,34 @@ struct query_params {
 
   char *filter;
 
+  /* Skip the count query if all results are to be fetched;
+   * results is then only final once the fetch loop is done */
+  int single_pass;
+
+  /* Columns to fetch in items queries, as a set of dbmfi_col() bits;
+   * 0 fetches everything. The id is always fetched. */
+  uint64_t cols;
+
+  /* Paging session, 0 for none; pages of the same session are sorted in a
+   * total order and the next page seeks past the last row delivered
+   * instead of skipping over the rows before it */
+  int session;
+
   /* Query results, filled in by query_start */
   int results;
 
   /* Private query context, keep out */
   sqlite3_stmt *stmt;
+  int counting;
+  int ncols;
+  char *select_cols;
+  int revision;
+  int lastid;
+  int fetched;
+  struct db_snapshot *snap;
+  int snap_pos;
+  int snap_end;
+  char *snap_buf;
   char buf[32];
 };
 
@@ -135,6 +158,10 @@ struct media_file_info {
   char *album_sort;
   char *composer_sort;
   char *album_artist_sort;
+
+  /* Computed by the database: first letter of title_sort for the DAAP
+   * sort headers, upper case ASCII or 0 */
+  uint32_t title_sort_bucket;
 };
 
 #define mfi_offsetof(field) offsetof(struct media_file_info, field)
@@ -191,6 +218,7 @@ struct db_group_info {
   char *itemname;
   char *itemcount;
   char *songalbumartist;
+  char *itemid;
 };
 
 #define dbgri_offsetof(field) offsetof(struct db_group_info, field)
@@ -250,10 +278,44 @@ struct db_media_file_info {
   char *album_sort;
   char *composer_sort;
   char *album_artist_sort;
+  char *title_sort_bucket;
 };
 
 #define dbmfi_offsetof(field) offsetof(struct db_media_file_info, field)
 
+#define DBMFI_NFIELDS (sizeof(struct db_media_file_info) / sizeof(char *))
+
+/* Column set bits for query_params.cols, one per field of a uint64_t */
+#define dbmfi_col_byoffset(offset) ((uint64_t)1 << ((offset) / sizeof(char *)))
+#define dbmfi_col(field) dbmfi_col_byoffset(dbmfi_offsetof(field))
+
+/* Fails to compile once there are more fields than bits in the column set */
+typedef char dbmfi_cols_fit_in_uint64[(DBMFI_NFIELDS <= 64) ? 1 : -1];
+
+/* Typed counterpart of struct db_media_file_info, as returned by
+ * db_query_fetch_file_values(). Integer columns come in intval (isnull
+ * is set for NULL values, which read as 0), text columns in strval/len
+ * (strval is NULL for NULL values).
+ * Values are indexed by the position of the field in struct
+ * db_media_file_info; use the dbmfv_*() accessors or dbmfv_field() with
+ * a dbmfi_offsetof() offset.
+ */
+struct db_value {
+  int64_t intval;
+  const char *strval;
+  int len;
+  int isnull;
+};
+
+struct db_media_file_values {
+  struct db_value val[DBMFI_NFIELDS];
+};
+
+#define dbmfv_field(dbmfv, offset) (&(dbmfv)->val[(offset) / sizeof(char *)])
+#define dbmfv_int(dbmfv, field) (dbmfv_field(dbmfv, dbmfi_offsetof(field))->intval)
+#define dbmfv_str(dbmfv, field) (dbmfv_field(dbmfv, dbmfi_offsetof(field))->strval)
+#define dbmfv_isnull(dbmfv, field) (dbmfv_field(dbmfv, dbmfi_offsetof(field))->isnull)
+
 struct watch_info {
   int wd;
   char *path;
@@ -270,10 +332,41 @@ struct watch_enum {
   sqlite3_stmt *stmt;
 };
 
+/* Per query template, literals replaced by '?'; times in microseconds,
+ * percentiles are bucket upper bounds (powers of 2) */
+struct db_profile_stats {
+  char *query;
+
+  uint64_t calls;
+  uint64_t rows;
+  uint64_t usec;
+  uint64_t p50_usec;
+  uint64_t p99_usec;
+  uint64_t wait_usec;
+};
+
+/* Wait times in microseconds */
+struct db_pool_stats {
+  int readers;
+  int readers_free;
+  int readers_max;
+
+  uint64_t reader_gets;
+  uint64_t reader_wait_usec;
+  uint64_t reader_wait_max_usec;
+
+  uint64_t writer_gets;
+  uint64_t writer_wait_usec;
+  uint64_t writer_wait_max_usec;
+};
+
 
 char *
 db_escape_string(const char *str);
 
+char *
+db_fts_clause(const char *col, const char *term, int len, int wild_start, int wild_end);
+
 void
 free_pi(struct pairing_info *pi, int content_only);
 
@@ -303,6 +396,9 @@ db_query_end(struct query_params *qp);
 int
 db_query_fetch_file(struct query_params *qp, struct db_media_file_info *dbmfi);
 
+int
+db_query_fetch_file_values(struct query_params *qp, struct db_media_file_values *dbmfv);
+
 int
 db_query_fetch_pl(struct query_params *qp, struct db_playlist_info *dbpli);
 
@@ -346,6 +442,9 @@ db_file_id_byurl(char *url);
 void
 db_file_stamp_bypath(char *path, time_t *stamp, int *id);
 
+int
+db_file_stamps_load(void);
+
 struct media_file_info *
 db_file_fetch_byid(int id);
 
@@ -414,6 +513,9 @@ db_groups_clear(void);
 enum group_type
 db_group_type_byid(int id);
 
+int
+db_group_itemid_byid(int id);
+
 /* Remotes */
 int
 db_pairing_add(struct pairing_info *pi);
@@ -475,12 +577,50 @@ int
 db_watch_enum_fetchwd(struct watch_enum *we, uint32_t *wd);
 
 
+int
+db_revision_get(void);
+
+int
+db_snapshot_wait(void);
+
 int
 db_pool_get(void);
 
 void
 db_pool_release(void);
 
+void
+db_pool_stats_get(struct db_pool_stats *stats);
+
+void
+db_profile_set(int enable);
+
+int
+db_profile_get(struct db_profile_stats **stats, int *nstats);
+
+void
+db_profile_stats_free(struct db_profile_stats *stats, int nstats);
+
+void
+db_profile_reset(void);
+
+/* Writer connection */
+void
+db_writer_get(void);
+
+void
+db_writer_release(void);
+
+/* Batched writes */
+int
+db_batch_start(void);
+
+void
+db_batch_flush(void);
+
+void
+db_batch_end(void);
+
 
 int
 db_init(void);
@@ -0,0 +1,1090 @@
+/*
+ * Database benchmark: builds a synthetic library through the db API, then
+ * times the db_query_start() query types.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <math.h>
+
+#include <getopt.h>
+
+#include <sqlite3.h>
+
+#include "conffile.h"
+#include "logger.h"
+#include "misc.h"
+#include "db.h"
+
+
+#define BENCH_MIN_TRACKS 10000
+#define BENCH_MAX_TRACKS 1000000
+
+#define BENCH_DEFAULT_DB  "/tmp/forked-daapd-dbbench.db"
+
+/* Page size of the index range cases */
+#define BENCH_PAGE 100
+
+struct bench_rng {
+  uint64_t state;
+};
+
+/* Zipf-like popularity: weight of rank r is 1 / (r + 1)^s */
+struct bench_zipf {
+  double *cdf;
+  int n;
+};
+
+struct bench_case {
+  char *name;
+  enum query_type type;
+  int id;
+  char *filter;
+  enum sort_type sort;
+  enum index_type idx_type;
+};
+
+struct bench_lib {
+  int ntracks;
+  int nartists;
+  int nplaylists;
+  int nsmart;
+
+  char **artists;
+  struct bench_zipf artist_pop;
+  struct bench_zipf genre_pop;
+
+  int plid;
+  int smartplid;
+  int groupid;
+};
+
+
+static const char *genres[] =
+  {
+    "Rock", "Pop", "Alternative", "Electronic", "Hip-Hop/Rap", "Jazz",
+    "Classical", "Soundtrack", "R&B/Soul", "Country", "Metal", "Blues",
+    "Folk", "Reggae", "Latin", "World", "Dance", "Punk", "Indie Rock",
+    "Singer/Songwriter", "Ambient", "Easy Listening", "Gospel", "Spoken Word",
+    "Unknown genre",
+  };
+
+static const char *syllables[] =
+  {
+    "ka", "lo", "mi", "ra", "shi", "ven", "tor", "al", "bel", "cro", "du",
+    "fen", "gar", "hol", "is", "jun", "kel", "mor", "nox", "ous", "pra",
+    "quin", "ros", "sta", "tul", "ur", "vex", "wil", "yor", "zan",
+  };
+
+/* Exercise the collation: accents, case and articles */
+static const char *prefixes[] =
+  {
+    "The ", "", "", "", "", "", "", "", "DJ ", "", "Les ", "", "", "",
+  };
+
+static const char *odd_names[] =
+  {
+    "Émile", "Ólafur", "Ærø", "björk", "µ-Ziq", "!!!", "2Pac", "50 Cent",
+    "Sigur Rós", "Zoë", "élan", "Ñu", "...And You Will Know Us", "école",
+  };
+
+static const char *words[] =
+  {
+    "Love", "Night", "Light", "Dream", "Heart", "Fire", "Rain", "Time",
+    "World", "Road", "Home", "Summer", "Blue", "Gold", "River", "Shadow",
+    "Song", "Dance", "Star", "Ocean", "Stone", "Wind", "Ghost", "Sun",
+    "Moon", "City", "Winter", "Silver", "Echo", "Storm", "Mirror", "Paper",
+  };
+
+#define NELEMS(a) (sizeof(a) / sizeof(a[0]))
+
+
+static uint32_t
+bench_rand(struct bench_rng *rng)
+{
+  /* xorshift64*, good enough and reproducible across platforms */
+  rng->state ^= rng->state >> 12;
+  rng->state ^= rng->state << 25;
+  rng->state ^= rng->state >> 27;
+
+  return (uint32_t)((rng->state * UINT64_C(2685821657736338717)) >> 32);
+}
+
+static int
+bench_rand_range(struct bench_rng *rng, int min, int max)
+{
+  return min + (int)(bench_rand(rng) % (uint32_t)(max - min + 1));
+}
+
+static int
+bench_zipf_init(struct bench_zipf *z, int n, double s)
+{
+  double sum;
+  int i;
+
+  z->cdf = (double *)malloc(n * sizeof(double));
+  if (!z->cdf)
+    return -1;
+
+  z->n = n;
+
+  sum = 0;
+  for (i = 0; i < n; i++)
+    {
+      sum += 1.0 / pow(i + 1, s);
+      z->cdf[i] = sum;
+    }
+
+  for (i = 0; i < n; i++)
+    z->cdf[i] /= sum;
+
+  return 0;
+}
+
+static int
+bench_zipf_pick(struct bench_zipf *z, struct bench_rng *rng)
+{
+  double u;
+  int lo;
+  int hi;
+  int mid;
+
+  u = (double)bench_rand(rng) / 4294967296.0;
+
+  lo = 0;
+  hi = z->n - 1;
+  while (lo < hi)
+    {
+      mid = (lo + hi) / 2;
+
+      if (z->cdf[mid] < u)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+  return lo;
+}
+
+static char *
+bench_name(struct bench_rng *rng, int min, int max)
+{
+  char buf[128];
+  int n;
+  int len;
+  int i;
+
+  n = bench_rand_range(rng, min, max);
+
+  len = 0;
+  for (i = 0; i < n; i++)
+    len += snprintf(buf + len, sizeof(buf) - len, "%s", syllables[bench_rand(rng) % NELEMS(syllables)]);
+
+  buf[0] = buf[0] - 'a' + 'A';
+
+  return strdup(buf);
+}
+
+static char *
+bench_title(struct bench_rng *rng)
+{
+  char buf[128];
+  int n;
+  int len;
+  int i;
+
+  /* Some titles start with digits or punctuation */
+  len = 0;
+  switch (bench_rand(rng) % 20)
+    {
+      case 0:
+	len = snprintf(buf, sizeof(buf), "%d ", bench_rand_range(rng, 1, 99));
+	break;
+
+      case 1:
+	len = snprintf(buf, sizeof(buf), "(");
+	break;
+
+      case 2:
+	len = snprintf(buf, sizeof(buf), "the ");
+	break;
+    }
+
+  n = bench_rand_range(rng, 1, 4);
+  for (i = 0; i < n; i++)
+    len += snprintf(buf + len, sizeof(buf) - len, "%s%s", (i > 0) ? " " : "", words[bench_rand(rng) % NELEMS(words)]);
+
+  if (buf[0] == '(')
+    snprintf(buf + len, sizeof(buf) - len, ")");
+
+  return strdup(buf);
+}
+
+static uint64_t
+bench_usec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/* Library generation */
+static int
+bench_artists_init(struct bench_lib *lib, struct bench_rng *rng)
+{
+  char *name;
+  int i;
+  int ret;
+
+  lib->artists = (char **)calloc(lib->nartists, sizeof(char *));
+  if (!lib->artists)
+    return -1;
+
+  for (i = 0; i < lib->nartists; i++)
+    {
+      if ((i < NELEMS(odd_names)) && (bench_rand(rng) % 2))
+	{
+	  lib->artists[i] = strdup(odd_names[i]);
+	  continue;
+	}
+
+      name = bench_name(rng, 2, 4);
+      if (!name)
+	return -1;
+
+      ret = asprintf(&lib->artists[i], "%s%s", prefixes[bench_rand(rng) % NELEMS(prefixes)], name);
+      free(name);
+      if (ret < 0)
+	return -1;
+    }
+
+  ret = bench_zipf_init(&lib->artist_pop, lib->nartists, 0.9);
+  if (ret < 0)
+    return -1;
+
+  return bench_zipf_init(&lib->genre_pop, NELEMS(genres), 1.1);
+}
+
+static int
+bench_files_add(struct bench_lib *lib, struct bench_rng *rng)
+{
+  struct media_file_info mfi;
+  char *album;
+  const char *album_artist;
+  const char *genre;
+  int media_kind;
+  int compilation;
+  int year;
+  int ntracks;
+  int ndiscs;
+  int added;
+  int track;
+  int artist;
+  int i;
+  int ret;
+
+  added = 0;
+  while (added < lib->ntracks)
+    {
+      album = bench_title(rng);
+      if (!album)
+	return -1;
+
+      artist = bench_zipf_pick(&lib->artist_pop, rng);
+      genre = genres[bench_zipf_pick(&lib->genre_pop, rng)];
+      year = bench_rand_range(rng, 1955, 2011);
+      compilation = (bench_rand(rng) % 100) < 6;
+      ndiscs = ((bench_rand(rng) % 100) < 8) ? 2 : 1;
+      ntracks = bench_rand_range(rng, 6, 16);
+
+      i = bench_rand(rng) % 100;
+      if (i < 88)
+	media_kind = 1;    /* music */
+      else if (i < 93)
+	media_kind = 4;    /* podcast */
+      else if (i < 96)
+	media_kind = 8;    /* audiobook */
+      else if (i < 98)
+	media_kind = 2;    /* movie */
+      else
+	media_kind = 64;   /* tv show */
+
+      album_artist = (compilation) ? "" : lib->artists[artist];
+
+      for (i = 0; (i < ntracks * ndiscs) && (added < lib->ntracks); i++, added++)
+	{
+	  memset(&mfi, 0, sizeof(struct media_file_info));
+
+	  track = (i % ntracks) + 1;
+
+	  if (compilation)
+	    artist = bench_zipf_pick(&lib->artist_pop, rng);
+
+	  mfi.title = bench_title(rng);
+	  mfi.artist = strdup(lib->artists[artist]);
+	  mfi.album = strdup(album);
+	  mfi.album_artist = strdup(album_artist);
+	  mfi.genre = strdup(genre);
+	  if ((bench_rand(rng) % 100) < 40)
+	    mfi.composer = strdup(lib->artists[bench_zipf_pick(&lib->artist_pop, rng)]);
+
+	  ret = asprintf(&mfi.path, "/bench/%s/%s/%07d %d-%02d %s.mp3",
+			 (compilation) ? "Compilations" : album_artist, album, added, (i / ntracks) + 1, track, mfi.title);
+	  if (ret < 0)
+	    mfi.path = NULL;
+
+	  mfi.fname = (mfi.path) ? strdup(strrchr(mfi.path, '/') + 1) : NULL;
+
+	  mfi.type = strdup("mp3");
+	  mfi.codectype = strdup("mpeg");
+	  mfi.description = strdup("MPEG audio file");
+
+	  mfi.title_sort = (mfi.title) ? strdup(mfi.title) : NULL;
+	  mfi.artist_sort = strdup(lib->artists[artist]);
+	  mfi.album_sort = strdup(album);
+	  mfi.album_artist_sort = strdup(album_artist);
+	  if (mfi.composer)
+	    mfi.composer_sort = strdup(mfi.composer);
+
+	  if (!mfi.path || !mfi.fname || !mfi.title || !mfi.artist || !mfi.album || !mfi.album_artist || !mfi.genre)
+	    {
+	      DPRINTF(E_LOG, L_MAIN, "Out of memory for synthetic file\n");
+
+	      free_mfi(&mfi, 1);
+	      free(album);
+	      return -1;
+	    }
+
+	  mfi.track = track;
+	  mfi.total_tracks = ntracks;
+	  mfi.disc = (i / ntracks) + 1;
+	  mfi.total_discs = ndiscs;
+	  mfi.year = year;
+	  mfi.compilation = compilation;
+	  mfi.media_kind = media_kind;
+	  mfi.item_kind = 2;
+	  mfi.data_kind = 0;
+	  mfi.bitrate = (bench_rand(rng) % 2) ? 320 : 192;
+	  mfi.samplerate = 44100;
+	  mfi.song_length = bench_rand_range(rng, 90, 480) * 1000;
+	  mfi.file_size = (int64_t)mfi.song_length * mfi.bitrate / 8;
+	  mfi.rating = (bench_rand(rng) % 4 == 0) ? bench_rand_range(rng, 1, 5) * 20 : 0;
+	  mfi.time_modified = 1000000000 + bench_rand(rng) % 300000000;
+
+	  ret = db_file_add(&mfi);
+
+	  free_mfi(&mfi, 1);
+
+	  if (ret < 0)
+	    {
+	      free(album);
+	      return -1;
+	    }
+	}
+
+      free(album);
+    }
+
+  return 0;
+}
+
+static int
+bench_playlists_add(struct bench_lib *lib, struct bench_rng *rng)
+{
+  char title[64];
+  char path[64];
+  int nitems;
+  int id;
+  int i;
+  int j;
+  int ret;
+
+  for (i = 0; i < lib->nplaylists; i++)
+    {
+      snprintf(title, sizeof(title), "Bench playlist %d", i + 1);
+      snprintf(path, sizeof(path), "/bench/playlists/%d.m3u", i + 1);
+
+      ret = db_pl_add(title, path, &id);
+      if (ret < 0)
+	return -1;
+
+      /* File ids are 1..ntracks in a fresh database */
+      nitems = (i == 0) ? 2000 : bench_rand_range(rng, 10, 500);
+      for (j = 0; j < nitems; j++)
+	{
+	  ret = db_pl_add_item_byid(id, bench_rand_range(rng, 1, lib->ntracks));
+	  if (ret < 0)
+	    return -1;
+	}
+    }
+
+  return 0;
+}
+
+/* There is no db API for smart playlists; insert them like the defaults */
+static int
+bench_smartpls_add(struct bench_lib *lib, char *db_path)
+{
+#define Q_TMPL "INSERT INTO playlists (title, type, query, db_timestamp, disabled, path, idx, special_id)" \
+               " VALUES ('%q', 1, '%q', 0, 0, '', 0, 0);"
+  static const char *smartpl_queries[] =
+    {
+      "f.genre = 'Rock'",
+      "f.year >= 1990 AND f.year < 2000",
+      "f.rating >= 80",
+      "f.media_kind = 1 AND f.compilation = 1",
+      "f.artist LIKE 'The %'",
+      "f.song_length > 300000",
+    };
+  sqlite3 *hdl;
+  char *query;
+  char *errmsg;
+  char title[64];
+  int i;
+  int ret;
+
+  ret = sqlite3_open(db_path, &hdl);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_MAIN, "Could not open database: %s\n", sqlite3_errmsg(hdl));
+
+      sqlite3_close(hdl);
+      return -1;
+    }
+
+  sqlite3_busy_timeout(hdl, 5000);
+
+  /* The playlists table uses the DAAP collation */
+  sqlite3_enable_load_extension(hdl, 1);
+
+  ret = sqlite3_load_extension(hdl, PKGLIBDIR "/forked-daapd-sqlext.so", NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_MAIN, "Could not load SQLite extension: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      sqlite3_close(hdl);
+      return -1;
+    }
+
+  for (i = 0; i < lib->nsmart; i++)
+    {
+      snprintf(title, sizeof(title), "Bench smart playlist %d", i + 1);
+
+      query = sqlite3_mprintf(Q_TMPL, title, smartpl_queries[i % NELEMS(smartpl_queries)]);
+      if (!query)
+	{
+	  DPRINTF(E_LOG, L_MAIN, "Out of memory for query string\n");
+
+	  sqlite3_close(hdl);
+	  return -1;
+	}
+
+      ret = sqlite3_exec(hdl, query, NULL, NULL, &errmsg);
+      sqlite3_free(query);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_MAIN, "Could not add smart playlist: %s\n", errmsg);
+
+	  sqlite3_free(errmsg);
+	  sqlite3_close(hdl);
+	  return -1;
+	}
+    }
+
+  sqlite3_close(hdl);
+
+  return 0;
+
+#undef Q_TMPL
+}
+
+/* First plain and smart playlists of the benchmark */
+static int
+bench_playlists_find(struct bench_lib *lib)
+{
+  struct query_params qp;
+  struct db_playlist_info dbpli;
+  int32_t id;
+  int ret;
+
+  memset(&qp, 0, sizeof(struct query_params));
+  qp.type = Q_PL;
+
+  ret = db_query_start(&qp);
+  if (ret < 0)
+    return -1;
+
+  while (((ret = db_query_fetch_pl(&qp, &dbpli)) == 0) && (dbpli.id))
+    {
+      if (safe_atoi32(dbpli.id, &id) < 0)
+	continue;
+
+      if (strcmp(dbpli.title, "Bench playlist 1") == 0)
+	lib->plid = id;
+      else if (strcmp(dbpli.title, "Bench smart playlist 1") == 0)
+	lib->smartplid = id;
+    }
+
+  db_query_end(&qp);
+
+  return (lib->plid && lib->smartplid) ? 0 : -1;
+}
+
+/* Largest album group, for the group queries */
+static int
+bench_group_find(struct bench_lib *lib)
+{
+  struct query_params qp;
+  struct db_group_info dbgri;
+  int32_t items;
+  int32_t max;
+  int32_t id;
+  int ret;
+
+  memset(&qp, 0, sizeof(struct query_params));
+  qp.type = Q_GROUPS;
+
+  ret = db_query_start(&qp);
+  if (ret < 0)
+    return -1;
+
+  max = 0;
+  while (((ret = db_query_fetch_group(&qp, &dbgri)) == 0) && (dbgri.id))
+    {
+      if ((safe_atoi32(dbgri.itemcount, &items) == 0) && (items > max)
+	  && (safe_atoi32(dbgri.id, &id) == 0))
+	{
+	  max = items;
+	  lib->groupid = id;
+	}
+    }
+
+  db_query_end(&qp);
+
+  return (max > 0) ? 0 : -1;
+}
+
+
+/* Queries */
+static int
+bench_run_once(struct bench_case *bc, int *results, int *rows)
+{
+  struct query_params qp;
+  struct db_media_file_values dbmfv;
+  struct db_playlist_info dbpli;
+  struct db_group_info dbgri;
+  char *str;
+  int n;
+  int ret;
+
+  memset(&qp, 0, sizeof(struct query_params));
+  qp.type = bc->type;
+  qp.id = bc->id;
+  qp.filter = bc->filter;
+  qp.sort = bc->sort;
+  qp.idx_type = bc->idx_type;
+
+  switch (bc->idx_type)
+    {
+      case I_FIRST:
+      case I_LAST:
+	qp.limit = BENCH_PAGE;
+	break;
+
+      case I_SUB:
+	qp.offset = 5000;
+	qp.limit = BENCH_PAGE;
+	break;
+
+      default:
+	break;
+    }
+
+  ret = db_query_start(&qp);
+  if (ret < 0)
+    return -1;
+
+  n = 0;
+  switch (bc->type)
+    {
+      case Q_ITEMS:
+      case Q_PLITEMS:
+      case Q_GROUPITEMS:
+	while (((ret = db_query_fetch_file_values(&qp, &dbmfv)) == 0) && (dbmfv_int(&dbmfv, id)))
+	  n++;
+	break;
+
+      case Q_PL:
+	while (((ret = db_query_fetch_pl(&qp, &dbpli)) == 0) && (dbpli.id))
+	  n++;
+	break;
+
+      case Q_GROUPS:
+	while (((ret = db_query_fetch_group(&qp, &dbgri)) == 0) && (dbgri.id))
+	  n++;
+	break;
+
+      default:
+	while (((ret = db_query_fetch_string(&qp, &str)) == 0) && (str))
+	  n++;
+	break;
+    }
+
+  *results = qp.results;
+  *rows = n;
+
+  db_query_end(&qp);
+
+  return ret;
+}
+
+static int
+bench_cmp_u64(const void *a, const void *b)
+{
+  uint64_t ua = *(const uint64_t *)a;
+  uint64_t ub = *(const uint64_t *)b;
+
+  return (ua > ub) - (ua < ub);
+}
+
+static void
+bench_run(struct bench_case *bc, int repeat)
+{
+  uint64_t *usec;
+  uint64_t start;
+  int results;
+  int rows;
+  int i;
+  int ret;
+
+  usec = (uint64_t *)calloc(repeat, sizeof(uint64_t));
+  if (!usec)
+    return;
+
+  results = 0;
+  rows = 0;
+  ret = 0;
+  for (i = 0; (i < repeat) && (ret == 0); i++)
+    {
+      start = bench_usec();
+
+      ret = bench_run_once(bc, &results, &rows);
+
+      usec[i] = bench_usec() - start;
+    }
+
+  if (ret < 0)
+    printf("query\t%s\terror\t-1\t-1\t-1\t-1\t-1\n", bc->name);
+  else
+    {
+      qsort(usec, repeat, sizeof(uint64_t), bench_cmp_u64);
+
+      printf("query\t%s\tok\t%d\t%d\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\n",
+	     bc->name, results, rows, usec[0], usec[repeat / 2], usec[repeat - 1]);
+    }
+
+  fflush(stdout);
+
+  free(usec);
+}
+
+static void
+bench_queries(struct bench_lib *lib, int repeat)
+{
+  static const struct {
+    char *name;
+    char *filter;
+  } filters[] =
+    {
+      { "all",    NULL },
+      { "genre",  "f.genre = 'Rock'" },
+      { "music",  "f.media_kind = 1" },
+      { "like",   "f.title LIKE '%Love%'" },
+    };
+  static const struct {
+    char *name;
+    enum index_type idx_type;
+  } idxs[] =
+    {
+      { "none",  I_NONE },
+      { "first", I_FIRST },
+      { "last",  I_LAST },
+      { "sub",   I_SUB },
+    };
+  static const struct {
+    char *name;
+    enum sort_type sort;
+  } sorts[] =
+    {
+      { "none",   S_NONE },
+      { "name",   S_NAME },
+      { "album",  S_ALBUM },
+      { "artist", S_ARTIST },
+    };
+  static const struct {
+    char *name;
+    enum query_type type;
+    int filtered;
+    int sorted;
+  } types[] =
+    {
+      { "items",            Q_ITEMS,            1, 1 },
+      { "pl",               Q_PL,               0, 0 },
+      { "plitems",          Q_PLITEMS,          1, 1 },
+      { "smartplitems",     Q_PLITEMS,          1, 1 },
+      { "browse_artists",   Q_BROWSE_ARTISTS,   1, 0 },
+      { "browse_albums",    Q_BROWSE_ALBUMS,    1, 0 },
+      { "browse_genres",    Q_BROWSE_GENRES,    1, 0 },
+      { "browse_composers", Q_BROWSE_COMPOSERS, 1, 0 },
+      { "groups",           Q_GROUPS,           1, 0 },
+      { "groupitems",       Q_GROUPITEMS,       0, 0 },
+      { "group_dirs",       Q_GROUP_DIRS,       0, 0 },
+    };
+  struct bench_case bc;
+  char name[128];
+  int t;
+  int f;
+  int s;
+  int i;
+
+  printf("#\tkind\tcase\tstatus\tresults\trows\tmin_usec\tmedian_usec\tmax_usec\n");
+
+  for (t = 0; t < NELEMS(types); t++)
+    {
+      for (f = 0; f < NELEMS(filters); f++)
+	{
+	  if (!types[t].filtered && filters[f].filter)
+	    continue;
+
+	  for (s = 0; s < NELEMS(sorts); s++)
+	    {
+	      if (!types[t].sorted && (sorts[s].sort != S_NONE))
+		continue;
+
+	      for (i = 0; i < NELEMS(idxs); i++)
+		{
+		  memset(&bc, 0, sizeof(struct bench_case));
+
+		  snprintf(name, sizeof(name), "%s/filter=%s/sort=%s/idx=%s",
+			   types[t].name, filters[f].name, sorts[s].name, idxs[i].name);
+
+		  bc.name = name;
+		  bc.type = types[t].type;
+		  bc.filter = filters[f].filter;
+		  bc.sort = sorts[s].sort;
+		  bc.idx_type = idxs[i].idx_type;
+
+		  if (strcmp(types[t].name, "smartplitems") == 0)
+		    bc.id = lib->smartplid;
+		  else if (types[t].type == Q_PLITEMS)
+		    bc.id = lib->plid;
+		  else if ((types[t].type == Q_GROUPITEMS) || (types[t].type == Q_GROUP_DIRS))
+		    bc.id = lib->groupid;
+
+		  bench_run(&bc, repeat);
+		}
+	    }
+	}
+    }
+}
+
+
+static void
+usage(char *program)
+{
+  printf("Usage: %s [options]\n\n", program);
+  printf("Builds a synthetic library in a scratch database and times the\n");
+  printf("database queries; results go to stdout, tab separated.\n\n");
+  printf("Options:\n");
+  printf("  -c <file>      Use <file> as the configfile\n");
+  printf("  -o <file>      Scratch database (default " BENCH_DEFAULT_DB ")\n");
+  printf("  -n <number>    Number of tracks (%d-%d, default %d)\n", BENCH_MIN_TRACKS, BENCH_MAX_TRACKS, BENCH_MIN_TRACKS);
+  printf("  -p <number>    Number of playlists (default 50)\n");
+  printf("  -P <number>    Number of smart playlists (default 6)\n");
+  printf("  -r <number>    Runs per query (default 5)\n");
+  printf("  -s <number>    Random seed (default 1)\n");
+  printf("  -m             Serve queries from the in-memory snapshot\n");
+  printf("  -k             Query the database of a previous run instead of\n");
+  printf("                 building a new one\n");
+  printf("  -d <number>    Log level (0-5)\n");
+  printf("\n");
+}
+
+int
+main(int argc, char **argv)
+{
+  struct bench_lib lib;
+  struct bench_rng rng;
+  char *configfile;
+  char *db_path;
+  char *wal;
+  uint64_t start;
+  uint64_t usec;
+  uint32_t seed;
+  int loglevel;
+  int snapshot;
+  int keep;
+  int repeat;
+  int option;
+  int ret;
+
+  configfile = CONFFILE;
+  db_path = BENCH_DEFAULT_DB;
+  loglevel = E_LOG;
+  snapshot = 0;
+  keep = 0;
+  repeat = 5;
+  seed = 1;
+
+  memset(&lib, 0, sizeof(struct bench_lib));
+  lib.ntracks = BENCH_MIN_TRACKS;
+  lib.nplaylists = 50;
+  lib.nsmart = 6;
+
+  while ((option = getopt(argc, argv, "c:o:n:p:P:r:s:mkd:")) != -1)
+    {
+      switch (option)
+	{
+	  case 'c':
+	    configfile = optarg;
+	    break;
+
+	  case 'o':
+	    db_path = optarg;
+	    break;
+
+	  case 'n':
+	    ret = safe_atoi32(optarg, &lib.ntracks);
+	    if ((ret < 0) || (lib.ntracks < BENCH_MIN_TRACKS) || (lib.ntracks > BENCH_MAX_TRACKS))
+	      {
+		fprintf(stderr, "Error: number of tracks must be %d-%d in '-n %s'\n", BENCH_MIN_TRACKS, BENCH_MAX_TRACKS, optarg);
+		return EXIT_FAILURE;
+	      }
+	    break;
+
+	  case 'p':
+	    ret = safe_atoi32(optarg, &lib.nplaylists);
+	    if ((ret < 0) || (lib.nplaylists < 1))
+	      {
+		fprintf(stderr, "Error: number of playlists must be a positive integer in '-p %s'\n", optarg);
+		return EXIT_FAILURE;
+	      }
+	    break;
+
+	  case 'P':
+	    ret = safe_atoi32(optarg, &lib.nsmart);
+	    if ((ret < 0) || (lib.nsmart < 1))
+	      {
+		fprintf(stderr, "Error: number of smart playlists must be a positive integer in '-P %s'\n", optarg);
+		return EXIT_FAILURE;
+	      }
+	    break;
+
+	  case 'r':
+	    ret = safe_atoi32(optarg, &repeat);
+	    if ((ret < 0) || (repeat < 1))
+	      {
+		fprintf(stderr, "Error: runs must be a positive integer in '-r %s'\n", optarg);
+		return EXIT_FAILURE;
+	      }
+	    break;
+
+	  case 's':
+	    ret = safe_atou32(optarg, &seed);
+	    if (ret < 0)
+	      {
+		fprintf(stderr, "Error: seed must be an integer in '-s %s'\n", optarg);
+		return EXIT_FAILURE;
+	      }
+	    break;
+
+	  case 'm':
+	    snapshot = 1;
+	    break;
+
+	  case 'k':
+	    keep = 1;
+	    break;
+
+	  case 'd':
+	    ret = safe_atoi32(optarg, &loglevel);
+	    if (ret < 0)
+	      {
+		fprintf(stderr, "Error: loglevel must be an integer in '-d %s'\n", optarg);
+		return EXIT_FAILURE;
+	      }
+	    break;
+
+	  default:
+	    usage(argv[0]);
+	    return EXIT_FAILURE;
+	}
+    }
+
+  ret = logger_init(NULL, NULL, loglevel);
+  if (ret != 0)
+    {
+      fprintf(stderr, "Could not initialize log facility\n");
+
+      return EXIT_FAILURE;
+    }
+
+  ret = conffile_load(configfile);
+  if (ret != 0)
+    {
+      DPRINTF(E_FATAL, L_MAIN, "Config file errors; please fix your config\n");
+
+      logger_deinit();
+      return EXIT_FAILURE;
+    }
+
+  /* Never touch the real library */
+  cfg_setstr(cfg_getsec(cfg, "general"), "db_path", db_path);
+  cfg_setbool(cfg_getsec(cfg, "library"), "memory_snapshot", (snapshot) ? cfg_true : cfg_false);
+
+  if (!keep)
+    {
+      unlink(db_path);
+
+      if (asprintf(&wal, "%s-wal", db_path) > 0)
+	{
+	  unlink(wal);
+	  free(wal);
+	}
+      if (asprintf(&wal, "%s-shm", db_path) > 0)
+	{
+	  unlink(wal);
+	  free(wal);
+	}
+    }
+
+  lib.nartists = lib.ntracks / 12;
+  rng.state = ((uint64_t)seed << 32) | 0x9e3779b9;
+
+  printf("#\tforked-daapd db benchmark\ttracks=%d\tplaylists=%d\tsmart_playlists=%d\tseed=%" PRIu32 "\tsnapshot=%d\truns=%d\tsqlite=%s\n",
+	 lib.ntracks, lib.nplaylists, lib.nsmart, seed, snapshot, repeat, sqlite3_libversion());
+
+  ret = db_init();
+  if (ret < 0)
+    goto out_conf;
+
+  ret = bench_artists_init(&lib, &rng);
+  if (ret < 0)
+    {
+      DPRINTF(E_FATAL, L_MAIN, "Out of memory for synthetic artists\n");
+      goto out_db;
+    }
+
+  if (!keep)
+    {
+      start = bench_usec();
+
+      db_batch_start();
+      ret = bench_files_add(&lib, &rng);
+      db_batch_end();
+      if (ret < 0)
+	goto out_db;
+
+      usec = bench_usec() - start;
+
+      printf("build\tfiles\tok\t%d\t%d\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\n", lib.ntracks, lib.ntracks, usec, usec, usec);
+
+      start = bench_usec();
+
+      db_batch_start();
+      ret = bench_playlists_add(&lib, &rng);
+      db_batch_end();
+      if (ret < 0)
+	goto out_db;
+
+      ret = bench_smartpls_add(&lib, db_path);
+      if (ret < 0)
+	goto out_db;
+
+      usec = bench_usec() - start;
+
+      printf("build\tplaylists\tok\t%d\t%d\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\n",
+	     lib.nplaylists + lib.nsmart, lib.nplaylists + lib.nsmart, usec, usec, usec);
+
+      /* Start over like the server would: ANALYZE and snapshot load */
+      db_deinit();
+
+      start = bench_usec();
+
+      ret = db_init();
+      if (ret < 0)
+	goto out_conf;
+
+      if (snapshot)
+	db_snapshot_wait();
+
+      usec = bench_usec() - start;
+
+      printf("build\tinit\tok\t0\t0\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\n", usec, usec, usec);
+    }
+
+  /* Don't time queries that the snapshot would serve once it's built */
+  if (snapshot)
+    {
+      ret = db_snapshot_wait();
+      if (ret < 0)
+	{
+	  DPRINTF(E_FATAL, L_MAIN, "Could not build the library snapshot\n");
+	  goto out_db;
+	}
+    }
+
+  ret = db_pool_get();
+  if (ret < 0)
+    goto out_db;
+
+  ret = bench_playlists_find(&lib);
+  if (ret < 0)
+    DPRINTF(E_LOG, L_MAIN, "Benchmark playlists not found, playlist queries will fail\n");
+
+  ret = bench_group_find(&lib);
+  if (ret < 0)
+    DPRINTF(E_LOG, L_MAIN, "No album group found, group queries will fail\n");
+
+  bench_queries(&lib, repeat);
+
+  db_pool_release();
+
+  ret = 0;
+
+ out_db:
+  db_deinit();
+ out_conf:
+  conffile_unload();
+  logger_deinit();
+
+  return (ret < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
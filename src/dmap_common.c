@@ -20,17 +20,27 @@
 # include <config.h>
 #endif
 
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "evbuffer/evbuffer.h"
 #include "db.h"
 #include "misc.h"
 #include "logger.h"
+#include "conffile.h"
 #include "http.h"
 #include "dmap_common.h"
 
 
+/* Meta sets with pre-encoded songs kept */
+#define DMAP_RECORD_SETS     4
+/* Initial hash size of a set, doubled as it fills up */
+#define DMAP_RECORD_BUCKETS  1024
+
+
 /* gperf static hash, dmap_fields.gperf */
 #include "dmap_fields_hash.c"
 
@@ -192,7 +202,7 @@ dmap_add_string(struct evbuffer *evbuf, char *tag, const char *str)
 }
 
 void
-dmap_add_field(struct evbuffer *evbuf, const struct dmap_field *df, char *strval, int32_t intval)
+dmap_add_field(struct evbuffer *evbuf, const struct dmap_field *df, char *strval, int64_t intval)
 {
   union {
     int32_t v_i32;
@@ -376,46 +386,174 @@ dmap_send_error(struct httpd_hdl *h, char *container, char *errmsg)
 }
 
 
-int
-dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_info *dbmfi, const struct dmap_field **meta, int nmeta, int sort_tags, int force_wav)
+/* Encoding plans
+ * Working out what to send for a song (requested fields, their types, the
+ * fields sent first or replaced when transcoding) only depends on the meta
+ * list, not on the song; it is done once and the songs go through the
+ * resulting list of steps.
+ */
+enum dmap_plan_op
+  {
+    DMAP_PLAN_CHAR,
+    DMAP_PLAN_SHORT,
+    DMAP_PLAN_INT,
+    DMAP_PLAN_LONG,
+    DMAP_PLAN_STRING,
+    DMAP_PLAN_CODECTYPE, /* ascd, actually a 4-char code */
+    DMAP_PLAN_SORT,      /* Sort tag, sent even if empty */
+    DMAP_PLAN_SORT_OPT,  /* Sort tag, sent if set */
+  };
+
+/* Values replaced when transcoding to WAV */
+enum dmap_plan_wav
+  {
+    DMAP_WAV_NONE = 0,
+    DMAP_WAV_TYPE,
+    DMAP_WAV_BITRATE,
+    DMAP_WAV_DESCRIPTION,
+  };
+
+struct dmap_plan_step {
+  int col;
+  char *tag;
+  enum dmap_plan_op op;
+  enum dmap_plan_wav wav;
+};
+
+struct dmap_encode_plan {
+  /* Identifies the output of the plan, for the pre-encoded songs */
+  uint64_t sig;
+
+  /* Prepended to the song */
+  int want_mikd;
+  int want_asdk;
+
+  int nsteps;
+  struct dmap_plan_step *steps;
+};
+
+/* Pre-encoded song, the mlit follows the struct; only valid for the values
+ * of the columns below, which change whenever the song does. Referenced by
+ * its set and by the song lists being sent with it.
+ */
+struct dmap_record {
+  int id;
+  int force_wav;
+  int refs;
+
+  uint32_t db_timestamp;
+  uint32_t play_count;
+  uint32_t time_played;
+
+  size_t len;
+
+  struct dmap_record *next;
+
+  /* Least recently used order of the records in the sets */
+  struct dmap_record_set *set;
+  struct dmap_record *lru_prev;
+  struct dmap_record *lru_next;
+};
+
+#define dmap_record_data(rec) ((unsigned char *)((rec) + 1))
+
+/* Pre-encoded songs for one encoding plan */
+struct dmap_record_set {
+  uint64_t sig;
+
+  struct dmap_record **buckets;
+  unsigned int nbuckets;
+  unsigned int nrecords;
+  size_t size;
+
+  unsigned int tick;
+};
+
+static const struct {
+  ssize_t mfi_offset;
+  char *tag;
+  enum dmap_plan_op op;
+} dmap_sort_tags[] =
+  {
+    { dbmfi_offsetof(title_sort),        "assn", DMAP_PLAN_SORT },
+    { dbmfi_offsetof(artist_sort),       "assa", DMAP_PLAN_SORT },
+    { dbmfi_offsetof(album_sort),        "assu", DMAP_PLAN_SORT },
+    { dbmfi_offsetof(album_artist_sort), "assl", DMAP_PLAN_SORT },
+    { dbmfi_offsetof(composer_sort),     "assc", DMAP_PLAN_SORT_OPT },
+  };
+
+/* Pre-encoded songs, protected by records_lck */
+static pthread_mutex_t records_lck;
+static struct dmap_record_set record_sets[DMAP_RECORD_SETS];
+static unsigned int records_tick;
+static size_t records_size;
+static size_t records_max_size;
+static struct dmap_record *records_lru_head;
+static struct dmap_record *records_lru_tail;
+
+
+/* FNV-1a */
+static uint64_t
+dmap_plan_sig_add(uint64_t sig, const void *data, size_t len)
 {
+  const unsigned char *p;
+  size_t i;
+
+  p = (const unsigned char *)data;
+
+  for (i = 0; i < len; i++)
+    {
+      sig ^= p[i];
+      sig *= 0x100000001b3ULL;
+    }
+
+  return sig;
+}
+
+
+/* nmeta = 0 for all the fields */
+struct dmap_encode_plan *
+dmap_encode_plan_new(const struct dmap_field **meta, int nmeta, int sort_tags)
+{
+  struct dmap_encode_plan *plan;
+  struct dmap_plan_step *step;
   const struct dmap_field_map *dfm;
   const struct dmap_field *df;
-  char **strval;
-  char *ptr;
-  int32_t val;
-  int want_mikd;
-  int want_asdk;
+  int nfields;
   int i;
-  int ret;
 
-  want_mikd = 0;
-  want_asdk = 0;
+  if (nmeta > 0)
+    nfields = nmeta;
+  else
+    nfields = sizeof(dmap_fields) / sizeof(dmap_fields[0]);
 
-  i = -1;
-  while (1)
+  plan = (struct dmap_encode_plan *)malloc(sizeof(struct dmap_encode_plan));
+  if (!plan)
     {
-      i++;
+      DPRINTF(E_LOG, L_DAAP, "Out of memory for DMAP encoding plan\n");
 
-      /* Specific meta tags requested (or default list) */
-      if (nmeta > 0)
-	{
-	  if (i == nmeta)
-	    break;
+      return NULL;
+    }
 
-	  df = meta[i];
-	  dfm = df->dfm;
-	}
-      /* No specific meta tags requested, send out everything */
+  memset(plan, 0, sizeof(struct dmap_encode_plan));
+
+  plan->steps = (struct dmap_plan_step *)malloc((nfields + (sizeof(dmap_sort_tags) / sizeof(dmap_sort_tags[0]))) * sizeof(struct dmap_plan_step));
+  if (!plan->steps)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Out of memory for DMAP encoding plan steps\n");
+
+      free(plan);
+      return NULL;
+    }
+
+  for (i = 0; i < nfields; i++)
+    {
+      if (nmeta > 0)
+	df = meta[i];
       else
-	{
-	  /* End of list */
-	  if (i == (sizeof(dmap_fields) / sizeof(dmap_fields[0])))
-	    break;
+	df = &dmap_fields[i];
 
-	  df = &dmap_fields[i];
-	  dfm = dmap_fields[i].dfm;
-	}
+      dfm = df->dfm;
 
       /* Not in struct media_file_info */
       if (dfm->mfi_offset < 0)
@@ -425,103 +563,230 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
       if (dfm == &dfm_dmap_mikd)
 	{
 	  /* item kind */
-	  want_mikd = 1;
+	  plan->want_mikd = 1;
 	  continue;
 	}
       else if (dfm == &dfm_dmap_asdk)
 	{
 	  /* data kind */
-	  want_asdk = 1;
+	  plan->want_asdk = 1;
 	  continue;
 	}
 
-      DPRINTF(E_DBG, L_DAAP, "Investigating %s\n", df->desc);
-
-      strval = (char **) ((char *)dbmfi + dfm->mfi_offset);
+      step = &plan->steps[plan->nsteps];
 
-      if (!(*strval) || (**strval == '\0'))
-	continue;
+      step->col = dfm->mfi_offset / sizeof(char *);
+      step->tag = df->tag;
+      step->wav = DMAP_WAV_NONE;
 
       /* Here's one exception ... codectype (ascd) is actually an integer */
       if (dfm == &dfm_dmap_ascd)
 	{
-	  dmap_add_literal(song, df->tag, *strval, 4);
+	  step->op = DMAP_PLAN_CODECTYPE;
+	  plan->nsteps++;
 	  continue;
 	}
 
-      val = 0;
+      switch (df->type)
+	{
+	  case DMAP_TYPE_UBYTE:
+	  case DMAP_TYPE_BYTE:
+	    step->op = DMAP_PLAN_CHAR;
+	    break;
+
+	  case DMAP_TYPE_USHORT:
+	  case DMAP_TYPE_SHORT:
+	    step->op = DMAP_PLAN_SHORT;
+	    break;
+
+	  case DMAP_TYPE_DATE:
+	  case DMAP_TYPE_UINT:
+	  case DMAP_TYPE_INT:
+	    step->op = DMAP_PLAN_INT;
+	    break;
+
+	  case DMAP_TYPE_ULONG:
+	  case DMAP_TYPE_LONG:
+	    step->op = DMAP_PLAN_LONG;
+	    break;
+
+	  case DMAP_TYPE_STRING:
+	    step->op = DMAP_PLAN_STRING;
+	    break;
+
+	  /* DMAP_TYPE_VERSION & DMAP_TYPE_LIST are never sent for songs */
+	  default:
+	    continue;
+	}
+
+      switch (dfm->mfi_offset)
+	{
+	  case dbmfi_offsetof(type):
+	    step->wav = DMAP_WAV_TYPE;
+	    break;
+
+	  case dbmfi_offsetof(bitrate):
+	    step->wav = DMAP_WAV_BITRATE;
+	    break;
+
+	  case dbmfi_offsetof(description):
+	    step->wav = DMAP_WAV_DESCRIPTION;
+	    break;
+
+	  default:
+	    break;
+	}
+
+      plan->nsteps++;
+    }
+
+  if (sort_tags)
+    {
+      for (i = 0; i < (sizeof(dmap_sort_tags) / sizeof(dmap_sort_tags[0])); i++)
+	{
+	  step = &plan->steps[plan->nsteps];
+
+	  step->col = dmap_sort_tags[i].mfi_offset / sizeof(char *);
+	  step->tag = dmap_sort_tags[i].tag;
+	  step->op = dmap_sort_tags[i].op;
+	  step->wav = DMAP_WAV_NONE;
+
+	  plan->nsteps++;
+	}
+    }
+
+  plan->sig = 0xcbf29ce484222325ULL;
+  plan->sig = dmap_plan_sig_add(plan->sig, &plan->want_mikd, sizeof(plan->want_mikd));
+  plan->sig = dmap_plan_sig_add(plan->sig, &plan->want_asdk, sizeof(plan->want_asdk));
+
+  for (i = 0; i < plan->nsteps; i++)
+    {
+      step = &plan->steps[i];
+
+      plan->sig = dmap_plan_sig_add(plan->sig, &step->col, sizeof(step->col));
+      plan->sig = dmap_plan_sig_add(plan->sig, &step->op, sizeof(step->op));
+      plan->sig = dmap_plan_sig_add(plan->sig, &step->wav, sizeof(step->wav));
+      plan->sig = dmap_plan_sig_add(plan->sig, step->tag, 4);
+    }
+
+  return plan;
+}
+
+void
+dmap_encode_plan_free(struct dmap_encode_plan *plan)
+{
+  free(plan->steps);
+  free(plan);
+}
+
+int
+dmap_encode_file_plan(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_values *dbmfv, const struct dmap_encode_plan *plan, int force_wav)
+{
+  const struct dmap_plan_step *step;
+  struct db_value *v;
+  struct db_value wav;
+  int32_t val;
+  int i;
+  int ret;
 
-      if (force_wav)
+  for (i = 0; i < plan->nsteps; i++)
+    {
+      step = &plan->steps[i];
+      v = &dbmfv->val[step->col];
+
+      if (force_wav && step->wav)
 	{
-	  switch (dfm->mfi_offset)
+	  memset(&wav, 0, sizeof(struct db_value));
+
+	  switch (step->wav)
 	    {
-	      case dbmfi_offsetof(type):
-		ptr = "wav";
-		strval = &ptr;
+	      case DMAP_WAV_TYPE:
+		wav.strval = "wav";
+		wav.len = 3;
 		break;
 
-	      case dbmfi_offsetof(bitrate):
-		val = 0;
-		ret = safe_atoi32(dbmfi->samplerate, &val);
-		if ((ret < 0) || (val == 0))
-		  val = 1411;
+	      case DMAP_WAV_BITRATE:
+		wav.intval = dbmfv_int(dbmfv, samplerate);
+		if (wav.intval == 0)
+		  wav.intval = 1411;
 		else
-		  val = (val * 8) / 250;
-
-		ptr = NULL;
-		strval = &ptr;
+		  wav.intval = (wav.intval * 8) / 250;
 		break;
 
-	      case dbmfi_offsetof(description):
-		ptr = "wav audio file";
-		strval = &ptr;
+	      case DMAP_WAV_DESCRIPTION:
+		wav.strval = "wav audio file";
+		wav.len = 14;
 		break;
 
 	      default:
 		break;
 	    }
+
+	  v = &wav;
 	}
 
-      dmap_add_field(song, df, *strval, val);
+      switch (step->op)
+	{
+	  case DMAP_PLAN_CHAR:
+	    if ((uint32_t)v->intval)
+	      dmap_add_char(song, step->tag, v->intval);
+	    break;
 
-      DPRINTF(E_DBG, L_DAAP, "Done with meta tag %s (%s)\n", df->desc, *strval);
-    }
+	  case DMAP_PLAN_SHORT:
+	    if ((uint32_t)v->intval)
+	      dmap_add_short(song, step->tag, v->intval);
+	    break;
 
-  if (sort_tags)
-    {
-      dmap_add_string(song, "assn", dbmfi->title_sort);
-      dmap_add_string(song, "assa", dbmfi->artist_sort);
-      dmap_add_string(song, "assu", dbmfi->album_sort);
-      dmap_add_string(song, "assl", dbmfi->album_artist_sort);
+	  case DMAP_PLAN_INT:
+	    if ((uint32_t)v->intval)
+	      dmap_add_int(song, step->tag, v->intval);
+	    break;
 
-      if (dbmfi->composer_sort)
-	dmap_add_string(song, "assc", dbmfi->composer_sort);
+	  case DMAP_PLAN_LONG:
+	    if (v->intval)
+	      dmap_add_long(song, step->tag, v->intval);
+	    break;
+
+	  case DMAP_PLAN_STRING:
+	    if (v->strval && (v->len > 0))
+	      dmap_add_literal(song, step->tag, (char *)v->strval, v->len);
+	    break;
+
+	  case DMAP_PLAN_CODECTYPE:
+	    if (v->len > 0)
+	      dmap_add_literal(song, step->tag, (char *)v->strval, 4);
+	    break;
+
+	  case DMAP_PLAN_SORT:
+	    dmap_add_literal(song, step->tag, (char *)v->strval, v->len);
+	    break;
+
+	  case DMAP_PLAN_SORT_OPT:
+	    if (v->strval)
+	      dmap_add_literal(song, step->tag, (char *)v->strval, v->len);
+	    break;
+	}
     }
 
   val = 0;
-  if (want_mikd)
+  if (plan->want_mikd)
     val += 9;
-  if (want_asdk)
+  if (plan->want_asdk)
     val += 9;
 
   dmap_add_container(songlist, "mlit", EVBUFFER_LENGTH(song) + val);
 
   /* Prepend mikd & asdk if needed */
-  if (want_mikd)
-    {
-      /* dmap.itemkind must come first */
-      ret = safe_atoi32(dbmfi->item_kind, &val);
-      if (ret < 0)
-	val = 2; /* music by default */
-      dmap_add_char(songlist, "mikd", val);
-    }
-  if (want_asdk)
+  if (plan->want_mikd)
     {
-      ret = safe_atoi32(dbmfi->data_kind, &val);
-      if (ret < 0)
-	val = 0;
-      dmap_add_char(songlist, "asdk", val);
+      /* dmap.itemkind must come first; music by default */
+      if (dbmfv_isnull(dbmfv, item_kind))
+	dmap_add_char(songlist, "mikd", 2);
+      else
+	dmap_add_char(songlist, "mikd", dbmfv_int(dbmfv, item_kind));
     }
+  if (plan->want_asdk)
+    dmap_add_char(songlist, "asdk", dbmfv_int(dbmfv, data_kind));
 
   ret = evbuffer_add_buffer(songlist, song);
   if (ret < 0)
@@ -533,3 +798,552 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
 
   return 0;
 }
+
+/* One-off encoding; song lists compile a plan once and use it for every song */
+int
+dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_values *dbmfv, const struct dmap_field **meta, int nmeta, int sort_tags, int force_wav)
+{
+  struct dmap_encode_plan *plan;
+  int ret;
+
+  plan = dmap_encode_plan_new(meta, nmeta, sort_tags);
+  if (!plan)
+    return -1;
+
+  ret = dmap_encode_file_plan(songlist, song, dbmfv, plan, force_wav);
+
+  dmap_encode_plan_free(plan);
+
+  return ret;
+}
+
+/* Pre-encoded songs
+ * Song lists for the same meta set keep sending the same bytes for a song
+ * until the song changes; the encoded mlit of each song is kept per plan and
+ * copied out as long as the song is unchanged. Filled as songs get encoded;
+ * once full, the songs used least recently make room.
+ */
+static inline unsigned int
+dmap_record_hash(int id, int force_wav, unsigned int nbuckets)
+{
+  return (((unsigned int)id << 1) | (force_wav != 0)) & (nbuckets - 1);
+}
+
+/* Lock held */
+static void
+dmap_record_unref(struct dmap_record *rec)
+{
+  rec->refs--;
+  if (rec->refs == 0)
+    free(rec);
+}
+
+/* Lock held */
+static void
+dmap_record_lru_unlink(struct dmap_record *rec)
+{
+  if (rec->lru_prev)
+    rec->lru_prev->lru_next = rec->lru_next;
+  else
+    records_lru_head = rec->lru_next;
+
+  if (rec->lru_next)
+    rec->lru_next->lru_prev = rec->lru_prev;
+  else
+    records_lru_tail = rec->lru_prev;
+
+  rec->lru_prev = NULL;
+  rec->lru_next = NULL;
+}
+
+/* Lock held */
+static void
+dmap_record_lru_push(struct dmap_record *rec)
+{
+  rec->lru_prev = NULL;
+  rec->lru_next = records_lru_head;
+
+  if (records_lru_head)
+    records_lru_head->lru_prev = rec;
+  else
+    records_lru_tail = rec;
+
+  records_lru_head = rec;
+}
+
+/* Lock held */
+static void
+dmap_record_set_clear(struct dmap_record_set *set)
+{
+  struct dmap_record *rec;
+  unsigned int i;
+
+  if (set->buckets)
+    {
+      for (i = 0; i < set->nbuckets; i++)
+	{
+	  while ((rec = set->buckets[i]))
+	    {
+	      set->buckets[i] = rec->next;
+	      dmap_record_lru_unlink(rec);
+	      dmap_record_unref(rec);
+	    }
+	}
+
+      free(set->buckets);
+    }
+
+  records_size -= set->size;
+
+  memset(set, 0, sizeof(struct dmap_record_set));
+}
+
+/* Lock held */
+static struct dmap_record_set *
+dmap_record_set_find(uint64_t sig)
+{
+  int i;
+
+  for (i = 0; i < DMAP_RECORD_SETS; i++)
+    {
+      if (record_sets[i].buckets && (record_sets[i].sig == sig))
+	{
+	  record_sets[i].tick = ++records_tick;
+	  return &record_sets[i];
+	}
+    }
+
+  return NULL;
+}
+
+/* Lock held; takes over the least recently used set if needed */
+static struct dmap_record_set *
+dmap_record_set_new(uint64_t sig)
+{
+  struct dmap_record_set *set;
+  int i;
+
+  set = NULL;
+  for (i = 0; i < DMAP_RECORD_SETS; i++)
+    {
+      if (!record_sets[i].buckets)
+	{
+	  set = &record_sets[i];
+	  break;
+	}
+
+      if (!set || (record_sets[i].tick < set->tick))
+	set = &record_sets[i];
+    }
+
+  dmap_record_set_clear(set);
+
+  set->buckets = (struct dmap_record **)malloc(DMAP_RECORD_BUCKETS * sizeof(struct dmap_record *));
+  if (!set->buckets)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Out of memory for pre-encoded songs\n");
+
+      return NULL;
+    }
+
+  memset(set->buckets, 0, DMAP_RECORD_BUCKETS * sizeof(struct dmap_record *));
+
+  set->sig = sig;
+  set->nbuckets = DMAP_RECORD_BUCKETS;
+  set->tick = ++records_tick;
+
+  return set;
+}
+
+/* Lock held */
+static void
+dmap_record_set_grow(struct dmap_record_set *set)
+{
+  struct dmap_record **buckets;
+  struct dmap_record *rec;
+  unsigned int nbuckets;
+  unsigned int h;
+  unsigned int i;
+
+  nbuckets = set->nbuckets * 2;
+
+  buckets = (struct dmap_record **)malloc(nbuckets * sizeof(struct dmap_record *));
+  if (!buckets)
+    return;
+
+  memset(buckets, 0, nbuckets * sizeof(struct dmap_record *));
+
+  for (i = 0; i < set->nbuckets; i++)
+    {
+      while ((rec = set->buckets[i]))
+	{
+	  set->buckets[i] = rec->next;
+
+	  h = dmap_record_hash(rec->id, rec->force_wav, nbuckets);
+	  rec->next = buckets[h];
+	  buckets[h] = rec;
+	}
+    }
+
+  free(set->buckets);
+
+  set->buckets = buckets;
+  set->nbuckets = nbuckets;
+}
+
+/* Lock held; returns the record for the song, valid or not */
+static struct dmap_record **
+dmap_record_find(struct dmap_record_set *set, int id, int force_wav)
+{
+  struct dmap_record **prec;
+
+  for (prec = &set->buckets[dmap_record_hash(id, force_wav, set->nbuckets)]; *prec; prec = &(*prec)->next)
+    {
+      if (((*prec)->id == id) && ((*prec)->force_wav == force_wav))
+	return prec;
+    }
+
+  return prec;
+}
+
+/* Lock held; takes the record out of its set */
+static void
+dmap_record_remove(struct dmap_record *rec)
+{
+  struct dmap_record_set *set;
+  struct dmap_record **prec;
+
+  set = rec->set;
+
+  prec = dmap_record_find(set, rec->id, rec->force_wav);
+  *prec = rec->next;
+
+  set->nrecords--;
+  set->size -= sizeof(struct dmap_record) + rec->len;
+  records_size -= sizeof(struct dmap_record) + rec->len;
+
+  dmap_record_lru_unlink(rec);
+  dmap_record_unref(rec);
+}
+
+/* Lock held; the set takes a reference on the record, making room for it
+ * if needed
+ */
+static void
+dmap_record_add(uint64_t sig, struct dmap_record *rec)
+{
+  struct dmap_record_set *set;
+  struct dmap_record **prec;
+  size_t size;
+
+  size = sizeof(struct dmap_record) + rec->len;
+  if (size > records_max_size)
+    return;
+
+  set = dmap_record_set_find(sig);
+  if (!set)
+    set = dmap_record_set_new(sig);
+
+  if (!set)
+    return;
+
+  /* Song changed, replace */
+  prec = dmap_record_find(set, rec->id, rec->force_wav);
+  if (*prec)
+    dmap_record_remove(*prec);
+
+  while (records_lru_tail && (records_size + size > records_max_size))
+    dmap_record_remove(records_lru_tail);
+
+  if (set->nrecords >= set->nbuckets * 2)
+    dmap_record_set_grow(set);
+
+  prec = dmap_record_find(set, rec->id, rec->force_wav);
+
+  rec->next = *prec;
+  *prec = rec;
+  rec->set = set;
+  rec->refs++;
+
+  dmap_record_lru_push(rec);
+
+  set->nrecords++;
+  set->size += size;
+  records_size += size;
+}
+
+/* Copies the song just encoded at the end of songlist into a new record,
+ * with no references yet
+ */
+static struct dmap_record *
+dmap_record_new(struct evbuffer *songlist, size_t len, struct db_media_file_values *dbmfv, int force_wav)
+{
+  struct dmap_record *rec;
+
+  rec = (struct dmap_record *)malloc(sizeof(struct dmap_record) + len);
+  if (!rec)
+    return NULL;
+
+  rec->id = dbmfv_int(dbmfv, id);
+  rec->force_wav = (force_wav != 0);
+  rec->refs = 0;
+  rec->db_timestamp = dbmfv_int(dbmfv, db_timestamp);
+  rec->play_count = dbmfv_int(dbmfv, play_count);
+  rec->time_played = dbmfv_int(dbmfv, time_played);
+  rec->len = len;
+  rec->next = NULL;
+  rec->set = NULL;
+  rec->lru_prev = NULL;
+  rec->lru_next = NULL;
+
+  memcpy(dmap_record_data(rec), EVBUFFER_DATA(songlist) + EVBUFFER_LENGTH(songlist) - len, len);
+
+  return rec;
+}
+
+/* Song lists encode their songs a page at a time, with the pre-encoded songs
+ * locked once for the page rather than for each song
+ */
+void
+dmap_records_page_start(void)
+{
+  pthread_mutex_lock(&records_lck);
+}
+
+void
+dmap_records_page_end(void)
+{
+  pthread_mutex_unlock(&records_lck);
+}
+
+/* Lock held; the pre-encoded song, if it is still valid */
+static struct dmap_record *
+dmap_record_lookup(struct db_media_file_values *dbmfv, const struct dmap_encode_plan *plan, int force_wav)
+{
+  struct dmap_record_set *set;
+  struct dmap_record *rec;
+
+  set = dmap_record_set_find(plan->sig);
+  if (!set)
+    return NULL;
+
+  rec = *dmap_record_find(set, dbmfv_int(dbmfv, id), (force_wav != 0));
+  if (!rec
+      || (rec->db_timestamp != dbmfv_int(dbmfv, db_timestamp))
+      || (rec->play_count != dbmfv_int(dbmfv, play_count))
+      || (rec->time_played != dbmfv_int(dbmfv, time_played)))
+    return NULL;
+
+  /* Used again, last to make room */
+  dmap_record_lru_unlink(rec);
+  dmap_record_lru_push(rec);
+
+  return rec;
+}
+
+/* Like dmap_encode_file_plan(), using the pre-encoded song if there is one;
+ * dbmfv must have DMAP_RECORD_COLS. Call within a page.
+ */
+int
+dmap_encode_file_record(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_values *dbmfv, const struct dmap_encode_plan *plan, int force_wav)
+{
+  struct dmap_record *rec;
+  uint32_t db_timestamp;
+  size_t len;
+  int ret;
+
+  if (records_max_size == 0)
+    return dmap_encode_file_plan(songlist, song, dbmfv, plan, force_wav);
+
+  rec = dmap_record_lookup(dbmfv, plan, force_wav);
+  if (rec)
+    {
+      ret = evbuffer_add(songlist, dmap_record_data(rec), rec->len);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_DAAP, "Could not add song to song list\n");
+
+	  return -1;
+	}
+
+      return 0;
+    }
+
+  /* Not there or outdated */
+  len = EVBUFFER_LENGTH(songlist);
+
+  ret = dmap_encode_file_plan(songlist, song, dbmfv, plan, force_wav);
+  if (ret < 0)
+    return -1;
+
+  len = EVBUFFER_LENGTH(songlist) - len;
+
+  /* db_timestamp has a resolution of one second; the song may still change
+   * within the second without a new timestamp, so wait until it is over
+   */
+  db_timestamp = dbmfv_int(dbmfv, db_timestamp);
+  if (db_timestamp >= (uint32_t)time(NULL))
+    return 0;
+
+  rec = dmap_record_new(songlist, len, dbmfv, force_wav);
+  if (!rec)
+    return 0;
+
+  dmap_record_add(plan->sig, rec);
+  if (rec->refs == 0)
+    free(rec);
+
+  return 0;
+}
+
+/* The encoded song, pre-encoded or encoded now, with a reference for the
+ * caller; a song list can hold on to its songs this way and send them
+ * later without going back to the database. Uses scratch as the song list
+ * to encode into. Call within a page.
+ */
+struct dmap_record *
+dmap_file_record_get(struct evbuffer *scratch, struct evbuffer *song, struct db_media_file_values *dbmfv, const struct dmap_encode_plan *plan, int force_wav)
+{
+  struct dmap_record *rec;
+  uint32_t db_timestamp;
+  int ret;
+
+  rec = (records_max_size > 0) ? dmap_record_lookup(dbmfv, plan, force_wav) : NULL;
+  if (rec)
+    {
+      rec->refs++;
+      return rec;
+    }
+
+  /* Not there or outdated */
+  evbuffer_drain(scratch, EVBUFFER_LENGTH(scratch));
+
+  ret = dmap_encode_file_plan(scratch, song, dbmfv, plan, force_wav);
+  if (ret < 0)
+    return NULL;
+
+  rec = dmap_record_new(scratch, EVBUFFER_LENGTH(scratch), dbmfv, force_wav);
+
+  evbuffer_drain(scratch, EVBUFFER_LENGTH(scratch));
+
+  if (!rec)
+    return NULL;
+
+  rec->refs = 1;
+
+  /* See dmap_encode_file_record() */
+  db_timestamp = dbmfv_int(dbmfv, db_timestamp);
+  if ((records_max_size > 0) && (db_timestamp < (uint32_t)time(NULL)))
+    dmap_record_add(plan->sig, rec);
+
+  return rec;
+}
+
+size_t
+dmap_record_len(const struct dmap_record *rec)
+{
+  return rec->len;
+}
+
+int
+dmap_records_add(struct evbuffer *songlist, struct dmap_record **recs, int nrecs)
+{
+  int ret;
+  int i;
+
+  for (i = 0; i < nrecs; i++)
+    {
+      ret = evbuffer_add(songlist, dmap_record_data(recs[i]), recs[i]->len);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_DAAP, "Could not add song to song list\n");
+
+	  return -1;
+	}
+    }
+
+  return 0;
+}
+
+/* Drops the references of a song list on its songs */
+void
+dmap_records_unref(struct dmap_record **recs, int nrecs)
+{
+  int i;
+
+  pthread_mutex_lock(&records_lck);
+
+  for (i = 0; i < nrecs; i++)
+    dmap_record_unref(recs[i]);
+
+  pthread_mutex_unlock(&records_lck);
+}
+
+void
+dmap_records_init(void)
+{
+  pthread_mutex_init(&records_lck, NULL);
+
+  memset(record_sets, 0, sizeof(record_sets));
+  records_lru_head = NULL;
+  records_lru_tail = NULL;
+  records_tick = 0;
+  records_size = 0;
+  records_max_size = (size_t)cfg_getint(cfg_getsec(cfg, "library"), "song_cache_size") * 1024 * 1024;
+}
+
+/* Song lists are encoded on the HTTP connections, all of them are gone by
+ * the time this runs (httpd_deinit() waits for them)
+ */
+void
+dmap_records_deinit(void)
+{
+  int i;
+
+  pthread_mutex_lock(&records_lck);
+
+  for (i = 0; i < DMAP_RECORD_SETS; i++)
+    dmap_record_set_clear(&record_sets[i]);
+
+  records_max_size = 0;
+
+  pthread_mutex_unlock(&records_lck);
+
+  pthread_mutex_destroy(&records_lck);
+}
+
+/* Columns dmap_encode_file_metadata() needs for the given meta list,
+ * as a query_params.cols set; 0 if everything is needed */
+uint64_t
+dmap_file_metadata_cols(const struct dmap_field **meta, int nmeta, int sort_tags)
+{
+  const struct dmap_field_map *dfm;
+  uint64_t cols;
+  int i;
+
+  /* No specific meta tags requested, everything goes out */
+  if (nmeta <= 0)
+    return 0;
+
+  cols = dbmfi_col(id);
+
+  for (i = 0; i < nmeta; i++)
+    {
+      dfm = meta[i]->dfm;
+
+      if (dfm->mfi_offset < 0)
+	continue;
+
+      cols |= dbmfi_col_byoffset(dfm->mfi_offset);
+
+      /* Transcoded bitrate is derived from the samplerate */
+      if (dfm->mfi_offset == dbmfi_offsetof(bitrate))
+	cols |= dbmfi_col(samplerate);
+    }
+
+  if (sort_tags)
+    cols |= dbmfi_col(title_sort) | dbmfi_col(artist_sort) | dbmfi_col(album_sort)
+      | dbmfi_col(album_artist_sort) | dbmfi_col(composer_sort);
+
+  return cols;
+}
@@ -37,6 +37,9 @@ struct dmap_field {
 };
 
 
+struct dmap_encode_plan;
+
+
 extern const struct dmap_field_map dfm_dmap_mimc;
 extern const struct dmap_field_map dfm_dmap_aeSP;
 
@@ -71,14 +74,58 @@ void
 dmap_add_string(struct evbuffer *evbuf, char *tag, const char *str);
 
 void
-dmap_add_field(struct evbuffer *evbuf, const struct dmap_field *df, char *strval, int32_t intval);
+dmap_add_field(struct evbuffer *evbuf, const struct dmap_field *df, char *strval, int64_t intval);
 
 
 int
 dmap_send_error(struct httpd_hdl *h, char *container, char *errmsg);
 
 
+struct dmap_encode_plan *
+dmap_encode_plan_new(const struct dmap_field **meta, int nmeta, int sort_tags);
+
+void
+dmap_encode_plan_free(struct dmap_encode_plan *plan);
+
+int
+dmap_encode_file_plan(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_values *dbmfv, const struct dmap_encode_plan *plan, int force_wav);
+
+void
+dmap_records_page_start(void);
+
+void
+dmap_records_page_end(void);
+
+/* Columns dmap_encode_file_record() tells changed songs with */
+#define DMAP_RECORD_COLS (dbmfi_col(id) | dbmfi_col(db_timestamp) | dbmfi_col(play_count) | dbmfi_col(time_played))
+
+int
+dmap_encode_file_record(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_values *dbmfv, const struct dmap_encode_plan *plan, int force_wav);
+
+struct dmap_record;
+
+struct dmap_record *
+dmap_file_record_get(struct evbuffer *scratch, struct evbuffer *song, struct db_media_file_values *dbmfv, const struct dmap_encode_plan *plan, int force_wav);
+
+size_t
+dmap_record_len(const struct dmap_record *rec);
+
 int
-dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_info *dbmfi, const struct dmap_field **meta, int nmeta, int sort_tags, int force_wav);
+dmap_records_add(struct evbuffer *songlist, struct dmap_record **recs, int nrecs);
+
+void
+dmap_records_unref(struct dmap_record **recs, int nrecs);
+
+void
+dmap_records_init(void);
+
+void
+dmap_records_deinit(void);
+
+int
+dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_values *dbmfv, const struct dmap_field **meta, int nmeta, int sort_tags, int force_wav);
+
+uint64_t
+dmap_file_metadata_cols(const struct dmap_field **meta, int nmeta, int sort_tags);
 
 #endif /* !__DMAP_HELPERS_H__ */
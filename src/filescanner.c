@@ -298,7 +298,7 @@ process_media_file(char *file, time_t mtime, off_t size, int compilation)
   memset(&mfi, 0, sizeof(struct media_file_info));
 
   if (stamp)
-    mfi.id = db_file_id_bypath(file);
+    mfi.id = id;
 
   filename = strrchr(file, '/');
   if (!filename)
@@ -444,6 +444,12 @@ defer_playlist(char *path)
 		       return;
 		     }
 
+		   /* Commit the pending batch so the readers see the files the
+		    * playlist refers to; the playlist's own writes take the
+		    * writer one by one, like the rest of the scanner
+		    */
+		   db_batch_flush();
+
 		   process_playlist(pl_path);
 
 		   free(pl_path);
@@ -770,9 +776,20 @@ bulk_scan(void)
   char *deref;
   time_t start;
   int i;
+  int ret;
 
   start = time(NULL);
 
+  /* Group the scanner's writes into transactions until the purge */
+  ret = db_batch_start();
+  if (ret < 0)
+    DPRINTF(E_LOG, L_SCAN, "Could not start batched writes, scanning without\n");
+
+  /* Look up known files in memory rather than one by one in the DB */
+  ret = db_file_stamps_load();
+  if (ret < 0)
+    DPRINTF(E_LOG, L_SCAN, "Could not load file stamps, looking up files in the DB\n");
+
   lib = cfg_getsec(cfg, "library");
 
   ndirs = cfg_size(lib, "directories");
@@ -817,6 +834,8 @@ bulk_scan(void)
 					       return;
 					     }
 
+					   db_batch_end();
+
 					   DPRINTF(E_DBG, L_SCAN, "Purging old database content\n");
 					   db_purge_cruft(start);
 
@@ -1493,5 +1512,8 @@ filescanner_deinit(void)
   if (ret != 0)
     DPRINTF(E_LOG, L_SCAN, "Error waiting for dispatch group\n");
 
+  /* Commit whatever the interrupted bulk scan left pending */
+  db_batch_end();
+
   /* deferred_pl_sq resumed & released after completion of the bulk scan */
 }
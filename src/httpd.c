@@ -51,6 +51,7 @@
 #include "httpd_daap.h"
 #include "httpd_dacp.h"
 #include "transcode.h"
+#include "query_cache.h"
 
 
 /*
@@ -94,6 +95,11 @@ struct stream_ctx {
   struct transcode_ctx *xcode;
 };
 
+/* Streamed gzip encoding, for replies too big to compress in one go */
+struct httpd_gzip {
+  z_stream strm;
+};
+
 
 static const struct content_type_map ext2ctype[] =
   {
@@ -604,104 +610,211 @@ httpd_stream_file(struct http_connection *c, struct http_request *req, struct ht
 }
 
 int
-httpd_send_reply(struct http_connection *c, struct http_request *req, struct http_response *r, struct evbuffer *evbuf)
+httpd_gzip_accepted(struct http_request *req)
 {
-  unsigned char outbuf[128 * 1024];
-  z_stream strm;
-  struct evbuffer *gzbuf;
   const char *param;
-  int flush;
-  int zret;
-  int ret;
-
-  if (!evbuf || (EVBUFFER_LENGTH(evbuf) == 0))
-    {
-      DPRINTF(E_DBG, L_HTTPD, "Not gzipping body-less reply\n");
-
-      goto no_gzip;
-    }
 
   param = http_request_get_header(req, "Accept-Encoding");
   if (!param)
     {
       DPRINTF(E_DBG, L_HTTPD, "Not gzipping; no Accept-Encoding header\n");
 
-      goto no_gzip;
+      return 0;
     }
   else if (!strstr(param, "gzip") && !strstr(param, "*"))
     {
       DPRINTF(E_DBG, L_HTTPD, "Not gzipping; gzip not in Accept-Encoding (%s)\n", param);
 
-      goto no_gzip;
+      return 0;
     }
 
-  gzbuf = evbuffer_new();
-  if (!gzbuf)
-    {
-      DPRINTF(E_LOG, L_HTTPD, "Could not allocate evbuffer for gzipped reply\n");
+  return 1;
+}
 
-      goto no_gzip;
-    }
+static int
+gzip_init(z_stream *strm)
+{
+  int zret;
 
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
+  strm->zalloc = Z_NULL;
+  strm->zfree = Z_NULL;
+  strm->opaque = Z_NULL;
 
   /* Set up a gzip stream (the "+ 16" in 15 + 16), instead of a zlib stream (default) */
-  zret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+  zret = deflateInit2(strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
   if (zret != Z_OK)
     {
       DPRINTF(E_DBG, L_HTTPD, "zlib setup failed: %s\n", zError(zret));
 
-      goto out_fail_init;
+      return -1;
     }
 
-  strm.next_in = EVBUFFER_DATA(evbuf);
-  strm.avail_in = EVBUFFER_LENGTH(evbuf);
+  return 0;
+}
+
+/* Consumes all of data, finishing the stream if flush is Z_FINISH */
+static int
+gzip_deflate(z_stream *strm, unsigned char *data, size_t len, struct evbuffer *out, int flush)
+{
+  unsigned char outbuf[64 * 1024];
+  int zret;
+  int ret;
 
-  flush = Z_NO_FLUSH;
+  strm->next_in = data;
+  strm->avail_in = len;
 
-  /* 2 iterations: Z_NO_FLUSH until input is consumed, then Z_FINISH */
-  for (;;)
+  do
     {
-      do
-	{
-	  strm.next_out = outbuf;
-	  strm.avail_out = sizeof(outbuf);
+      strm->next_out = outbuf;
+      strm->avail_out = sizeof(outbuf);
 
-	  zret = deflate(&strm, flush);
-	  if (zret == Z_STREAM_ERROR)
-	    {
-	      DPRINTF(E_LOG, L_HTTPD, "Could not deflate data: %s\n", strm.msg);
+      zret = deflate(strm, flush);
+      if (zret == Z_STREAM_ERROR)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Could not deflate data: %s\n", strm->msg);
 
-	      goto out_fail_gz;
-	    }
+	  return -1;
+	}
 
-	  ret = evbuffer_add(gzbuf, outbuf, sizeof(outbuf) - strm.avail_out);
-	  if (ret < 0)
-	    {
-	      DPRINTF(E_LOG, L_HTTPD, "Out of memory adding gzipped data to evbuffer\n");
+      ret = evbuffer_add(out, outbuf, sizeof(outbuf) - strm->avail_out);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Out of memory adding gzipped data to evbuffer\n");
 
-	      goto out_fail_gz;
-	    }
+	  return -1;
 	}
-      while (strm.avail_out == 0);
+    }
+  while (strm->avail_out == 0);
+
+  if ((flush == Z_FINISH) && (zret != Z_STREAM_END))
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Compressed data not finalized!\n");
+
+      return -1;
+    }
+
+  return 0;
+}
+
+/* Returns NULL if the client does not accept gzip or if setup fails; the reply
+ * then goes out uncompressed. Adds the Content-Encoding header otherwise.
+ */
+struct httpd_gzip *
+httpd_gzip_new(struct http_request *req, struct http_response *r)
+{
+  struct httpd_gzip *gz;
+  int ret;
+
+  if (!httpd_gzip_accepted(req))
+    return NULL;
 
-      if (flush == Z_FINISH)
-	break;
+  gz = (struct httpd_gzip *)malloc(sizeof(struct httpd_gzip));
+  if (!gz)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Out of memory for gzip stream\n");
 
-      flush = Z_FINISH;
+      return NULL;
     }
 
-  if (zret != Z_STREAM_END)
+  ret = gzip_init(&gz->strm);
+  if (ret < 0)
     {
-      DPRINTF(E_LOG, L_HTTPD, "Compressed data not finalized!\n");
+      free(gz);
+      return NULL;
+    }
+
+  ret = http_response_add_header(r, "Content-Encoding", "gzip");
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Out of memory for Content-Encoding: gzip header, not gzipping\n");
+
+      deflateEnd(&gz->strm);
+      free(gz);
+      return NULL;
+    }
+
+  return gz;
+}
+
+/* Drains in into the gzip stream and adds whatever compressed data is ready
+ * to out; out may stay empty until enough input has been fed, unless finish
+ * is set, which ends the stream.
+ */
+int
+httpd_gzip_deflate(struct httpd_gzip *gz, struct evbuffer *in, struct evbuffer *out, int finish)
+{
+  int ret;
+
+  ret = gzip_deflate(&gz->strm, EVBUFFER_DATA(in), EVBUFFER_LENGTH(in), out, (finish) ? Z_FINISH : Z_NO_FLUSH);
+
+  evbuffer_drain(in, EVBUFFER_LENGTH(in));
+
+  return ret;
+}
+
+void
+httpd_gzip_free(struct httpd_gzip *gz)
+{
+  deflateEnd(&gz->strm);
+  free(gz);
+}
+
+/* Compresses evbuf in one go, leaving it untouched; returns NULL on error */
+struct evbuffer *
+httpd_gzip_buffer(struct evbuffer *evbuf)
+{
+  z_stream strm;
+  struct evbuffer *gzbuf;
+  int ret;
 
-      goto out_fail_gz;
+  gzbuf = evbuffer_new();
+  if (!gzbuf)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not allocate evbuffer for gzipped reply\n");
+
+      return NULL;
     }
 
+  ret = gzip_init(&strm);
+  if (ret < 0)
+    goto out_fail_init;
+
+  ret = gzip_deflate(&strm, EVBUFFER_DATA(evbuf), EVBUFFER_LENGTH(evbuf), gzbuf, Z_FINISH);
+  if (ret < 0)
+    goto out_fail_gz;
+
   deflateEnd(&strm);
 
+  return gzbuf;
+
+ out_fail_gz:
+  deflateEnd(&strm);
+ out_fail_init:
+  evbuffer_free(gzbuf);
+
+  return NULL;
+}
+
+int
+httpd_send_reply(struct http_connection *c, struct http_request *req, struct http_response *r, struct evbuffer *evbuf)
+{
+  struct evbuffer *gzbuf;
+  int ret;
+
+  if (!evbuf || (EVBUFFER_LENGTH(evbuf) == 0))
+    {
+      DPRINTF(E_DBG, L_HTTPD, "Not gzipping body-less reply\n");
+
+      goto no_gzip;
+    }
+
+  if (!httpd_gzip_accepted(req))
+    goto no_gzip;
+
+  gzbuf = httpd_gzip_buffer(evbuf);
+  if (!gzbuf)
+    goto no_gzip;
+
   ret = http_response_add_header(r, "Content-Encoding", "gzip");
   if (ret < 0)
     {
@@ -720,11 +833,6 @@ httpd_send_reply(struct http_connection *c, struct http_request *req, struct htt
 
   return 0;
 
- out_fail_gz:
-  deflateEnd(&strm);
- out_fail_init:
-  evbuffer_free(gzbuf);
-
  no_gzip:
   http_response_set_body(r, evbuf);
 
@@ -788,22 +896,16 @@ redirect_to_index(struct http_connection *c, struct http_response *r, char *uri)
   return http_server_error_run(c, r, HTTP_INTERNAL_ERROR, "Internal Server Error");
 }
 
+/* Returns HTTP_OK if the request may proceed; otherwise a response has
+ * been sent and the return value is that of the request callback
+ */
 static int
-serve_file(struct http_connection *c, struct http_request *req, struct http_response *r, char *uri)
+check_admin_auth(struct http_connection *c, struct http_request *req, struct http_response *r)
 {
-  char path[PATH_MAX];
   char remote_host[NCONN_ADDRSTRLEN];
-  char *ext;
-  char *deref;
-  char *ctype;
   char *passwd;
-  struct evbuffer *evbuf;
-  struct stat sb;
-  int fd;
-  int i;
   int ret;
 
-  /* Check authentication */
   passwd = cfg_getstr(cfg_getsec(cfg, "general"), "admin_password");
   if (passwd)
     {
@@ -814,7 +916,7 @@ serve_file(struct http_connection *c, struct http_request *req, struct http_resp
 	{
 	  case HTTP_OK:
 	    DPRINTF(E_DBG, L_HTTPD, "Authentication successful\n");
-	    break;
+	    return HTTP_OK;
 
 	  case -1:
 	    /* Kill connection */
@@ -825,19 +927,151 @@ serve_file(struct http_connection *c, struct http_request *req, struct http_resp
 	    return 0;
 	}
     }
-  else
+
+  remote_host[0] = '\0';
+  http_connection_get_remote_addr(c, remote_host);
+  if ((strcmp(remote_host, "::1") != 0) &&
+      (strcmp(remote_host, "127.0.0.1") != 0))
     {
-      remote_host[0] = '\0';
-      http_connection_get_remote_addr(c, remote_host);
-      if ((strcmp(remote_host, "::1") != 0) &&
-	  (strcmp(remote_host, "127.0.0.1") != 0))
-	{
-	  DPRINTF(E_LOG, L_HTTPD, "Remote web interface request denied; no password set\n");
+      DPRINTF(E_LOG, L_HTTPD, "Remote web interface request denied; no password set\n");
 
-	  return http_server_error_run(c, r, HTTP_FORBIDDEN, "Forbidden");
-	}
+      return http_server_error_run(c, r, HTTP_FORBIDDEN, "Forbidden");
+    }
+
+  return HTTP_OK;
+}
+
+/* Database statistics, as text/plain
+ * /admin/db?profile=on|off switches statement profiling, &reset=1 clears it
+ */
+static int
+serve_admin_db(struct http_connection *c, struct http_request *req, struct http_response *r)
+{
+  struct db_pool_stats pstats;
+  struct query_cache_stats qstats;
+  struct db_profile_stats *stats;
+  struct evbuffer *evbuf;
+  struct keyval query;
+  const char *param;
+  char *full_uri;
+  int nstats;
+  int enabled;
+  int i;
+  int ret;
+
+  ret = check_admin_auth(c, req, r);
+  if (ret != HTTP_OK)
+    return ret;
+
+  memset(&query, 0, sizeof(struct keyval));
+
+  full_uri = httpd_fixup_uri(req);
+  if (full_uri)
+    {
+      ret = http_parse_query_string(full_uri, &query);
+      free(full_uri);
+      if (ret < 0)
+	return http_server_error_run(c, r, HTTP_INTERNAL_ERROR, "Internal Server Error");
+    }
+
+  param = keyval_get(&query, "profile");
+  if (param)
+    db_profile_set(strcmp(param, "on") == 0);
+
+  param = keyval_get(&query, "reset");
+  if (param && (strcmp(param, "1") == 0))
+    db_profile_reset();
+
+  keyval_clear(&query);
+
+  evbuf = evbuffer_new();
+  if (!evbuf)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not create evbuffer\n");
+
+      return http_server_error_run(c, r, HTTP_INTERNAL_ERROR, "Internal Server Error");
+    }
+
+  db_pool_stats_get(&pstats);
+
+  evbuffer_add_printf(evbuf, "readers: %d (%d free, %d max)\n", pstats.readers, pstats.readers_free, pstats.readers_max);
+  evbuffer_add_printf(evbuf, "reader gets: %" PRIu64 ", wait %" PRIu64 " usec (max %" PRIu64 ")\n",
+		      pstats.reader_gets, pstats.reader_wait_usec, pstats.reader_wait_max_usec);
+  evbuffer_add_printf(evbuf, "writer gets: %" PRIu64 ", wait %" PRIu64 " usec (max %" PRIu64 ")\n",
+		      pstats.writer_gets, pstats.writer_wait_usec, pstats.writer_wait_max_usec);
+
+  query_cache_stats_get(QUERY_CACHE_DAAP, &qstats);
+  evbuffer_add_printf(evbuf, "daap query cache: %d/%d entries, %" PRIu64 " hits, %" PRIu64 " misses\n",
+		      qstats.entries, qstats.size, qstats.hits, qstats.misses);
+  query_cache_stats_get(QUERY_CACHE_RSP, &qstats);
+  evbuffer_add_printf(evbuf, "rsp query cache: %d/%d entries, %" PRIu64 " hits, %" PRIu64 " misses\n",
+		      qstats.entries, qstats.size, qstats.hits, qstats.misses);
+
+  enabled = db_profile_get(&stats, &nstats);
+  if (enabled < 0)
+    {
+      evbuffer_free(evbuf);
+
+      return http_server_error_run(c, r, HTTP_INTERNAL_ERROR, "Internal Server Error");
+    }
+
+  evbuffer_add_printf(evbuf, "\nprofiling: %s\n", (enabled) ? "on" : "off");
+  evbuffer_add_printf(evbuf, "calls\trows\ttotal_usec\tp50_usec\tp99_usec\twait_usec\tquery\n");
+
+  for (i = 0; i < nstats; i++)
+    {
+      if (stats[i].calls == 0)
+	continue;
+
+      evbuffer_add_printf(evbuf, "%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%s\n",
+			  stats[i].calls, stats[i].rows, stats[i].usec, stats[i].p50_usec, stats[i].p99_usec,
+			  stats[i].wait_usec, stats[i].query);
+    }
+
+  db_profile_stats_free(stats, nstats);
+
+  http_response_set_body(r, evbuf);
+
+  ret = http_response_add_header(r, "Content-Type", "text/plain; charset=utf-8");
+  if (ret < 0)
+    goto out_unavail;
+
+  ret = http_response_set_status(r, HTTP_OK, "OK");
+  if (ret < 0)
+    goto out_unavail;
+
+  ret = http_server_response_run(c, r);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Failed to serve database statistics: could not run response\n");
+
+      goto out_unavail;
     }
 
+  return 0;
+
+ out_unavail:
+  return http_server_error_run(c, r, HTTP_INTERNAL_ERROR, "Internal Server Error");
+}
+
+static int
+serve_file(struct http_connection *c, struct http_request *req, struct http_response *r, char *uri)
+{
+  char path[PATH_MAX];
+  char *ext;
+  char *deref;
+  char *ctype;
+  struct evbuffer *evbuf;
+  struct stat sb;
+  int fd;
+  int i;
+  int ret;
+
+  /* Check authentication */
+  ret = check_admin_auth(c, req, r);
+  if (ret != HTTP_OK)
+    return ret;
+
   ret = snprintf(path, sizeof(path), "%s%s", WEBFACE_ROOT, uri + 1); /* skip starting '/' */
   if ((ret < 0) || (ret >= sizeof(path)))
     {
@@ -1026,6 +1260,13 @@ httpd_cb(struct http_connection *c, struct http_request *req, struct http_respon
 
   DPRINTF(E_DBG, L_HTTPD, "HTTP request: %s\n", uri);
 
+  if (strcmp(uri, "/admin/db") == 0)
+    {
+      free(uri);
+
+      return serve_admin_db(c, req, r);
+    }
+
   /* Serve web interface files */
   ret = serve_file(c, req, r, uri);
 
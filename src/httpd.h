@@ -12,8 +12,14 @@ struct httpd_hdl {
   struct http_response *r;
 
   struct keyval *query;
+
+  /* Key and library revision for replies that can be cached */
+  char *cache_key;
+  int cache_rev;
 };
 
+struct httpd_gzip;
+
 
 int
 httpd_stream_file(struct http_connection *c, struct http_request *req, struct http_response *r, int id);
@@ -21,6 +27,21 @@ httpd_stream_file(struct http_connection *c, struct http_request *req, struct ht
 int
 httpd_send_reply(struct http_connection *c, struct http_request *req, struct http_response *r, struct evbuffer *evbuf);
 
+int
+httpd_gzip_accepted(struct http_request *req);
+
+struct evbuffer *
+httpd_gzip_buffer(struct evbuffer *evbuf);
+
+struct httpd_gzip *
+httpd_gzip_new(struct http_request *req, struct http_response *r);
+
+int
+httpd_gzip_deflate(struct httpd_gzip *gz, struct evbuffer *in, struct evbuffer *out, int finish);
+
+void
+httpd_gzip_free(struct httpd_gzip *gz);
+
 int
 httpd_send_error(struct http_connection *c, struct http_response *r, int code, char *reason);
 
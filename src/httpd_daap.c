@@ -54,18 +54,28 @@
 #include "httpd_daap.h"
 #include "daap_query.h"
 #include "dmap_common.h"
+#include "sort_bucket.h"
 
 
 /* Session timeout in seconds */
 #define DAAP_SESSION_TIMEOUT 1800
 /* Update requests refresh interval in seconds */
 #define DAAP_UPDATE_REFRESH  300
+/* Song lists bigger than this (in bytes) are streamed, not built in memory */
+#define DAAP_SONGLIST_STREAM_MIN  (256 * 1024)
+/* Songs encoded per page of a song list, one chunk when streaming */
+#define DAAP_SONGLIST_PAGE_SIZE   256
+/* Largest cached reply, as a fraction of the reply cache size */
+#define DAAP_CACHE_ENTRY_SHARE    4
+/* Cached replies bigger than this are sent in chunks */
+#define DAAP_CACHE_CHUNK_SIZE     (64 * 1024)
 
 
 struct uri_map {
   regex_t preg;
   char *regexp;
   int (*handler)(struct httpd_hdl *h, struct evbuffer *evbuf, char **uri);
+  int cacheable;
 };
 
 struct daap_session {
@@ -93,6 +103,50 @@ struct sort_ctx {
   uint32_t misc_mshn;
 };
 
+/* Cached reply, gzipped; referenced by the cache and by the replies being
+ * sent from it
+ */
+struct daap_cache_entry {
+  char *key;
+  struct evbuffer *body;
+  int refs;
+
+  struct daap_cache_entry *prev;
+  struct daap_cache_entry *next;
+};
+
+/* Big cached reply being sent in chunks */
+struct cache_stream {
+  struct daap_cache_entry *ce;
+  size_t offset;
+  struct evbuffer *evbuf;
+};
+
+/* Streamed song list; the songs past the first ones are kept as the
+ * encoded songs that sized the list, so sending them needs no database
+ * access and no encoding, and they can't change under the stream
+ */
+struct songlist_stream {
+  struct dmap_record **recs;
+  int nrecs;
+  int next;
+  int done;
+
+  struct sort_ctx *sctx;
+
+  struct evbuffer *song;
+  struct evbuffer *evbuf;
+
+  /* Compressed output, if gzip is accepted */
+  struct httpd_gzip *gz;
+  struct evbuffer *gzbuf;
+
+  /* Copy of the compressed output for the reply cache */
+  char *cache_key;
+  int cache_rev;
+  struct evbuffer *cachebuf;
+};
+
 
 /* Default meta tags if not provided in the query */
 static char *default_meta_plsongs = "dmap.itemkind,dmap.itemid,dmap.itemname,dmap.containeritemid,dmap.parentcontainerid";
@@ -109,6 +163,14 @@ static int current_rev;
 static dispatch_queue_t updates_sq;
 static struct daap_update_request *update_requests;
 
+/* Reply cache, most recently used first */
+static dispatch_queue_t cache_sq;
+static struct daap_cache_entry *cache_head;
+static struct daap_cache_entry *cache_tail;
+static size_t cache_size;
+static size_t cache_max_size;
+static int cache_rev;
+
 
 /* Session handling */
 static int
@@ -278,6 +340,472 @@ daap_session_find(struct httpd_hdl *h, struct daap_session **s)
 }
 
 
+/* Reply cache
+ * Clients reconnecting all ask for the same lists; the gzipped replies are
+ * kept for as long as the library revision they were built from is current.
+ */
+
+/* Queue: cache_sq */
+static void
+daap_cache_entry_unref(struct daap_cache_entry *ce)
+{
+  ce->refs--;
+  if (ce->refs > 0)
+    return;
+
+  free(ce->key);
+  evbuffer_free(ce->body);
+  free(ce);
+}
+
+/* Queue: cache_sq */
+static void
+daap_cache_remove(struct daap_cache_entry *ce)
+{
+  if (ce->prev)
+    ce->prev->next = ce->next;
+  else
+    cache_head = ce->next;
+
+  if (ce->next)
+    ce->next->prev = ce->prev;
+  else
+    cache_tail = ce->prev;
+
+  cache_size -= EVBUFFER_LENGTH(ce->body);
+
+  daap_cache_entry_unref(ce);
+}
+
+/* Queue: cache_sq */
+static void
+daap_cache_purge(void)
+{
+  while (cache_head)
+    daap_cache_remove(cache_head);
+}
+
+/* Queue: cache_sq */
+static int
+daap_cache_rev_check(int rev)
+{
+  if (rev > cache_rev)
+    {
+      DPRINTF(E_DBG, L_DAAP, "Library revision %d, dropping cached replies\n", rev);
+
+      daap_cache_purge();
+      cache_rev = rev;
+    }
+
+  return (rev == cache_rev);
+}
+
+static char *
+daap_cache_key(struct httpd_hdl *h, char **uri_parts)
+{
+  static const char *params[] = { "meta", "query", "filter", "sort", "index", "include-sort-headers" };
+  struct evbuffer *evbuf;
+  const char *codecs;
+  const char *val;
+  char *key;
+  int ret;
+  int i;
+
+  evbuf = evbuffer_new();
+  if (!evbuf)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Could not allocate evbuffer for reply cache key\n");
+
+      return NULL;
+    }
+
+  for (i = 0; uri_parts[i]; i++)
+    {
+      ret = evbuffer_add_printf(evbuf, "/%s", uri_parts[i]);
+      if (ret < 0)
+	goto oom;
+    }
+
+  for (i = 0; i < (sizeof(params) / sizeof(params[0])); i++)
+    {
+      val = keyval_get(h->query, params[i]);
+      if (!val)
+	continue;
+
+      ret = evbuffer_add_printf(evbuf, "&%s=%s", params[i], val);
+      if (ret < 0)
+	goto oom;
+    }
+
+  /* Song lists tell which songs will be transcoded to WAV */
+  codecs = transcode_client_codecs(h->req);
+
+  ret = evbuffer_add_printf(evbuf, "&codecs=%s", (codecs) ? codecs : "");
+  if (ret < 0)
+    goto oom;
+
+  key = strndup((char *)EVBUFFER_DATA(evbuf), EVBUFFER_LENGTH(evbuf));
+  if (!key)
+    goto oom;
+
+  evbuffer_free(evbuf);
+
+  return key;
+
+ oom:
+  DPRINTF(E_LOG, L_DAAP, "Out of memory for reply cache key\n");
+
+  evbuffer_free(evbuf);
+
+  return NULL;
+}
+
+/* Returns a reference to the cached reply, NULL if there's none */
+static struct daap_cache_entry *
+daap_cache_get(const char *key, int rev)
+{
+  __block struct daap_cache_entry *b_ce;
+
+  b_ce = NULL;
+
+  dispatch_sync(cache_sq, ^{
+      struct daap_cache_entry *ce;
+
+      if (!daap_cache_rev_check(rev))
+	return;
+
+      for (ce = cache_head; ce; ce = ce->next)
+	{
+	  if (strcmp(ce->key, key) == 0)
+	    break;
+	}
+
+      if (!ce)
+	return;
+
+      /* Move to the front */
+      if (ce != cache_head)
+	{
+	  ce->prev->next = ce->next;
+	  if (ce->next)
+	    ce->next->prev = ce->prev;
+	  else
+	    cache_tail = ce->prev;
+
+	  ce->prev = NULL;
+	  ce->next = cache_head;
+	  cache_head->prev = ce;
+	  cache_head = ce;
+	}
+
+      ce->refs++;
+      b_ce = ce;
+    });
+
+  if (b_ce)
+    DPRINTF(E_DBG, L_DAAP, "Reply cache hit for %s\n", key);
+
+  return b_ce;
+}
+
+static void
+daap_cache_release(struct daap_cache_entry *ce)
+{
+  dispatch_sync(cache_sq, ^{
+      daap_cache_entry_unref(ce);
+    });
+}
+
+/* Takes ownership of body */
+static void
+daap_cache_add(const char *key, int rev, struct evbuffer *body)
+{
+  struct daap_cache_entry *ce;
+  size_t len;
+  __block int b_ret;
+
+  if (EVBUFFER_LENGTH(body) > cache_max_size / DAAP_CACHE_ENTRY_SHARE)
+    {
+      DPRINTF(E_DBG, L_DAAP, "Reply for %s too big to be cached (%zu bytes)\n", key, EVBUFFER_LENGTH(body));
+
+      evbuffer_free(body);
+      return;
+    }
+
+  ce = (struct daap_cache_entry *)malloc(sizeof(struct daap_cache_entry));
+  if (!ce)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Out of memory for reply cache entry\n");
+
+      evbuffer_free(body);
+      return;
+    }
+
+  memset(ce, 0, sizeof(struct daap_cache_entry));
+
+  ce->key = strdup(key);
+  if (!ce->key)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Out of memory for reply cache key\n");
+
+      evbuffer_free(body);
+      free(ce);
+      return;
+    }
+
+  ce->body = body;
+  ce->refs = 1;
+
+  len = EVBUFFER_LENGTH(body);
+
+  dispatch_sync(cache_sq, ^{
+      struct daap_cache_entry *p;
+
+      b_ret = -1;
+
+      /* Stale already, or beaten to it by another client */
+      if (!daap_cache_rev_check(rev))
+	return;
+
+      for (p = cache_head; p; p = p->next)
+	{
+	  if (strcmp(p->key, key) == 0)
+	    return;
+	}
+
+      while (cache_tail && (cache_size + len > cache_max_size))
+	daap_cache_remove(cache_tail);
+
+      ce->next = cache_head;
+      if (cache_head)
+	cache_head->prev = ce;
+      else
+	cache_tail = ce;
+      cache_head = ce;
+
+      cache_size += len;
+
+      b_ret = 0;
+    });
+
+  if (b_ret < 0)
+    {
+      free(ce->key);
+      evbuffer_free(ce->body);
+      free(ce);
+      return;
+    }
+
+  DPRINTF(E_DBG, L_DAAP, "Cached reply for %s (%zu bytes)\n", key, len);
+}
+
+static void
+cache_stream_free_cb(void *data)
+{
+  struct cache_stream *cs;
+
+  cs = (struct cache_stream *)data;
+
+  daap_cache_release(cs->ce);
+
+  if (cs->evbuf)
+    evbuffer_free(cs->evbuf);
+
+  free(cs);
+}
+
+/* Adds the next chunk of the cached reply to cs->evbuf */
+static int
+cache_stream_fill(struct cache_stream *cs)
+{
+  size_t len;
+  int ret;
+
+  len = EVBUFFER_LENGTH(cs->ce->body) - cs->offset;
+  if (len > DAAP_CACHE_CHUNK_SIZE)
+    len = DAAP_CACHE_CHUNK_SIZE;
+
+  if (len == 0)
+    return 0;
+
+  ret = evbuffer_add(cs->evbuf, EVBUFFER_DATA(cs->ce->body) + cs->offset, len);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Out of memory for cached reply chunk\n");
+
+      return -1;
+    }
+
+  cs->offset += len;
+
+  return 0;
+}
+
+static struct evbuffer *
+cache_stream_chunk_cb(struct http_connection *c, struct http_response *r, void *data)
+{
+  struct cache_stream *cs;
+  struct evbuffer *evbuf;
+  int ret;
+
+  cs = (struct cache_stream *)data;
+
+  ret = cache_stream_fill(cs);
+  if (ret < 0)
+    return NULL;
+
+  if (EVBUFFER_LENGTH(cs->evbuf) > 0)
+    return cs->evbuf;
+
+  ret = http_server_response_end_chunked(c, r);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Failed to terminate chunked response properly!\n");
+
+      return NULL;
+    }
+
+  /* Buffer will be freed by the server */
+  evbuf = cs->evbuf;
+  cs->evbuf = NULL;
+
+  return evbuf;
+}
+
+/* Sends a cached reply; takes over the reference to ce */
+static int
+daap_reply_cached(struct httpd_hdl *h, struct daap_cache_entry *ce)
+{
+  struct daap_session *s;
+  struct cache_stream *cs;
+  struct evbuffer *evbuf;
+  int ret;
+
+  ret = daap_session_find(h, &s);
+  if (!s)
+    {
+      daap_cache_release(ce);
+      return ret;
+    }
+
+  ret = http_response_set_status(h->r, HTTP_OK, "OK");
+  if (ret < 0)
+    goto out_fail;
+
+  ret = http_response_add_header(h->r, "Content-Encoding", "gzip");
+  if (ret < 0)
+    goto out_fail;
+
+  if (EVBUFFER_LENGTH(ce->body) <= DAAP_CACHE_CHUNK_SIZE)
+    {
+      evbuf = evbuffer_new();
+      if (!evbuf)
+	goto out_fail;
+
+      ret = evbuffer_add(evbuf, EVBUFFER_DATA(ce->body), EVBUFFER_LENGTH(ce->body));
+      daap_cache_release(ce);
+      if (ret < 0)
+	{
+	  evbuffer_free(evbuf);
+	  goto out_error;
+	}
+
+      http_response_set_body(h->r, evbuf);
+
+      ret = http_server_response_run(h->c, h->r);
+      if (ret < 0)
+	goto out_error;
+
+      return 0;
+    }
+
+  cs = (struct cache_stream *)malloc(sizeof(struct cache_stream));
+  if (!cs)
+    goto out_fail;
+
+  cs->ce = ce;
+  cs->offset = 0;
+
+  cs->evbuf = evbuffer_new();
+  if (!cs->evbuf)
+    {
+      free(cs);
+      goto out_fail;
+    }
+
+  ret = cache_stream_fill(cs);
+  if (ret < 0)
+    {
+      cache_stream_free_cb(cs);
+      goto out_error;
+    }
+
+  ret = http_server_response_run_chunked(h->c, h->r, cs->evbuf, cache_stream_chunk_cb, cache_stream_free_cb, cs);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Could not start chunked response for cached reply\n");
+
+      cache_stream_free_cb(cs);
+      goto out_error;
+    }
+
+  return 0;
+
+ out_fail:
+  daap_cache_release(ce);
+ out_error:
+  DPRINTF(E_LOG, L_DAAP, "Could not send cached reply\n");
+
+  http_response_remove_header(h->r, "Content-Encoding");
+
+  return http_server_error_run(h->c, h->r, HTTP_INTERNAL_ERROR, "Internal Server Error");
+}
+
+/* Sends the reply, keeping it in the cache if it can be cached */
+static int
+daap_send_reply(struct httpd_hdl *h, struct evbuffer *evbuf)
+{
+  struct evbuffer *gzbuf;
+  struct evbuffer *body;
+  int ret;
+
+  if (!h->cache_key)
+    return httpd_send_reply(h->c, h->req, h->r, evbuf);
+
+  gzbuf = httpd_gzip_buffer(evbuf);
+  if (!gzbuf)
+    return httpd_send_reply(h->c, h->req, h->r, evbuf);
+
+  ret = http_response_add_header(h->r, "Content-Encoding", "gzip");
+  if (ret < 0)
+    {
+      evbuffer_free(gzbuf);
+      return httpd_send_reply(h->c, h->req, h->r, evbuf);
+    }
+
+  evbuffer_free(evbuf);
+
+  /* The reply body goes away with the response */
+  body = evbuffer_new();
+  if (body)
+    {
+      ret = evbuffer_add(body, EVBUFFER_DATA(gzbuf), EVBUFFER_LENGTH(gzbuf));
+      if (ret == 0)
+	daap_cache_add(h->cache_key, h->cache_rev, body);
+      else
+	evbuffer_free(body);
+    }
+
+  http_response_set_body(h->r, gzbuf);
+
+  ret = http_server_response_run(h->c, h->r);
+  if (ret < 0)
+    return http_server_error_run(h->c, h->r, HTTP_INTERNAL_ERROR, "Internal Server Error");
+
+  return 0;
+}
+
+
 /* Update requests helpers */
 /* Queue: updates_sq */
 static void
@@ -434,34 +962,16 @@ daap_sort_context_free(struct sort_ctx *ctx)
   free(ctx);
 }
 
-static int
-daap_sort_build(struct sort_ctx *ctx, char *str)
+static void
+daap_sort_build(struct sort_ctx *ctx, int bucket)
 {
-  uint8_t *ret;
-  size_t len;
-  char fl;
-
-  len = strlen(str);
-  ret = u8_normalize(UNINORM_NFD, (uint8_t *)str, len, NULL, &len);
-  if (!ret)
+  if (bucket)
     {
-      DPRINTF(E_LOG, L_DAAP, "Could not normalize string for sort header\n");
-
-      return -1;
-    }
-
-  fl = ret[0];
-  free(ret);
-
-  if (isascii(fl) && isalpha(fl))
-    {
-      fl = toupper(fl);
-
       /* Init */
       if (ctx->mshc == -1)
-	ctx->mshc = fl;
+	ctx->mshc = bucket;
 
-      if (fl == ctx->mshc)
+      if (bucket == ctx->mshc)
 	ctx->mshn++;
       else
         {
@@ -470,11 +980,11 @@ daap_sort_build(struct sort_ctx *ctx, char *str)
 	  dmap_add_int(ctx->headerlist, "mshi", ctx->mshi);   /* 12 */
 	  dmap_add_int(ctx->headerlist, "mshn", ctx->mshn);   /* 12 */
 
-	  DPRINTF(E_DBG, L_DAAP, "Added sort header: mshc = %c, mshi = %u, mshn = %u fl %c\n", ctx->mshc, ctx->mshi, ctx->mshn, fl);
+	  DPRINTF(E_DBG, L_DAAP, "Added sort header: mshc = %c, mshi = %u, mshn = %u fl %c\n", ctx->mshc, ctx->mshi, ctx->mshn, bucket);
 
 	  ctx->mshi = ctx->mshi + ctx->mshn;
 	  ctx->mshn = 1;
-	  ctx->mshc = fl;
+	  ctx->mshc = bucket;
 	}
     }
   else
@@ -482,8 +992,6 @@ daap_sort_build(struct sort_ctx *ctx, char *str)
       /* Non-ASCII, goes to misc category */
       ctx->misc_mshn++;
     }
-
-  return 0;
 }
 
 static int
@@ -573,6 +1081,9 @@ get_query_params(struct keyval *query, int *sort_headers, struct query_params *q
 
   qp->idx_type = I_SUB;
 
+  /* mtco is only sent once all the results have been fetched */
+  qp->single_pass = 1;
+
   qp->sort = S_NONE;
   param = keyval_get(query, "sort");
   if (param)
@@ -1098,19 +1609,292 @@ daap_reply_dblist(struct httpd_hdl *h, struct evbuffer *evbuf, char **uri)
   return httpd_send_reply(h->c, h->req, h->r, evbuf);
 }
 
+/* Streamed song lists */
+static void
+songlist_stream_free(struct songlist_stream *st)
+{
+  if (st->recs)
+    {
+      dmap_records_unref(st->recs + st->next, st->nrecs - st->next);
+      free(st->recs);
+    }
+
+  if (st->sctx)
+    daap_sort_context_free(st->sctx);
+
+  if (st->evbuf)
+    evbuffer_free(st->evbuf);
+
+  if (st->gzbuf)
+    evbuffer_free(st->gzbuf);
+
+  if (st->gz)
+    httpd_gzip_free(st->gz);
+
+  if (st->cachebuf)
+    evbuffer_free(st->cachebuf);
+
+  if (st->cache_key)
+    free(st->cache_key);
+
+  free(st);
+}
+
+static void
+songlist_stream_free_cb(void *data)
+{
+  songlist_stream_free((struct songlist_stream *)data);
+}
+
+/* Adds the next page of songs; returns 1 if there are more to come,
+ * 0 once the list and its sort headers are done, -1 on error
+ */
+static int
+songlist_stream_page(struct songlist_stream *st)
+{
+  int nsongs;
+  int ret;
+
+  nsongs = st->nrecs - st->next;
+  if (nsongs > DAAP_SONGLIST_PAGE_SIZE)
+    nsongs = DAAP_SONGLIST_PAGE_SIZE;
+
+  ret = dmap_records_add(st->evbuf, st->recs + st->next, nsongs);
+
+  /* Sent songs are let go of as we go */
+  dmap_records_unref(st->recs + st->next, nsongs);
+  st->next += nsongs;
+
+  if (ret < 0)
+    return -1;
+
+  if (st->next < st->nrecs)
+    return 1;
+
+  if (st->sctx)
+    {
+      ret = daap_sort_finalize(st->sctx, st->evbuf);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_DAAP, "Could not add sort headers to DAAP song list reply\n");
+
+	  return -1;
+	}
+    }
+
+  return 0;
+}
+
+/* Returns the next chunk to send, empty at the end of the list */
+static struct evbuffer *
+songlist_stream_fill(struct songlist_stream *st)
+{
+  struct evbuffer *out;
+  int ret;
+
+  out = (st->gz) ? st->gzbuf : st->evbuf;
+
+  /* Small pages can compress down to nothing yet */
+  while (!st->done && (EVBUFFER_LENGTH(out) == 0))
+    {
+      ret = songlist_stream_page(st);
+      if (ret < 0)
+	return NULL;
+
+      st->done = (ret == 0);
+
+      if (st->gz)
+	{
+	  ret = httpd_gzip_deflate(st->gz, st->evbuf, st->gzbuf, st->done);
+	  if (ret < 0)
+	    return NULL;
+	}
+    }
+
+  if (st->cachebuf && (EVBUFFER_LENGTH(out) > 0))
+    {
+      ret = evbuffer_add(st->cachebuf, EVBUFFER_DATA(out), EVBUFFER_LENGTH(out));
+      if ((ret < 0) || (EVBUFFER_LENGTH(st->cachebuf) > cache_max_size / DAAP_CACHE_ENTRY_SHARE))
+	{
+	  evbuffer_free(st->cachebuf);
+	  st->cachebuf = NULL;
+	}
+    }
+
+  return out;
+}
+
+static struct evbuffer *
+songlist_stream_chunk_cb(struct http_connection *c, struct http_response *r, void *data)
+{
+  struct songlist_stream *st;
+  struct evbuffer *evbuf;
+  int ret;
+
+  st = (struct songlist_stream *)data;
+
+  evbuf = songlist_stream_fill(st);
+  if (!evbuf)
+    return NULL;
+
+  if (EVBUFFER_LENGTH(evbuf) > 0)
+    return evbuf;
+
+  ret = http_server_response_end_chunked(c, r);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Failed to terminate chunked response properly!\n");
+
+      return NULL;
+    }
+
+  if (st->cachebuf)
+    {
+      daap_cache_add(st->cache_key, st->cache_rev, st->cachebuf);
+      st->cachebuf = NULL;
+    }
+
+  /* Buffer will be freed by the server */
+  if (evbuf == st->gzbuf)
+    st->gzbuf = NULL;
+  else
+    st->evbuf = NULL;
+
+  return evbuf;
+}
+
+/* Sends the song list header and the songs encoded already, then streams
+ * the others. Takes ownership of evbuf, head, recs and sctx.
+ */
+static int
+daap_songlist_stream(struct httpd_hdl *h, struct evbuffer *evbuf, char *tag, int results, int nsongs, struct evbuffer *head, struct dmap_record **recs, int nrecs, size_t listlen, struct sort_ctx *sctx)
+{
+  struct songlist_stream *st;
+  struct evbuffer *chunk;
+  int ret;
+
+  DPRINTF(E_DBG, L_DAAP, "Streaming song list, %d songs, %zu bytes\n", nsongs, listlen);
+
+  st = (struct songlist_stream *)malloc(sizeof(struct songlist_stream));
+  if (!st)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Out of memory for song list stream\n");
+
+      dmap_records_unref(recs, nrecs);
+      free(recs);
+      if (sctx)
+	daap_sort_context_free(sctx);
+      evbuffer_free(head);
+      evbuffer_free(evbuf);
+
+      return dmap_send_error(h, tag, "Out of memory");
+    }
+
+  memset(st, 0, sizeof(struct songlist_stream));
+
+  st->recs = recs;
+  st->nrecs = nrecs;
+  st->sctx = sctx;
+  st->evbuf = evbuf;
+
+  /* Add header and the first songs to evbuf, the others follow */
+  if (sctx)
+    dmap_add_container(evbuf, tag, listlen + EVBUFFER_LENGTH(sctx->headerlist) + 53);
+  else
+    dmap_add_container(evbuf, tag, listlen + 53);
+  dmap_add_int(evbuf, "mstt", 200);    /* 12 */
+  dmap_add_char(evbuf, "muty", 0);     /* 9 */
+  dmap_add_int(evbuf, "mtco", results); /* 12 */
+  dmap_add_int(evbuf, "mrco", nsongs); /* 12 */
+  dmap_add_container(evbuf, "mlcl", listlen);
+
+  ret = evbuffer_add_buffer(evbuf, head);
+  evbuffer_free(head);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Could not add song list to DAAP song list reply\n");
+
+      ret = dmap_send_error(h, tag, "Out of memory");
+      goto out_free_st;
+    }
+
+  ret = http_response_set_status(h->r, HTTP_OK, "OK");
+  if (ret < 0)
+    {
+      ret = dmap_send_error(h, "aply", "Server Error");
+      goto out_free_st;
+    }
+
+  st->gzbuf = evbuffer_new();
+  if (st->gzbuf)
+    {
+      st->gz = httpd_gzip_new(h->req, h->r);
+      if (!st->gz)
+	{
+	  evbuffer_free(st->gzbuf);
+	  st->gzbuf = NULL;
+	}
+    }
+
+  /* Keep the compressed reply for the cache */
+  if (st->gz && h->cache_key)
+    {
+      st->cache_key = strdup(h->cache_key);
+      st->cache_rev = h->cache_rev;
+      if (st->cache_key)
+	st->cachebuf = evbuffer_new();
+    }
+
+  /* First chunk, with the header */
+  chunk = songlist_stream_fill(st);
+  if (!chunk || (EVBUFFER_LENGTH(chunk) == 0))
+    {
+      if (st->gz)
+	http_response_remove_header(h->r, "Content-Encoding");
+
+      ret = dmap_send_error(h, tag, "Error fetching query results");
+      goto out_free_st;
+    }
+
+  ret = http_server_response_run_chunked(h->c, h->r, chunk, songlist_stream_chunk_cb, songlist_stream_free_cb, st);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Could not start chunked response for song list\n");
+
+      songlist_stream_free(st);
+
+      return http_server_error_run(h->c, h->r, HTTP_INTERNAL_ERROR, "Internal Server Error");
+    }
+
+  return 0;
+
+ out_free_st:
+  songlist_stream_free(st);
+
+  return ret;
+}
+
 static int
-daap_reply_songlist_generic(struct httpd_hdl *h, struct evbuffer *evbuf, int playlist)
+daap_reply_songlist_generic(struct httpd_hdl *h, struct evbuffer *evbuf, int playlist, int session)
 {
   struct query_params qp;
-  struct db_media_file_info dbmfi;
+  struct db_media_file_values dbmfv;
   struct evbuffer *song;
   struct evbuffer *songlist;
+  struct evbuffer *scratch;
   const struct dmap_field **meta;
+  struct dmap_encode_plan *plan;
+  struct dmap_record **recs;
+  struct dmap_record **tmp;
   struct sort_ctx *sctx;
   const char *param;
   char *tag;
   int nmeta;
+  size_t listlen;
   int sort_headers;
+  int nrecs;
+  int recs_size;
+  int results;
   int nsongs;
   int transcode;
   int ret;
@@ -1219,11 +2003,35 @@ daap_reply_songlist_generic(struct httpd_hdl *h, struct evbuffer *evbuf, int pla
   else
     qp.type = Q_ITEMS;
 
+  /* Lets the next index range of the list pick up where this one ends */
+  qp.session = session;
+
+  /* Only fetch what the client asked for, plus what transcoding and the
+   * pre-encoded songs need */
+  qp.cols = dmap_file_metadata_cols(meta, nmeta, 1);
+  if (qp.cols)
+    qp.cols |= dbmfi_col(codectype) | DMAP_RECORD_COLS;
+  if (qp.cols && sort_headers)
+    qp.cols |= dbmfi_col(title_sort_bucket);
+
+  /* What to send for each song is worked out once for the whole list */
+  plan = dmap_encode_plan_new(meta, nmeta, 1);
+  if (!plan)
+    {
+      if (sort_headers)
+	daap_sort_context_free(sctx);
+
+      ret = dmap_send_error(h, tag, "Out of memory");
+      goto out_query_free;
+    }
+
   ret = db_query_start(&qp);
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_DAAP, "Could not start query\n");
 
+      dmap_encode_plan_free(plan);
+
       if (sort_headers)
 	daap_sort_context_free(sctx);
 
@@ -1231,14 +2039,63 @@ daap_reply_songlist_generic(struct httpd_hdl *h, struct evbuffer *evbuf, int pla
       goto out_query_free;
     }
 
+  /* Past DAAP_SONGLIST_STREAM_MIN, the songs are kept as encoded songs,
+   * shared with the pre-encoded ones, and streamed once the list is done;
+   * the query and its connection are gone by then */
+  scratch = NULL;
+  recs = NULL;
+  nrecs = 0;
+  recs_size = 0;
+  listlen = 0;
+
+  dmap_records_page_start();
+
   nsongs = 0;
-  while (((ret = db_query_fetch_file(&qp, &dbmfi)) == 0) && (dbmfi.id))
+  while (((ret = db_query_fetch_file_values(&qp, &dbmfv)) == 0) && (dbmfv_int(&dbmfv, id)))
     {
       nsongs++;
 
-      transcode = transcode_needed(h->req, dbmfi.codectype);
+      transcode = transcode_needed(h->req, (char *)dbmfv_str(&dbmfv, codectype));
+
+      if (!scratch)
+	{
+	  ret = dmap_encode_file_record(songlist, song, &dbmfv, plan, transcode);
+
+	  if ((ret == 0) && (EVBUFFER_LENGTH(songlist) > DAAP_SONGLIST_STREAM_MIN))
+	    {
+	      scratch = evbuffer_new();
+	      if (!scratch)
+		ret = -1;
+	    }
+	}
+      else
+	{
+	  if (nrecs == recs_size)
+	    {
+	      recs_size = (recs_size > 0) ? 2 * recs_size : 1024;
+
+	      tmp = (struct dmap_record **)realloc(recs, recs_size * sizeof(struct dmap_record *));
+	      if (!tmp)
+		{
+		  DPRINTF(E_LOG, L_DAAP, "Out of memory for song list\n");
+
+		  ret = -100;
+		  break;
+		}
+
+	      recs = tmp;
+	    }
+
+	  recs[nrecs] = dmap_file_record_get(scratch, song, &dbmfv, plan, transcode);
+	  if (recs[nrecs])
+	    {
+	      listlen += dmap_record_len(recs[nrecs]);
+	      nrecs++;
+	    }
+	  else
+	    ret = -1;
+	}
 
-      ret = dmap_encode_file_metadata(songlist, song, &dbmfi, meta, nmeta, 1, transcode);
       if (ret < 0)
 	{
 	  DPRINTF(E_LOG, L_DAAP, "Failed to encode song metadata\n");
@@ -1248,33 +2105,45 @@ daap_reply_songlist_generic(struct httpd_hdl *h, struct evbuffer *evbuf, int pla
 	}
 
       if (sort_headers)
-	{
-	  ret = daap_sort_build(sctx, dbmfi.title_sort);
-	  if (ret < 0)
-	    {
-	      DPRINTF(E_LOG, L_DAAP, "Could not add sort header to DAAP song list reply\n");
+	daap_sort_build(sctx, dbmfv_int(&dbmfv, title_sort_bucket));
 
-	      ret = -100;
-	      break;
-	    }
-   	}
+      if ((nsongs % DAAP_SONGLIST_PAGE_SIZE) == 0)
+	{
+	  dmap_records_page_end();
+	  dmap_records_page_start();
+	}
 
       DPRINTF(E_DBG, L_DAAP, "Done with song\n");
     }
 
-  DPRINTF(E_DBG, L_DAAP, "Done with song list, %d songs\n", nsongs);
+  dmap_records_page_end();
 
-  if (nmeta > 0)
-    free(meta);
+  DPRINTF(E_DBG, L_DAAP, "Done with song list, %d songs\n", nsongs);
 
   evbuffer_free(song);
 
-  if (qp.filter)
-    free(qp.filter);
+  if (scratch)
+    evbuffer_free(scratch);
+
+  results = qp.results;
+
+  db_query_end(&qp);
+
+  dmap_encode_plan_free(plan);
 
   if (ret < 0)
     {
-      db_query_end(&qp);
+      if (recs)
+	{
+	  dmap_records_unref(recs, nrecs);
+	  free(recs);
+	}
+
+      if (nmeta > 0)
+	free(meta);
+
+      if (qp.filter)
+	free(qp.filter);
 
       if (sort_headers)
 	daap_sort_context_free(sctx);
@@ -1290,6 +2159,19 @@ daap_reply_songlist_generic(struct httpd_hdl *h, struct evbuffer *evbuf, int pla
       goto out_list_free;
     }
 
+  if (nmeta > 0)
+    free(meta);
+
+  if (qp.filter)
+    free(qp.filter);
+
+  if (scratch)
+    {
+      listlen += EVBUFFER_LENGTH(songlist);
+
+      return daap_songlist_stream(h, evbuf, tag, results, nsongs, songlist, recs, nrecs, listlen, (sort_headers) ? sctx : NULL);
+    }
+
   /* Add header to evbuf, add songlist to evbuf */
   if (sort_headers)
     dmap_add_container(evbuf, tag, EVBUFFER_LENGTH(songlist) + EVBUFFER_LENGTH(sctx->headerlist) + 53);
@@ -1297,12 +2179,10 @@ daap_reply_songlist_generic(struct httpd_hdl *h, struct evbuffer *evbuf, int pla
     dmap_add_container(evbuf, tag, EVBUFFER_LENGTH(songlist) + 53);
   dmap_add_int(evbuf, "mstt", 200);    /* 12 */
   dmap_add_char(evbuf, "muty", 0);     /* 9 */
-  dmap_add_int(evbuf, "mtco", qp.results); /* 12 */
+  dmap_add_int(evbuf, "mtco", results); /* 12 */
   dmap_add_int(evbuf, "mrco", nsongs); /* 12 */
   dmap_add_container(evbuf, "mlcl", EVBUFFER_LENGTH(songlist));
 
-  db_query_end(&qp);
-
   ret = evbuffer_add_buffer(evbuf, songlist);
   evbuffer_free(songlist);
   if (ret < 0)
@@ -1337,7 +2217,7 @@ daap_reply_songlist_generic(struct httpd_hdl *h, struct evbuffer *evbuf, int pla
       goto out_evbuf_free;
     }
 
-  return httpd_send_reply(h->c, h->req, h->r, evbuf);
+  return daap_send_reply(h, evbuf);
 
  out_query_free:
   if (nmeta > 0)
@@ -1371,7 +2251,7 @@ daap_reply_dbsonglist(struct httpd_hdl *h, struct evbuffer *evbuf, char **uri)
       return ret;
     }
 
-  return daap_reply_songlist_generic(h, evbuf, -1);
+  return daap_reply_songlist_generic(h, evbuf, -1, s->id);
 }
 
 static int
@@ -1395,7 +2275,7 @@ daap_reply_plsonglist(struct httpd_hdl *h, struct evbuffer *evbuf, char **uri)
       return dmap_send_error(h, "apso", "Invalid playlist ID");
     }
 
-  return daap_reply_songlist_generic(h, evbuf, playlist);
+  return daap_reply_songlist_generic(h, evbuf, playlist, s->id);
 }
 
 static int
@@ -1630,7 +2510,7 @@ daap_reply_playlists(struct httpd_hdl *h, struct evbuffer *evbuf, char **uri)
       goto out_evbuf_free;
     }
 
-  return httpd_send_reply(h->c, h->req, h->r, evbuf);
+  return daap_send_reply(h, evbuf);
 
  out_query_free:
   free(meta);
@@ -1803,16 +2683,7 @@ daap_reply_groups(struct httpd_hdl *h, struct evbuffer *evbuf, char **uri)
 	}
 
       if (sort_headers)
-	{
-	  ret = daap_sort_build(sctx, dbgri.itemname);
-	  if (ret < 0)
-	    {
-	      DPRINTF(E_LOG, L_DAAP, "Could not add sort header to DAAP groups reply\n");
-
-	      ret = -100;
-	      break;
-	    }
-	}
+	daap_sort_build(sctx, daap_sort_bucket(dbgri.itemname));
 
       /* Item count, always added (mimc) */
       val = 0;
@@ -1916,7 +2787,7 @@ daap_reply_groups(struct httpd_hdl *h, struct evbuffer *evbuf, char **uri)
       goto out_evbuf_free;
     }
 
-  return httpd_send_reply(h->c, h->req, h->r, evbuf);
+  return daap_send_reply(h, evbuf);
 
  out_query_free:
   free(meta);
@@ -2057,15 +2928,7 @@ daap_reply_browse(struct httpd_hdl *h, struct evbuffer *evbuf, char **uri)
       nitems++;
 
       if (sort_headers)
-	{
-	  ret = daap_sort_build(sctx, sort_item);
-	  if (ret < 0)
-	    {
-	      DPRINTF(E_LOG, L_DAAP, "Could not add sort header to DAAP browse reply\n");
-
-	      break;
-	    }
-	}
+	daap_sort_build(sctx, daap_sort_bucket(sort_item));
 
       dmap_add_string(itemlist, "mlit", browse_item);
     }
@@ -2138,7 +3001,7 @@ daap_reply_browse(struct httpd_hdl *h, struct evbuffer *evbuf, char **uri)
       return dmap_send_error(h, tag, "Server error");
     }
 
-  return httpd_send_reply(h->c, h->req, h->r, evbuf);
+  return daap_send_reply(h, evbuf);
 }
 
 /* NOTE: We only handle artwork at the moment */
@@ -2449,11 +3312,13 @@ static struct uri_map daap_handlers[] =
     },
     {
       .regexp = "^/databases/[[:digit:]]+/browse/[^/]+$",
-      .handler = daap_reply_browse
+      .handler = daap_reply_browse,
+      .cacheable = 1
     },
     {
       .regexp = "^/databases/[[:digit:]]+/items$",
-      .handler = daap_reply_dbsonglist
+      .handler = daap_reply_dbsonglist,
+      .cacheable = 1
     },
     {
       .regexp = "^/databases/[[:digit:]]+/items/[[:digit:]]+[.][^/]+$",
@@ -2465,15 +3330,18 @@ static struct uri_map daap_handlers[] =
     },
     {
       .regexp = "^/databases/[[:digit:]]+/containers$",
-      .handler = daap_reply_playlists
+      .handler = daap_reply_playlists,
+      .cacheable = 1
     },
     {
       .regexp = "^/databases/[[:digit:]]+/containers/[[:digit:]]+/items$",
-      .handler = daap_reply_plsonglist
+      .handler = daap_reply_plsonglist,
+      .cacheable = 1
     },
     {
       .regexp = "^/databases/[[:digit:]]+/groups$",
-      .handler = daap_reply_groups
+      .handler = daap_reply_groups,
+      .cacheable = 1
     },
     {
       .regexp = "^/databases/[[:digit:]]+/groups/[[:digit:]]+/extra_data/artwork$",
@@ -2497,6 +3365,7 @@ daap_request(struct http_connection *c, struct http_request *req, struct http_re
 {
   struct httpd_hdl hdl;
   struct keyval query;
+  struct daap_cache_entry *ce;
   char *full_uri;
   char *uri;
   char *ptr;
@@ -2666,6 +3535,28 @@ daap_request(struct http_connection *c, struct http_request *req, struct http_re
       goto out_clear_query;
     }
 
+  hdl.c = c;
+  hdl.req = req;
+  hdl.r = r;
+  hdl.query = &query;
+
+  /* Only gzipped replies are cached */
+  if (daap_handlers[handler].cacheable && (cache_max_size > 0) && httpd_gzip_accepted(req))
+    {
+      hdl.cache_rev = db_revision_get();
+      hdl.cache_key = daap_cache_key(&hdl, uri_parts);
+
+      if (hdl.cache_key)
+	{
+	  ce = daap_cache_get(hdl.cache_key, hdl.cache_rev);
+	  if (ce)
+	    {
+	      ret = daap_reply_cached(&hdl, ce);
+	      goto out_free_key;
+	    }
+	}
+    }
+
   /* Freed in the handler */
   evbuf = evbuffer_new();
   if (!evbuf)
@@ -2673,7 +3564,7 @@ daap_request(struct http_connection *c, struct http_request *req, struct http_re
       DPRINTF(E_LOG, L_DAAP, "Could not allocate evbuffer for DAAP reply\n");
 
       ret = http_server_error_run(c, r, HTTP_INTERNAL_ERROR, "Internal Server Error");
-      goto out_clear_query;
+      goto out_free_key;
     }
 
   ret = db_pool_get();
@@ -2684,18 +3575,16 @@ daap_request(struct http_connection *c, struct http_request *req, struct http_re
       evbuffer_free(evbuf);
 
       ret = http_server_error_run(c, r, HTTP_INTERNAL_ERROR, "Internal Server Error");
-      goto out_clear_query;
+      goto out_free_key;
     }
 
-  hdl.c = c;
-  hdl.req = req;
-  hdl.r = r;
-  hdl.query = &query;
-
   ret = daap_handlers[handler].handler(&hdl, evbuf, uri_parts);
 
   db_pool_release();
 
+ out_free_key:
+  if (hdl.cache_key)
+    free(hdl.cache_key);
  out_clear_query:
   keyval_clear(&query);
  out:
@@ -2748,6 +3637,12 @@ daap_init(void)
   current_rev = 2;
   update_requests = NULL;
 
+  cache_head = NULL;
+  cache_tail = NULL;
+  cache_size = 0;
+  cache_rev = 0;
+  cache_max_size = (size_t)cfg_getint(cfg_getsec(cfg, "library"), "daap_cache_size") * 1024 * 1024;
+
   sessions_sq = dispatch_queue_create("org.forked-daapd.daap.sessions", NULL);
   if (!sessions_sq)
     {
@@ -2764,6 +3659,14 @@ daap_init(void)
       goto updates_sq_fail;
     }
 
+  cache_sq = dispatch_queue_create("org.forked-daapd.daap.cache", NULL);
+  if (!cache_sq)
+    {
+      DPRINTF(E_FATAL, L_DAAP, "Could not create dispatch queue for DAAP reply cache\n");
+
+      goto cache_sq_fail;
+    }
+
   for (i = 0; daap_handlers[i].handler; i++)
     {
       ret = tre_regcomp(&daap_handlers[i].preg, daap_handlers[i].regexp, REG_EXTENDED | REG_NOSUB);
@@ -2784,12 +3687,16 @@ daap_init(void)
       goto daap_avl_alloc_fail;
     }
 
+  dmap_records_init();
+
   return 0;
 
  daap_avl_alloc_fail:
   for (i = 0; daap_handlers[i].handler; i++)
     tre_regfree(&daap_handlers[i].preg);
  regexp_fail:
+  dispatch_release(cache_sq);
+ cache_sq_fail:
   dispatch_release(updates_sq);
  updates_sq_fail:
   dispatch_release(sessions_sq);
@@ -2807,8 +3714,15 @@ daap_deinit(void)
 
   avl_free_tree(daap_sessions);
 
+  dispatch_sync(cache_sq, ^{
+      daap_cache_purge();
+    });
+
   dispatch_release(sessions_sq);
   dispatch_release(updates_sq);
+  dispatch_release(cache_sq);
+
+  dmap_records_deinit();
 
   /* Pending update requests are removed during HTTP server shutdown */
 }
@@ -41,6 +41,7 @@
 #include "conffile.h"
 #include "misc.h"
 #include "http.h"
+#include "network.h"
 #include "httpd.h"
 #include "transcode.h"
 #include "httpd_rsp.h"
@@ -458,6 +459,7 @@ rsp_reply_playlist(struct httpd_hdl *h, char **uri)
   struct db_media_file_info dbmfi;
   const char *param;
   char **strval;
+  char remote_host[NCONN_ADDRSTRLEN];
   mxml_node_t *reply;
   mxml_node_t *status;
   mxml_node_t *items;
@@ -501,6 +503,20 @@ rsp_reply_playlist(struct httpd_hdl *h, char **uri)
   if (ret != 1)
     return ret;
 
+  /* RSP has no sessions; page per client so the next index range of the
+   * list can pick up where this one ends */
+  remote_host[0] = '\0';
+  http_connection_get_remote_addr(h->c, remote_host);
+  qp.session = djb_hash(remote_host, strlen(remote_host)) | 1;
+
+  /* Only fetch the fields this mode sends out, plus what transcoding needs */
+  qp.cols = dbmfi_col(codectype) | dbmfi_col(samplerate);
+  for (i = 0; rsp_fields[i].field; i++)
+    {
+      if (rsp_fields[i].flags & mode)
+	qp.cols |= dbmfi_col_byoffset(rsp_fields[i].offset);
+    }
+
   ret = db_query_start(&qp);
   if (ret < 0)
     {
@@ -57,6 +57,7 @@ GCRY_THREAD_OPTION_PTHREAD_IMPL;
 #include "mdns.h"
 #include "remote_pairing.h"
 #include "player.h"
+#include "query_cache.h"
 #if LIBAVFORMAT_VERSION_MAJOR < 53
 # include "ffmpeg_url_evbuffer.h"
 #endif
@@ -830,6 +831,8 @@ app_shutdown(shutdown_plan_t plan)
 	DPRINTF(E_LOG, L_MAIN, "Player deinit\n");
 	player_deinit();
 
+	query_cache_purge();
+
 	/* FALLTHROUGH */
 
       case SHUTDOWN_FAIL_PLAYER:
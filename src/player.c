@@ -544,7 +544,7 @@ metadata_send(struct player_source *ps, int startup)
 static struct player_source *
 player_queue_make(struct query_params *qp, const char *sort)
 {
-  struct db_media_file_info dbmfi;
+  struct db_media_file_values dbmfv;
   struct player_source *q_head;
   struct player_source *q_tail;
   struct player_source *ps;
@@ -564,6 +564,9 @@ player_queue_make(struct query_params *qp, const char *sort)
 	qp->sort = S_ARTIST;
     }
 
+  /* Only the ids make it into the queue */
+  qp->cols = dbmfi_col(id);
+
   /* Database handle provided by DACP */
   ret = db_query_start(qp);
   if (ret < 0)
@@ -577,15 +580,9 @@ player_queue_make(struct query_params *qp, const char *sort)
 
   q_head = NULL;
   q_tail = NULL;
-  while (((ret = db_query_fetch_file(qp, &dbmfi)) == 0) && (dbmfi.id))
+  while (((ret = db_query_fetch_file_values(qp, &dbmfv)) == 0) && (dbmfv_int(&dbmfv, id)))
     {
-      ret = safe_atou32(dbmfi.id, &id);
-      if (ret < 0)
-	{
-	  DPRINTF(E_LOG, L_PLAYER, "Invalid song id in query result!\n");
-
-	  continue;
-	}
+      id = dbmfv_int(&dbmfv, id);
 
       ps = (struct player_source *)malloc(sizeof(struct player_source));
       if (!ps)
@@ -614,7 +611,7 @@ player_queue_make(struct query_params *qp, const char *sort)
 
       q_tail = ps;
 
-      DPRINTF(E_DBG, L_PLAYER, "Added song id %d (%s)\n", id, dbmfi.title);
+      DPRINTF(E_DBG, L_PLAYER, "Added song id %d\n", id);
     }
 
   db_query_end(qp);
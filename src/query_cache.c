@@ -0,0 +1,304 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <pthread.h>
+
+#include "logger.h"
+#include "query_cache.h"
+
+
+/* Query string to SQL cache
+ * Remotes send the same few queries over and over; translating one takes a
+ * full ANTLR pipeline, so the resulting SQL is kept around by query string,
+ * least recently used first out. The translation does not depend on the
+ * library, so entries never go stale; callers keep out what does depend on
+ * something else (the current time, for instance).
+ */
+
+/* Entries per query language */
+#define QUERY_CACHE_SIZE    64
+#define QUERY_CACHE_BUCKETS 128
+/* Longer queries are not worth keeping */
+#define QUERY_CACHE_MAXLEN  1024
+
+struct query_cache_entry {
+  uint32_t hash;
+  char *query;
+  char *sql;
+
+  struct query_cache_entry *hnext;
+
+  /* LRU list, most recently used first */
+  struct query_cache_entry *prev;
+  struct query_cache_entry *next;
+};
+
+struct query_cache {
+  struct query_cache_entry *buckets[QUERY_CACHE_BUCKETS];
+
+  struct query_cache_entry *head;
+  struct query_cache_entry *tail;
+  int entries;
+
+  uint64_t hits;
+  uint64_t misses;
+};
+
+/* Protects all caches */
+static pthread_mutex_t caches_lck = PTHREAD_MUTEX_INITIALIZER;
+static struct query_cache caches[QUERY_CACHE_NTYPES];
+
+
+/* FNV-1a */
+static uint32_t
+query_cache_hash(const char *query)
+{
+  const unsigned char *p;
+  uint32_t hash;
+
+  hash = 2166136261U;
+  for (p = (const unsigned char *)query; *p; p++)
+    {
+      hash ^= *p;
+      hash *= 16777619;
+    }
+
+  return hash;
+}
+
+static void
+query_cache_entry_free(struct query_cache_entry *qce)
+{
+  free(qce->query);
+  free(qce->sql);
+  free(qce);
+}
+
+/* Must be called with caches_lck held */
+static void
+query_cache_lru_unlink(struct query_cache *qc, struct query_cache_entry *qce)
+{
+  if (qce->prev)
+    qce->prev->next = qce->next;
+  else
+    qc->head = qce->next;
+
+  if (qce->next)
+    qce->next->prev = qce->prev;
+  else
+    qc->tail = qce->prev;
+
+  qce->prev = NULL;
+  qce->next = NULL;
+}
+
+/* Must be called with caches_lck held */
+static void
+query_cache_lru_push(struct query_cache *qc, struct query_cache_entry *qce)
+{
+  qce->prev = NULL;
+  qce->next = qc->head;
+
+  if (qc->head)
+    qc->head->prev = qce;
+  else
+    qc->tail = qce;
+
+  qc->head = qce;
+}
+
+/* Must be called with caches_lck held */
+static struct query_cache_entry *
+query_cache_lookup(struct query_cache *qc, const char *query, uint32_t hash)
+{
+  struct query_cache_entry *qce;
+
+  for (qce = qc->buckets[hash % QUERY_CACHE_BUCKETS]; qce; qce = qce->hnext)
+    {
+      if ((qce->hash == hash) && (strcmp(qce->query, query) == 0))
+	return qce;
+    }
+
+  return NULL;
+}
+
+/* Must be called with caches_lck held */
+static void
+query_cache_remove(struct query_cache *qc, struct query_cache_entry *qce)
+{
+  struct query_cache_entry **p;
+
+  for (p = &qc->buckets[qce->hash % QUERY_CACHE_BUCKETS]; *p; p = &(*p)->hnext)
+    {
+      if (*p == qce)
+	{
+	  *p = qce->hnext;
+	  break;
+	}
+    }
+
+  query_cache_lru_unlink(qc, qce);
+  qc->entries--;
+
+  query_cache_entry_free(qce);
+}
+
+/* Returns a copy of the SQL for query, or NULL if it has to be parsed */
+char *
+query_cache_get(enum query_cache_type type, const char *query)
+{
+  struct query_cache *qc;
+  struct query_cache_entry *qce;
+  uint32_t hash;
+  char *sql;
+
+  qc = &caches[type];
+
+  if (strlen(query) > QUERY_CACHE_MAXLEN)
+    {
+      pthread_mutex_lock(&caches_lck);
+      qc->misses++;
+      pthread_mutex_unlock(&caches_lck);
+
+      return NULL;
+    }
+
+  hash = query_cache_hash(query);
+  sql = NULL;
+
+  pthread_mutex_lock(&caches_lck);
+
+  qce = query_cache_lookup(qc, query, hash);
+  if (qce)
+    {
+      if (qce != qc->head)
+	{
+	  query_cache_lru_unlink(qc, qce);
+	  query_cache_lru_push(qc, qce);
+	}
+
+      sql = strdup(qce->sql);
+    }
+
+  if (sql)
+    qc->hits++;
+  else
+    qc->misses++;
+
+  pthread_mutex_unlock(&caches_lck);
+
+  return sql;
+}
+
+void
+query_cache_add(enum query_cache_type type, const char *query, const char *sql)
+{
+  struct query_cache *qc;
+  struct query_cache_entry *qce;
+
+  qc = &caches[type];
+
+  if (strlen(query) > QUERY_CACHE_MAXLEN)
+    return;
+
+  qce = (struct query_cache_entry *)malloc(sizeof(struct query_cache_entry));
+  if (!qce)
+    {
+      DPRINTF(E_LOG, L_MISC, "Out of memory for query cache entry\n");
+
+      return;
+    }
+
+  memset(qce, 0, sizeof(struct query_cache_entry));
+
+  qce->hash = query_cache_hash(query);
+  qce->query = strdup(query);
+  qce->sql = strdup(sql);
+  if (!qce->query || !qce->sql)
+    {
+      DPRINTF(E_LOG, L_MISC, "Out of memory for query cache entry\n");
+
+      query_cache_entry_free(qce);
+      return;
+    }
+
+  pthread_mutex_lock(&caches_lck);
+
+  /* Someone else parsed the same query in the meantime */
+  if (query_cache_lookup(qc, query, qce->hash))
+    {
+      pthread_mutex_unlock(&caches_lck);
+
+      query_cache_entry_free(qce);
+      return;
+    }
+
+  qce->hnext = qc->buckets[qce->hash % QUERY_CACHE_BUCKETS];
+  qc->buckets[qce->hash % QUERY_CACHE_BUCKETS] = qce;
+
+  query_cache_lru_push(qc, qce);
+  qc->entries++;
+
+  while (qc->entries > QUERY_CACHE_SIZE)
+    query_cache_remove(qc, qc->tail);
+
+  pthread_mutex_unlock(&caches_lck);
+}
+
+void
+query_cache_stats_get(enum query_cache_type type, struct query_cache_stats *stats)
+{
+  struct query_cache *qc;
+
+  qc = &caches[type];
+
+  pthread_mutex_lock(&caches_lck);
+
+  stats->hits = qc->hits;
+  stats->misses = qc->misses;
+  stats->entries = qc->entries;
+  stats->size = QUERY_CACHE_SIZE;
+
+  pthread_mutex_unlock(&caches_lck);
+}
+
+void
+query_cache_purge(void)
+{
+  struct query_cache *qc;
+  int i;
+
+  pthread_mutex_lock(&caches_lck);
+
+  for (i = 0; i < QUERY_CACHE_NTYPES; i++)
+    {
+      qc = &caches[i];
+
+      while (qc->head)
+	query_cache_remove(qc, qc->head);
+    }
+
+  pthread_mutex_unlock(&caches_lck);
+}
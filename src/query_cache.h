@@ -0,0 +1,34 @@
+
+#ifndef __QUERY_CACHE_H__
+#define __QUERY_CACHE_H__
+
+#include <stdint.h>
+
+enum query_cache_type {
+  QUERY_CACHE_DAAP = 0,
+  QUERY_CACHE_RSP,
+
+  QUERY_CACHE_NTYPES
+};
+
+struct query_cache_stats {
+  uint64_t hits;
+  uint64_t misses;
+  int entries;
+  int size;
+};
+
+
+char *
+query_cache_get(enum query_cache_type type, const char *query);
+
+void
+query_cache_add(enum query_cache_type type, const char *query, const char *sql);
+
+void
+query_cache_stats_get(enum query_cache_type type, struct query_cache_stats *stats);
+
+void
+query_cache_purge(void);
+
+#endif /* !__QUERY_CACHE_H__ */
@@ -746,7 +746,7 @@ static struct raop_metadata *
 raop_metadata_prepare(int id, uint64_t rtptime)
 {
   struct query_params qp;
-  struct db_media_file_info dbmfi;
+  struct db_media_file_values dbmfv;
   char filter[32];
   struct raop_metadata *rmd;
   struct evbuffer *tmp;
@@ -771,7 +771,7 @@ raop_metadata_prepare(int id, uint64_t rtptime)
 
   memset(rmd, 0, sizeof(struct raop_metadata));
 
-  /* Get dbmfi */
+  /* Get dbmfv */
   memset(&qp, 0, sizeof(struct query_params));
   qp.type = Q_ITEMS;
   qp.idx_type = I_NONE;
@@ -794,7 +794,7 @@ raop_metadata_prepare(int id, uint64_t rtptime)
       goto out_rmd;
     }
 
-  ret = db_query_fetch_file(&qp, &dbmfi);
+  ret = db_query_fetch_file_values(&qp, &dbmfv);
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_RAOP, "Couldn't fetch file id %d; metadata will not be sent\n", id);
@@ -820,7 +820,7 @@ raop_metadata_prepare(int id, uint64_t rtptime)
       goto out_query;
     }
 
-  ret = dmap_encode_file_metadata(rmd->metadata, tmp, &dbmfi, NULL, 0, 0, 1);
+  ret = dmap_encode_file_metadata(rmd->metadata, tmp, &dbmfv, NULL, 0, 0, 1);
   evbuffer_free(tmp);
   if (ret < 0)
     {
@@ -830,14 +830,15 @@ raop_metadata_prepare(int id, uint64_t rtptime)
     }
 
   /* Progress */
-  ret = safe_atou64(dbmfi.song_length, &duration);
-  if (ret < 0)
+  if (dbmfv_isnull(&dbmfv, song_length) || (dbmfv_int(&dbmfv, song_length) < 0))
     {
       DPRINTF(E_LOG, L_RAOP, "Failed to convert song_length to integer; no metadata will be sent\n");
 
       goto out_metadata;
     }
 
+  duration = dbmfv_int(&dbmfv, song_length);
+
   rmd->start = rtptime;
   rmd->end = rtptime + (duration * 44100UL) / 1000UL;
 
@@ -850,10 +851,10 @@ raop_metadata_prepare(int id, uint64_t rtptime)
       goto skip_artwork;
     }
 
-  ret = artwork_get_item_filename(dbmfi.path, 600, 600, ART_CAN_PNG | ART_CAN_JPEG, rmd->artwork);
+  ret = artwork_get_item_filename((char *)dbmfv_str(&dbmfv, path), 600, 600, ART_CAN_PNG | ART_CAN_JPEG, rmd->artwork);
   if (ret < 0)
     {
-      DPRINTF(E_LOG, L_RAOP, "Failed to retrieve artwork for '%s' (%d); no artwork will be sent\n", dbmfi.title, id);
+      DPRINTF(E_LOG, L_RAOP, "Failed to retrieve artwork for '%s' (%d); no artwork will be sent\n", dbmfv_str(&dbmfv, title), id);
 
       evbuffer_free(rmd->artwork);
       rmd->artwork = NULL;
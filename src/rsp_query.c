@@ -28,6 +28,7 @@
 #include "logger.h"
 #include "misc.h"
 #include "rsp_query.h"
+#include "query_cache.h"
 
 #include "RSPLexer.h"
 #include "RSPParser.h"
@@ -54,6 +55,19 @@ rsp_query_parse_sql(const char *rsp_query)
   pANTLR3_STRING sql;
 
   char *ret = NULL;
+  int cacheable;
+
+  /* Relative dates are worked out when the query is parsed */
+  cacheable = !strstr(rsp_query, "today");
+  if (cacheable)
+    {
+      ret = query_cache_get(QUERY_CACHE_RSP, rsp_query);
+      if (ret)
+	{
+	  DPRINTF(E_DBG, L_RSP, "RSP SQL query (cached): -%s-\n", ret);
+	  return ret;
+	}
+    }
 
   DPRINTF(E_DBG, L_RSP, "Trying RSP query -%s-\n", rsp_query);
 
@@ -127,6 +141,8 @@ rsp_query_parse_sql(const char *rsp_query)
     {
       DPRINTF(E_DBG, L_RSP, "RSP SQL query: -%s-\n", sql->chars);
       ret = strdup((char *)sql->chars);
+      if (ret && cacheable)
+	query_cache_add(QUERY_CACHE_RSP, rsp_query, ret);
     }
   else
     {
@@ -0,0 +1,44 @@
+#ifndef __SORT_BUCKET_H__
+#define __SORT_BUCKET_H__
+
+#include <stdint.h>
+
+#include <unistr.h>
+#include <uninorm.h>
+
+/* First letter bucket for the DAAP sort headers, shared by the server and
+ * the daap_sortbucket() SQLite function that fills files.title_sort_bucket,
+ * so both always agree: the upper case ASCII letter the NFD form of str
+ * starts with, or 0 for the misc category (NULL, empty, invalid UTF-8,
+ * digits, punctuation, other scripts). NFD leaves a leading ASCII character
+ * alone, so only the first character ever needs decomposing.
+ */
+static inline int
+daap_sort_bucket(const char *str)
+{
+  ucs4_t decomp[UC_DECOMPOSITION_MAX_LENGTH];
+  ucs4_t ch;
+  int ret;
+
+  if (!str)
+    return 0;
+
+  if ((unsigned char)str[0] < 0x80)
+    ch = (unsigned char)str[0];
+  else
+    {
+      ret = u8_strmbtouc(&ch, (const uint8_t *)str);
+      if (ret <= 0)
+	return 0;
+
+      while (uc_canonical_decomposition(ch, decomp) > 0)
+	ch = decomp[0];
+    }
+
+  if ((ch >= 'a') && (ch <= 'z'))
+    ch -= 'a' - 'A';
+
+  return ((ch >= 'A') && (ch <= 'Z')) ? (int)ch : 0;
+}
+
+#endif /* !__SORT_BUCKET_H__ */
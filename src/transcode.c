@@ -502,51 +502,14 @@ transcode_cleanup(struct transcode_ctx *ctx)
 }
 
 
-int
-transcode_needed(struct http_request *req, char *file_codectype)
+/* Codecs the client can play, NULL if the client cannot be sent transcoded
+ * streams at all
+ */
+const char *
+transcode_client_codecs(struct http_request *req)
 {
   const char *client_codecs;
   const char *user_agent;
-  char *codectype;
-  cfg_t *lib;
-  int size;
-  int i;
-
-  DPRINTF(E_DBG, L_XCODE, "Determining transcoding status for codectype %s\n", file_codectype);
-
-  lib = cfg_getsec(cfg, "library");
-
-  size = cfg_size(lib, "no_transcode");
-  if (size > 0)
-    {
-      for (i = 0; i < size; i++)
-	{
-	  codectype = cfg_getnstr(lib, "no_transcode", i);
-
-	  if (strcmp(file_codectype, codectype) == 0)
-	    {
-	      DPRINTF(E_DBG, L_XCODE, "Codectype is in no_transcode\n");
-
-	      return 0;
-	    }
-	}
-    }
-
-  size = cfg_size(lib, "force_transcode");
-  if (size > 0)
-    {
-      for (i = 0; i < size; i++)
-	{
-	  codectype = cfg_getnstr(lib, "force_transcode", i);
-
-	  if (strcmp(file_codectype, codectype) == 0)
-	    {
-	      DPRINTF(E_DBG, L_XCODE, "Codectype is in force_transcode\n");
-
-	      return 1;
-	    }
-	}
-    }
 
   client_codecs = http_request_get_header(req, "Accept-Codecs");
   if (!client_codecs)
@@ -594,7 +557,7 @@ transcode_needed(struct http_request *req, char *file_codectype)
 	       * HTTP implementation doesn't honour Connection: close.
 	       * At least, that's why mt-daapd didn't do it.
 	       */
-	      return 0;
+	      return NULL;
 	    }
 	}
     }
@@ -608,6 +571,58 @@ transcode_needed(struct http_request *req, char *file_codectype)
       client_codecs = default_codecs;
     }
 
+  return client_codecs;
+}
+
+int
+transcode_needed(struct http_request *req, char *file_codectype)
+{
+  const char *client_codecs;
+  char *codectype;
+  cfg_t *lib;
+  int size;
+  int i;
+
+  DPRINTF(E_DBG, L_XCODE, "Determining transcoding status for codectype %s\n", file_codectype);
+
+  lib = cfg_getsec(cfg, "library");
+
+  size = cfg_size(lib, "no_transcode");
+  if (size > 0)
+    {
+      for (i = 0; i < size; i++)
+	{
+	  codectype = cfg_getnstr(lib, "no_transcode", i);
+
+	  if (strcmp(file_codectype, codectype) == 0)
+	    {
+	      DPRINTF(E_DBG, L_XCODE, "Codectype is in no_transcode\n");
+
+	      return 0;
+	    }
+	}
+    }
+
+  size = cfg_size(lib, "force_transcode");
+  if (size > 0)
+    {
+      for (i = 0; i < size; i++)
+	{
+	  codectype = cfg_getnstr(lib, "force_transcode", i);
+
+	  if (strcmp(file_codectype, codectype) == 0)
+	    {
+	      DPRINTF(E_DBG, L_XCODE, "Codectype is in force_transcode\n");
+
+	      return 1;
+	    }
+	}
+    }
+
+  client_codecs = transcode_client_codecs(req);
+  if (!client_codecs)
+    return 0;
+
   if (strstr(client_codecs, file_codectype))
     {
       DPRINTF(E_DBG, L_XCODE, "Codectype supported by client, no transcoding needed\n");
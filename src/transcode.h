@@ -18,6 +18,9 @@ transcode_setup(struct media_file_info *mfi, off_t *est_size, int wavhdr);
 void
 transcode_cleanup(struct transcode_ctx *ctx);
 
+const char *
+transcode_client_codecs(struct http_request *req);
+
 int
 transcode_needed(struct http_request *req, char *file_codectype);
 